@@ -19,13 +19,8 @@
 
 
 #include "Command/Registration.h"
-#include "Command/Listener.h"
-#include "Pipeline/Peer/Target.h"
-#include "RealWorld.h"
-#include "Pipeline/Client/Listener.h"
-#include "Pipeline/Peer/Listener.h"
+#include "ConsensusGroup.h"
 #include "Epoll.h"
-#include "Paxos/Legislator.h"
 
 #include <getopt.h>
 #include <signal.h>
@@ -38,24 +33,146 @@ struct option long_options[] =
     {"command-port",  required_argument, 0, 'm'},
     {"target",        required_argument, 0, 't'},
     {"register-at",   required_argument, 0, 'r'},
+    {"retain-bytes",  required_argument, 0, 'b'},
+    {"retain-seconds",required_argument, 0, 'a'},
+    {"retain-until-consumed", no_argument, 0, 'u'},
+    {"inflight-window-bytes", required_argument, 0, 'w'},
+    {"io-threads",    required_argument, 0, 'i'},
+    {"groups",        required_argument, 0, 'g'},
+    {"epoll-events",  required_argument, 0, 'e'},
+    {"edge-triggered",no_argument,       0, 'E'},
+    {"io-uring",      no_argument,       0, 'U'},
+    {"catch-up-rate", required_argument, 0, 'C'},
+    {"subscriber-port", required_argument, 0, 's'},
+    {"compact-chosen-log", no_argument,   0, 'L'},
+    {"tee-to-peers",  no_argument,       0, 'T'},
+    {"pipe-memory-budget", required_argument, 0, 'P'},
+    {"direct-io",     no_argument,       0, 'D'},
     {0, 0, 0, 0}
   };
 
+/* Every 500ms, prints stats and retries any disconnected target
+   connections. */
+class TargetCheckTimer : public Epoll::TimerHandler {
+  Epoll::Manager                                &manager;
+  std::vector<std::unique_ptr<ConsensusGroup>>  &groups;
+
+  const std::chrono::steady_clock::duration interval
+    = std::chrono::milliseconds(500);
+
+public:
+  TargetCheckTimer(Epoll::Manager                               &manager,
+                   std::vector<std::unique_ptr<ConsensusGroup>> &groups)
+    : manager(manager), groups(groups) {
+    manager.schedule_timer(this, manager.get_current_time() + interval);
+  }
+
+  void handle_timeout() override {
+    const auto now = manager.get_current_time();
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: getrusage() failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+
+    for (auto &group : groups) {
+      const auto &legislator   = group->get_legislator();
+      const auto &flow_control = group->get_client_listener().get_flow_control();
+      uint64_t frames_queued = 0, frames_merged = 0, frames_superseded = 0,
+               frames_dropped = 0, outbound_depth = 0, peer_writes = 0;
+      for (const auto &target : group->get_targets()) {
+        frames_queued     += target->get_frames_queued();
+        frames_merged     += target->get_frames_merged();
+        frames_superseded += target->get_frames_superseded();
+        frames_dropped    += target->get_frames_dropped();
+        outbound_depth    += target->get_outbound_depth();
+        peer_writes       += target->get_write_count();
+      }
+      printf("stats: real %13luus user %3ld%06ldus sys %4ld%06ldus group %u active slots [%9lu,%9lu)=%7lu throttled %6lums (%lu) peer frames %lu merged %lu superseded %lu dropped %lu queued %luB writes %lu\n",
+        std::chrono::time_point_cast<std::chrono::microseconds>
+          (now).time_since_epoch().count(),
+        usage.ru_utime.tv_sec, usage.ru_utime.tv_usec,
+        usage.ru_stime.tv_sec, usage.ru_stime.tv_usec,
+        group->get_node_name().group,
+        legislator.get_next_chosen_slot(),
+        legislator.get_next_activated_slot(),
+        legislator.get_next_activated_slot() - legislator.get_next_chosen_slot(),
+        std::chrono::duration_cast<std::chrono::milliseconds>
+          (flow_control.get_throttled_time()).count(),
+        flow_control.get_throttle_count(),
+        frames_queued, frames_merged, frames_superseded, frames_dropped,
+        outbound_depth, peer_writes);
+
+      uint64_t tee_bytes_teed = 0, tee_bytes_sent = 0,
+               tee_bytes_discarded = 0;
+      bool     tee_enabled = false;
+      for (const auto &target : group->get_targets()) {
+        const auto *sink = target->get_tee_sink();
+        if (sink != NULL) {
+          tee_enabled          = true;
+          tee_bytes_teed      += sink->get_bytes_teed();
+          tee_bytes_sent      += sink->get_bytes_sent();
+          tee_bytes_discarded += sink->get_bytes_discarded();
+        }
+      }
+      if (tee_enabled) {
+        printf("stats: group %u tee teed %luB sent %luB discarded %luB\n",
+          group->get_node_name().group,
+          tee_bytes_teed, tee_bytes_sent, tee_bytes_discarded);
+      }
+
+      group->start_target_connections();
+      group->checkpoint();
+    }
+
+    printf("stats: epoll waits %lu events %lu epoll_ctl %lu syncs %lu\n",
+      manager.get_wait_count(),
+      manager.get_event_count(),
+      manager.get_epoll_ctl_count(),
+      manager.get_sync_count());
+
+    const auto &pipe_budget = Pipeline::PipeBudget::shared();
+    printf("stats: pipes %luB of %luB grown %lu shrunk %lu resize failures %lu\n",
+      pipe_budget.get_allocated(),
+      pipe_budget.get_limit(),
+      pipe_budget.get_grow_count(),
+      pipe_budget.get_shrink_count(),
+      pipe_budget.get_failure_count());
+
+    manager.schedule_timer(this, now + interval);
+  }
+};
+
 int main(int argc, char **argv) {
   const char *client_port   = NULL;
   const char *peer_port     = NULL;
   const char *command_port  = NULL;
+  const char *subscriber_port = NULL;
   std::vector<Pipeline::Peer::Target::Address> target_addresses;
   std::vector<Command::Registration::Address>  registration_addresses;
+  Pipeline::RetentionPolicy retention_policy;
+  uint64_t inflight_window_bytes = CLIENT_INFLIGHT_WINDOW_BYTES;
+  size_t   io_thread_count       = 0;
+  uint32_t group_count           = 1;
+  size_t   epoll_events          = EPOLL_EVENTS_SIZE;
+  bool     edge_triggered        = false;
+  bool     compact_chosen_log    = false;
+  bool     tee_to_peers          = false;
+  uint64_t pipe_memory_budget    = PIPE_MEMORY_BUDGET;
+  bool     direct_io             = false;
+  uint64_t catch_up_rate         = TARGET_CATCH_UP_BYTES_PER_SECOND;
+  Epoll::Manager::Backend epoll_backend = Epoll::Manager::Backend::epoll;
 
   while (1) {
     int option_index = 0;
-    int getopt_result = getopt_long(argc, argv, "c:p:m:t:r:",
+    int getopt_result = getopt_long(argc, argv, "c:p:m:t:r:b:a:uw:i:g:e:EUC:s:LTP:D",
                                     long_options, &option_index);
 
     if (getopt_result == -1) { break; }
 
-    char *target, *p;
+    char *target, *p, *end;
 
     switch (getopt_result) {
       case 'c':
@@ -129,6 +246,106 @@ int main(int argc, char **argv) {
         free(target);
         break;
 
+      case 'b':
+        retention_policy.max_bytes = strtoull(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0') {
+          fprintf(stderr, "--retain-bytes: invalid value '%s'\n", optarg);
+          abort();
+        }
+        break;
+
+      case 'a':
+        retention_policy.max_age = std::chrono::seconds(strtoull(optarg, &end, 10));
+        if (*optarg == '\0' || *end != '\0') {
+          fprintf(stderr, "--retain-seconds: invalid value '%s'\n", optarg);
+          abort();
+        }
+        break;
+
+      case 'u':
+        retention_policy.delete_when_consumed = true;
+        break;
+
+      case 'w':
+        inflight_window_bytes = strtoull(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || inflight_window_bytes == 0) {
+          fprintf(stderr, "--inflight-window-bytes: invalid value '%s'\n", optarg);
+          abort();
+        }
+        break;
+
+      case 'i':
+        io_thread_count = strtoull(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0') {
+          fprintf(stderr, "--io-threads: invalid value '%s'\n", optarg);
+          abort();
+        }
+        break;
+
+      case 'g':
+        group_count = strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || group_count == 0) {
+          fprintf(stderr, "--groups: invalid value '%s'\n", optarg);
+          abort();
+        }
+        break;
+
+      case 'e':
+        epoll_events = strtoull(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || epoll_events == 0) {
+          fprintf(stderr, "--epoll-events: invalid value '%s'\n", optarg);
+          abort();
+        }
+        break;
+
+      case 'E':
+        edge_triggered = true;
+        break;
+
+      case 'U':
+        epoll_backend = Epoll::Manager::Backend::io_uring;
+        break;
+
+      case 'C':
+        catch_up_rate = strtoull(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0') {
+          fprintf(stderr, "--catch-up-rate: invalid value '%s'\n", optarg);
+          abort();
+        }
+        break;
+
+      case 's':
+        if (subscriber_port != NULL) {
+          fprintf(stderr, "--subscriber-port repeated\n");
+          abort();
+        }
+        subscriber_port = strdup(optarg);
+        if (subscriber_port == NULL) {
+          perror("getopt: subscriber_port");
+          abort();
+        }
+        break;
+
+      case 'L':
+        compact_chosen_log = true;
+        break;
+
+      case 'T':
+        tee_to_peers = true;
+        break;
+
+      case 'D':
+        direct_io = true;
+        break;
+
+      case 'P':
+        pipe_memory_budget = strtoull(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || pipe_memory_budget == 0) {
+          fprintf(stderr, "--pipe-memory-budget: invalid value '%s'\n", optarg);
+          abort();
+        }
+        break;
+
       default:
         fprintf(stderr, "unknown option\n");
         abort();
@@ -150,91 +367,68 @@ int main(int argc, char **argv) {
     abort();
   }
 
+  if (!ConsensusGroup::check_port_ranges(group_count, client_port, peer_port,
+                                         command_port, subscriber_port)) {
+    abort();
+  }
+
+  Pipeline::PipeBudget::shared().set_limit(pipe_memory_budget);
+
   std::string cluster_name;
   Paxos::NodeId node_id;
   Command::Registration::get_node_name(cluster_name, node_id,
                                        registration_addresses);
-  const Pipeline::NodeName node_name(cluster_name, node_id);
 
-  printf("Starting as cluster %s node %d\n", node_name.cluster.c_str(),
-                                             node_name.id);
+  printf("Starting as cluster %s node %d with %u group(s)\n",
+         cluster_name.c_str(), node_id, group_count);
 
   std::cout << "Targets:" << std::endl;
   for (const auto &address : target_addresses) {
     std::cout << address.host << " port " << address.port << std::endl;
   }
 
-  Pipeline::SegmentCache segment_cache(node_name);
-  std::vector<std::unique_ptr<Pipeline::Peer::Target>> targets;
   Paxos::Configuration conf(1);
+  std::vector<std::unique_ptr<ConsensusGroup>> groups;
+  for (uint32_t group = 0; group < group_count; group++) {
+    groups.push_back(std::unique_ptr<ConsensusGroup>
+      (new ConsensusGroup(cluster_name, node_id, group, conf)));
+    groups.back()->get_segment_cache().set_retention_policy(retention_policy);
+    groups.back()->get_segment_cache().set_direct_io(direct_io);
+    groups.back()->recover();
+  }
 
-  RealWorld real_world(node_name, segment_cache, targets);
-  Paxos::Legislator legislator(real_world, node_name.id, 0, 0, conf);
-  Epoll::Manager manager(real_world);
-  Pipeline::Client::Listener client_listener
-    (manager, segment_cache, legislator, node_name, client_port);
-  Pipeline::Peer::Listener peer_listener
-    (manager, segment_cache, legislator, node_name, peer_port);
-  Command::Listener command_listener
-    (manager, legislator, node_name, command_port);
-
-  real_world.add_chosen_value_handler(&client_listener);
-  real_world.set_node_id_generation_handler(&command_listener);
+  ConsensusGroupClocks clocks(groups);
+  Epoll::Manager manager(clocks, epoll_backend);
+  manager.set_max_events(epoll_events);
+  manager.set_edge_triggered(edge_triggered);
 
-  for (const auto &address : target_addresses) {
-    targets.push_back(std::move(std::unique_ptr<Pipeline::Peer::Target>
-      (new Pipeline::Peer::Target(address, manager,
-                                  segment_cache, legislator, node_name))));
+  std::unique_ptr<Pipeline::SendfileShards> sendfile_shards;
+  if (0 < io_thread_count) {
+    sendfile_shards.reset(new Pipeline::SendfileShards(manager, io_thread_count));
   }
 
-  const std::chrono::steady_clock::duration
-                                    target_check_interval
-          = std::chrono::milliseconds(500);
+  for (auto &group : groups) {
+    group->start(manager, client_port, peer_port, command_port,
+                 subscriber_port, target_addresses, sendfile_shards.get());
+    group->get_client_listener().get_flow_control()
+         .set_window_bytes(inflight_window_bytes);
+    for (auto &target : group->get_targets()) {
+      target->set_catch_up_rate(catch_up_rate);
+    }
+    if (compact_chosen_log) {
+      group->start_chosen_log_compactor(manager);
+    }
+    if (tee_to_peers) {
+      group->start_tee_replication();
+    }
+  }
 
-  std::chrono::steady_clock::time_point
-                                    next_target_check_time
-                                      = real_world.get_current_time()
-                                      + target_check_interval;
+  TargetCheckTimer target_check_timer(manager, groups);
 
   signal(SIGPIPE, SIG_IGN);
 
   while (1) {
-    auto ms_to_next_wake_up
-      = std::chrono::duration_cast<std::chrono::milliseconds>
-          (real_world.get_next_wake_up_time()
-            - real_world.get_current_time()).count();
-
-    if (ms_to_next_wake_up < 0) {
-      ms_to_next_wake_up = 0;
-    }
-
-    manager.wait(ms_to_next_wake_up);
-
-    legislator.handle_wake_up();
-
-    if (next_target_check_time < real_world.get_current_time()) {
-      struct rusage usage;
-      if (getrusage(RUSAGE_SELF, &usage) == -1) {
-        perror(__PRETTY_FUNCTION__);
-        fprintf(stderr, "%s: getrusage() failed\n", __PRETTY_FUNCTION__);
-        abort();
-      }
-      printf("stats: real %13luus user %3ld%06ldus sys %4ld%06ldus active slots [%9lu,%9lu)=%7lu\n",
-        std::chrono::time_point_cast<std::chrono::microseconds>
-          (real_world.get_current_time()).time_since_epoch().count(),
-        usage.ru_utime.tv_sec, usage.ru_utime.tv_usec,
-        usage.ru_stime.tv_sec, usage.ru_stime.tv_usec,
-        legislator.get_next_chosen_slot(),
-        legislator.get_next_activated_slot(),
-        legislator.get_next_activated_slot() - legislator.get_next_chosen_slot());
-
-      for (auto &target : targets) {
-        target->start_connection();
-      }
-
-      next_target_check_time = real_world.get_current_time()
-                             + target_check_interval;
-    }
+    manager.wait(-1);
   }
 
   return 1;
@@ -0,0 +1,275 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "ConsensusGroup.h"
+
+#include <iostream>
+#include <limits>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+
+ConsensusGroup::ConsensusGroup(const std::string          &cluster_name,
+                               const Paxos::NodeId         node_id,
+                               const uint32_t              group,
+                               const Paxos::Configuration &conf)
+  : node_name(cluster_name, node_id, group),
+    segment_cache(node_name),
+    real_world(node_name, segment_cache, targets),
+    legislator(real_world, node_name.id, 0, 0, conf),
+    manifest(node_name) {}
+
+std::string ConsensusGroup::group_port(const char *port) const {
+  char *end;
+  unsigned long port_number = strtoul(port, &end, 10);
+  if (*port == '\0' || *end != '\0' || 65535 < port_number + node_name.group) {
+    fprintf(stderr, "%s: invalid port '%s' for group %u\n",
+                    __PRETTY_FUNCTION__, port, node_name.group);
+    abort();
+  }
+  return std::to_string(port_number + node_name.group);
+}
+
+bool ConsensusGroup::check_port_ranges(const uint32_t  group_count,
+                                       const char     *client_port,
+                                       const char     *peer_port,
+                                       const char     *command_port,
+                                       const char     *subscriber_port) {
+  struct PortRange {
+    const char    *option;
+    const char    *port;
+    unsigned long  first;
+    unsigned long  count;
+  };
+
+  std::vector<PortRange> ranges = {
+    {"--client-port",  client_port,  0, 1},
+    {"--peer-port",    peer_port,    0, group_count},
+    {"--command-port", command_port, 0, group_count}};
+  if (subscriber_port != NULL) {
+    ranges.push_back({"--subscriber-port", subscriber_port, 0, group_count});
+  }
+
+  for (auto &range : ranges) {
+    char *end;
+    range.first = strtoul(range.port, &end, 10);
+    if (*range.port == '\0' || *end != '\0'
+        || 65536 < range.first + range.count) {
+      fprintf(stderr, "%s: invalid port '%s' for %s with %u group(s)\n",
+                      __PRETTY_FUNCTION__, range.port, range.option,
+                      group_count);
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < ranges.size(); i++) {
+    for (size_t j = i + 1; j < ranges.size(); j++) {
+      const auto &a = ranges[i];
+      const auto &b = ranges[j];
+      if (a.first < b.first + b.count && b.first < a.first + a.count) {
+        fprintf(stderr, "%s: %s ports %lu-%lu overlap %s ports %lu-%lu\n",
+                        __PRETTY_FUNCTION__,
+                        a.option, a.first, a.first + a.count - 1,
+                        b.option, b.first, b.first + b.count - 1);
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+void ConsensusGroup::start
+      (      Epoll::Manager                               &manager,
+       const char                                         *client_port,
+       const char                                         *peer_port,
+       const char                                         *command_port,
+       const char                                         *subscriber_port,
+       const std::vector<Pipeline::Peer::Target::Address> &target_addresses,
+             Pipeline::SendfileShards                     *sendfile_shards) {
+
+  segment_cache.start_pool();
+  real_world.set_manager(&manager);
+  real_world.set_wake_up_handler(this);
+
+  client_listener.reset(new Pipeline::Client::Listener
+    (manager, segment_cache, legislator, node_name, client_port));
+  peer_listener.reset(new Pipeline::Peer::Listener
+    (manager, segment_cache, legislator, node_name,
+     group_port(peer_port).c_str()));
+  command_listener.reset(new Command::Listener
+    (manager, legislator, node_name, segment_cache,
+     group_port(command_port).c_str()));
+
+  real_world.add_chosen_value_handler(client_listener.get());
+  if (subscriber_port != NULL) {
+    subscriber_listener.reset(new Pipeline::Subscriber::Listener
+      (manager, segment_cache, group_port(subscriber_port).c_str()));
+    real_world.add_chosen_value_handler(subscriber_listener.get());
+  }
+  real_world.set_node_id_generation_handler(command_listener.get());
+
+  for (const auto &address : target_addresses) {
+    Pipeline::Peer::Target::Address group_address
+      (address.host.c_str(), group_port(address.port.c_str()).c_str());
+    targets.push_back(std::unique_ptr<Pipeline::Peer::Target>
+      (new Pipeline::Peer::Target(group_address, manager,
+                                  segment_cache, legislator, node_name,
+                                  sendfile_shards)));
+  }
+}
+
+void ConsensusGroup::recover() {
+  Pipeline::SegmentManifest::Snapshot snapshot;
+  if (!manifest.load(snapshot)) {
+    return;
+  }
+  const auto &header = snapshot.header;
+
+  std::set<std::string> listed_paths;
+  for (const auto &segment : snapshot.segments) {
+    listed_paths.insert(segment.path);
+    const Paxos::Value::OffsetStream stream = {
+      .name   = {.owner = segment.owner, .id = segment.id},
+      .offset = segment.offset
+    };
+    const Paxos::SlotRange slots(segment.start_slot, segment.end_slot);
+    const Paxos::Term      term(segment.term.get_paxos_term());
+
+    if (segment.flags & Pipeline::SegmentManifest::chosen) {
+      segment_cache.restore_chosen_segment({
+        .stream           = stream,
+        .slots            = slots,
+        .term             = term,
+        .path             = segment.path,
+        .is_compacted_log = (segment.flags
+                           & Pipeline::SegmentManifest::compacted_log) != 0});
+    } else {
+      segment_cache.restore_entry(stream, term, slots,
+        (segment.flags & Pipeline::SegmentManifest::locally_accepted) != 0,
+        segment.path);
+    }
+  }
+
+  // Segments opened since the checkpoint hold acceptances that it lacks.
+  std::vector<Paxos::Proposal> acceptances;
+  segment_cache.restore_unlisted_entries(listed_paths, acceptances);
+
+  for (const auto &record : snapshot.acceptances) {
+    const Paxos::Proposal acceptance
+      = Pipeline::SegmentManifest::Snapshot::get_acceptance(record);
+    // Only claim to have accepted stream content that is still held.
+    if (acceptance.value.type == Paxos::Value::Type::stream_content
+        && segment_cache.first_slot_not_held(acceptance.value.payload.stream,
+                                             acceptance.slots)
+              != acceptance.slots.end()) {
+      continue;
+    }
+    acceptances.push_back(acceptance);
+  }
+
+  Paxos::Term promise = header.min_acceptable_term.get_paxos_term();
+  real_world.replay_log(header.log_offset, promise, acceptances);
+
+  std::vector<Paxos::Value::StreamPosition> open_streams;
+  snapshot.get_open_streams(open_streams);
+
+  legislator.restore(header.first_unchosen_slot,
+                     header.era,
+                     snapshot.get_configuration(),
+                     header.next_generated_node_id,
+                     open_streams,
+                     acceptances,
+                     promise);
+
+  segment_cache.expire_because_chosen_to(legislator.get_next_chosen_slot());
+
+#ifndef NTRACE
+  std::cout << __PRETTY_FUNCTION__
+    << ": restored " << snapshot.segments.size() << " segments and "
+    << acceptances.size() << " acceptances up to slot "
+    << header.first_unchosen_slot << std::endl;
+#endif // ndef NTRACE
+}
+
+void ConsensusGroup::checkpoint() {
+  std::unique_ptr<Pipeline::SegmentManifest::Snapshot> snapshot
+    (new Pipeline::SegmentManifest::Snapshot());
+  auto &header = snapshot->header;
+
+  header.first_unchosen_slot    = legislator.get_next_chosen_slot();
+  header.era                    = legislator.get_current_era();
+  header.next_generated_node_id = legislator.get_next_generated_node_id();
+  header.min_acceptable_term.copy_from(legislator.get_min_acceptable_term());
+  header.log_offset             = real_world.get_synced_log_offset();
+
+  snapshot->set_configuration(legislator.get_current_configuration());
+  snapshot->set_open_streams(legislator.get_open_streams());
+  for (const auto &acceptance : legislator.get_sent_acceptances()) {
+    snapshot->add_acceptance(acceptance);
+  }
+
+  std::vector<const Pipeline::SegmentCache::CacheEntry*> entries;
+  segment_cache.get_entries(entries);
+  for (const auto entry : entries) {
+    snapshot->add_segment(entry->stream, entry->slots, entry->term,
+      entry->is_locally_accepted
+        ? Pipeline::SegmentManifest::locally_accepted : 0,
+      entry->path);
+  }
+
+  std::vector<Pipeline::SegmentCache::ChosenSegment> chosen_segments;
+  segment_cache.get_chosen_segments
+    (std::numeric_limits<Paxos::Slot>::max(), chosen_segments);
+  for (const auto &segment : chosen_segments) {
+    snapshot->add_segment(segment.stream, segment.slots, segment.term,
+      Pipeline::SegmentManifest::locally_accepted
+        | Pipeline::SegmentManifest::chosen
+        | (segment.is_compacted_log
+             ? Pipeline::SegmentManifest::compacted_log : 0),
+      segment.path);
+  }
+
+  manifest.checkpoint(std::move(snapshot));
+}
+
+void ConsensusGroup::start_target_connections() {
+  for (auto &target : targets) {
+    target->start_connection();
+  }
+}
+
+void ConsensusGroup::start_chosen_log_compactor(Epoll::Manager &manager) {
+  chosen_log_compactor.reset(new Pipeline::ChosenLogCompactor
+    (manager, segment_cache));
+  real_world.add_chosen_value_handler(chosen_log_compactor.get());
+}
+
+void ConsensusGroup::start_tee_replication() {
+  for (auto &target : targets) {
+    Pipeline::TeeSink *sink = target->enable_tee_sink();
+    if (sink != NULL) {
+      tee_sinks.push_back(sink);
+    }
+  }
+  if (!tee_sinks.empty()) {
+    client_listener->set_tee_sinks(&tee_sinks);
+  }
+}
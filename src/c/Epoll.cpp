@@ -18,16 +18,599 @@
 
 
 
+#include "Epoll.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
-#include <atomic>
+#include <algorithm>
 
 namespace Epoll {
 
-void update_clock(std::atomic<bool> *flag, std::atomic<bool> *exit)
-{
-  while (!exit->load()) {
-    usleep(10000);
-    flag->store(true);
+uint64_t TimerWheel::tick_of(const timestamp &t) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>
+           (t.time_since_epoch()).count() / EPOLL_TIMER_TICK_MS;
+}
+
+TimerWheel::TimerWheel(const timestamp &now)
+  : slots(EPOLL_TIMER_WHEEL_SLOTS),
+    current_tick(tick_of(now)) {
+}
+
+void TimerWheel::schedule(TimerHandler *handler, const timestamp &deadline) {
+  cancel(handler);
+
+  /* Deadlines that have already passed go in the current slot, so that they
+     expire on the next call to expire(). */
+  handler->timer_scheduled = true;
+  handler->timer_deadline  = deadline;
+  handler->timer_tick      = std::max(tick_of(deadline), current_tick);
+  slot_for(handler->timer_tick).push_back(handler);
+  timer_count++;
+}
+
+void TimerWheel::cancel(TimerHandler *handler) {
+  if (!handler->timer_scheduled) {
+    return;
+  }
+
+  auto &slot = slot_for(handler->timer_tick);
+  auto it = std::find(slot.begin(), slot.end(), handler);
+  assert(it != slot.end());
+  *it = slot.back();
+  slot.pop_back();
+
+  handler->timer_scheduled = false;
+  timer_count--;
+}
+
+timestamp TimerWheel::next_deadline() const {
+  assert(!is_empty());
+
+  /* Every timer's tick is at least current_tick, so the first slot holding a
+     timer for the current turn of the wheel holds the earliest one. */
+  for (uint64_t tick = current_tick;
+                tick < current_tick + slots.size();
+                tick++) {
+    bool      found = false;
+    timestamp earliest;
+    for (const auto handler : slot_for(tick)) {
+      if (handler->timer_tick == tick
+          && (!found || handler->timer_deadline < earliest)) {
+        found    = true;
+        earliest = handler->timer_deadline;
+      }
+    }
+    if (found) {
+      return earliest;
+    }
+  }
+
+  /* Every timer is more than a full turn away. */
+  bool      found = false;
+  timestamp earliest;
+  for (const auto &slot : slots) {
+    for (const auto handler : slot) {
+      if (!found || handler->timer_deadline < earliest) {
+        found    = true;
+        earliest = handler->timer_deadline;
+      }
+    }
+  }
+  assert(found);
+  return earliest;
+}
+
+void TimerWheel::expire(const timestamp &now,
+                        std::vector<TimerHandler*> &expired) {
+  const uint64_t now_tick = tick_of(now);
+
+  const uint64_t new_tick = std::max(now_tick, current_tick);
+
+  /* Visit each slot from the current one up to now, but no slot twice. */
+  uint64_t last_tick = new_tick;
+  if (current_tick + slots.size() <= last_tick) {
+    last_tick = current_tick + slots.size() - 1;
+  }
+
+  for (uint64_t tick = current_tick; tick <= last_tick; tick++) {
+    auto &slot = slot_for(tick);
+    size_t i = 0;
+    while (i < slot.size()) {
+      TimerHandler *handler = slot[i];
+      if (handler->timer_tick <= new_tick && handler->timer_deadline <= now) {
+        slot[i] = slot.back();
+        slot.pop_back();
+        handler->timer_scheduled = false;
+        timer_count--;
+        expired.push_back(handler);
+      } else {
+        i++;
+      }
+    }
+  }
+
+  current_tick = new_tick;
+}
+
+BackgroundSyncs::BackgroundSyncs(int completion_fd)
+  : completion_fd(completion_fd),
+    worker(&BackgroundSyncs::run, this) {
+}
+
+BackgroundSyncs::~BackgroundSyncs() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    should_exit = true;
+  }
+  condition.notify_one();
+  worker.join();
+}
+
+void BackgroundSyncs::submit(const Job &job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queued_jobs.push_back(job);
+  }
+  condition.notify_one();
+}
+
+void BackgroundSyncs::run() {
+  std::deque<Job> jobs;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      condition.wait(lock, [this] { return should_exit || !queued_jobs.empty(); });
+      if (queued_jobs.empty()) {
+        assert(should_exit);
+        return;
+      }
+      jobs.swap(queued_jobs);
+    }
+
+    for (const auto &job : jobs) {
+      switch (job.kind) {
+        case SYNC:
+          if (fdatasync(job.fd) == -1) {
+            perror(__PRETTY_FUNCTION__);
+            fprintf(stderr, "%s: fdatasync(%d) failed\n",
+                            __PRETTY_FUNCTION__, job.fd);
+            abort();
+          }
+          break;
+
+        case WRITE: {
+          size_t written = 0;
+          while (written < job.length) {
+            ssize_t write_result = pwrite(job.fd,
+              static_cast<const char*>(job.data) + written,
+              job.length - written, job.offset + written);
+            if (write_result <= 0) {
+              perror(__PRETTY_FUNCTION__);
+              fprintf(stderr, "%s: pwrite(%d) failed\n",
+                              __PRETTY_FUNCTION__, job.fd);
+              abort();
+            }
+            written += write_result;
+          }
+          job.release(job.data);
+          break;
+        }
+
+        case TRUNCATE: {
+          struct stat buf;
+          if (fstat(job.fd, &buf) == -1) {
+            perror(__PRETTY_FUNCTION__);
+            fprintf(stderr, "%s: fstat(%d) failed\n",
+                            __PRETTY_FUNCTION__, job.fd);
+            abort();
+          }
+          if ((off_t)job.length < buf.st_size
+              && ftruncate(job.fd, job.length) == -1) {
+            perror(__PRETTY_FUNCTION__);
+            fprintf(stderr, "%s: ftruncate(%d) failed\n",
+                            __PRETTY_FUNCTION__, job.fd);
+            abort();
+          }
+          break;
+        }
+      }
+      close(job.fd);
+    }
+
+    uint64_t completion_count = jobs.size();
+    jobs.clear();
+    if (write(completion_fd, &completion_count, sizeof completion_count)
+          != sizeof completion_count) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: write() failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+  }
+}
+
+Uring::Uring(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+
+  ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: io_uring_setup() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  if (!(params.features & IORING_FEAT_EXT_ARG)) {
+    fprintf(stderr, "%s: io_uring lacks IORING_FEAT_EXT_ARG\n",
+                    __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes
+               + params.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  void *sqes_map
+          = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes_map == MAP_FAILED) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: mmap() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+  sqes = static_cast<struct io_uring_sqe*>(sqes_map);
+
+  uint8_t *sq = static_cast<uint8_t*>(sq_ring);
+  sq_head    = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail    = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask    = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_entries = params.sq_entries;
+  sq_array   = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+  uint8_t *cq = static_cast<uint8_t*>(cq_ring);
+  cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes    = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+Uring::~Uring() {
+  munmap(sqes, sqes_size);
+  munmap(cq_ring, cq_ring_size);
+  munmap(sq_ring, sq_ring_size);
+  close(ring_fd);
+}
+
+int Uring::enter(unsigned min_complete, int timeout_milliseconds) {
+  struct __kernel_timespec timeout;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof arg);
+
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  if (0 < min_complete) {
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+  if (0 <= timeout_milliseconds) {
+    timeout.tv_sec  = timeout_milliseconds / 1000;
+    timeout.tv_nsec = (timeout_milliseconds % 1000) * 1000000L;
+    arg.ts = reinterpret_cast<uint64_t>(&timeout);
+  }
+
+  int result = syscall(__NR_io_uring_enter, ring_fd, queued, min_complete,
+                       flags, &arg, sizeof arg);
+  if (result == -1 && errno != ETIME && errno != EINTR) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: io_uring_enter() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+  queued = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  return result;
+}
+
+void Uring::reserve(unsigned count) {
+  assert(count <= sq_entries);
+  if (sq_entries - (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE))
+        < count) {
+    enter(0, 0);
+    assert(count <= sq_entries
+             - (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)));
+  }
+}
+
+struct io_uring_sqe *Uring::get_sqe() {
+  reserve(1);
+  unsigned tail = *sq_tail;
+
+  unsigned index = tail & sq_mask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof *sqe);
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  queued++;
+  return sqe;
+}
+
+void Uring::poll_add(int fd, uint32_t events, bool multishot,
+                     uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = fd;
+  sqe->poll32_events = events;
+  sqe->len           = multishot ? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data     = user_data;
+}
+
+void Uring::poll_remove(uint64_t target_user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode    = IORING_OP_POLL_REMOVE;
+  sqe->fd        = -1;
+  sqe->addr      = target_user_data;
+  sqe->user_data = 0;
+}
+
+void Uring::fdatasync(int fd, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode      = IORING_OP_FSYNC;
+  sqe->fd          = fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->user_data   = user_data;
+}
+
+void Uring::splice_then_fdatasync(int fd_in, int fd_out, uint64_t off_out,
+                                  uint32_t length,
+                                  uint64_t splice_user_data,
+                                  uint64_t sync_user_data) {
+  reserve(2);
+
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode        = IORING_OP_SPLICE;
+  sqe->flags         = IOSQE_IO_LINK;
+  sqe->splice_fd_in  = fd_in;
+  sqe->splice_off_in = -1; // a pipe has no offset
+  sqe->fd            = fd_out;
+  sqe->off           = off_out;
+  sqe->len           = length;
+  sqe->splice_flags  = SPLICE_F_MOVE;
+  sqe->user_data     = splice_user_data;
+
+  fdatasync(fd_out, sync_user_data);
+}
+
+void Uring::submit_and_wait(int timeout_milliseconds,
+                            std::vector<Completion> &completions) {
+  const bool have_completions
+    = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != *cq_head;
+
+  if (0 < queued || !have_completions) {
+    enter(have_completions || timeout_milliseconds == 0 ? 0 : 1,
+          timeout_milliseconds);
+  }
+
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    const struct io_uring_cqe &cqe = cqes[head & cq_mask];
+    completions.push_back({ .user_data = cqe.user_data,
+                            .result    = cqe.res,
+                            .flags     = cqe.flags });
+    head++;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* User data for sync completions has this bit set and holds the sync's
+   sequence number, and likewise for splices. Poll completions hold the
+   generation in the upper half and the fd in the lower half. Generations
+   run from 1 up to URING_GENERATION_MASK and then wrap back to 1, so they
+   never reach these bits, and user data 0 (used for poll removals) matches
+   nothing. */
+#define URING_SYNC_TAG        (1ULL << 63)
+#define URING_SPLICE_TAG      (1ULL << 62)
+#define URING_GENERATION_MASK ((1U << 30) - 1)
+
+static uint64_t uring_poll_user_data(int fd, uint32_t generation) {
+  return (static_cast<uint64_t>(generation) << 32)
+       | static_cast<uint32_t>(fd);
+}
+
+void Manager::uring_arm(int fd) {
+  auto &r = uring_registrations[fd];
+  assert(r.handler != NULL);
+  assert(!r.armed);
+  uring->poll_add(fd, r.events & ~EPOLLET, (r.events & EPOLLET) != 0,
+                  uring_poll_user_data(fd, r.generation));
+  r.armed = true;
+}
+
+void Manager::uring_ctl(int op, int fd, Handler *handler, uint32_t events) {
+  if (fd < 0) {
+    fprintf(stderr, "%s: bad fd %d\n", __PRETTY_FUNCTION__, fd);
+    abort();
+  }
+  if (uring_registrations.size() <= static_cast<size_t>(fd)) {
+    uring_registrations.resize(fd + 1);
+  }
+
+  auto &r = uring_registrations[fd];
+  if ((op == EPOLL_CTL_ADD) != (r.handler == NULL)) {
+    fprintf(stderr, "%s: op %d on fd %d which is %sregistered\n",
+      __PRETTY_FUNCTION__, op, fd, r.handler == NULL ? "not " : "");
+    abort();
+  }
+
+  if (r.armed) {
+    uring->poll_remove(uring_poll_user_data(fd, r.generation));
+    r.armed = false;
+  }
+
+  if (op == EPOLL_CTL_DEL) {
+    r.handler = NULL;
+    r.events  = 0;
+    return;
+  }
+
+  uring_generation = (uring_generation + 1) & URING_GENERATION_MASK;
+  if (uring_generation == 0) {
+    uring_generation = 1;
+  }
+
+  r.handler    = handler;
+  r.events     = events;
+  r.generation = uring_generation;
+  uring_arm(fd);
+}
+
+void Manager::uring_sync(int fd, SyncHandler *handler) {
+  /* The caller may close fd before the sync completes, so sync a copy. */
+  int dup_fd = dup(fd);
+  if (dup_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: dup(%d) failed\n", __PRETTY_FUNCTION__, fd);
+    abort();
+  }
+
+  uring->fdatasync(dup_fd,
+                   URING_SYNC_TAG | (uring_first_sync + uring_syncs.size()));
+  uring_syncs.push_back({ .handler = handler, .fd = dup_fd, .done = false });
+}
+
+void Manager::splice_and_sync_in_background(int pipe_fd, int fd, off_t offset,
+                                           size_t         length,
+                                           SpliceHandler *spliced,
+                                           SyncHandler   *synced) {
+  assert(uring);
+  sync_count++;
+  assert(0 < length && length <= UINT32_MAX);
+
+  /* The caller may close either fd before the splice completes, so use
+   * copies. */
+  int dup_pipe_fd = dup(pipe_fd);
+  int dup_fd      = dup(fd);
+  int dup_sync_fd = dup(fd);
+  if (dup_pipe_fd == -1 || dup_fd == -1 || dup_sync_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: dup() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  uring->splice_then_fdatasync(dup_pipe_fd, dup_fd, offset, length,
+    URING_SPLICE_TAG | (uring_first_splice + uring_splices.size()),
+    URING_SYNC_TAG   | (uring_first_sync   + uring_syncs.size()));
+
+  uring_splices.push_back({ .handler = spliced,
+                            .pipe_fd = dup_pipe_fd,
+                            .fd      = dup_fd,
+                            .result  = 0,
+                            .done    = false });
+  uring_syncs.push_back({ .handler = synced, .fd = dup_sync_fd, .done = false });
+}
+
+void Manager::uring_splice_completed(uint64_t splice, int32_t result) {
+  assert(uring_first_splice <= splice);
+  assert(splice - uring_first_splice < uring_splices.size());
+  auto &s = uring_splices[splice - uring_first_splice];
+  s.result = result;
+  s.done   = true;
+
+  /* Like syncs, splices are reported in order. */
+  while (!uring_splices.empty() && uring_splices.front().done) {
+    const UringSplice completed = uring_splices.front();
+    uring_splices.pop_front();
+    uring_first_splice++;
+    close(completed.pipe_fd);
+    close(completed.fd);
+    if (completed.handler != NULL) {
+      completed.handler->handle_spliced(completed.result);
+    }
+  }
+}
+
+void Manager::uring_sync_completed(uint64_t sync, int32_t result) {
+  if (result < 0) {
+    errno = -result;
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fdatasync failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  assert(uring_first_sync <= sync);
+  assert(sync - uring_first_sync < uring_syncs.size());
+  uring_syncs[sync - uring_first_sync].done = true;
+
+  /* Syncs may complete out of order, but are reported in order. */
+  while (!uring_syncs.empty() && uring_syncs.front().done) {
+    const UringSync completed = uring_syncs.front();
+    uring_syncs.pop_front();
+    uring_first_sync++;
+    close(completed.fd);
+    if (completed.handler != NULL) {
+      completed.handler->handle_synced();
+    }
+  }
+}
+
+void Manager::uring_wait(int timeout_milliseconds) {
+  uring_completions.clear();
+  uring->submit_and_wait(timeout_milliseconds, uring_completions);
+
+  refresh_clock_cache();
+
+#ifndef NTRACE
+  printf("%s: %lu completions received\n",
+         __PRETTY_FUNCTION__, uring_completions.size());
+#endif // ndef NTRACE
+
+  wait_count++;
+  events_received += uring_completions.size();
+
+  for (const auto &c : uring_completions) {
+    if (c.user_data == 0) {
+      continue; // completion of a poll removal
+    }
+
+    if (c.user_data & URING_SYNC_TAG) {
+      uring_sync_completed(c.user_data & ~URING_SYNC_TAG, c.result);
+      continue;
+    }
+
+    if (c.user_data & URING_SPLICE_TAG) {
+      uring_splice_completed(c.user_data & ~URING_SPLICE_TAG, c.result);
+      continue;
+    }
+
+    const int      fd         = c.user_data & 0xffffffff;
+    const uint32_t generation = c.user_data >> 32;
+    auto &r = uring_registrations[fd];
+    if (r.handler == NULL || r.generation != generation) {
+      continue; // superseded registration
+    }
+
+    if (!(c.flags & IORING_CQE_F_MORE)) {
+      r.armed = false;
+    }
+
+    if (0 <= c.result) {
+      dispatch(r.handler, c.result);
+    }
+
+    /* The handler may have changed the registrations, including resizing
+     * the vector, so look this one up again. */
+    auto &after = uring_registrations[fd];
+    if (after.handler != NULL && after.generation == generation
+        && !after.armed) {
+      uring_arm(fd);
+    }
   }
 }
 
@@ -78,9 +78,7 @@ std::ostream &Legislator::write_to(std::ostream &o) const {
 
   o << "-- RSM state:" << std::endl;
   o << "next_generated_node_id  = " << _next_generated_node_id << std::endl;
-  o << "current_stream.owner    = " << _current_stream.owner   << std::endl;
-  o << "current_stream.id       = " << _current_stream.id      << std::endl;
-  o << "current_stream_pos      = " << _current_stream_pos     << std::endl;
+  o << "open_streams            = " << _open_streams           << std::endl;
   return o;
 }
 
@@ -206,8 +204,7 @@ void Legislator::handle_request_catch_up(const NodeId &sender) {
                        _palladium.get_current_era(),
                        _palladium.get_current_configuration(),
                        _next_generated_node_id,
-                       _current_stream,
-                       _current_stream_pos);
+                       _open_streams);
 }
 
 void Legislator::unsafely_stage_coup() {
@@ -223,8 +220,7 @@ void Legislator::unsafely_stage_coup() {
                        _palladium.get_current_era() + 2,
                        conf,
                        _next_generated_node_id,
-                       _current_stream,
-                       _current_stream_pos);
+                       _open_streams);
 }
 
 void Legislator::handle_send_catch_up
@@ -232,8 +228,7 @@ void Legislator::handle_send_catch_up
     const Era           &era,
     const Configuration &conf,
     const NodeId        &next_generated_node,
-    const Value::StreamName &current_stream,
-    const uint64_t       current_stream_pos) {
+    const std::vector<Value::StreamPosition> &open_streams) {
 
   if (_palladium.next_chosen_slot() < slot) {
     _palladium.catch_up(slot, era, conf);
@@ -241,13 +236,16 @@ void Legislator::handle_send_catch_up
     assert(_next_generated_node_id <= next_generated_node);
     _next_generated_node_id = next_generated_node;
 
-    if (current_stream.owner == _current_stream.owner
-      && current_stream.id   == _current_stream.id) {
-      assert(_current_stream_pos <= current_stream_pos);
+#ifndef NDEBUG
+    for (const auto &open_stream : open_streams) {
+      const auto it = find_open_stream(open_stream.name);
+      if (it != _open_streams.end()) {
+        assert(it->position <= open_stream.position);
+      }
     }
+#endif // ndef NDEBUG
 
-    _current_stream     = current_stream;
-    _current_stream_pos = current_stream_pos;
+    _open_streams = open_streams;
 
     instant now = _world.get_current_time();
     if (_role != Role::candidate) {
@@ -287,6 +285,34 @@ void Legislator::start_term(const NodeId &owner_id) {
   handle_prepare_term(_palladium.node_id(), _attempted_term);
 }
 
+void Legislator::restore
+   (const Slot                               &first_unchosen_slot,
+    const Era                                &era,
+    const Configuration                      &conf,
+    const NodeId                             &next_generated_node_id,
+    const std::vector<Value::StreamPosition> &open_streams,
+    const std::vector<Proposal>              &acceptances,
+    const Term                               &min_acceptable_term) {
+
+  if (_palladium.next_chosen_slot() < first_unchosen_slot) {
+    _palladium.catch_up(first_unchosen_slot, era, conf);
+  }
+
+  if (_next_generated_node_id < next_generated_node_id) {
+    _next_generated_node_id = next_generated_node_id;
+  }
+  _open_streams = open_streams;
+
+  for (const auto &acceptance : acceptances) {
+    _palladium.handle_proposal(acceptance);
+  }
+
+  if (min_acceptable_term.era <= _palladium.get_current_era()
+      && _palladium.get_min_acceptable_term() < min_acceptable_term) {
+    _palladium.handle_prepare(min_acceptable_term);
+  }
+}
+
 void Legislator::handle_prepare_term(const NodeId &sender, const Term &term) {
   if (_role == Role::follower && sender != _leader_id)           { return; }
   if (is_leading()            && sender != _palladium.node_id()) { return; }
@@ -299,7 +325,9 @@ void Legislator::handle_prepare_term(const NodeId &sender, const Term &term) {
     if (promise.type == Promise::Type::multi
         || promise.slots.is_nonempty()) {
       if (term.owner == _palladium.node_id()) {
-        handle_promise(_palladium.node_id(), promise);
+        _world.after_log_synced([this, promise]() {
+          handle_promise(_palladium.node_id(), promise);
+        });
       } else {
         _world.make_promise(promise);
       }
@@ -315,3 +343,29 @@ void Legislator::handle_promise(const NodeId &sender, const Promise &promise) {
   }
 }
 
+std::vector<Value::StreamPosition>::iterator
+  Legislator::find_open_stream(const Value::StreamName &name) {
+  for (auto it = _open_streams.begin(); it != _open_streams.end(); ++it) {
+    if (it->name.owner == name.owner && it->name.id == name.id) {
+      return it;
+    }
+  }
+  return _open_streams.end();
+}
+
+void Legislator::open_stream(const Value::StreamName &name,
+                             uint64_t position, Slot slot) {
+  if (_max_open_streams <= _open_streams.size()) {
+    auto least_recent = _open_streams.begin();
+    for (auto it = _open_streams.begin(); it != _open_streams.end(); ++it) {
+      if (it->last_chosen_slot < least_recent->last_chosen_slot) {
+        least_recent = it;
+      }
+    }
+    _open_streams.erase(least_recent);
+  }
+
+  _open_streams.push_back({.name             = name,
+                           .position         = position,
+                           .last_chosen_slot = slot});
+}
@@ -501,6 +501,38 @@ const bool Palladium::search_for_quorums
   return false;
 }
 
+const Slot Palladium::find_quorum_end
+        (Slot                  *ends,
+         Configuration::Weight *weights,
+         const size_t           count,
+         const uint32_t         total_weight) {
+
+  /* Sort by descending end, keeping the weights alongside. Acceptances
+   * mostly arrive in order, so an insertion sort does very little work. */
+  for (size_t i = 1; i < count; i++) {
+    const Slot                  end    = ends[i];
+    const Configuration::Weight weight = weights[i];
+    size_t j = i;
+    while (j > 0 && ends[j-1] < end) {
+      ends   [j] = ends   [j-1];
+      weights[j] = weights[j-1];
+      j--;
+    }
+    ends   [j] = end;
+    weights[j] = weight;
+  }
+
+  uint32_t covering_weight = 0;
+  for (size_t i = 0; i < count; i++) {
+    covering_weight += weights[i];
+    if (total_weight < 2 * covering_weight) {
+      return ends[i];
+    }
+  }
+
+  return 0;
+}
+
 const void Palladium::catch_up(const Slot          &slot,
                                const Era           &era,
                                const Configuration &configuration) {
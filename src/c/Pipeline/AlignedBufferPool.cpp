@@ -0,0 +1,74 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/AlignedBufferPool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace Pipeline {
+
+AlignedBufferPool &AlignedBufferPool::shared() {
+  static AlignedBufferPool pool;
+  return pool;
+}
+
+AlignedBufferPool::~AlignedBufferPool() {
+  for (void *buffer : spare_buffers) {
+    free(buffer);
+  }
+}
+
+void *AlignedBufferPool::take() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!spare_buffers.empty()) {
+      void *buffer = spare_buffers.back();
+      spare_buffers.pop_back();
+      return buffer;
+    }
+  }
+
+  void *buffer;
+  int memalign_result = posix_memalign(&buffer, DIRECT_IO_ALIGNMENT,
+                                       DIRECT_IO_BUFFER_SIZE);
+  if (memalign_result != 0) {
+    errno = memalign_result;
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: posix_memalign() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+  return buffer;
+}
+
+void AlignedBufferPool::give_back(void *buffer) {
+  auto &pool = shared();
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.spare_buffers.size() < ALIGNED_BUFFER_POOL_SIZE) {
+      pool.spare_buffers.push_back(buffer);
+      return;
+    }
+  }
+  free(buffer);
+}
+
+}
@@ -0,0 +1,468 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/ChosenLogCompactor.h"
+#include "directories.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <limits>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+namespace Pipeline {
+
+bool ChosenLogCompactor::LogKey::operator<(const LogKey &other) const {
+  if (owner  != other.owner)  { return owner  < other.owner; }
+  if (id     != other.id)     { return id     < other.id; }
+  return offset < other.offset;
+}
+
+ChosenLogCompactor::ChosenLogCompactor(Epoll::Manager &manager,
+                                       SegmentCache   &segment_cache)
+  : manager(manager),
+    segment_cache(segment_cache),
+    completion_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+
+  if (completion_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: eventfd() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+  manager.register_handler(completion_fd, this, EPOLLIN);
+  segment_cache.add_consumer(this);
+
+  worker = std::thread(&ChosenLogCompactor::run, this);
+}
+
+ChosenLogCompactor::~ChosenLogCompactor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    should_exit = true;
+  }
+  condition.notify_one();
+  worker.join();
+
+  for (auto &it : logs) {
+    close_log(it.second);
+  }
+  close_source();
+
+  segment_cache.remove_consumer(this);
+  manager.deregister_close_and_clear(completion_fd);
+}
+
+Paxos::Slot ChosenLogCompactor::get_first_unconsumed_slot() const {
+  if (jobs_in_flight.empty()) {
+    return std::numeric_limits<Paxos::Slot>::max();
+  }
+  return jobs_in_flight.front();
+}
+
+void ChosenLogCompactor::handle_stream_content
+      (const Paxos::Proposal &proposal) {
+  assert(proposal.value.type == Paxos::Value::Type::stream_content);
+  const auto &stream = proposal.value.payload.stream;
+
+  std::vector<Job> jobs;
+  Paxos::Slot slot = proposal.slots.start();
+  while (slot < proposal.slots.end()) {
+    SegmentCache::ChosenSegment segment
+      = {.stream = stream, .slots = Paxos::SlotRange(0, 0)};
+    if (!segment_cache.locate_chosen_data(stream, slot, segment)) {
+      jobs.push_back({
+        .stream        = stream,
+        .slots         = Paxos::SlotRange(slot, proposal.slots.end()),
+        .term          = proposal.term,
+        .source_path   = "",
+        .source_offset = 0});
+      break;
+    }
+
+    const Paxos::Slot end_slot = std::min(proposal.slots.end(),
+                                          segment.slots.end());
+    jobs.push_back({
+      .stream        = stream,
+      .slots         = Paxos::SlotRange(slot, end_slot),
+      .term          = segment.term,
+      .source_path   = segment.path,
+      .source_offset = off_t(slot - segment.slots.start())});
+    slot = end_slot;
+  }
+
+  if (jobs.empty()) {
+    return;
+  }
+
+  const bool was_idle = jobs_in_flight.empty();
+  for (const auto &job : jobs) {
+    jobs_in_flight.push_back(job.slots.start());
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    incoming.insert(incoming.end(), jobs.begin(), jobs.end());
+  }
+  condition.notify_one();
+
+  if (was_idle) {
+    segment_cache.consumers_progressed();
+  }
+}
+
+void ChosenLogCompactor::handle_readable() {
+  uint64_t completion_count;
+  if (read(completion_fd, &completion_count, sizeof completion_count) == -1) {
+    if (errno == EAGAIN) {
+      return;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: read() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  std::vector<SegmentCache::ChosenSegment> new_logs, finished_logs;
+  size_t job_count;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    new_logs.swap(completed_logs);
+    finished_logs.swap(completed_finished_logs);
+    job_count = completed_jobs;
+    completed_jobs = 0;
+  }
+
+  for (const auto &log : new_logs) {
+#ifndef NTRACE
+    std::cout << __PRETTY_FUNCTION__ << ": " << log.path
+              << " holds " << log.slots << std::endl;
+#endif // ndef NTRACE
+    segment_cache.add_compacted_log(log);
+  }
+  for (const auto &log : finished_logs) {
+    segment_cache.expire_compacted_log(log);
+  }
+
+  assert(job_count <= jobs_in_flight.size());
+  jobs_in_flight.erase(jobs_in_flight.begin(),
+                       jobs_in_flight.begin() + job_count);
+  segment_cache.consumers_progressed();
+}
+
+void ChosenLogCompactor::handle_writeable() {
+  fprintf(stderr, "%s: unexpected\n", __PRETTY_FUNCTION__);
+  abort();
+}
+
+void ChosenLogCompactor::handle_error(const uint32_t events) {
+  fprintf(stderr, "%s (events=%x): unexpected\n", __PRETTY_FUNCTION__, events);
+  abort();
+}
+
+void ChosenLogCompactor::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+    while (incoming.empty() && !should_exit) {
+      condition.wait(lock);
+    }
+    if (should_exit) {
+      return;
+    }
+
+    std::deque<Job> jobs;
+    jobs.swap(incoming);
+    lock.unlock();
+
+    std::vector<Log*> touched_logs;
+    for (const auto &job : jobs) {
+      run_job(job, touched_logs);
+    }
+
+    // Logs must be durable before the segments they replace are dropped.
+    for (auto log : touched_logs) {
+      sync_log(*log);
+    }
+
+    /* The segments are unpinned once these jobs are reported, after which
+     * their files may be recycled, so none may be kept open. */
+    close_source();
+
+    lock.lock();
+    completed_logs.insert(completed_logs.end(),
+                          synced_logs.begin(), synced_logs.end());
+    synced_logs.clear();
+    completed_finished_logs.insert(completed_finished_logs.end(),
+                                   finished_logs.begin(), finished_logs.end());
+    finished_logs.clear();
+    completed_jobs += jobs.size();
+    lock.unlock();
+
+    uint64_t one = 1;
+    if (write(completion_fd, &one, sizeof one) != sizeof one) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: write(completion_fd) failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+
+    lock.lock();
+  }
+}
+
+bool ChosenLogCompactor::open_source(const std::string &path) {
+  if (source_fd != -1 && source_path == path) {
+    return true;
+  }
+
+  close_source();
+
+  source_path = path;
+  source_fd   = open(path.c_str(), O_RDONLY);
+  return source_fd != -1;
+}
+
+void ChosenLogCompactor::close_source() {
+  if (source_fd != -1) {
+    close(source_fd);
+    source_fd = -1;
+  }
+  source_path.clear();
+}
+
+void ChosenLogCompactor::run_job(const Job                &job,
+                                       std::vector<Log*>  &touched_logs) {
+  const LogKey key = {
+    .owner  = job.stream.name.owner,
+    .id     = job.stream.name.id,
+    .offset = job.stream.offset
+  };
+  Log &log = logs[key];
+
+  if (job.source_path.empty() || !open_source(job.source_path)) {
+    // Not held locally, so the log cannot continue past here.
+#ifndef NTRACE
+    std::cout << __PRETTY_FUNCTION__ << ": " << job.stream << " "
+              << job.slots << " not held locally" << std::endl;
+#endif // ndef NTRACE
+    finish_log(log);
+    return;
+  }
+
+  if (log.fd != -1 && log.slots.end() != job.slots.start()) {
+    finish_log(log);
+  }
+
+  if (log.fd == -1 && !start_log(log, job)) {
+    return;
+  }
+
+  off_t    source_offset = job.source_offset;
+  uint64_t remaining     = job.slots.end() - job.slots.start();
+  while (0 < remaining) {
+    ssize_t sendfile_result = sendfile(log.fd, source_fd,
+                                       &source_offset, remaining);
+    if (sendfile_result == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: sendfile(%s, %s) failed\n",
+                      __PRETTY_FUNCTION__,
+                      source_path.c_str(), log.path.c_str());
+      abort();
+    }
+    if (sendfile_result == 0) {
+      fprintf(stderr, "%s: %s is shorter than expected\n",
+                      __PRETTY_FUNCTION__, source_path.c_str());
+      break;
+    }
+    remaining -= sendfile_result;
+  }
+
+  const Paxos::Slot end_slot = job.slots.end() - remaining;
+  if (job.slots.start() < end_slot) {
+    IndexRecord *last = log.records.empty() ? NULL : &log.records.back();
+    if (last != NULL
+        && last->end_slot    == job.slots.start()
+        && last->era         == job.term.era
+        && last->term_number == job.term.term_number
+        && last->term_owner  == job.term.owner) {
+      last->end_slot = end_slot;
+      // If already written, the last record is rewritten in place.
+      log.first_unwritten_record = std::min(log.first_unwritten_record,
+                                            log.records.size() - 1);
+    } else {
+      log.records.push_back({
+        .start_slot  = job.slots.start(),
+        .end_slot    = end_slot,
+        .era         = job.term.era,
+        .term_number = job.term.term_number,
+        .term_owner  = job.term.owner});
+    }
+    log.slots.set_end(end_slot);
+    log.unsynced = true;
+    if (std::find(touched_logs.begin(), touched_logs.end(), &log)
+          == touched_logs.end()) {
+      touched_logs.push_back(&log);
+    }
+  }
+
+  if (0 < remaining) {
+    finish_log(log);
+  }
+}
+
+bool ChosenLogCompactor::start_log(Log &log, const Job &job) {
+  assert(log.fd == -1);
+
+  // The log lives in the same directory as the segments it replaces.
+  const std::string directory
+    = job.source_path.substr(0, job.source_path.rfind('/'));
+
+  char path[PATH_MAX];
+  ensure_length(snprintf(path, PATH_MAX, "%s/chosen_%016lx",
+                         directory.c_str(),
+                         job.slots.start() - job.stream.offset));
+  log.path = path;
+
+  char index_path[PATH_MAX];
+  ensure_length(snprintf(index_path, PATH_MAX, "%s_idx", path));
+
+  /* A log of the same name was written before a restart, and may still be
+   * in use, so leave this content in its segments instead. */
+  log.fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (log.fd == -1) {
+    if (errno == EEXIST) {
+      fprintf(stderr, "%s: %s already exists\n", __PRETTY_FUNCTION__, path);
+      return false;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: open(%s) failed\n", __PRETTY_FUNCTION__, path);
+    abort();
+  }
+
+  log.index_fd = open(index_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                      0644);
+  if (log.index_fd == -1) {
+    if (errno == EEXIST) {
+      fprintf(stderr, "%s: %s already exists\n",
+                      __PRETTY_FUNCTION__, index_path);
+      close(log.fd);
+      log.fd = -1;
+      unlink(path);
+      return false;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: open(%s) failed\n", __PRETTY_FUNCTION__, index_path);
+    abort();
+  }
+
+  sync_directory(directory.c_str());
+
+  log.stream                 = job.stream;
+  log.slots                  = Paxos::SlotRange(job.slots.start(),
+                                                job.slots.start());
+  log.records.clear();
+  log.first_unwritten_record = 0;
+  log.unsynced               = false;
+
+#ifndef NTRACE
+  printf("%s: started %s\n", __PRETTY_FUNCTION__, path);
+#endif // ndef NTRACE
+  return true;
+}
+
+void ChosenLogCompactor::sync_log(Log &log) {
+  if (log.fd == -1 || !log.unsynced) {
+    return;
+  }
+
+  if (fdatasync(log.fd) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fdatasync(%s) failed\n",
+                    __PRETTY_FUNCTION__, log.path.c_str());
+    abort();
+  }
+
+  const size_t record_count = log.records.size() - log.first_unwritten_record;
+  const size_t bytes        = record_count * sizeof(IndexRecord);
+  const off_t  offset       = log.first_unwritten_record * sizeof(IndexRecord);
+  if (pwrite(log.index_fd, &log.records[log.first_unwritten_record],
+             bytes, offset) != ssize_t(bytes)) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: pwrite(%s_idx) failed\n",
+                    __PRETTY_FUNCTION__, log.path.c_str());
+    abort();
+  }
+
+  if (fdatasync(log.index_fd) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fdatasync(%s_idx) failed\n",
+                    __PRETTY_FUNCTION__, log.path.c_str());
+    abort();
+  }
+
+  log.first_unwritten_record = log.records.size();
+  log.unsynced               = false;
+
+  synced_logs.push_back(describe_log(log));
+}
+
+void ChosenLogCompactor::finish_log(Log &log) {
+  if (log.fd == -1) {
+    return;
+  }
+  sync_log(log);
+  close_log(log);
+
+  if (log.records.empty()) {
+    // Nothing was ever copied into it.
+    unlink(log.path.c_str());
+    unlink((log.path + "_idx").c_str());
+    return;
+  }
+  finished_logs.push_back(describe_log(log));
+}
+
+SegmentCache::ChosenSegment ChosenLogCompactor::describe_log(const Log &log) {
+  const auto &last = log.records.back();
+  return {
+    .stream = log.stream,
+    .slots  = log.slots,
+    .term   = Paxos::Term(last.era, last.term_number, last.term_owner),
+    .path   = log.path,
+    .is_compacted_log = true};
+}
+
+void ChosenLogCompactor::close_log(Log &log) {
+  assert(!log.unsynced);
+  if (log.fd != -1) {
+    close(log.fd);
+    log.fd = -1;
+  }
+  if (log.index_fd != -1) {
+    close(log.index_fd);
+    log.index_fd = -1;
+  }
+}
+
+}
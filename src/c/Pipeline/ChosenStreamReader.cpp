@@ -0,0 +1,186 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/ChosenStreamReader.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <fcntl.h>
+#include <limits>
+#include <stdio.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+namespace Pipeline {
+
+ChosenStreamReader::ChosenStreamReader
+      (      SegmentCache             &segment_cache,
+       const Paxos::Value::StreamName &stream)
+  : segment_cache(segment_cache),
+    stream(stream),
+    first_unread_slot(std::numeric_limits<Paxos::Slot>::max()),
+    segment({.stream = {.name = stream, .offset = 0},
+             .slots  = Paxos::SlotRange(0, 0)}) {
+  segment_cache.add_consumer(this);
+}
+
+ChosenStreamReader::~ChosenStreamReader() {
+  close_segment();
+  segment_cache.remove_consumer(this);
+}
+
+Paxos::Slot ChosenStreamReader::get_first_unconsumed_slot() const {
+  const Paxos::Slot slot
+    = unread.empty() ? first_unread_slot : unread.front().slots.start();
+  // The open segment stays pinned until it is closed.
+  return segment_fd == -1 ? slot : std::min(slot, segment.slots.start());
+}
+
+void ChosenStreamReader::add_chosen(const Paxos::Proposal &proposal) {
+  assert(proposal.value.type == Paxos::Value::Type::stream_content);
+  const auto &proposal_stream = proposal.value.payload.stream;
+  assert(proposal_stream.name.owner == stream.owner);
+  assert(proposal_stream.name.id    == stream.id);
+
+  if (proposal.slots.is_empty()) {
+    return;
+  }
+  unread_bytes += proposal.slots.end() - proposal.slots.start();
+
+  if (!unread.empty()) {
+    auto &last = unread.back();
+    if (last.stream.offset == proposal_stream.offset
+        && last.slots.end() == proposal.slots.start()) {
+      last.slots.set_end(proposal.slots.end());
+      return;
+    }
+  }
+
+  const bool was_empty = unread.empty();
+  unread.push_back({.stream = proposal_stream, .slots = proposal.slots});
+  if (was_empty) {
+    segment_cache.consumers_progressed();
+  }
+}
+
+void ChosenStreamReader::close_segment() {
+  if (segment_fd != -1) {
+    close(segment_fd);
+    segment_fd = -1;
+  }
+}
+
+bool ChosenStreamReader::open_segment() {
+  assert(!unread.empty());
+  const Extent &next = unread.front();
+
+  if (segment_fd != -1
+      && segment.stream.offset == next.stream.offset
+      && segment.slots.contains(next.slots.start())) {
+    return true;
+  }
+
+  close_segment();
+
+  if (!segment_cache.locate_chosen_data(next.stream, next.slots.start(),
+                                        segment)) {
+    return false;
+  }
+
+  segment_fd = open(segment.path.c_str(), O_RDONLY);
+  if (segment_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: open(%s) failed\n",
+                    __PRETTY_FUNCTION__, segment.path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void ChosenStreamReader::consume(uint64_t bytes) {
+  bool progressed = false;
+  while (0 < bytes) {
+    assert(!unread.empty());
+    auto &next = unread.front();
+    const uint64_t available = next.slots.end() - next.slots.start();
+    if (bytes < available) {
+      next.slots.truncate(next.slots.start() + bytes);
+      unread_bytes -= bytes;
+      break;
+    }
+    bytes        -= available;
+    unread_bytes -= available;
+    first_unread_slot = next.slots.end();
+    unread.pop_front();
+    progressed = true;
+  }
+
+  /* Close the segment once it has been read to its end, before unpinning
+   * it, since its file may then be recycled. */
+  if (segment_fd != -1
+      && (unread.empty()
+       || segment.stream.offset != unread.front().stream.offset
+       || !segment.slots.contains(unread.front().slots.start()))) {
+    close_segment();
+    progressed = true;
+  }
+
+  if (progressed) {
+    segment_cache.consumers_progressed();
+  }
+}
+
+ChosenStreamReader::Result ChosenStreamReader::send_to(int out_fd,
+                                                       size_t max_bytes) {
+  if (unread.empty()) {
+    return Result::succeeded;
+  }
+
+  if (!open_segment()) {
+    return Result::unavailable;
+  }
+
+  const Extent &next = unread.front();
+  off_t file_offset = next.slots.start() - segment.slots.start();
+  const uint64_t length = std::min<uint64_t>(max_bytes,
+    std::min(next.slots.end(), segment.slots.end()) - next.slots.start());
+
+  ssize_t sendfile_result = sendfile(out_fd, segment_fd, &file_offset, length);
+
+  if (sendfile_result == -1) {
+    if (errno == EAGAIN) {
+      return Result::blocked;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: sendfile() failed\n", __PRETTY_FUNCTION__);
+    return Result::failed;
+  }
+
+  if (sendfile_result == 0) {
+    fprintf(stderr, "%s: %s is shorter than expected\n",
+                    __PRETTY_FUNCTION__, segment.path.c_str());
+    return Result::unavailable;
+  }
+
+  consume(sendfile_result);
+  return Result::succeeded;
+}
+
+}
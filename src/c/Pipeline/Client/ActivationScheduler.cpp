@@ -0,0 +1,130 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Client/ActivationScheduler.h"
+#include "Pipeline/Client/Socket.h"
+
+#include <algorithm>
+
+namespace Pipeline {
+namespace Client {
+
+ActivationScheduler::~ActivationScheduler() {
+  manager.cancel_deferred(this);
+}
+
+bool ActivationScheduler::turn_used_up() const {
+  return !waiting.empty()
+      && (CLIENT_ACTIVATION_QUANTUM_BYTES <= active_bytes
+          || turn_deadline <= std::chrono::steady_clock::now());
+}
+
+void ActivationScheduler::enqueue(Socket *socket) {
+  if (std::find(waiting.begin(), waiting.end(), socket) == waiting.end()) {
+    waiting.push_back(socket);
+  }
+  arm_timer();
+}
+
+void ActivationScheduler::arm_timer() {
+  if (!timer_armed && active != NULL && !waiting.empty()) {
+    manager.defer(this, turn_deadline);
+    timer_armed = true;
+  }
+}
+
+void ActivationScheduler::start_turn(Socket *socket) {
+  active        = socket;
+  active_bytes  = 0;
+  turn_deadline = std::chrono::steady_clock::now()
+    + std::chrono::milliseconds(CLIENT_ACTIVATION_QUANTUM_MILLISECONDS);
+  arm_timer();
+}
+
+void ActivationScheduler::end_turn() {
+  if (timer_armed) {
+    manager.cancel_deferred(this);
+    timer_armed = false;
+  }
+
+  active       = NULL;
+  active_bytes = 0;
+
+  if (!waiting.empty()) {
+    Socket *next = waiting.front();
+    waiting.pop_front();
+    start_turn(next);
+    next->turn_granted();
+  }
+}
+
+bool ActivationScheduler::request_turn(Socket *socket) {
+  if (active == NULL) {
+    start_turn(socket);
+    return true;
+  }
+
+  if (active == socket) {
+    if (!turn_used_up()) {
+      return true;
+    }
+
+    /* Yield to the next socket, but only once everything this socket has
+     * already written has been activated. */
+    enqueue(socket);
+    if (!socket->has_writes_in_flight()) {
+      end_turn();
+    }
+    return false;
+  }
+
+  enqueue(socket);
+  return false;
+}
+
+void ActivationScheduler::record_activation(Socket *socket, uint64_t bytes) {
+  assert(active == socket);
+  active_bytes += bytes;
+}
+
+void ActivationScheduler::writes_activated(Socket *socket) {
+  if (active == socket && turn_used_up()) {
+    end_turn();
+  }
+}
+
+void ActivationScheduler::remove(Socket *socket) {
+  waiting.erase(std::remove(waiting.begin(), waiting.end(), socket),
+                waiting.end());
+
+  if (active == socket) {
+    end_turn();
+  }
+}
+
+void ActivationScheduler::handle_deferred() {
+  timer_armed = false;
+  if (active != NULL && turn_used_up() && !active->has_writes_in_flight()) {
+    end_turn();
+  }
+}
+
+}
+}
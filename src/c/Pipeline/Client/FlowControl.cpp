@@ -0,0 +1,117 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Client/FlowControl.h"
+#include "Pipeline/Client/Socket.h"
+
+#include <algorithm>
+
+namespace Pipeline {
+namespace Client {
+
+FlowControl::~FlowControl() {
+  manager.cancel_deferred(this);
+}
+
+void FlowControl::set_window_bytes(uint64_t bytes) {
+  window_bytes = bytes;
+  slots_chosen();
+}
+
+bool FlowControl::window_exceeded() const {
+  return window_bytes < legislator.get_next_activated_slot()
+                      - legislator.get_next_chosen_slot();
+}
+
+void FlowControl::arm_timer() {
+  if (!timer_armed && !throttled.empty()) {
+    manager.defer(this, std::chrono::steady_clock::now()
+      + std::chrono::milliseconds(CLIENT_THROTTLE_RECHECK_MILLISECONDS));
+    timer_armed = true;
+  }
+}
+
+void FlowControl::throttle(Socket *socket) {
+  if (std::find(throttled.begin(), throttled.end(), socket)
+        != throttled.end()) {
+    return;
+  }
+
+  if (throttled.empty()) {
+    throttled_since = std::chrono::steady_clock::now();
+    throttle_count += 1;
+  }
+
+  throttled.push_back(socket);
+  arm_timer();
+}
+
+void FlowControl::remove(Socket *socket) {
+  auto it = std::find(throttled.begin(), throttled.end(), socket);
+  if (it == throttled.end()) {
+    return;
+  }
+
+  throttled.erase(it);
+  if (throttled.empty()) {
+    if (timer_armed) {
+      manager.cancel_deferred(this);
+      timer_armed = false;
+    }
+    throttled_time += std::chrono::steady_clock::now() - throttled_since;
+  }
+}
+
+void FlowControl::slots_chosen() {
+  if (throttled.empty() || window_exceeded()) {
+    return;
+  }
+
+  if (timer_armed) {
+    manager.cancel_deferred(this);
+    timer_armed = false;
+  }
+
+  throttled_time += std::chrono::steady_clock::now() - throttled_since;
+
+  /* Sockets may be removed or re-throttled while being released, so release
+   * a snapshot. */
+  std::vector<Socket*> released;
+  released.swap(throttled);
+  for (auto socket : released) {
+    socket->window_reopened();
+  }
+}
+
+std::chrono::steady_clock::duration FlowControl::get_throttled_time() const {
+  if (throttled.empty()) {
+    return throttled_time;
+  }
+  return throttled_time + (std::chrono::steady_clock::now() - throttled_since);
+}
+
+void FlowControl::handle_deferred() {
+  timer_armed = false;
+  slots_chosen();
+  arm_timer();
+}
+
+}
+}
@@ -20,6 +20,7 @@
 
 #include "Pipeline/Client/Listener.h"
 
+#include <limits>
 #include <sys/socket.h>
 #include <netdb.h>
 
@@ -35,21 +36,21 @@ void Listener::handle_accept(int client_fd) {
     abort();
   }
 
-  client_sockets.erase(std::remove_if(
-    client_sockets.begin(),
-    client_sockets.end(),
-    [](const std::unique_ptr<Socket> &c) {
-      return c->is_shutdown(); }),
-    client_sockets.end());
-
-  if (client_sockets.size() > 0) {
-    close(client_fd);
-  } else {
-    Paxos::Value::StreamName stream
-      = { .owner = node_name.id, .id = next_stream_id++ };
-    client_sockets.push_back(std::move(std::unique_ptr<Socket>
-      (new Socket(manager, segment_cache, legislator, node_name, stream, client_fd))));
+  auto it = client_sockets.begin();
+  while (it != client_sockets.end()) {
+    if (it->second->is_shutdown()) {
+      it = client_sockets.erase(it);
+    } else {
+      ++it;
+    }
   }
+
+  Paxos::Value::StreamName stream
+    = { .owner = node_name.id, .id = next_stream_id++ };
+  client_sockets[stream.id] = std::unique_ptr<Socket>
+    (new Socket(manager, segment_cache, legislator, scheduler,
+                flow_control, node_name, stream, client_fd));
+  client_sockets[stream.id]->set_tee_sinks(tee_sinks);
 }
 
 Listener::Listener(Epoll::Manager    &manager,
@@ -60,27 +61,74 @@ Listener::Listener(Epoll::Manager    &manager,
   : AbstractListener(manager, port),
     legislator(legislator),
     segment_cache(segment_cache),
-    node_name(node_name) {}
+    node_name(node_name),
+    scheduler(manager),
+    flow_control(manager, legislator) {
+
+  // After a restart, new streams must not reuse the ids of this node's
+  // streams that are still open or still have data held.
+  for (const auto &open_stream : legislator.get_open_streams()) {
+    skip_stream_id(open_stream.name);
+  }
+
+  std::vector<const SegmentCache::CacheEntry*> entries;
+  segment_cache.get_entries(entries);
+  for (const auto entry : entries) {
+    skip_stream_id(entry->stream.name);
+  }
+
+  std::vector<SegmentCache::ChosenSegment> chosen_segments;
+  segment_cache.get_chosen_segments
+    (std::numeric_limits<Paxos::Slot>::max(), chosen_segments);
+  for (const auto &segment : chosen_segments) {
+    skip_stream_id(segment.stream.name);
+  }
+}
+
+void Listener::skip_stream_id(const Paxos::Value::StreamName &stream) {
+  if (stream.owner == node_name.id && next_stream_id <= stream.id) {
+    next_stream_id = stream.id + 1;
+  }
+}
+
+Socket *Listener::find_socket(const Paxos::Proposal &proposal) const {
+  const auto &stream = proposal.value.payload.stream.name;
+  if (stream.owner != node_name.id) {
+    return NULL;
+  }
+
+  const auto it = client_sockets.find(stream.id);
+  if (it == client_sockets.end()) {
+    return NULL;
+  }
+  return it->second.get();
+}
 
 void Listener::handle_stream_content
     (const Paxos::Proposal &proposal) {
-  for (const auto &s : client_sockets) {
-    s->handle_stream_content(proposal);
+  Socket *socket = find_socket(proposal);
+  if (socket != NULL) {
+    socket->handle_stream_content(proposal);
   }
+  flow_control.slots_chosen();
 }
 
 void Listener::handle_unknown_stream_content
     (const Paxos::Proposal &proposal) {
-  for (const auto &s : client_sockets) {
-    s->handle_unknown_stream_content(proposal);
+  Socket *socket = find_socket(proposal);
+  if (socket != NULL) {
+    socket->handle_unknown_stream_content(proposal);
   }
+  flow_control.slots_chosen();
 }
 
 void Listener::handle_non_contiguous_stream_content
     (const Paxos::Proposal &proposal) {
-  for (const auto &s : client_sockets) {
-    s->handle_non_contiguous_stream_content(proposal);
+  Socket *socket = find_socket(proposal);
+  if (socket != NULL) {
+    socket->handle_non_contiguous_stream_content(proposal);
   }
+  flow_control.slots_chosen();
 }
 
 }
@@ -34,11 +34,15 @@ Socket::Socket
        (Epoll::Manager                  &manager,
         SegmentCache                    &segment_cache,
         Paxos::Legislator               &legislator,
+        ActivationScheduler             &scheduler,
+        FlowControl                     &flow_control,
         const NodeName                  &node_name,
         const Paxos::Value::StreamName   stream,
         const int                        fd)
   : manager         (manager),
     legislator      (legislator),
+    scheduler       (scheduler),
+    flow_control    (flow_control),
     node_name       (node_name),
     stream          (stream),
     pipe            (manager, *this, segment_cache, node_name,
@@ -58,6 +62,8 @@ Socket::~Socket() {
 #endif // ndef NTRACE
 
   shutdown();
+  scheduler.remove(this);
+  flow_control.remove(this);
 }
 
 bool Socket::is_shutdown() const {
@@ -69,20 +75,21 @@ void Socket::handle_readable() {
   if (waiting_for_downstream) { return; }
   assert(pipe.get_next_stream_pos_write() == read_stream_pos);
 
-  if (legislator.get_next_activated_slot()
-         > CLIENT_SEGMENT_DEFAULT_SIZE + legislator.get_next_chosen_slot()) {
+  if (throttled) { return; }
 
-    // TODO if legislator has too many active slots, unsubscribe from epoll and stop
-    // reading more data. Socket will be re-subscribed to epoll when the number
-    // of active slots drops back down.
-
-    // For now, just spin until the slots are chosen.
+  if (flow_control.window_exceeded()) {
+#ifndef NTRACE
+    printf("%s: window exceeded (fd=%d)\n", __PRETTY_FUNCTION__, fd);
+#endif // ndef NTRACE
+    manager.modify_handler(fd, this, 0);
+    throttled = true;
+    flow_control.throttle(this);
     return;
   }
 
   ssize_t splice_result = splice(
     fd, NULL, pipe.get_write_end_fd(), NULL,
-    PIPE_SIZE,
+    PIPE_MAX_SIZE,
     SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
 
   if (splice_result == -1) {
@@ -129,14 +136,40 @@ void Socket::handle_error(const uint32_t events) {
 
 void Socket::downstream_became_writeable() {
   assert(waiting_for_downstream);
-  manager.modify_handler(fd, this, EPOLLIN);
+  if (!throttled) {
+    manager.modify_handler(fd, this, EPOLLIN);
+  }
   waiting_for_downstream = false;
 }
 
+void Socket::window_reopened() {
+  assert(throttled);
+  throttled = false;
+  if (fd != -1 && !waiting_for_downstream) {
+    manager.modify_handler(fd, this, EPOLLIN);
+  }
+}
+
 void Socket::downstream_closed() {
-  fprintf(stderr, "%s (fd=%d) unexpected\n",
-                  __PRETTY_FUNCTION__, fd);
+  if (fd != -1) {
+    fprintf(stderr, "%s (fd=%d) unexpected\n",
+                    __PRETTY_FUNCTION__, fd);
+  }
   shutdown();
+  scheduler.remove(this);
+  flow_control.remove(this);
+}
+
+bool Socket::ready_to_write_data() {
+  return scheduler.request_turn(this);
+}
+
+bool Socket::has_writes_in_flight() const {
+  return pipe.has_unsynced_writes();
+}
+
+void Socket::turn_granted() {
+  pipe.upstream_became_ready();
 }
 
 bool Socket::ok_to_write_data(uint64_t start_pos) const {
@@ -150,6 +183,37 @@ bool Socket::ok_to_write_data(uint64_t start_pos) const {
   return true;
 }
 
+void Socket::downstream_wrote_unsynced_bytes(uint64_t start_pos,
+                                             uint64_t byte_count) {
+  if (!propose_before_sync
+      || start_pos != proposed_stream_pos
+      || !legislator.activation_will_yield_proposals()) {
+    return;
+  }
+
+  Paxos::Value value = { .type = Paxos::Value::Type::stream_content };
+
+  uint64_t next_slot = legislator.get_next_activated_slot();
+  assert(start_pos <= next_slot);
+
+  value.payload.stream = {
+    .name = stream,
+    .offset = next_slot - start_pos
+  };
+
+  const Paxos::Proposal proposal = legislator.propose_slots(value, byte_count);
+  if (proposal.slots.is_empty()) { return; }
+
+#ifndef NTRACE
+  printf("%s: proposed %lu bytes from %lu before sync\n",
+          __PRETTY_FUNCTION__, byte_count, start_pos);
+#endif // def NTRACE
+
+  unaccepted_proposals.push_back(proposal);
+  proposed_stream_pos += byte_count;
+  scheduler.record_activation(this, byte_count);
+}
+
 void Socket::downstream_wrote_bytes(uint64_t start_pos, uint64_t byte_count) {
   assert(written_stream_pos == start_pos);
 #ifndef NDEBUG
@@ -160,20 +224,37 @@ void Socket::downstream_wrote_bytes(uint64_t start_pos, uint64_t byte_count) {
   printf("%s: written_stream_pos updated by %lu from %lu to %lu\n",
           __PRETTY_FUNCTION__, byte_count, start_pos, written_stream_pos);
 #endif // def NTRACE
-  assert(committed_stream_pos <= written_stream_pos);
+  assert(committed_stream_pos <= proposed_stream_pos);
   assert(legislator.activation_will_yield_proposals());
 
-  Paxos::Value value = { .type = Paxos::Value::Type::stream_content };
+  if (!unaccepted_proposals.empty()) {
+    const Paxos::Proposal proposal = unaccepted_proposals.front();
+    unaccepted_proposals.pop_front();
+    assert(proposal.slots.start() - proposal.value.payload.stream.offset
+             == start_pos);
+    assert(proposal.slots.end() - proposal.slots.start() == byte_count);
+    legislator.accept_own_proposal(proposal);
+  } else {
+    assert(proposed_stream_pos == start_pos);
 
-  uint64_t next_slot = legislator.get_next_activated_slot();
-  assert(start_pos <= next_slot);
+    Paxos::Value value = { .type = Paxos::Value::Type::stream_content };
 
-  value.payload.stream = {
-    .name = stream,
-    .offset = next_slot - start_pos
-  };
+    uint64_t next_slot = legislator.get_next_activated_slot();
+    assert(start_pos <= next_slot);
 
-  legislator.activate_slots(value, byte_count);
+    value.payload.stream = {
+      .name = stream,
+      .offset = next_slot - start_pos
+    };
+
+    legislator.activate_slots(value, byte_count);
+    proposed_stream_pos += byte_count;
+    scheduler.record_activation(this, byte_count);
+  }
+
+  if (!pipe.has_unsynced_writes()) {
+    scheduler.writes_activated(this);
+  }
   send_pending_acknowledgement(true);
 }
 
@@ -182,7 +263,7 @@ void Socket::send_pending_acknowledgement(bool shutdown_on_error) {
     return;
   }
 
-  assert(committed_stream_pos <= written_stream_pos);
+  assert(committed_stream_pos <= proposed_stream_pos);
   assert(acknowledged_stream_pos <= committed_stream_pos);
 
   const uint32_t max_acknowledgement = 0xffffffff;
@@ -218,20 +299,8 @@ void Socket::send_pending_acknowledgement(bool shutdown_on_error) {
 
 void Socket::handle_stream_content(const Paxos::Proposal &proposal) {
   assert(proposal.value.type == Paxos::Value::Type::stream_content);
-
-  if (proposal.value.payload.stream.name.owner != stream.owner) {
-    shutdown();
-    return;
-  }
-
-  if (proposal.value.payload.stream.name.id != stream.id) {
-    shutdown();
-    return;
-  }
-
-  // TODO if previously unsubscribed because there were too many
-  // active slots, but there are now not too many, then
-  // resubscribe
+  assert(proposal.value.payload.stream.name.owner == stream.owner);
+  assert(proposal.value.payload.stream.name.id    == stream.id);
 
   assert(proposal.slots.start() - proposal.value.payload.stream.offset
            == committed_stream_pos);
@@ -242,7 +311,7 @@ void Socket::handle_stream_content(const Paxos::Proposal &proposal) {
   printf("%s: committed_stream_pos updated to %lu\n",
           __PRETTY_FUNCTION__, committed_stream_pos);
 #endif // def NTRACE
-  assert(committed_stream_pos <= written_stream_pos);
+  assert(committed_stream_pos <= proposed_stream_pos);
 
   send_pending_acknowledgement(true);
 }
@@ -271,8 +340,9 @@ const Paxos::Term &Socket::get_term_for_next_write() const {
 const Paxos::Value::StreamOffset Socket::get_offset_for_next_write
                                       (uint64_t next_stream_pos) const {
   Paxos::Slot next_activated_slot = legislator.get_next_activated_slot();
-  assert(next_stream_pos <= next_activated_slot);
-  return next_activated_slot - next_stream_pos;
+  assert(next_stream_pos <= proposed_stream_pos);
+  assert(proposed_stream_pos <= next_activated_slot);
+  return next_activated_slot - proposed_stream_pos;
 }
 
 }
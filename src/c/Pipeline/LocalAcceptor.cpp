@@ -20,14 +20,11 @@
 
 #include "Pipeline/LocalAcceptor.h"
 
-#include <algorithm>
 #include <fcntl.h>
 
 namespace Pipeline {
 
 void LocalAcceptor::DummyClockCache::set_current_time(const timestamp&) {
-  fprintf(stderr, "%s: unexpected\n", __PRETTY_FUNCTION__);
-  abort();
 }
 
 LocalAcceptor::ValidateArgs::ValidateArgs(const Paxos::Proposal &proposal,
@@ -40,8 +37,7 @@ LocalAcceptor::LocalAcceptor
   (const Paxos::Proposal  &proposal,
          Paxos::SlotRange &slots_to_accept,
          SegmentCache     &segment_cache,
-   const NodeName         &node_name,
-         std::vector<std::unique_ptr<SegmentCache::CacheEntry>> &entries)
+   const NodeName         &node_name)
 
     : proposal(proposal),
       slots_to_accept(slots_to_accept),
@@ -50,7 +46,7 @@ LocalAcceptor::LocalAcceptor
       pipe(manager, *this, segment_cache, node_name, node_name.id,
             proposal.value.payload.stream.name,
             slots_to_accept.start() - proposal.value.payload.stream.offset),
-      entries(entries) {
+      segment_cache(segment_cache) {
 }
 
 void LocalAcceptor::downstream_wrote_bytes(uint64_t, uint64_t) {
@@ -63,18 +59,13 @@ void LocalAcceptor::downstream_became_writeable() {
   const auto  first_slot_to_accept = slots_to_accept.start();
   const auto &stream               = proposal.value.payload.stream;
 
-  const auto entry_it = std::find_if(
-    entries.cbegin(),
-    entries.cend(),
-    [&stream, &first_slot_to_accept](const std::unique_ptr<SegmentCache::CacheEntry> &ce) {
-      return ce->stream.name.owner == stream.name.owner
-          && ce->stream.name.id    == stream.name.id
-          && ce->stream.offset     == stream.offset
-          && ce->slots.contains(first_slot_to_accept)
-          && ce->fd                != -1;
-    });
-
-  if (entry_it == entries.cend()) {
+  const SegmentCache::CacheEntry *found
+    = segment_cache.find(stream, first_slot_to_accept, false);
+  if (found == NULL) {
+    found = segment_cache.find(stream, first_slot_to_accept, true);
+  }
+
+  if (found == NULL) {
     std::cout << __PRETTY_FUNCTION__
               << ": no segment for " << stream
               << " containing " << slots_to_accept
@@ -83,7 +74,7 @@ void LocalAcceptor::downstream_became_writeable() {
     return;
   }
 
-  const auto &entry = **entry_it;
+  const auto &entry = *found;
   assert(entry.slots.start() <= first_slot_to_accept);
   loff_t off_in = first_slot_to_accept - entry.slots.start();
 
@@ -0,0 +1,58 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/NodeName.h"
+#include "directories.h"
+
+#include <limits.h>
+#include <stdio.h>
+
+namespace Pipeline {
+
+static std::string group_directory_for(const std::string &cluster,
+                                       const uint32_t     group) {
+  char path[PATH_MAX];
+  if (group == 0) {
+    ensure_length(snprintf(path, PATH_MAX, "data/clu_%s", cluster.c_str()));
+  } else {
+    ensure_length(snprintf(path, PATH_MAX, "data/clu_%s/grp_%08x",
+                                           cluster.c_str(), group));
+  }
+  return path;
+}
+
+static std::string node_directory_for(const std::string   &group_directory,
+                                      const Paxos::NodeId  id) {
+  char path[PATH_MAX];
+  ensure_length(snprintf(path, PATH_MAX, "%s/n_%08x",
+                                         group_directory.c_str(), id));
+  return path;
+}
+
+NodeName::NodeName(const std::string   &cluster,
+                   const Paxos::NodeId  id,
+                   const uint32_t       group)
+  : cluster(cluster),
+    id(id),
+    group(group),
+    group_directory(group_directory_for(cluster, group)),
+    directory(node_directory_for(group_directory, id)) {}
+
+}
@@ -33,6 +33,7 @@ void send_handshake(int fd, const NodeName &node_name) {
   strncpy(handshake.cluster_id, node_name.cluster.c_str(), CLUSTER_ID_LENGTH);
   handshake.cluster_id[CLUSTER_ID_LENGTH] = '\0';
   handshake.node_id = node_name.id;
+  handshake.group   = node_name.group;
 
   ssize_t handshake_write_result = write(fd, &handshake, sizeof handshake);
   if (handshake_write_result == -1) {
@@ -49,7 +50,9 @@ void send_handshake(int fd, const NodeName &node_name) {
 }
 
 int receive_handshake(int fd, Handshake &handshake, size_t &received_bytes,
-                      const std::string &cluster_id) {
+                      const NodeName &node_name) {
+  const std::string &cluster_id = node_name.cluster;
+
   ssize_t read_result = read(fd,
       reinterpret_cast<uint8_t*>(&handshake) + received_bytes,
       sizeof handshake - received_bytes);
@@ -84,10 +87,10 @@ int receive_handshake(int fd, Handshake &handshake, size_t &received_bytes,
     handshake.node_id);
 #endif // ndef NTRACE
 
-  if (handshake.protocol_version != 1) {
-    fprintf(stderr, "%s (fd=%d): protocol version mismatch: %u != %u\n",
+  if (handshake.protocol_version < MIN_PROTOCOL_VERSION) {
+    fprintf(stderr, "%s (fd=%d): protocol version too old: %u < %u\n",
       __PRETTY_FUNCTION__, fd,
-      handshake.protocol_version, PROTOCOL_VERSION);
+      handshake.protocol_version, MIN_PROTOCOL_VERSION);
     return RECEIVE_HANDSHAKE_INVALID;
   }
 
@@ -106,6 +109,13 @@ int receive_handshake(int fd, Handshake &handshake, size_t &received_bytes,
     return RECEIVE_HANDSHAKE_INVALID;
   }
 
+  if (handshake.group != node_name.group) {
+    fprintf(stderr, "%s (fd=%d): group mismatch: %u != %u\n",
+      __PRETTY_FUNCTION__, fd,
+      handshake.group, node_name.group);
+    return RECEIVE_HANDSHAKE_INVALID;
+  }
+
 #ifndef NTRACE
     printf("%s (fd=%d): accepted handshake version %d cluster %s node %d\n",
       __PRETTY_FUNCTION__, fd,
@@ -117,6 +127,163 @@ int receive_handshake(int fd, Handshake &handshake, size_t &received_bytes,
   return RECEIVE_HANDSHAKE_SUCCESS;
 }
 
+uint32_t negotiated_version(const Handshake &handshake) {
+  return handshake.protocol_version < PROTOCOL_VERSION
+       ? handshake.protocol_version : PROTOCOL_VERSION;
+}
+
+void get_receiving_frame_layout(uint32_t version, FrameLayout &layout) {
+  if (version < PROTOCOL_VERSION_VARIABLE_FRAMES) {
+    get_frame_layout(version, 0, layout);
+  } else {
+    layout.header_size  = sizeof(FrameHeader);
+    layout.message_size = 0;
+    layout.value_size   = 0;
+  }
+}
+
+bool get_frame_layout(uint32_t version, uint8_t type, FrameLayout &layout) {
+  if (version < PROTOCOL_VERSION_VARIABLE_FRAMES) {
+    layout.header_size  = 1;
+    layout.message_size = sizeof(Message);
+    layout.value_size   = sizeof(Value);
+    return true;
+  }
+
+  layout.header_size = sizeof(FrameHeader);
+  layout.value_size  = 0;
+
+  switch (type & 0x0f) {
+    case MESSAGE_TYPE_SEEK_VOTES_OR_CATCH_UP:
+      layout.message_size = sizeof(Message::seek_votes_or_catch_up);
+      return true;
+    case MESSAGE_TYPE_OFFER_VOTE:
+      layout.message_size = sizeof(Message::offer_vote);
+      return true;
+    case MESSAGE_TYPE_OFFER_CATCH_UP:
+    case MESSAGE_TYPE_REQUEST_CATCH_UP:
+      layout.message_size = 0;
+      return true;
+    case MESSAGE_TYPE_SEND_CATCH_UP:
+      layout.message_size = sizeof(Message::send_catch_up);
+      return true;
+    case MESSAGE_TYPE_PREPARE_TERM:
+      layout.message_size = sizeof(Message::prepare_term);
+      return true;
+    case MESSAGE_TYPE_MAKE_PROMISE_MULTI:
+      layout.message_size = sizeof(Message::make_promise_multi);
+      return true;
+    case MESSAGE_TYPE_MAKE_PROMISE_FREE:
+      layout.message_size = sizeof(Message::make_promise_free);
+      return true;
+    case MESSAGE_TYPE_MAKE_PROMISE_BOUND:
+      layout.message_size = sizeof(Message::make_promise_bound);
+      break;
+    case MESSAGE_TYPE_PROPOSED_AND_ACCEPTED:
+      layout.message_size = sizeof(Message::proposed_and_accepted);
+      break;
+    case MESSAGE_TYPE_ACCEPTED:
+      layout.message_size = sizeof(Message::accepted);
+      break;
+    case MESSAGE_TYPE_START_STREAMING_PROMISES:
+      layout.message_size = sizeof(Message::start_streaming_promises);
+      return true;
+    case MESSAGE_TYPE_START_STREAMING_PROPOSALS:
+      layout.message_size = sizeof(Message::start_streaming_proposals);
+      return true;
+    case MESSAGE_TYPE_START_STREAMING_CATCH_UP:
+      if (version < PROTOCOL_VERSION_CATCH_UP_TRANSFER) {
+        return false;
+      }
+      layout.message_size = sizeof(Message::start_streaming_catch_up);
+      return true;
+    case MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS:
+      if (version < PROTOCOL_VERSION_EARLY_PROPOSALS) {
+        return false;
+      }
+      layout.message_size = sizeof(Message::start_streaming_early_proposals);
+      return true;
+    default:
+      return false;
+  }
+
+  // message types that carry a value
+  switch (type & 0xf0) {
+    case VALUE_TYPE_NO_OP:
+      layout.value_size = sizeof(Value::no_op);
+      return true;
+    case VALUE_TYPE_GENERATE_NODE_ID:
+      layout.value_size = sizeof(Value::generate_node_id);
+      return true;
+    case VALUE_TYPE_INCREMENT_WEIGHT:
+      layout.value_size = sizeof(Value::increment_weight);
+      return true;
+    case VALUE_TYPE_DECREMENT_WEIGHT:
+      layout.value_size = sizeof(Value::decrement_weight);
+      return true;
+    case VALUE_TYPE_MULTIPLY_WEIGHTS:
+      layout.value_size = sizeof(Value::multiply_weights);
+      return true;
+    case VALUE_TYPE_DIVIDE_WEIGHTS:
+      layout.value_size = sizeof(Value::divide_weights);
+      return true;
+    case VALUE_TYPE_STREAM_CONTENT:
+      layout.value_size = sizeof(Value::stream_content);
+      return true;
+    default:
+      return false;
+  }
+}
+
+int parse_frame(uint32_t version, const uint8_t *data, size_t available,
+                FrameLayout &layout) {
+
+  get_receiving_frame_layout(version, layout);
+  if (available < layout.header_size) {
+    return PARSE_FRAME_INCOMPLETE;
+  }
+
+  if (version >= PROTOCOL_VERSION_VARIABLE_FRAMES) {
+    const FrameHeader &header = *reinterpret_cast<const FrameHeader*>(data);
+    if (!get_frame_layout(version, header.type, layout)
+        || header.body_length != layout.body_size()) {
+      return PARSE_FRAME_INVALID;
+    }
+  }
+
+  return available < layout.size() ? PARSE_FRAME_INCOMPLETE
+                                   : PARSE_FRAME_COMPLETE;
+}
+
+int get_frame_iovecs(const FrameLayout &layout,
+                     FrameHeader &header, Message &message, Value &value,
+                     size_t done, struct iovec *iov) {
+
+  uint8_t *bases[3] = {
+    reinterpret_cast<uint8_t*>(&header),
+    reinterpret_cast<uint8_t*>(&message),
+    reinterpret_cast<uint8_t*>(&value)
+  };
+  const size_t sizes[3] = {
+    layout.header_size,
+    layout.message_size,
+    layout.value_size
+  };
+
+  int iovcnt = 0;
+  for (int part = 0; part < 3; part++) {
+    if (sizes[part] <= done) {
+      done -= sizes[part];
+      continue;
+    }
+    iov[iovcnt].iov_base = bases[part] + done;
+    iov[iovcnt].iov_len  = sizes[part] - done;
+    iovcnt += 1;
+    done = 0;
+  }
+  return iovcnt;
+}
+
 Paxos::Term Term::get_paxos_term() const {
   return Paxos::Term(era, term_number, owner);
 }
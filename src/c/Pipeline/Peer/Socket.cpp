@@ -26,6 +26,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <memory>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -48,7 +49,9 @@ Socket::Socket
     segment_cache   (segment_cache),
     legislator      (legislator),
     node_name       (node_name),
-    fd              (fd) {
+    fd              (fd),
+    receive_buffer  (PEER_RECEIVE_BUFFER_SIZE
+                       + sizeof(Protocol::Message) + sizeof(Protocol::Value)) {
 
   manager.register_handler(fd, this, EPOLLIN);
 
@@ -70,7 +73,8 @@ Socket::~Socket() {
 bool Socket::is_shutdown() const {
   return fd == -1
     &&  (promise_receiver == NULL ||  promise_receiver->is_shutdown())
-    && (proposal_receiver == NULL || proposal_receiver->is_shutdown());
+    && (proposal_receiver == NULL || proposal_receiver->is_shutdown())
+    && (catch_up_receiver == NULL || catch_up_receiver->is_shutdown());
 }
 
 void Socket::handle_readable() {
@@ -84,7 +88,7 @@ void Socket::handle_readable() {
     switch(Protocol::receive_handshake(fd,
                                        received_handshake,
                                        received_handshake_size,
-                                       node_name.cluster)) {
+                                       node_name)) {
 
       case RECEIVE_HANDSHAKE_ERROR:
         fprintf(stderr, "%s (fd=%d): read(handshake) failed\n",
@@ -111,6 +115,7 @@ void Socket::handle_readable() {
 
       case RECEIVE_HANDSHAKE_SUCCESS:
         peer_id = received_handshake.node_id;
+        protocol_version = Protocol::negotiated_version(received_handshake);
 
 #ifndef NTRACE
         printf("%s (fd=%d): accepted handshake version %d cluster %s node %d\n",
@@ -127,151 +132,170 @@ void Socket::handle_readable() {
     abort();
   }
 
-  if (size_received == 1 + sizeof(Protocol::Message) + sizeof(Protocol::Value)
-          && current_message_type == MESSAGE_TYPE_SEND_CATCH_UP) {
-
-    // reading configuration entries after a catch-up message
-
-    auto &payload = current_message.send_catch_up;
-    assert(current_entry_size < sizeof(Protocol::Message::configuration_entry));
-
-    ssize_t read_configuration_entry_result
-      = read(fd,
-        reinterpret_cast<uint8_t*>(&current_entry) + current_entry_size,
-        sizeof(Protocol::Message::configuration_entry) - current_entry_size);
+  assert(peer_id != 0);
+  assert(receive_start == 0);
+  assert(receive_end < PEER_RECEIVE_BUFFER_SIZE);
 
-    if (read_configuration_entry_result == -1) {
-      perror(__PRETTY_FUNCTION__);
-      fprintf(stderr, "%s (fd=%d,peer=%d): read(configuration entry) failed\n",
-                      __PRETTY_FUNCTION__, fd, peer_id);
-      shutdown();
+  ssize_t read_result = read(fd, &receive_buffer[receive_end],
+                             PEER_RECEIVE_BUFFER_SIZE - receive_end);
+  if (read_result == -1) {
+    if (errno == EAGAIN) {
       return;
     }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s (fd=%d,peer=%d): read() failed\n",
+                    __PRETTY_FUNCTION__, fd, peer_id);
+    shutdown();
+    return;
+  }
 
-    if (read_configuration_entry_result == 0) {
+  if (read_result == 0) {
 #ifndef NTRACE
-      printf("%s (fd=%d,peer=%d): EOF in configuration entry\n",
-              __PRETTY_FUNCTION__, fd, peer_id);
+    printf("%s (fd=%d,peer=%d): EOF in read()\n",
+            __PRETTY_FUNCTION__, fd, peer_id);
 #endif // ndef NTRACE
+    shutdown();
+    return;
+  }
+
+  assert(read_result > 0);
+  receive_end += read_result;
+  assert(receive_end <= PEER_RECEIVE_BUFFER_SIZE);
+
+  while (fd != -1 && receive_start < receive_end) {
+    const uint8_t *data      = &receive_buffer[receive_start];
+    const size_t   available = receive_end - receive_start;
+
+    if (receiving_catch_up_entries) {
+      const size_t consumed = handle_catch_up_entries(data, available);
+      if (consumed == 0) {
+        break;
+      }
+      receive_start += consumed;
+      continue;
+    }
+
+    Protocol::FrameLayout layout;
+    const int parse_result
+      = Protocol::parse_frame(protocol_version, data, available, layout);
+
+    if (parse_result == PARSE_FRAME_INCOMPLETE) {
+      break;
+    }
+
+    if (parse_result == PARSE_FRAME_INVALID) {
+      fprintf(stderr, "%s (fd=%d,peer=%d): invalid frame type=%02x\n",
+          __PRETTY_FUNCTION__, fd, peer_id, data[0]);
       shutdown();
       return;
     }
 
-    assert(read_configuration_entry_result > 0);
-    current_entry_size += read_configuration_entry_result;
-    assert(current_entry_size <= sizeof(Protocol::Message::configuration_entry));
+    assert(parse_result == PARSE_FRAME_COMPLETE);
+    receive_start += layout.size();
 
-    if (current_entry_size < sizeof(Protocol::Message::configuration_entry)) {
-      return;
+    const uint8_t *body = data + layout.header_size;
+    handle_message(data[0],
+      *reinterpret_cast<const Protocol::Message*>(body),
+      *reinterpret_cast<const Protocol::Value*>(body + layout.message_size));
+  }
+
+  if (fd == -1) {
+    return;
+  }
+
+  // Move any partial frame to the start, ready for the rest of it.
+  if (receive_start < receive_end) {
+    memmove(&receive_buffer[0], &receive_buffer[receive_start],
+            receive_end - receive_start);
+  }
+  receive_end  -= receive_start;
+  receive_start = 0;
+}
+
+size_t Socket::handle_catch_up_entries(const uint8_t *data, size_t available) {
+  auto &payload = catch_up_message.send_catch_up;
+  size_t consumed = 0;
+
+  while (0 < payload.configuration_size) {
+    const size_t entry_size = sizeof(Protocol::Message::configuration_entry);
+    if (available - consumed < entry_size) {
+      return consumed;
     }
 
+    const auto &entry = *reinterpret_cast
+      <const Protocol::Message::configuration_entry*>(data + consumed);
+    consumed += entry_size;
+
     received_entries.push_back(
-      Paxos::Configuration::Entry(current_entry.node_id,
-                                  current_entry.weight));
+      Paxos::Configuration::Entry(entry.node_id, entry.weight));
     payload.configuration_size -= 1;
-    current_entry_size = 0;
 #ifndef NTRACE
     std::cout << __PRETTY_FUNCTION__
       << " (fd=" << fd << ",peer=" << peer_id << "): "
       << "received configuration entry("
-      << current_entry.node_id << ", "
-      << (uint32_t)current_entry.weight << ")"
+      << entry.node_id << ", "
+      << (uint32_t)entry.weight << ")"
       << std::endl;
 #endif // ndef NTRACE
+  }
 
-    if (0 < payload.configuration_size) {
-      // still more entries to go
-      return;
+  while (0 < payload.open_stream_count) {
+    const size_t entry_size = sizeof(Protocol::Message::open_stream_entry);
+    if (available - consumed < entry_size) {
+      return consumed;
     }
 
+    const auto &entry = *reinterpret_cast
+      <const Protocol::Message::open_stream_entry*>(data + consumed);
+    consumed += entry_size;
+
+    received_open_streams.push_back({
+      .name             = {.owner = entry.owner, .id = entry.id},
+      .position         = entry.position,
+      .last_chosen_slot = entry.last_chosen_slot});
+    payload.open_stream_count -= 1;
 #ifndef NTRACE
     std::cout << __PRETTY_FUNCTION__
       << " (fd=" << fd << ",peer=" << peer_id << "): "
-      << "received all configuration entries"
+      << "received open stream entry("
+      << received_open_streams.back() << ")"
       << std::endl;
 #endif // ndef NTRACE
-
-    Paxos::Configuration configuration(received_entries);
-    Paxos::Value::StreamName stream =
-      {.owner = payload.current_stream_owner,
-       .id    = payload.current_stream_id };
-
-    legislator.handle_send_catch_up(
-      payload.slot,
-      payload.era,
-      configuration,
-      payload.next_generated_node_id,
-      stream,
-      payload.current_stream_position);
-
-    received_entries.clear();
-    size_received = 0;
-    return;
   }
 
-  // receiving a value
-  assert(peer_id != 0);
+#ifndef NTRACE
+  std::cout << __PRETTY_FUNCTION__
+    << " (fd=" << fd << ",peer=" << peer_id << "): "
+    << "received all catch-up entries"
+    << std::endl;
+#endif // ndef NTRACE
 
-  struct iovec iov[3];
-  int iovcnt;
-  if (size_received == 0) {
-    iovcnt = 3;
-    iov[0].iov_base = reinterpret_cast<uint8_t*>(&current_message_type);
-    iov[1].iov_base = reinterpret_cast<uint8_t*>(&current_message);
-    iov[2].iov_base = reinterpret_cast<uint8_t*>(&current_value);
-    iov[0].iov_len  = 1;
-    iov[1].iov_len  = sizeof(Protocol::Message);
-    iov[2].iov_len  = sizeof(Protocol::Value);
-  } else if (size_received <= 1 + sizeof(Protocol::Message)) {
-    iovcnt = 2;
-    iov[0].iov_base = reinterpret_cast<uint8_t*>(&current_message)
-                    + (size_received - 1);
-    iov[1].iov_base = reinterpret_cast<uint8_t*>(&current_value);
-    iov[0].iov_len  = sizeof(Protocol::Message)
-                    - (size_received - 1);
-    iov[1].iov_len  = sizeof(Protocol::Value);
-  } else {
-    assert(size_received < 1 + sizeof(Protocol::Message) + sizeof(Protocol::Value));
-    iovcnt = 1;
-    iov[0].iov_base = reinterpret_cast<uint8_t*>(&current_value)
-                    + (size_received - 1 - sizeof(Protocol::Message));
-    iov[0].iov_len  = sizeof(Protocol::Value)
-                    - (size_received - 1 - sizeof(Protocol::Message));
-  }
+  receiving_catch_up_entries = false;
 
-  int readv_result = readv(fd, iov, iovcnt);
-  if (readv_result == -1) {
-    perror(__PRETTY_FUNCTION__);
-    fprintf(stderr, "%s (fd=%d,peer=%d): readv() failed\n",
-                    __PRETTY_FUNCTION__, fd, peer_id);
-    shutdown();
-    return;
-  }
+  Paxos::Configuration configuration(received_entries);
 
-  if (readv_result == 0) {
-#ifndef NTRACE
-    printf("%s (fd=%d,peer=%d): EOF in readv()\n",
-            __PRETTY_FUNCTION__, fd, peer_id);
-#endif // ndef NTRACE
-    shutdown();
-    return;
-  }
+  legislator.handle_send_catch_up(
+    payload.slot,
+    payload.era,
+    configuration,
+    payload.next_generated_node_id,
+    received_open_streams);
 
-  assert(readv_result > 0);
-  size_received += readv_result;
-  assert(size_received <= 1 + sizeof(Protocol::Message) + sizeof(Protocol::Value));
+  received_entries.clear();
+  received_open_streams.clear();
+  return consumed;
+}
 
-  if (size_received < 1 + sizeof(Protocol::Message) + sizeof(Protocol::Value)) {
-    return;
-  }
+void Socket::handle_message(const uint8_t                type,
+                            const Protocol::Message     &current_message,
+                            const Protocol::Value       &current_value) {
 
 #ifndef NTRACE
   printf("%s (fd=%d,peer=%d): receiving message type=%02x\n",
-    __PRETTY_FUNCTION__, fd, peer_id,
-    current_message_type);
+    __PRETTY_FUNCTION__, fd, peer_id, type);
 #endif // ndef NTRACE
 
-  switch (current_message_type & 0x0f) {
+  switch (type & 0x0f) {
 
     case MESSAGE_TYPE_SEEK_VOTES_OR_CATCH_UP:
     {
@@ -288,7 +312,6 @@ void Socket::handle_readable() {
       legislator.handle_seek_votes_or_catch_up(peer_id,
            payload.slot,
            term);
-      size_received = 0;
       return;
     }
 
@@ -304,7 +327,6 @@ void Socket::handle_readable() {
         << std::endl;
 #endif // ndef NTRACE
       legislator.handle_offer_vote(peer_id, term);
-      size_received = 0;
       return;
     }
 
@@ -317,7 +339,6 @@ void Socket::handle_readable() {
         << std::endl;
 #endif // ndef NTRACE
       legislator.handle_offer_catch_up(peer_id);
-      size_received = 0;
       return;
     }
 
@@ -330,7 +351,6 @@ void Socket::handle_readable() {
         << std::endl;
 #endif // ndef NTRACE
       legislator.handle_request_catch_up(peer_id);
-      size_received = 0;
       return;
     }
 
@@ -347,7 +367,10 @@ void Socket::handle_readable() {
       // have received header so now reading
       // configuration entries.
       assert(payload.configuration_size > 0);
-      assert(current_entry_size == 0);
+      assert(received_entries.empty());
+      assert(received_open_streams.empty());
+      catch_up_message           = current_message;
+      receiving_catch_up_entries = true;
       return;
     }
 
@@ -363,7 +386,6 @@ void Socket::handle_readable() {
         << std::endl;
 #endif // ndef NTRACE
       legislator.handle_prepare_term(peer_id, term);
-      size_received = 0;
       return;
     }
 
@@ -385,7 +407,6 @@ void Socket::handle_readable() {
         payload.slot, payload.slot, term);
 
       legislator.handle_promise(peer_id, promise);
-      size_received = 0;
       return;
     }
 
@@ -408,7 +429,6 @@ void Socket::handle_readable() {
         payload.start_slot, payload.end_slot, term);
 
       legislator.handle_promise(peer_id, promise);
-      size_received = 0;
       return;
     }
 
@@ -418,7 +438,7 @@ void Socket::handle_readable() {
       const auto term              = payload.term.get_paxos_term();
       const auto max_accepted_term = payload.max_accepted_term.get_paxos_term();
       Paxos::Value value;
-      if (!get_paxos_value(value)) {
+      if (!get_paxos_value(type, current_value, value)) {
         shutdown();
         return;
       }
@@ -443,7 +463,6 @@ void Socket::handle_readable() {
       promise.max_accepted_term_value = value;
 
       legislator.handle_promise(peer_id, promise);
-      size_received = 0;
       return;
     }
 
@@ -452,7 +471,7 @@ void Socket::handle_readable() {
       const auto &payload = current_message.proposed_and_accepted;
       const auto term     = payload.term.get_paxos_term();
       Paxos::Value value;
-      if (!get_paxos_value(value)) {
+      if (!get_paxos_value(type, current_value, value)) {
         shutdown();
         return;
       }
@@ -476,7 +495,6 @@ void Socket::handle_readable() {
       };
 
       legislator.handle_proposed_and_accepted(peer_id, proposal);
-      size_received = 0;
       return;
     }
 
@@ -485,7 +503,7 @@ void Socket::handle_readable() {
       const auto &payload = current_message.accepted;
       const auto term     = payload.term.get_paxos_term();
       Paxos::Value value;
-      if (!get_paxos_value(value)) {
+      if (!get_paxos_value(type, current_value, value)) {
         shutdown();
         return;
       }
@@ -507,7 +525,6 @@ void Socket::handle_readable() {
       };
 
       legislator.handle_accepted(peer_id, proposal);
-      size_received = 0;
       return;
     }
 
@@ -542,12 +559,22 @@ void Socket::handle_readable() {
 
       manager.modify_handler(fd, promise_receiver.get(), EPOLLIN);
       fd = -1;
+
+      // anything after this message is stream data, for the receiver
+      promise_receiver->receive_buffered(&receive_buffer[receive_start],
+                                         receive_end - receive_start);
+      receive_start = receive_end;
       return;
     }
 
     case MESSAGE_TYPE_START_STREAMING_PROPOSALS:
+    case MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS:
     {
-      const auto &payload = current_message.start_streaming_proposals;
+      const bool accepted_by_proposer
+        = type == MESSAGE_TYPE_START_STREAMING_PROPOSALS;
+      const auto &payload = accepted_by_proposer
+        ? current_message.start_streaming_proposals
+        : current_message.start_streaming_early_proposals;
       const auto term = payload.term.get_paxos_term();
       const Paxos::Value::OffsetStream stream
         = {.name = {.owner = payload.stream_owner,
@@ -560,7 +587,8 @@ void Socket::handle_readable() {
         << "received start_streaming_proposals("
         << stream                   << ", "
         << payload.first_slot       << ", "
-        << term             << ")"
+        << term             << ", "
+        << (accepted_by_proposer ? "accepted" : "early") << ")"
         << std::endl;
 #endif // ndef NTRACE
 
@@ -569,24 +597,60 @@ void Socket::handle_readable() {
 
       proposal_receiver = std::unique_ptr<ProposalReceiver>(new ProposalReceiver
         (manager, segment_cache, legislator, node_name, peer_id, fd, term,
-          stream, payload.first_slot));
+          stream, payload.first_slot, accepted_by_proposer));
 
       manager.modify_handler(fd, proposal_receiver.get(), EPOLLIN);
       fd = -1;
+
+      // anything after this message is stream data, for the receiver
+      proposal_receiver->receive_buffered(&receive_buffer[receive_start],
+                                          receive_end - receive_start);
+      receive_start = receive_end;
+      return;
+    }
+
+    case MESSAGE_TYPE_START_STREAMING_CATCH_UP:
+    {
+      const auto &payload = current_message.start_streaming_catch_up;
+
+#ifndef NTRACE
+      std::cout << __PRETTY_FUNCTION__
+        << " (fd=" << fd << ",peer=" << peer_id << "): "
+        << "received start_streaming_catch_up("
+        << payload.end_slot         << ")"
+        << std::endl;
+#endif // ndef NTRACE
+      (void)payload;
+
+      assert(promise_receiver == NULL);
+      assert(proposal_receiver == NULL);
+      assert(catch_up_receiver == NULL);
+
+      catch_up_receiver = std::unique_ptr<CatchUpReceiver>(new CatchUpReceiver
+        (manager, segment_cache, node_name, peer_id, fd));
+
+      manager.modify_handler(fd, catch_up_receiver.get(), EPOLLIN);
+      fd = -1;
+
+      // anything after this message is part of the transfer, for the receiver
+      catch_up_receiver->receive_buffered(&receive_buffer[receive_start],
+                                          receive_end - receive_start);
+      receive_start = receive_end;
       return;
     }
 
     default:
       fprintf(stderr, "%s (fd=%d): unknown message type=%02x\n",
-          __PRETTY_FUNCTION__, fd,
-          current_message_type);
+          __PRETTY_FUNCTION__, fd, type);
       shutdown();
       return;
   }
 }
 
-bool Socket::get_paxos_value(Paxos::Value &value) {
-  switch(current_message_type & 0xf0) {
+bool Socket::get_paxos_value(const uint8_t          type,
+                             const Protocol::Value &current_value,
+                                   Paxos::Value    &value) {
+  switch(type & 0xf0) {
     case VALUE_TYPE_NO_OP:
       value.type = Paxos::Value::Type::no_op;
       break;
@@ -619,7 +683,7 @@ bool Socket::get_paxos_value(Paxos::Value &value) {
 
     default:
       fprintf(stderr, "%s (fd=%d,peer=%d): unknown message type: %02x\n",
-        __PRETTY_FUNCTION__, fd, peer_id, current_message_type);
+        __PRETTY_FUNCTION__, fd, peer_id, type);
       shutdown();
       return false;
   }
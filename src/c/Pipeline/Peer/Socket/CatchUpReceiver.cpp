@@ -0,0 +1,284 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Peer/Socket.h"
+#include "Pipeline/Pipe.h"
+#include "Epoll.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace Pipeline {
+namespace Peer {
+
+Socket::CatchUpReceiver::CatchUpReceiver(Epoll::Manager &manager,
+          SegmentCache      &segment_cache,
+    const NodeName          &node_name,
+          Paxos::NodeId      peer_id,
+          int                fd)
+  : manager(manager),
+    segment_cache(segment_cache),
+    node_name(node_name),
+    peer_id(peer_id),
+    fd(fd) {}
+
+void Socket::CatchUpReceiver::shutdown() {
+  manager.deregister_close_and_clear(fd);
+  if (pipe != NULL) {
+    pipe->close_write_end();
+  }
+}
+
+bool Socket::CatchUpReceiver::is_shutdown() const {
+  return fd == -1 && (pipe == NULL || pipe->is_shutdown());
+}
+
+void Socket::CatchUpReceiver::receive_buffered(const uint8_t *data,
+                                               size_t         size) {
+  if (size == 0) { return; }
+
+  if (receive_offer(data, size) < size) {
+    fprintf(stderr, "%s (fd=%d,peer=%d): unexpected data after offer\n",
+                    __PRETTY_FUNCTION__, fd, peer_id);
+    shutdown();
+  }
+}
+
+size_t Socket::CatchUpReceiver::receive_offer(const uint8_t *data,
+                                              size_t         size) {
+  assert(state == State::receiving_offer);
+  const size_t wanted = std::min(size, sizeof offer - offer_bytes_received);
+  memcpy(reinterpret_cast<uint8_t*>(&offer) + offer_bytes_received,
+         data, wanted);
+  offer_bytes_received += wanted;
+  if (offer_bytes_received == sizeof offer) {
+    handle_offer();
+  }
+  return wanted;
+}
+
+void Socket::CatchUpReceiver::handle_offer() {
+  stream = {.name = {.owner = offer.stream_owner,
+                     .id    = offer.stream_id },
+            .offset         = offer.stream_offset };
+  term   = offer.term.get_paxos_term();
+
+  if (offer.end_slot < offer.start_slot
+      || offer.start_slot < stream.offset) {
+    fprintf(stderr, "%s (fd=%d,peer=%d): invalid offer [%lu,%lu)\n",
+                    __PRETTY_FUNCTION__, fd, peer_id,
+                    offer.start_slot, offer.end_slot);
+    shutdown();
+    return;
+  }
+
+  resume.resume_slot = segment_cache.first_slot_not_held(stream,
+    Paxos::SlotRange(offer.start_slot, offer.end_slot));
+  bytes_remaining = offer.end_slot - resume.resume_slot;
+
+#ifndef NTRACE
+  std::cout << __PRETTY_FUNCTION__
+    << " (fd=" << fd << ",peer=" << peer_id << "): "
+    << "offered " << stream
+    << " [" << offer.start_slot << "," << offer.end_slot << ")"
+    << " resuming from " << resume.resume_slot
+    << std::endl;
+#endif // ndef NTRACE
+
+  finished_pipe.reset();
+  if (0 < bytes_remaining) {
+    pipe.reset(new Pipe<CatchUpReceiver>(manager, *this, segment_cache,
+      node_name, node_name.id, stream.name,
+      resume.resume_slot - stream.offset));
+  }
+
+  resume_bytes_sent = 0;
+  state             = State::sending_resume;
+  send_resume();
+}
+
+void Socket::CatchUpReceiver::send_resume() {
+  const uint8_t *ptr = reinterpret_cast<const uint8_t*>(&resume);
+  ssize_t write_result = write(fd, ptr + resume_bytes_sent,
+                                   sizeof resume - resume_bytes_sent);
+
+  if (write_result == -1) {
+    if (errno == EAGAIN) {
+      manager.modify_handler(fd, this, EPOLLOUT);
+      return;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s (fd=%d,peer=%d): write() failed\n",
+                    __PRETTY_FUNCTION__, fd, peer_id);
+    shutdown();
+    return;
+  }
+
+  resume_bytes_sent += write_result;
+  if (resume_bytes_sent < sizeof resume) {
+    manager.modify_handler(fd, this, EPOLLOUT);
+    return;
+  }
+
+  if (0 < bytes_remaining) {
+    state = State::receiving_data;
+  } else {
+    state                = State::receiving_offer;
+    offer_bytes_received = 0;
+  }
+  manager.modify_handler(fd, this, EPOLLIN);
+}
+
+void Socket::CatchUpReceiver::handle_readable() {
+  assert(fd != -1);
+  assert(!waiting_for_downstream);
+
+  if (state == State::receiving_offer) {
+    uint8_t *ptr = reinterpret_cast<uint8_t*>(&offer);
+    ssize_t read_result = read(fd, ptr + offer_bytes_received,
+                                   sizeof offer - offer_bytes_received);
+    if (read_result == -1) {
+      if (errno == EAGAIN) {
+        return;
+      }
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s (fd=%d,peer=%d): read() failed\n",
+                      __PRETTY_FUNCTION__, fd, peer_id);
+      shutdown();
+    } else if (read_result == 0) {
+      if (offer_bytes_received != 0) {
+        fprintf(stderr, "%s (fd=%d,peer=%d): EOF within offer\n",
+                        __PRETTY_FUNCTION__, fd, peer_id);
+      }
+#ifndef NTRACE
+      printf("%s (fd=%d,peer=%d): EOF\n",
+             __PRETTY_FUNCTION__, fd, peer_id);
+#endif // ndef NTRACE
+      shutdown();
+    } else {
+      offer_bytes_received += read_result;
+      if (offer_bytes_received == sizeof offer) {
+        handle_offer();
+      }
+    }
+    return;
+  }
+
+  if (state == State::waiting_for_sync) {
+    // The sender closes the connection after the last segment, which needs
+    // nothing more from the socket.
+    shutdown();
+    return;
+  }
+
+  if (state != State::receiving_data) {
+    fprintf(stderr, "%s (fd=%d,peer=%d): unexpected\n",
+                    __PRETTY_FUNCTION__, fd, peer_id);
+    shutdown();
+    return;
+  }
+
+  assert(pipe != NULL);
+  assert(pipe->get_write_end_fd() != -1);
+  assert(0 < bytes_remaining);
+
+  ssize_t splice_result = splice(
+    fd, NULL, pipe->get_write_end_fd(), NULL,
+    std::min<uint64_t>(bytes_remaining, CLIENT_SEGMENT_DEFAULT_SIZE),
+    SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+
+  if (splice_result == -1) {
+    if (errno == EAGAIN) {
+      pipe->wait_until_writeable();
+      manager.modify_handler(fd, this, 0);
+      waiting_for_downstream = true;
+    } else {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s (fd=%d,peer=%d): splice() failed\n",
+                      __PRETTY_FUNCTION__, fd, peer_id);
+      shutdown();
+    }
+  } else if (splice_result == 0) {
+    // What has arrived is kept, and a later transfer resumes after it.
+    printf("%s (fd=%d,peer=%d): EOF with %lu bytes to go\n",
+           __PRETTY_FUNCTION__, fd, peer_id, bytes_remaining);
+    shutdown();
+  } else {
+    assert(splice_result > 0);
+    bytes_remaining -= splice_result;
+    pipe->record_bytes_in(splice_result);
+    pipe->handle_readable();
+
+    if (bytes_remaining == 0) {
+      // Wait for the segment to be synced before asking for the next one.
+      state = State::waiting_for_sync;
+      manager.modify_handler(fd, this, 0);
+      pipe->close_write_end();
+    }
+  }
+}
+
+void Socket::CatchUpReceiver::handle_writeable() {
+  if (state == State::sending_resume) {
+    send_resume();
+    return;
+  }
+  fprintf(stderr, "%s (fd=%d,peer=%d): unexpected\n",
+                  __PRETTY_FUNCTION__, fd, peer_id);
+  shutdown();
+}
+
+void Socket::CatchUpReceiver::handle_error(const uint32_t events) {
+  fprintf(stderr, "%s (fd=%d, events=%x): unexpected\n",
+                  __PRETTY_FUNCTION__, fd, events);
+  shutdown();
+}
+
+void Socket::CatchUpReceiver::downstream_became_writeable() {
+  assert(waiting_for_downstream);
+  manager.modify_handler(fd, this, EPOLLIN);
+  waiting_for_downstream = false;
+}
+
+void Socket::CatchUpReceiver::downstream_closed() {
+  if (fd == -1) {
+    return;
+  }
+
+  if (state != State::waiting_for_sync) {
+    fprintf(stderr, "%s (fd=%d,peer=%d): unexpected\n",
+                    __PRETTY_FUNCTION__, fd, peer_id);
+    shutdown();
+    return;
+  }
+
+  // Called from within the pipe, so it is destroyed when the next one starts.
+  finished_pipe        = std::move(pipe);
+  state                = State::receiving_offer;
+  offer_bytes_received = 0;
+  manager.modify_handler(fd, this, EPOLLIN);
+}
+
+}
+}
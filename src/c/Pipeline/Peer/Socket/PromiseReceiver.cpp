@@ -64,11 +64,50 @@ Socket::PromiseReceiver::PromiseReceiver(Epoll::Manager &manager,
 
 bool Socket::PromiseReceiver::is_shutdown() const { return fd == -1; }
 
+void Socket::PromiseReceiver::receive_buffered(const uint8_t *data, size_t size) {
+  assert(buffered_data.empty());
+  if (size == 0) { return; }
+  buffered_data.assign(data, data + size);
+  write_buffered_data();
+}
+
+void Socket::PromiseReceiver::write_buffered_data() {
+  while (!buffered_data.empty() && !waiting_for_downstream && fd != -1) {
+    ssize_t write_result = write(pipe.get_write_end_fd(),
+                                 buffered_data.data(), buffered_data.size());
+
+    if (write_result == -1) {
+      if (errno == EAGAIN) {
+        pipe.wait_until_writeable();
+        manager.modify_handler(fd, this, 0);
+        waiting_for_downstream = true;
+      } else {
+        perror(__PRETTY_FUNCTION__);
+        fprintf(stderr, "%s (fd=%d,peer=%d): write() failed\n",
+                        __PRETTY_FUNCTION__, fd, peer_id);
+        shutdown();
+      }
+      return;
+    }
+
+    assert(write_result > 0);
+    buffered_data.erase(buffered_data.begin(),
+                        buffered_data.begin() + write_result);
+    pipe.record_bytes_in(write_result);
+    pipe.handle_readable();
+  }
+}
+
 void Socket::PromiseReceiver::handle_readable() {
   assert(fd != -1);
   assert(pipe.get_write_end_fd() != -1);
   assert(!waiting_for_downstream);
 
+  if (!buffered_data.empty()) {
+    write_buffered_data();
+    return;
+  }
+
   ssize_t splice_result = splice(
     fd, NULL, pipe.get_write_end_fd(), NULL,
     CLIENT_SEGMENT_DEFAULT_SIZE,
@@ -120,6 +159,7 @@ void Socket::PromiseReceiver::downstream_became_writeable() {
   assert(waiting_for_downstream);
   manager.modify_handler(fd, this, EPOLLIN);
   waiting_for_downstream = false;
+  write_buffered_data();
 }
 
 void Socket::PromiseReceiver::downstream_closed() {
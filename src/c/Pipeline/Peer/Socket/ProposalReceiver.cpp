@@ -34,6 +34,7 @@ namespace Pipeline {
 namespace Peer {
 
 void Socket::ProposalReceiver::shutdown() {
+  pipe.close_write_end();
   manager.deregister_close_and_clear(fd);
 }
 
@@ -45,7 +46,8 @@ Socket::ProposalReceiver::ProposalReceiver(Epoll::Manager &manager,
           int                fd,
     const Paxos::Term       &term,
           Paxos::Value::OffsetStream stream,
-          Paxos::Slot        first_slot)
+          Paxos::Slot        first_slot,
+          bool               accepted_by_proposer)
   : manager(manager),
     legislator(legislator),
     node_name(node_name),
@@ -54,19 +56,61 @@ Socket::ProposalReceiver::ProposalReceiver(Epoll::Manager &manager,
     proposal({.slots = Paxos::SlotRange(first_slot, first_slot),
               .term = term,
               .value = {.type = Paxos::Value::Type::stream_content}}),
+    accepted_by_proposer(accepted_by_proposer),
     pipe(manager, *this, segment_cache, node_name, node_name.id,
          stream.name, first_slot - stream.offset) {
 
   proposal.value.payload.stream = stream;
 }
 
-bool Socket::ProposalReceiver::is_shutdown() const { return fd == -1; }
+bool Socket::ProposalReceiver::is_shutdown() const {
+  return fd == -1 && pipe.is_shutdown();
+}
+
+void Socket::ProposalReceiver::receive_buffered(const uint8_t *data, size_t size) {
+  assert(buffered_data.empty());
+  if (size == 0) { return; }
+  buffered_data.assign(data, data + size);
+  write_buffered_data();
+}
+
+void Socket::ProposalReceiver::write_buffered_data() {
+  while (!buffered_data.empty() && !waiting_for_downstream && fd != -1) {
+    ssize_t write_result = write(pipe.get_write_end_fd(),
+                                 buffered_data.data(), buffered_data.size());
+
+    if (write_result == -1) {
+      if (errno == EAGAIN) {
+        pipe.wait_until_writeable();
+        manager.modify_handler(fd, this, 0);
+        waiting_for_downstream = true;
+      } else {
+        perror(__PRETTY_FUNCTION__);
+        fprintf(stderr, "%s (fd=%d,peer=%d): write() failed\n",
+                        __PRETTY_FUNCTION__, fd, peer_id);
+        shutdown();
+      }
+      return;
+    }
+
+    assert(write_result > 0);
+    buffered_data.erase(buffered_data.begin(),
+                        buffered_data.begin() + write_result);
+    pipe.record_bytes_in(write_result);
+    pipe.handle_readable();
+  }
+}
 
 void Socket::ProposalReceiver::handle_readable() {
   assert(fd != -1);
   assert(pipe.get_write_end_fd() != -1);
   assert(!waiting_for_downstream);
 
+  if (!buffered_data.empty()) {
+    write_buffered_data();
+    return;
+  }
+
   ssize_t splice_result = splice(
     fd, NULL, pipe.get_write_end_fd(), NULL,
     CLIENT_SEGMENT_DEFAULT_SIZE,
@@ -129,11 +173,14 @@ void Socket::ProposalReceiver::downstream_became_writeable() {
   assert(waiting_for_downstream);
   manager.modify_handler(fd, this, EPOLLIN);
   waiting_for_downstream = false;
+  write_buffered_data();
 }
 
 void Socket::ProposalReceiver::downstream_closed() {
-  fprintf(stderr, "%s (fd=%d,peer=%d): unexpected\n",
-                  __PRETTY_FUNCTION__, fd, peer_id);
+  if (fd != -1) {
+    fprintf(stderr, "%s (fd=%d,peer=%d): unexpected\n",
+                    __PRETTY_FUNCTION__, fd, peer_id);
+  }
   shutdown();
 }
 
@@ -143,7 +190,11 @@ void Socket::ProposalReceiver::downstream_wrote_bytes
 
   proposal.slots.set_end(next_stream_pos + bytes_sent
                           + proposal.value.payload.stream.offset);
-  legislator.handle_proposed_and_accepted(peer_id, proposal);
+  if (accepted_by_proposer) {
+    legislator.handle_proposed_and_accepted(peer_id, proposal);
+  } else {
+    legislator.handle_proposed(proposal);
+  }
 }
 
 const Paxos::Term &Socket::ProposalReceiver::get_term_for_next_write() const {
@@ -21,7 +21,12 @@
 #include "Pipeline/Peer/Target.h"
 
 #include <sys/types.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <limits>
 #include <netdb.h>
 #include <string.h>
 
@@ -34,6 +39,10 @@ Target::Address::Address(const char *host, const char *port)
 bool Target::is_connected() const { return fd != -1 && peer_id != 0; }
 
 bool Target::is_connected_to(const Paxos::NodeId &n) const {
+  if (outbound.get_handed_over_peer_id() != 0) {
+    // Frames queued while reconnecting are sent once reconnected.
+    return outbound.get_handed_over_peer_id() == n;
+  }
   return is_connected() && peer_id == n;
 }
 
@@ -42,6 +51,7 @@ void Target::shutdown() {
   assert(fd == -1);
   received_handshake_bytes = 0;
   peer_id = 0;
+  outbound.clear();
 }
 
 void Target::start_connection() {
@@ -170,16 +180,33 @@ Target::Target(const Address           &address,
                      Epoll::Manager    &manager,
                      SegmentCache      &segment_cache,
                      Paxos::Legislator &legislator,
-               const NodeName          &node_name)
+               const NodeName          &node_name,
+                     SendfileShards    *shards)
   : streaming_slots(0,0),
     address(address),
     manager(manager),
     segment_cache(segment_cache),
     legislator(legislator),
-    node_name(node_name) {
+    node_name(node_name),
+    shards(shards) {
   start_connection();
 }
 
+Target::~Target() {
+  manager.cancel_deferred(this);
+}
+
+TeeSink *Target::enable_tee_sink() {
+  if (shards != NULL) {
+    // The shards only send from segment files.
+    return NULL;
+  }
+  if (tee_sink == NULL) {
+    tee_sink.reset(new TeeSink);
+  }
+  return tee_sink.get();
+}
+
 void Target::handle_readable() {
   if (fd == -1) {
     return;
@@ -191,7 +218,7 @@ void Target::handle_readable() {
     switch(Protocol::receive_handshake(fd,
                                        received_handshake,
                                        received_handshake_bytes,
-                                       node_name.cluster)) {
+                                       node_name)) {
 
       case RECEIVE_HANDSHAKE_ERROR:
         fprintf(stderr, "%s (fd=%d): read(handshake) failed\n",
@@ -218,6 +245,13 @@ void Target::handle_readable() {
 
       case RECEIVE_HANDSHAKE_SUCCESS:
         peer_id = received_handshake.node_id;
+        protocol_version = Protocol::negotiated_version(received_handshake);
+
+        outbound.reconnected(peer_id, protocol_version);
+        if (outbound.has_unwritten() && !flush_deferred) {
+          manager.defer(this);
+          flush_deferred = true;
+        }
 
 #ifndef NTRACE
         printf("%s (fd=%d): accepted handshake version %d cluster %s node %d\n",
@@ -262,64 +296,28 @@ void Target::handle_writeable() {
     return;
   }
 
-  bool sent_data = false;
-
-  while (current_message.still_to_send > 0) {
-    struct iovec iov[3];
-    int          iovcnt;
-    if (current_message.still_to_send <= sizeof(Protocol::Value)) {
-      iovcnt = 1;
-      iov[0].iov_len  = current_message.still_to_send;
-      iov[0].iov_base = reinterpret_cast<uint8_t*>(&current_message.value)
-                      + sizeof(Protocol::Value)
-                      - current_message.still_to_send;
-    } else if (current_message.still_to_send <= sizeof(Protocol::Value)
-                                              + sizeof(Protocol::Message)) {
-
-      iovcnt = 2;
-      iov[1].iov_len  = sizeof(Protocol::Value);
-      iov[0].iov_len  = current_message.still_to_send
-                      - sizeof(Protocol::Value);
-      iov[1].iov_base = reinterpret_cast<uint8_t*>(&current_message.value);
-      iov[0].iov_base = reinterpret_cast<uint8_t*>(&current_message.message)
-                      + sizeof(Protocol::Message)
-                      + sizeof(Protocol::Value)
-                      - current_message.still_to_send;
-    } else {
-      assert(current_message.still_to_send == sizeof(Protocol::Value)
-                                            + sizeof(Protocol::Message)
-                                            + 1);
-      iovcnt = 3;
-      iov[2].iov_len  = sizeof(Protocol::Value);
-      iov[1].iov_len  = sizeof(Protocol::Message);
-      iov[0].iov_len  = 1;
-      iov[2].iov_base = reinterpret_cast<uint8_t*>(&current_message.value);
-      iov[1].iov_base = reinterpret_cast<uint8_t*>(&current_message.message);
-      iov[0].iov_base = reinterpret_cast<uint8_t*>(&current_message.type);
-    }
-
+  struct iovec iov[2];
+  int iovcnt;
+  while ((iovcnt = outbound.get_unwritten(iov)) != 0) {
 #ifndef NTRACE
-    size_t total_len = 0;
+    const size_t size = iov[0].iov_len + (iovcnt == 2 ? iov[1].iov_len : 0);
     printf("%s (fd=%d): sending", __PRETTY_FUNCTION__, fd);
     for (int i = 0; i < iovcnt; i++) {
-      printf(" /");
-      uint8_t *p = reinterpret_cast<uint8_t*>(iov[i].iov_base);
-      total_len += iov[i].iov_len;
-      for (size_t j = 0; j < iov[i].iov_len; j++) {
-        printf(" %02x", *p);
-        p++;
+      const uint8_t *ptr = static_cast<const uint8_t*>(iov[i].iov_base);
+      for (size_t n = 0; n < iov[i].iov_len; n++) {
+        printf(" %02x", ptr[n]);
       }
     }
-    printf(" = %lu bytes\n", total_len);
+    printf(" = %lu bytes\n", size);
 #endif // ndef NTRACE
 
-    ssize_t writev_result = writev(fd, iov, iovcnt);
+    ssize_t write_result = writev(fd, iov, iovcnt);
 
 #ifndef NTRACE
-    printf("%s: writev returned %ld\n", __PRETTY_FUNCTION__, writev_result);
+    printf("%s: writev returned %ld\n", __PRETTY_FUNCTION__, write_result);
 #endif // ndef NTRACE
 
-    if (writev_result == -1) {
+    if (write_result == -1) {
       if (errno == EAGAIN) {
         if (!waiting_to_become_writeable) {
           manager.modify_handler(fd, this, EPOLLOUT);
@@ -332,27 +330,29 @@ void Target::handle_writeable() {
       }
       return;
     } else {
-      assert(writev_result >= 0);
-      size_t bytes_written = writev_result;
-      assert(bytes_written <= current_message.still_to_send);
-      current_message.still_to_send -= bytes_written;
-      if (writev_result > 0) {
-        sent_data = true;
-      }
+      assert(write_result >= 0);
+      size_t bytes_written = write_result;
+      assert(bytes_written
+          <= iov[0].iov_len + (iovcnt == 2 ? iov[1].iov_len : 0));
+      outbound.consume(bytes_written);
+      write_count++;
     }
   }
 
-  assert (current_message.still_to_send == 0);
+  // Anything queued after a streaming frame waits for the next connection
+  // to this peer.
+  const uint8_t sent_streaming_frame_type
+    = outbound.finish_writing(peer_id, protocol_version);
 
   if (waiting_to_become_writeable) {
     manager.modify_handler(fd, this, 0);
     waiting_to_become_writeable = false;
   }
 
-  if (sent_data) {
+  if (sent_streaming_frame_type != 0) {
     // Just finished sending a message, so may need to switch to another mode.
 
-    if (current_message.type == MESSAGE_TYPE_START_STREAMING_PROMISES) {
+    if (sent_streaming_frame_type == MESSAGE_TYPE_START_STREAMING_PROMISES) {
 
 #ifndef NTRACE
       printf("%s (fd=%d): sent MESSAGE_TYPE_START_STREAMING_PROMISES\n",
@@ -384,7 +384,8 @@ void Target::handle_writeable() {
       fd = -1;
       start_connection();
 
-    } else if (current_message.type == MESSAGE_TYPE_START_STREAMING_PROPOSALS) {
+    } else if (sent_streaming_frame_type == MESSAGE_TYPE_START_STREAMING_PROPOSALS
+            || sent_streaming_frame_type == MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS) {
 
 #ifndef NTRACE
       printf("%s (fd=%d): active senders before cleanout = %ld\n",
@@ -414,7 +415,28 @@ void Target::handle_writeable() {
         = std::unique_ptr<ProposedAndAcceptedSender>
           (new ProposedAndAcceptedSender(manager, segment_cache,
                                          node_name, fd,
-                                         streaming_slots, streaming_stream));
+                                         streaming_slots, streaming_stream,
+                                         shards, tee_sink.get()));
+      current_proposals_frame_type = sent_streaming_frame_type;
+
+      // previous constructor took ownership of this FD so dissociate it and
+      // make a new one.
+      fd = -1;
+      start_connection();
+
+    } else if (sent_streaming_frame_type == MESSAGE_TYPE_START_STREAMING_CATCH_UP) {
+
+#ifndef NTRACE
+      printf("%s (fd=%d): sent MESSAGE_TYPE_START_STREAMING_CATCH_UP\n",
+        __PRETTY_FUNCTION__, fd);
+#endif // ndef NTRACE
+
+      assert(catch_up_sender == NULL || catch_up_sender->is_shutdown());
+
+      catch_up_sender = std::unique_ptr<CatchUpSender>
+        (new CatchUpSender(manager, segment_cache, fd,
+                           streaming_catch_up_end_slot,
+                           catch_up_bytes_per_second));
 
       // previous constructor took ownership of this FD so dissociate it and
       // make a new one.
@@ -431,28 +453,61 @@ void Target::handle_error(const uint32_t events) {
   assert(fd == -1);
 }
 
+void Target::handle_deferred() {
+  flush_deferred = false;
+  handle_writeable();
+}
+
 bool Target::prepare_to_send(uint8_t message_type) {
-  if (!is_connected()) {
+  if (!is_connected() && outbound.get_handed_over_peer_id() == 0) {
 #ifndef NTRACE
     printf("%s (fd=%d,type=%02x): not connected\n",
       __PRETTY_FUNCTION__, fd, message_type);
 #endif //ndef NTRACE
     return false;
   }
-  if (0 < current_message.still_to_send) {
+  if (outbound.get_streaming_frame_type() != 0
+      && (message_type == MESSAGE_TYPE_START_STREAMING_PROMISES
+       || message_type == MESSAGE_TYPE_START_STREAMING_PROPOSALS
+       || message_type == MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS
+       || message_type == MESSAGE_TYPE_START_STREAMING_CATCH_UP)) {
 #ifndef NTRACE
-    printf("%s (fd=%d,type=%02x): still %ld bytes of previous message (%02x) to send\n",
+    printf("%s (fd=%d,type=%02x): connection is switching to streaming (%02x)\n",
           __PRETTY_FUNCTION__, fd, message_type,
-          current_message.still_to_send, current_message.type);
+          outbound.get_streaming_frame_type());
 #endif //ndef NTRACE
+    outbound.drop_frame();
     return false;
   }
 
-  assert(current_message.still_to_send == 0);
   memset(&current_message, 0, sizeof(current_message));
-  current_message.type          = message_type;
-  current_message.still_to_send = 1 + sizeof(Protocol::Message)
-                                    + sizeof(Protocol::Value);
+  current_message.header.type = message_type;
+  if (!Protocol::get_frame_layout(protocol_version, message_type,
+                                  current_message.layout)) {
+    fprintf(stderr, "%s (fd=%d): unknown message type %02x\n",
+                    __PRETTY_FUNCTION__, fd, message_type);
+    abort();
+  }
+  current_message.header.body_length = current_message.layout.body_size();
+  return true;
+}
+
+bool Target::queue_current_message(size_t trailing_bytes) {
+  if (!outbound.queue(current_message.header, current_message.layout,
+                      current_message.message, current_message.value,
+                      trailing_bytes)) {
+#ifndef NTRACE
+    printf("%s (fd=%d,type=%02x): still %ld bytes of previous messages to send\n",
+          __PRETTY_FUNCTION__, fd, current_message.header.type,
+          outbound.get_depth());
+#endif //ndef NTRACE
+    return false;
+  }
+
+  if (!flush_deferred && is_connected()) {
+    manager.defer(this);
+    flush_deferred = true;
+  }
   return true;
 }
 
@@ -468,7 +523,7 @@ void Target::seek_votes_or_catch_up(const Paxos::Slot &first_unchosen_slot,
   auto &payload = current_message.message.seek_votes_or_catch_up;
   payload.slot = first_unchosen_slot;
   payload.term.copy_from(min_acceptable_term);
-  handle_writeable();
+  queue_current_message();
 }
 
 void Target::offer_vote(const Paxos::NodeId &destination,
@@ -483,7 +538,7 @@ void Target::offer_vote(const Paxos::NodeId &destination,
   if (!prepare_to_send(MESSAGE_TYPE_OFFER_VOTE)) { return; }
   auto &payload = current_message.message.offer_vote;
   payload.term.copy_from(min_acceptable_term);
-  handle_writeable();
+  queue_current_message();
 }
 
 void Target::offer_catch_up(const Paxos::NodeId &destination) {
@@ -494,7 +549,7 @@ void Target::offer_catch_up(const Paxos::NodeId &destination) {
             << std::endl;
 #endif //ndef NTRACE
   if (!prepare_to_send(MESSAGE_TYPE_OFFER_CATCH_UP)) { return; }
-  handle_writeable();
+  queue_current_message();
 }
 
 void Target::request_catch_up(const Paxos::NodeId &destination) {
@@ -505,7 +560,7 @@ void Target::request_catch_up(const Paxos::NodeId &destination) {
             << std::endl;
 #endif //ndef NTRACE
   if (!prepare_to_send(MESSAGE_TYPE_REQUEST_CATCH_UP)) { return; }
-  handle_writeable();
+  queue_current_message();
 }
 
 void Target::send_catch_up(
@@ -514,8 +569,7 @@ void Target::send_catch_up(
   const Paxos::Era&             current_era,
   const Paxos::Configuration&   current_configuration,
   const Paxos::NodeId&          next_generated_node_id,
-  const Paxos::Value::StreamName& current_stream,
-  const uint64_t                current_stream_pos) {
+  const std::vector<Paxos::Value::StreamPosition>& open_streams) {
 
   if (!is_connected_to(destination)) { return; }
 #ifndef NTRACE
@@ -525,8 +579,7 @@ void Target::send_catch_up(
             << " " << current_era
             << " " << current_configuration
             << " " << next_generated_node_id
-            << " " << current_stream
-            << " " << current_stream_pos
+            << " " << open_streams
             << std::endl;
 #endif //ndef NTRACE
   if (!prepare_to_send(MESSAGE_TYPE_SEND_CATCH_UP)) { return; }
@@ -534,59 +587,45 @@ void Target::send_catch_up(
   payload.slot                    = first_unchosen_slot;
   payload.era                     = current_era;
   payload.next_generated_node_id  = next_generated_node_id;
-  payload.current_stream_owner    = current_stream.owner;
-  payload.current_stream_id       = current_stream.id;
-  payload.current_stream_position = current_stream_pos;
+  payload.open_stream_count       = open_streams.size();
   payload.configuration_size      = current_configuration.entries.size();
-
-  handle_writeable();
-  if (current_message.still_to_send > 0) {
-    fprintf(stderr, "%s: partial write of catch-up data, %ld bytes remaining\n",
-      __PRETTY_FUNCTION__, current_message.still_to_send);
-    shutdown();
-    return;
-  }
-
-  if (!is_connected()) {
-    fprintf(stderr, "%s: disconnected before writing configuration entries\n",
-                     __PRETTY_FUNCTION__);
+  if (!queue_current_message(
+        current_configuration.entries.size()
+          * sizeof(Protocol::Message::configuration_entry)
+      + open_streams.size() * sizeof(Protocol::Message::open_stream_entry))) {
     return;
   }
 
   for (const auto &entry : current_configuration.entries) {
-
     Protocol::Message::configuration_entry e;
     e.node_id = entry.node_id();
     e.weight  = entry.weight();
-    const uint8_t* ptr  = reinterpret_cast<const uint8_t*>(&e);
-    const size_t   size = sizeof e;
+    outbound.append(&e, sizeof e);
+  }
 
-#ifndef NTRACE
-    printf("%s: sending %lu bytes:", __PRETTY_FUNCTION__, size);
-    for (size_t n = 0; n < size; n++) {
-      printf(" %02x", ptr[n]);
-    }
-    printf("\n");
-#endif // ndef NTRACE
+  for (const auto &open_stream : open_streams) {
+    Protocol::Message::open_stream_entry e;
+    e.owner            = open_stream.name.owner;
+    e.id               = open_stream.name.id;
+    e.position         = open_stream.position;
+    e.last_chosen_slot = open_stream.last_chosen_slot;
+    outbound.append(&e, sizeof e);
+  }
 
-    ssize_t write_result = write(fd, ptr, size);
+  // Follow up with the chosen segments themselves, on a separate connection,
+  // unless the peer is too old or a transfer is already under way.
+  if (protocol_version < PROTOCOL_VERSION_CATCH_UP_TRANSFER) { return; }
+  if (catch_up_sender != NULL && !catch_up_sender->is_shutdown()) { return; }
 
-    if (write_result == -1) {
-      perror(__PRETTY_FUNCTION__);
-      fprintf(stderr, "%s: write() failed\n", __PRETTY_FUNCTION__);
-      shutdown();
-      return;
-    } else {
-      assert(0 <= write_result);
-      size_t bytes_written = write_result;
-      if (bytes_written < size) {
-        fprintf(stderr, "%s: write() only wrote %ld of %ld bytes\n",
-               __PRETTY_FUNCTION__, bytes_written, size);
-        shutdown();
-        return;
-      }
-    }
-  }
+  std::vector<SegmentCache::ChosenSegment> segments;
+  segment_cache.get_chosen_segments(first_unchosen_slot, segments);
+  if (segments.empty()) { return; }
+
+  if (!prepare_to_send(MESSAGE_TYPE_START_STREAMING_CATCH_UP)) { return; }
+  current_message.message.start_streaming_catch_up.end_slot
+    = first_unchosen_slot;
+  streaming_catch_up_end_slot = first_unchosen_slot;
+  queue_current_message();
 }
 
 void Target::prepare_term(const Paxos::Term &term) {
@@ -598,7 +637,7 @@ void Target::prepare_term(const Paxos::Term &term) {
   if (!prepare_to_send(MESSAGE_TYPE_PREPARE_TERM)) { return; }
   auto &payload = current_message.message.prepare_term;
   payload.term.copy_from(term);
-  handle_writeable();
+  queue_current_message();
 }
 
 void Target::make_promise(const Paxos::Promise &promise) {
@@ -614,7 +653,7 @@ void Target::make_promise(const Paxos::Promise &promise) {
     auto &payload = current_message.message.make_promise_multi;
     payload.slot = promise.slots.start();
     payload.term.copy_from(promise.term);
-    handle_writeable();
+    queue_current_message();
     return;
   }
 
@@ -633,7 +672,7 @@ void Target::make_promise(const Paxos::Promise &promise) {
     payload.start_slot = promise.slots.start();
     payload.end_slot   = promise.slots.end();
     payload.term.copy_from(promise.term);
-    handle_writeable();
+    queue_current_message();
     return;
   }
 
@@ -655,7 +694,7 @@ void Target::make_promise(const Paxos::Promise &promise) {
       pl.max_accepted_term.copy_from(promise.max_accepted_term);
       streaming_slots = promise.slots;
       streaming_stream = stream;
-      handle_writeable();
+      queue_current_message();
       return;
 
     } else {
@@ -673,7 +712,7 @@ void Target::make_promise(const Paxos::Promise &promise) {
       payload.term.copy_from(promise.term);
       payload.max_accepted_term.copy_from(promise.max_accepted_term);
       set_current_message_value(promise.max_accepted_term_value);
-      handle_writeable();
+      queue_current_message();
       return;
     }
   }
@@ -682,15 +721,12 @@ void Target::make_promise(const Paxos::Promise &promise) {
   abort();
 }
 
-void Target::proposed_and_accepted(const Paxos::Proposal &proposal) {
-  if (proposal.value.type == Paxos::Value::Type::stream_content) {
-
-#ifndef NTRACE
-    printf("%s (fd=%d): proposed_and_accepted(stream_content)\n",
-      __PRETTY_FUNCTION__, fd);
-#endif // ndef NTRACE
+void Target::send_proposed_stream(const Paxos::Proposal &proposal,
+                                  uint8_t start_frame_type) {
+  assert(proposal.value.type == Paxos::Value::Type::stream_content);
 
-    if (current_proposed_and_accepted_sender != NULL) {
+  if (current_proposed_and_accepted_sender != NULL) {
+    if (current_proposals_frame_type == start_frame_type) {
 #ifndef NTRACE
       printf("%s (fd=%d): try existing sender\n",
         __PRETTY_FUNCTION__, fd);
@@ -704,28 +740,57 @@ void Target::proposed_and_accepted(const Paxos::Proposal &proposal) {
 #endif // ndef NTRACE
         return;
       }
+    }
 
 #ifndef NTRACE
-      printf("%s (fd=%d): failed with existing sender - expiring it\n",
-        __PRETTY_FUNCTION__, fd);
+    printf("%s (fd=%d): cannot use existing sender - expiring it\n",
+      __PRETTY_FUNCTION__, fd);
 #endif // ndef NTRACE
 
-      expired_proposed_and_accepted_senders.push_back(
-        std::move(current_proposed_and_accepted_sender));
-    }
+    current_proposed_and_accepted_sender->expire();
+    expired_proposed_and_accepted_senders.push_back(
+      std::move(current_proposed_and_accepted_sender));
+  }
+
+  assert(current_proposed_and_accepted_sender == NULL);
+
+  auto &proposal_stream = proposal.value.payload.stream;
+  const uint8_t streaming_frame_type = outbound.get_streaming_frame_type();
+  if  (streaming_frame_type         == start_frame_type
+    && proposal_stream.name.owner   == streaming_stream.name.owner
+    && proposal_stream.name.id      == streaming_stream.name.id
+    && proposal_stream.offset       == streaming_stream.offset
+    && proposal.slots.start()       == streaming_slots.end()) {
+    // The sender for this stream is not yet created, so extend the range
+    // that it will start with.
+    streaming_slots.set_end(proposal.slots.end());
+    return;
+  }
+
+  if (!prepare_to_send(start_frame_type)) { return; }
+  auto &pl = start_frame_type == MESSAGE_TYPE_START_STREAMING_PROPOSALS
+           ? current_message.message.start_streaming_proposals
+           : current_message.message.start_streaming_early_proposals;
+  auto &stream = proposal.value.payload.stream;
+  pl.stream_owner  = stream.name.owner;
+  pl.stream_id     = stream.name.id;
+  pl.stream_offset = stream.offset;
+  pl.first_slot    = proposal.slots.start();
+  pl.term.copy_from(proposal.term);
+  streaming_slots = proposal.slots;
+  streaming_stream = stream;
+  queue_current_message();
+}
+
+void Target::proposed_and_accepted(const Paxos::Proposal &proposal) {
+  if (proposal.value.type == Paxos::Value::Type::stream_content) {
+
+#ifndef NTRACE
+    printf("%s (fd=%d): proposed_and_accepted(stream_content)\n",
+      __PRETTY_FUNCTION__, fd);
+#endif // ndef NTRACE
 
-    assert(current_proposed_and_accepted_sender == NULL);
-
-    if (!prepare_to_send(MESSAGE_TYPE_START_STREAMING_PROPOSALS)) { return; }
-    auto &pl = current_message.message.start_streaming_proposals;
-    auto &stream = proposal.value.payload.stream;
-    pl.stream_owner  = stream.name.owner;
-    pl.stream_id     = stream.name.id;
-    pl.stream_offset = stream.offset;
-    pl.first_slot    = proposal.slots.start();
-    pl.term.copy_from(proposal.term);
-    streaming_slots = proposal.slots;
-    streaming_stream = stream;
+    send_proposed_stream(proposal, MESSAGE_TYPE_START_STREAMING_PROPOSALS);
   } else {
 #ifndef NTRACE
     std::cout << __PRETTY_FUNCTION__ << ":"
@@ -740,8 +805,20 @@ void Target::proposed_and_accepted(const Paxos::Proposal &proposal) {
     payload.end_slot   = proposal.slots.end();
     payload.term.copy_from(proposal.term);
     set_current_message_value(proposal.value);
+    queue_current_message();
   }
-  handle_writeable();
+}
+
+void Target::proposed(const Paxos::Proposal &proposal) {
+#ifndef NTRACE
+  std::cout << __PRETTY_FUNCTION__ << ":"
+            << " " << proposal
+            << std::endl;
+#endif //ndef NTRACE
+  // An older peer cannot take a proposal without its proposer's acceptance,
+  // so it is sent the whole thing once this node has accepted it.
+  if (protocol_version < PROTOCOL_VERSION_EARLY_PROPOSALS) { return; }
+  send_proposed_stream(proposal, MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS);
 }
 
 void Target::accepted(const Paxos::Proposal &proposal) {
@@ -750,6 +827,13 @@ void Target::accepted(const Paxos::Proposal &proposal) {
             << " " << proposal
             << std::endl;
 #endif //ndef NTRACE
+  if (proposal.value.type == Paxos::Value::Type::stream_content
+      && proposal.term.owner == node_name.id
+      && protocol_version < PROTOCOL_VERSION_EARLY_PROPOSALS) {
+    // proposed() sent nothing, so send the proposal and acceptance together.
+    proposed_and_accepted(proposal);
+    return;
+  }
   if (!prepare_to_send( MESSAGE_TYPE_ACCEPTED
                       | value_type(proposal.value.type)))
          { return; }
@@ -758,7 +842,7 @@ void Target::accepted(const Paxos::Proposal &proposal) {
   payload.end_slot   = proposal.slots.end();
   payload.term.copy_from(proposal.term);
   set_current_message_value(proposal.value);
-  handle_writeable();
+  queue_current_message();
 }
 
 Target::BoundPromiseSender::BoundPromiseSender(
@@ -847,14 +931,38 @@ Target::ProposedAndAcceptedSender::ProposedAndAcceptedSender(
   const NodeName                   &node_name,
         int                         fd,
   const Paxos::SlotRange           &slots,
-  const Paxos::Value::OffsetStream &stream)
+  const Paxos::Value::OffsetStream &stream,
+        SendfileShards             *shards,
+        TeeSink                    *tee_sink)
   : manager(manager),
     segment_cache(segment_cache),
     fd(fd),
     slots(slots),
-    stream(stream) {
+    stream(stream),
+    tee_sink(tee_sink),
+    shards(shards) {
   assert(slots.is_nonempty());
-  manager.modify_handler(fd, this, EPOLLOUT);
+  if (shards == NULL) {
+    manager.modify_handler(fd, this, EPOLLOUT);
+  } else {
+    /* The shard waits for the socket to be writeable, so only errors are
+     * reported here. */
+    waiting_to_be_writeable = false;
+    manager.modify_handler(fd, this, 0);
+    shard = shards->choose_shard();
+  }
+
+  // Pinned before any file is opened.
+  segment_cache.add_consumer(this);
+
+  if (!queue_extents(slots)) {
+    shutdown();
+    return;
+  }
+
+  if (shards != NULL) {
+    dispatch_job();
+  }
 }
 
 Target::ProposedAndAcceptedSender::~ProposedAndAcceptedSender() {
@@ -862,14 +970,178 @@ Target::ProposedAndAcceptedSender::~ProposedAndAcceptedSender() {
 }
 
 void Target::ProposedAndAcceptedSender::shutdown() {
+  if (job_in_flight) {
+    shards->cancel(job_token);
+    job_in_flight = false;
+  }
   manager.deregister_close_and_clear(fd);
   assert(fd == -1);
+
+  if (tee_sink != NULL) {
+    tee_sink->release(get_teed_bytes_queued());
+    tee_sink = NULL;
+  }
+
+  for (const auto &extent : extents) {
+    if (!extent.teed) {
+      close(extent.fd);
+    }
+  }
+  extents.clear();
+
+  segment_cache.remove_consumer(this);
+}
+
+Paxos::Slot
+Target::ProposedAndAcceptedSender::get_first_unconsumed_slot() const {
+  return slots.start();
+}
+
+uint64_t Target::ProposedAndAcceptedSender::get_teed_bytes_queued() const {
+  uint64_t teed_bytes = 0;
+  for (const auto &extent : extents) {
+    if (extent.teed) {
+      teed_bytes += extent.length;
+    }
+  }
+  return teed_bytes;
+}
+
+/* Stops claiming from the TeeSink, and gives back what is already claimed,
+   re-locating it in the segment files, so that another sender may claim. */
+void Target::ProposedAndAcceptedSender::release_teed_extents() {
+  if (tee_sink == NULL) {
+    return;
+  }
+
+  const uint64_t teed_bytes = get_teed_bytes_queued();
+  if (teed_bytes == 0) {
+    tee_sink = NULL;
+    return;
+  }
+
+  tee_sink->release(teed_bytes);
+  tee_sink = NULL;
+
+  for (const auto &extent : extents) {
+    if (!extent.teed) {
+      close(extent.fd);
+    }
+  }
+  extents.clear();
+
+  if (!queue_extents(slots)) {
+    shutdown();
+  }
 }
 
 bool Target::ProposedAndAcceptedSender::is_shutdown() const {
   return fd == -1;
 }
 
+bool Target::ProposedAndAcceptedSender::queue_extents
+      (const Paxos::SlotRange &new_slots) {
+  Paxos::SlotRange remaining = new_slots;
+
+  while (remaining.is_nonempty()) {
+    if (tee_sink != NULL) {
+      const uint64_t claimed = tee_sink->claim(stream, remaining);
+      if (0 < claimed) {
+        if (!extents.empty() && extents.back().teed) {
+          extents.back().length += claimed;
+        } else {
+          extents.push_back({
+            .fd        = -1,
+            .source_fd = -1,
+            .offset    = 0,
+            .length    = claimed,
+            .teed      = true});
+        }
+        remaining.truncate(remaining.start() + claimed);
+        continue;
+      }
+    }
+
+    int      file_fd;
+    off_t    file_offset;
+    uint64_t length;
+    if (!segment_cache.locate_accepted_data(stream, remaining,
+                                            file_fd, file_offset, length)) {
+      fprintf(stderr, "%s (fd=%d): matching CacheEntry not found\n",
+                      __PRETTY_FUNCTION__, fd);
+      return false;
+    }
+
+    if (!extents.empty()) {
+      auto &last = extents.back();
+      if (!last.teed && last.source_fd == file_fd
+          && last.offset + (off_t)last.length == file_offset) {
+        last.length += length;
+        remaining.truncate(remaining.start() + length);
+        continue;
+      }
+    }
+
+    int extent_fd = dup(file_fd);
+    if (extent_fd == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s (fd=%d): dup() failed\n", __PRETTY_FUNCTION__, fd);
+      return false;
+    }
+
+    extents.push_back({
+      .fd        = extent_fd,
+      .source_fd = file_fd,
+      .offset    = file_offset,
+      .length    = length,
+      .teed      = false});
+    remaining.truncate(remaining.start() + length);
+  }
+
+  return true;
+}
+
+void Target::ProposedAndAcceptedSender::consume(uint64_t bytes) {
+  slots.truncate(slots.start() + bytes);
+
+  bool closed_file = false;
+  while (0 < bytes) {
+    assert(!extents.empty());
+    auto &extent = extents.front();
+    const uint64_t from_extent = std::min(bytes, extent.length);
+    extent.offset += from_extent;
+    extent.length -= from_extent;
+    bytes         -= from_extent;
+    if (extent.length == 0) {
+      if (!extent.teed) {
+        close(extent.fd);
+        closed_file = true;
+      }
+      extents.pop_front();
+    }
+  }
+
+  // The pin only needs to move on once a file is closed.
+  if (closed_file) {
+    segment_cache.consumers_progressed();
+  }
+}
+
+void Target::ProposedAndAcceptedSender::set_cork(bool cork) {
+  if (corked == cork) {
+    return;
+  }
+  int value = cork ? 1 : 0;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof value) == -1) {
+    // Only an optimisation, and fails harmlessly on non-TCP sockets.
+#ifndef NTRACE
+    perror(__PRETTY_FUNCTION__);
+#endif // ndef NTRACE
+    return;
+  }
+  corked = cork;
+}
+
 void Target::ProposedAndAcceptedSender::handle_error(const uint32_t events) {
   fprintf(stderr, "%s (fd=%d, events=%x): unexpected\n",
                   __PRETTY_FUNCTION__, fd, events);
@@ -884,47 +1156,65 @@ void Target::ProposedAndAcceptedSender::handle_readable() {
 
 void Target::ProposedAndAcceptedSender::handle_writeable() {
 #ifndef NTRACE
-  printf("%s (fd=%d): writing [%lu,%lu)\n",
-    __PRETTY_FUNCTION__, fd, slots.start(), slots.end());
+  printf("%s (fd=%d): writing [%lu,%lu) in %lu extents\n",
+    __PRETTY_FUNCTION__, fd, slots.start(), slots.end(), extents.size());
 #endif // def NTRACE
 
   if (fd == -1) {
     return;
   }
 
-  auto write_result
-    = segment_cache.write_accepted_data_to(fd, stream, slots);
+  if (shards != NULL) {
+    dispatch_job();
+    return;
+  }
 
-  switch(write_result) {
-    case SegmentCache::WriteAcceptedDataResult::succeeded:
-#ifndef NTRACE
-      printf("%s (fd=%d): still-to-write [%lu,%lu)\n",
-        __PRETTY_FUNCTION__, fd, slots.start(), slots.end());
-#endif // def NTRACE
-      if (waiting_to_be_writeable && slots.is_empty()) {
-        waiting_to_be_writeable = false;
-        manager.modify_handler(fd, this, 0);
-      }
-      break;
+  while (!extents.empty()) {
+    // Hold back the partial packet at the end of one extent until the next
+    // has been written after it.
+    set_cork(1 < extents.size());
 
-    case SegmentCache::WriteAcceptedDataResult::blocked:
+    auto &extent = extents.front();
+    ssize_t sendfile_result;
+    if (extent.teed) {
+      sendfile_result = tee_sink->send_claimed(fd, extent.length);
+    } else {
+      off_t offset = extent.offset;
+      sendfile_result = sendfile(fd, extent.fd, &offset, extent.length);
+    }
+
+    if (sendfile_result == -1) {
+      if (errno == EAGAIN) {
 #ifndef NTRACE
-      printf("%s (fd=%d): blocked, still-to-write [%lu,%lu)\n",
-        __PRETTY_FUNCTION__, fd, slots.start(), slots.end());
+        printf("%s (fd=%d): blocked, still-to-write [%lu,%lu)\n",
+          __PRETTY_FUNCTION__, fd, slots.start(), slots.end());
 #endif // def NTRACE
-      if (!waiting_to_be_writeable) {
-        waiting_to_be_writeable = true;
-        manager.modify_handler(fd, this, EPOLLOUT);
+        if (!waiting_to_be_writeable) {
+          waiting_to_be_writeable = true;
+          manager.modify_handler(fd, this, EPOLLOUT);
+        }
+        return;
       }
-      break;
 
-    case SegmentCache::WriteAcceptedDataResult::failed:
-#ifndef NTRACE
-      printf("%s (fd=%d): write failed, shutting down\n",
-        __PRETTY_FUNCTION__, fd);
-#endif // def NTRACE
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s (fd=%d): send failed, shutting down\n",
+                      __PRETTY_FUNCTION__, fd);
       shutdown();
-       break;
+      return;
+    }
+
+    assert(0 < sendfile_result);
+    consume(sendfile_result);
+  }
+
+  assert(slots.is_empty());
+  set_cork(false);
+
+  if (expired) {
+    shutdown();
+  } else if (waiting_to_be_writeable) {
+    waiting_to_be_writeable = false;
+    manager.modify_handler(fd, this, 0);
   }
 }
 
@@ -944,21 +1234,356 @@ bool Target::ProposedAndAcceptedSender::send(
 
   assert(proposal_slots.is_nonempty());
 
-  if  (proposal_stream.name.owner != stream.name.owner
+  if  (fd == -1
+    || proposal_stream.name.owner != stream.name.owner
     || proposal_stream.name.id    != stream.name.id
     || proposal_stream.offset     != stream.offset
     || proposal_slots.start()     != slots.end()) {
       return false;
   }
 
+  if (!queue_extents(proposal_slots)) {
+    shutdown();
+    return false;
+  }
   slots.set_end(proposal_slots.end());
 
-  if (!waiting_to_be_writeable) {
+  if (shards != NULL) {
+    dispatch_job();
+  } else if (!waiting_to_be_writeable) {
     handle_writeable();
   }
 
   return true;
 }
 
+void Target::ProposedAndAcceptedSender::dispatch_job() {
+  assert(shards != NULL);
+  if (fd == -1 || job_in_flight || extents.empty()) {
+    return;
+  }
+
+  const auto &extent = extents.front();
+
+#ifndef NTRACE
+  printf("%s (fd=%d): dispatching %lu bytes to shard %lu\n",
+    __PRETTY_FUNCTION__, fd, extent.length, shard);
+#endif // def NTRACE
+
+  job_token     = shards->dispatch(this, shard, fd,
+                                   extent.fd, extent.offset, extent.length);
+  job_in_flight = true;
+}
+
+void Target::ProposedAndAcceptedSender::sendfile_completed
+      (uint64_t bytes_sent, bool failed) {
+  assert(job_in_flight);
+  job_in_flight = false;
+
+  if (failed) {
+#ifndef NTRACE
+    printf("%s (fd=%d): write failed, shutting down\n",
+      __PRETTY_FUNCTION__, fd);
+#endif // def NTRACE
+    shutdown();
+    return;
+  }
+
+  consume(bytes_sent);
+
+  if (expired && slots.is_empty()) {
+    shutdown();
+  } else {
+    dispatch_job();
+  }
+}
+
+void Target::ProposedAndAcceptedSender::expire() {
+  expired = true;
+  release_teed_extents();
+  if (fd != -1 && slots.is_empty() && !job_in_flight) {
+    shutdown();
+  }
+}
+
+
+Target::CatchUpSender::CatchUpSender(
+        Epoll::Manager             &manager,
+        SegmentCache               &segment_cache,
+        int                         fd,
+  const Paxos::Slot                &end_slot,
+        uint64_t                    bytes_per_second)
+  : manager(manager),
+    segment_cache(segment_cache),
+    fd(fd),
+    bytes_per_second(bytes_per_second),
+    budget(TARGET_CATCH_UP_CHUNK_SIZE),
+    budget_updated(manager.get_current_time()) {
+
+  segment_cache.get_chosen_segments(end_slot, segments);
+  segment_cache.add_consumer(this);
+
+  if (start_next_segment()) {
+    manager.modify_handler(fd, this, EPOLLOUT);
+  } else {
+    shutdown();
+  }
+}
+
+Target::CatchUpSender::~CatchUpSender() {
+  shutdown();
+}
+
+void Target::CatchUpSender::shutdown() {
+  close_segment();
+  manager.cancel_timer(this);
+  manager.deregister_close_and_clear(fd);
+  assert(fd == -1);
+  next_segment = segments.size();
+  segment_cache.remove_consumer(this);
+}
+
+void Target::CatchUpSender::close_segment() {
+  if (segment_fd != -1) {
+    close(segment_fd);
+    segment_fd = -1;
+  }
+}
+
+bool Target::CatchUpSender::is_shutdown() const {
+  return fd == -1;
+}
+
+Paxos::Slot Target::CatchUpSender::get_first_unconsumed_slot() const {
+  if (next_segment < segments.size()) {
+    return segments[next_segment].slots.start();
+  }
+  return std::numeric_limits<Paxos::Slot>::max();
+}
+
+bool Target::CatchUpSender::start_next_segment() {
+  close_segment();
+
+  while (next_segment < segments.size()) {
+    const auto &segment = segments[next_segment];
+
+    segment_fd = open(segment.path.c_str(), O_RDONLY);
+    if (segment_fd == -1) {
+      // Reclaimed before it was pinned, so the peer must do without it.
+#ifndef NTRACE
+      printf("%s (fd=%d): %s no longer retained\n",
+        __PRETTY_FUNCTION__, fd, segment.path.c_str());
+#endif // ndef NTRACE
+      next_segment += 1;
+      continue;
+    }
+
+    offer.stream_owner  = segment.stream.name.owner;
+    offer.stream_id     = segment.stream.name.id;
+    offer.stream_offset = segment.stream.offset;
+    offer.start_slot    = segment.slots.start();
+    offer.end_slot      = segment.slots.end();
+    offer.term.copy_from(segment.term);
+
+    offer_bytes_sent      = 0;
+    resume_bytes_received = 0;
+    state                 = State::sending_offer;
+    return true;
+  }
+
+  return false;
+}
+
+void Target::CatchUpSender::handle_error(const uint32_t events) {
+  fprintf(stderr, "%s (fd=%d, events=%x): unexpected\n",
+                  __PRETTY_FUNCTION__, fd, events);
+  shutdown();
+}
+
+void Target::CatchUpSender::handle_writeable() {
+  if (fd == -1) {
+    return;
+  }
+
+  switch (state) {
+    case State::sending_offer:
+      send_offer();
+      break;
+    case State::sending_data:
+      send_data();
+      break;
+    case State::awaiting_resume:
+      break;
+  }
+}
+
+void Target::CatchUpSender::send_offer() {
+  const uint8_t *ptr = reinterpret_cast<const uint8_t*>(&offer);
+
+  ssize_t write_result = write(fd, ptr + offer_bytes_sent,
+                                   sizeof offer - offer_bytes_sent);
+  if (write_result == -1) {
+    if (errno == EAGAIN) {
+      manager.modify_handler(fd, this, EPOLLOUT);
+      return;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s (fd=%d): write() failed\n", __PRETTY_FUNCTION__, fd);
+    shutdown();
+    return;
+  }
+
+  offer_bytes_sent += write_result;
+  if (offer_bytes_sent == sizeof offer) {
+    state = State::awaiting_resume;
+    manager.modify_handler(fd, this, EPOLLIN);
+  } else {
+    manager.modify_handler(fd, this, EPOLLOUT);
+  }
+}
+
+void Target::CatchUpSender::handle_readable() {
+  if (fd == -1) {
+    return;
+  }
+
+  if (state != State::awaiting_resume) {
+    fprintf(stderr, "%s (fd=%d): unexpected\n", __PRETTY_FUNCTION__, fd);
+    shutdown();
+    return;
+  }
+
+  uint8_t *ptr = reinterpret_cast<uint8_t*>(&resume);
+  ssize_t read_result = read(fd, ptr + resume_bytes_received,
+                                 sizeof resume - resume_bytes_received);
+  if (read_result == -1) {
+    if (errno == EAGAIN) {
+      return;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s (fd=%d): read() failed\n", __PRETTY_FUNCTION__, fd);
+    shutdown();
+    return;
+  }
+
+  if (read_result == 0) {
+#ifndef NTRACE
+    printf("%s (fd=%d): EOF\n", __PRETTY_FUNCTION__, fd);
+#endif // ndef NTRACE
+    shutdown();
+    return;
+  }
+
+  resume_bytes_received += read_result;
+  if (resume_bytes_received < sizeof resume) {
+    return;
+  }
+
+  if (resume.resume_slot < offer.start_slot
+      || offer.end_slot < resume.resume_slot) {
+    fprintf(stderr, "%s (fd=%d): resume slot %lu outside [%lu,%lu)\n",
+                    __PRETTY_FUNCTION__, fd, resume.resume_slot,
+                    offer.start_slot, offer.end_slot);
+    shutdown();
+    return;
+  }
+
+#ifndef NTRACE
+  printf("%s (fd=%d): sending [%lu,%lu) of [%lu,%lu)\n",
+    __PRETTY_FUNCTION__, fd, resume.resume_slot, offer.end_slot,
+    offer.start_slot, offer.end_slot);
+#endif // ndef NTRACE
+
+  send_offset    = resume.resume_slot - offer.start_slot;
+  send_remaining = offer.end_slot     - resume.resume_slot;
+  state          = State::sending_data;
+  manager.modify_handler(fd, this, EPOLLOUT);
+}
+
+void Target::CatchUpSender::refill_budget() {
+  const auto now = manager.get_current_time();
+  if (budget_updated < now) {
+    const uint64_t elapsed_us = std::chrono::duration_cast
+      <std::chrono::microseconds>(now - budget_updated).count();
+    budget = std::min<uint64_t>(TARGET_CATCH_UP_CHUNK_SIZE,
+                   budget + elapsed_us * bytes_per_second / 1000000);
+    budget_updated = now;
+  }
+}
+
+/* Sends at most one chunk per call, so a large segment does not hold up the
+ * rest of the event loop. */
+void Target::CatchUpSender::send_data() {
+  if (0 < send_remaining) {
+    const size_t chunk = std::min<uint64_t>(send_remaining,
+                                            TARGET_CATCH_UP_CHUNK_SIZE);
+
+    if (0 < bytes_per_second) {
+      refill_budget();
+      if (budget < chunk) {
+        /* Sleep until there is budget for the whole chunk, rather than
+         * trickling out whatever has accrued since the last wakeup. */
+        const uint64_t wait_us
+          = (chunk - budget) * 1000000 / bytes_per_second + 1;
+        manager.modify_handler(fd, this, 0);
+        manager.schedule_timer(this, manager.get_current_time()
+                                   + std::chrono::microseconds(wait_us));
+        waiting_for_budget = true;
+        return;
+      }
+    }
+
+    ssize_t sendfile_result = sendfile(fd, segment_fd, &send_offset, chunk);
+    if (sendfile_result == -1) {
+      if (errno == EAGAIN) {
+        return;
+      }
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s (fd=%d): sendfile() failed\n",
+                      __PRETTY_FUNCTION__, fd);
+      shutdown();
+      return;
+    }
+
+    if (sendfile_result == 0) {
+      fprintf(stderr, "%s (fd=%d): segment truncated with %lu bytes to go\n",
+                      __PRETTY_FUNCTION__, fd, send_remaining);
+      shutdown();
+      return;
+    }
+
+    send_remaining -= sendfile_result;
+    if (0 < bytes_per_second) {
+      budget -= sendfile_result;
+    }
+
+    if (0 < send_remaining) {
+      return;
+    }
+  }
+
+  // Closed before it is unpinned, since it may then be recycled.
+  close_segment();
+  next_segment += 1;
+  segment_cache.consumers_progressed();
+
+  if (start_next_segment()) {
+    send_offer();
+  } else {
+#ifndef NTRACE
+    printf("%s (fd=%d): all segments sent\n", __PRETTY_FUNCTION__, fd);
+#endif // ndef NTRACE
+    shutdown();
+  }
+}
+
+void Target::CatchUpSender::handle_timeout() {
+  if (fd == -1 || !waiting_for_budget) {
+    return;
+  }
+  waiting_for_budget = false;
+  manager.modify_handler(fd, this, EPOLLOUT);
+}
+
 
 }}
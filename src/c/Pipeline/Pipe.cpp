@@ -23,6 +23,7 @@
 #include "Pipeline/Peer/Socket.h"
 #include "Pipeline/LocalAcceptor.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -69,6 +70,21 @@ void Pipe<Upstream>::WriteEnd::handle_error(const uint32_t events) {
   abort();
 }
 
+template<class Upstream>
+void Pipe<Upstream>::Committer::handle_deferred() {
+  pipe.commit();
+}
+
+template<class Upstream>
+void Pipe<Upstream>::Syncer::handle_synced() {
+  pipe.handle_synced();
+}
+
+template<class Upstream>
+void Pipe<Upstream>::Splicer::handle_spliced(int32_t result) {
+  pipe.handle_spliced(result);
+}
+
 template<class Upstream>
 void Pipe<Upstream>::handle_readable() {
   if (pipe_fds[0] == -1) {
@@ -76,84 +92,357 @@ void Pipe<Upstream>::handle_readable() {
     return;
   }
 
-  if (!upstream.ok_to_write_data(next_stream_pos)) {
-    fprintf(stderr, "%s: cancelled by upstream\n", __PRETTY_FUNCTION__);
-    unclean_shutdown();
-    upstream.downstream_closed();
+  if (waiting_for_upstream) {
     return;
   }
 
-  const Paxos::Term &term_for_next_write
-    = upstream.get_term_for_next_write();
-  const Paxos::Value::StreamOffset offset_for_next_write
-    = upstream.get_offset_for_next_write(next_stream_pos);
+  if (std::min<uint64_t>(PIPE_GROUP_COMMIT_BYTES, pipe_size / 4)
+        <= bytes_in_pipe) {
+    commit();
+  } else {
+    schedule_commit();
+  }
+}
 
-  if (current_segment != NULL
-        && (current_segment->get_term()          != term_for_next_write
-         || current_segment->get_stream_offset() != offset_for_next_write)) {
-    delete current_segment;
-    current_segment = NULL;
+template<class Upstream>
+void Pipe<Upstream>::schedule_commit() {
+  if (commit_scheduled) {
+    return;
   }
+  commit_scheduled = true;
+
+#if PIPE_GROUP_COMMIT_MILLISECONDS > 0
+  /* Stop watching the read end until the commit, or else wait() would return
+   * immediately each time while there is still data in the pipe. */
+  manager.modify_handler(pipe_fds[0], &read_end, 0);
+  manager.defer(&committer, std::chrono::steady_clock::now()
+    + std::chrono::milliseconds(PIPE_GROUP_COMMIT_MILLISECONDS));
+#else // PIPE_GROUP_COMMIT_MILLISECONDS > 0
+  manager.defer(&committer);
+#endif // PIPE_GROUP_COMMIT_MILLISECONDS > 0
+}
 
-  if (current_segment == NULL) {
-    Paxos::Value::OffsetStream os = {.name = stream, .offset = offset_for_next_write};
-    current_segment = new Segment(segment_cache, node_name, acceptor_id, os,
-        term_for_next_write, next_stream_pos);
-  } else {
-    assert(!current_segment->is_shutdown());
+template<class Upstream>
+void Pipe<Upstream>::cancel_commit() {
+  if (!commit_scheduled) {
+    return;
   }
+  commit_scheduled = false;
+  manager.cancel_deferred(&committer);
 
-  assert(current_segment->get_next_stream_pos() == next_stream_pos);
+#if PIPE_GROUP_COMMIT_MILLISECONDS > 0
+  if (pipe_fds[0] != -1) {
+    manager.modify_handler(pipe_fds[0], &read_end, EPOLLIN);
+  }
+#endif // PIPE_GROUP_COMMIT_MILLISECONDS > 0
+}
 
-  ssize_t splice_result = splice(
-    pipe_fds[0], NULL, current_segment->get_fd(), NULL,
-    current_segment->get_remaining_space(),
-    SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+template<class Upstream>
+void Pipe<Upstream>::commit() {
+  cancel_commit();
+
+  while (pipe_fds[0] != -1 && !eof_after_syncs && bytes_being_spliced == 0) {
+    if (!upstream.ready_to_write_data()) {
+      /* Stop watching the read end, which will remain readable, until the
+       * upstream is ready. */
+      waiting_for_upstream = true;
+      manager.modify_handler(pipe_fds[0], &read_end, 0);
+      return;
+    }
 
-  if (splice_result == -1) {
-    if (errno == EAGAIN) {
+    if (!upstream.ok_to_write_data(next_synced_stream_pos)) {
+      fprintf(stderr, "%s: cancelled by upstream\n", __PRETTY_FUNCTION__);
+      unclean_shutdown();
+      upstream.downstream_closed();
       return;
     }
-    perror(__PRETTY_FUNCTION__);
-    fprintf(stderr, "%s: splice() failed\n", __PRETTY_FUNCTION__);
-    abort();
-  } else if (splice_result == 0) {
-    printf("%s: EOF\n", __PRETTY_FUNCTION__);
-    shutdown();
-    upstream.downstream_closed();
-  } else {
-    assert(splice_result > 0);
 
+    const Paxos::Term &term_for_next_write
+      = upstream.get_term_for_next_write();
+    const Paxos::Value::StreamOffset offset_for_next_write
+      = upstream.get_offset_for_next_write(next_synced_stream_pos);
+
+    if (current_segment != NULL
+          && (current_segment->get_term()          != term_for_next_write
+           || current_segment->get_stream_offset() != offset_for_next_write)) {
+      delete current_segment;
+      current_segment = NULL;
+    }
+
+    if (current_segment == NULL) {
+      Paxos::Value::OffsetStream os = {.name = stream, .offset = offset_for_next_write};
+      current_segment = new Segment(segment_cache, node_name, acceptor_id, os,
+          term_for_next_write, next_stream_pos);
+    } else {
+      assert(!current_segment->is_shutdown());
+    }
+
+    assert(current_segment->get_next_stream_pos() == next_stream_pos);
+
+    /* Move everything that is known to be in the pipe (or at least try once,
+     * to detect EOF) into the segment, then sync it all with one barrier. */
+    const uint64_t remaining_space = current_segment->get_remaining_space();
+
+    /* Duplicate the data for any followers first, since splicing it into the
+     * segment consumes it. */
+    if (tee_sinks != NULL && 0 < bytes_in_pipe) {
+      const Paxos::Value::OffsetStream os
+        = {.name = stream, .offset = offset_for_next_write};
+      for (auto sink : *tee_sinks) {
+        sink->tee_from(pipe_fds[0], os, next_stream_pos + offset_for_next_write,
+                       std::min(bytes_in_pipe, remaining_space));
+      }
+    }
+
+    /* The data known to be in the pipe can be spliced in the background, but
+     * EOF can only be detected by trying. */
 #ifndef NFSYNC
-    int fsync_result = fsync(current_segment->get_fd());
-    if (fsync_result == -1) {
-      perror(__PRETTY_FUNCTION__);
-      fprintf(stderr, "%s: fsync() failed\n", __PRETTY_FUNCTION__);
-      abort();
+    const bool splice_in_background = 0 < bytes_in_pipe
+                                   && manager.can_splice_in_background()
+                                   && !current_segment->is_direct();
+#else // ndef NFSYNC
+    const bool splice_in_background = false;
+#endif // ndef NFSYNC
+
+    uint64_t bytes_written = 0;
+    bool     reached_eof   = false;
+    if (splice_in_background) {
+      bytes_written = std::min(bytes_in_pipe, remaining_space);
+    }
+    while (!splice_in_background
+       && bytes_written < remaining_space
+       && (bytes_written == 0 || bytes_written < bytes_in_pipe)) {
+
+      loff_t file_offset = current_segment->get_used_size() + bytes_written;
+      ssize_t splice_result = current_segment->is_direct()
+        ? current_segment->read_direct(pipe_fds[0],
+                                       remaining_space - bytes_written)
+        : splice(pipe_fds[0], NULL, current_segment->get_fd(), &file_offset,
+                 remaining_space - bytes_written,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+
+      if (splice_result == -1) {
+        if (errno == EAGAIN) {
+          break;
+        }
+        perror(__PRETTY_FUNCTION__);
+        fprintf(stderr, "%s: splice() failed\n", __PRETTY_FUNCTION__);
+        abort();
+      } else if (splice_result == 0) {
+        reached_eof = true;
+        break;
+      }
+
+      assert(splice_result > 0);
+      bytes_written += splice_result;
+    }
+
+    if (tee_sinks != NULL) {
+      for (auto sink : *tee_sinks) {
+        sink->trim_last(bytes_written);
+      }
     }
+
+    adapt_pipe_size();
+
+    bool segment_full = false;
+    if (bytes_written > 0) {
+      assert(bytes_written <= bytes_in_pipe);
+      bytes_in_pipe -= bytes_written;
+      unsynced_writes.push_back({
+        .start_pos  = next_stream_pos,
+        .byte_count = bytes_written,
+        .term       = term_for_next_write,
+        .offset     = offset_for_next_write});
+      next_stream_pos += bytes_written;
+
+#ifndef NFSYNC
+      current_segment->sync_directories_in_background(manager);
+      if (splice_in_background) {
+        /* Stop watching the read end, which will remain readable, until the
+         * splice has completed. */
+        bytes_being_spliced = bytes_written;
+        manager.modify_handler(pipe_fds[0], &read_end, 0);
+        manager.splice_and_sync_in_background(pipe_fds[0],
+          current_segment->get_fd(), current_segment->get_used_size(),
+          bytes_written, &splicer, &syncer);
+      } else if (current_segment->is_direct()) {
+        current_segment->write_direct_in_background(manager, &syncer);
+      } else {
+        manager.sync_in_background(current_segment->get_fd(), &syncer);
+      }
+#else // ndef NFSYNC
+      if (current_segment->is_direct()) {
+        current_segment->write_direct_in_background(manager, NULL);
+      }
 #endif // ndef NFSYNC
 
-    uint64_t bytes_sent = splice_result;
-    assert(bytes_sent <= bytes_in_pipe);
-    bytes_in_pipe -= bytes_sent;
-    uint64_t old_next_stream_pos = next_stream_pos;
-    next_stream_pos += bytes_sent;
-    current_segment->record_bytes_in(bytes_sent);
+      const uint64_t start_pos      = next_stream_pos - bytes_written;
+      const bool     written_in_place = !splice_in_background
+                                     && !current_segment->is_direct();
+      current_segment->record_bytes_in(bytes_written);
+      if (written_in_place) {
+        upstream.downstream_wrote_unsynced_bytes(start_pos, bytes_written);
+      }
+      if (current_segment->is_shutdown()) {
+        segment_full = true;
+        close_current_segment();
+      }
+
+#ifdef NFSYNC
+      handle_synced();
+#endif // def NFSYNC
+    }
 
-    if (current_segment->is_shutdown()) {
-      close_current_segment();
+    if (reached_eof) {
+      if (unsynced_writes.empty()) {
+        printf("%s: EOF\n", __PRETTY_FUNCTION__);
+        shutdown();
+        upstream.downstream_closed();
+      } else {
+        /* Stop watching the read end, which will remain readable, and finish
+         * shutting down when the last outstanding sync completes. */
+        eof_after_syncs = true;
+        manager.modify_handler(pipe_fds[0], &read_end, 0);
+      }
+      return;
     }
 
-    upstream.downstream_wrote_bytes(old_next_stream_pos, bytes_sent);
+    if (!segment_full || bytes_in_pipe == 0) {
+      return;
+    }
   }
 }
 
+template<class Upstream>
+void Pipe<Upstream>::upstream_became_ready() {
+  if (!waiting_for_upstream) {
+    return;
+  }
+  waiting_for_upstream = false;
+
+  if (pipe_fds[0] != -1) {
+    manager.modify_handler(pipe_fds[0], &read_end, EPOLLIN);
+    schedule_commit();
+  }
+}
+
+template<class Upstream>
+void Pipe<Upstream>::handle_synced() {
+  assert(!unsynced_writes.empty());
+  const UnsyncedWrite write = unsynced_writes.front();
+  unsynced_writes.pop_front();
+  assert(write.start_pos == next_synced_stream_pos);
+
+  /* Something else may have happened while waiting for the sync that means
+   * this data can no longer be used as intended. */
+  if (!upstream.ok_to_write_data(write.start_pos)
+      || upstream.get_term_for_next_write() != write.term
+      || upstream.get_offset_for_next_write(write.start_pos) != write.offset) {
+    fprintf(stderr, "%s: cancelled by upstream\n", __PRETTY_FUNCTION__);
+    unclean_shutdown();
+    upstream.downstream_closed();
+    return;
+  }
+
+  next_synced_stream_pos += write.byte_count;
+  upstream.downstream_wrote_bytes(write.start_pos, write.byte_count);
+
+  if (eof_after_syncs && unsynced_writes.empty() && !is_shutdown()) {
+    printf("%s: EOF\n", __PRETTY_FUNCTION__);
+    shutdown();
+    upstream.downstream_closed();
+  }
+}
+
+template<class Upstream>
+void Pipe<Upstream>::handle_spliced(int32_t result) {
+  assert(0 < bytes_being_spliced);
+  if (result < 0 || (uint64_t)result != bytes_being_spliced) {
+    if (result < 0) {
+      errno = -result;
+      perror(__PRETTY_FUNCTION__);
+    }
+    fprintf(stderr, "%s: splice() of %lu bytes returned %d\n",
+                    __PRETTY_FUNCTION__, bytes_being_spliced, result);
+    abort();
+  }
+  bytes_being_spliced = 0;
+
+  /* The spliced write is the latest, and is still waiting for its sync. */
+  if (!unsynced_writes.empty()) {
+    const UnsyncedWrite &write = unsynced_writes.back();
+    if (upstream.get_term_for_next_write() == write.term
+        && upstream.get_offset_for_next_write(next_synced_stream_pos)
+             == write.offset) {
+      upstream.downstream_wrote_unsynced_bytes(write.start_pos,
+                                               write.byte_count);
+    }
+  }
+
+  if (pipe_fds[0] != -1 && !waiting_for_upstream && !eof_after_syncs) {
+    manager.modify_handler(pipe_fds[0], &read_end, EPOLLIN);
+  }
+}
+
+template<class Upstream>
+void Pipe<Upstream>::cancel_syncs() {
+  manager.cancel_syncs(&syncer);
+  manager.cancel_splices(&splicer);
+  bytes_being_spliced = 0;
+  unsynced_writes.clear();
+}
+
 template<class Upstream>
 void Pipe<Upstream>::handle_writeable() {
-  manager.modify_handler(pipe_fds[1], &write_end, 0);
+  if (manager.is_edge_triggered()) {
+    if (!waiting_for_space) {
+      return;
+    }
+    waiting_for_space = false;
+  } else {
+    manager.modify_handler(pipe_fds[1], &write_end, 0);
+  }
   upstream.downstream_became_writeable();
 }
 
+/* Called just after draining the pipe, which is when resizing it is
+   cheapest, and when shrinking is least likely to find it too full. */
+template<class Upstream>
+void Pipe<Upstream>::adapt_pipe_size() {
+  auto &budget = PipeBudget::shared();
+
+  if (found_full) {
+    found_full = false;
+    if (pipe_size < PIPE_MAX_SIZE) {
+      pipe_size = budget.resize(pipe_fds[0], pipe_size,
+                                std::min<uint64_t>(PIPE_MAX_SIZE, pipe_size * 2));
+    }
+    peak_bytes_in_pipe    = 0;
+    resize_interval_start = manager.get_current_time();
+    return;
+  }
+
+  const auto now = manager.get_current_time();
+  if (now < resize_interval_start
+          + std::chrono::milliseconds(PIPE_RESIZE_INTERVAL_MILLISECONDS)) {
+    return;
+  }
+
+  if (PIPE_MIN_SIZE < pipe_size && peak_bytes_in_pipe < pipe_size / 4) {
+    pipe_size = budget.resize(pipe_fds[0], pipe_size,
+                              std::max<uint64_t>(PIPE_MIN_SIZE, pipe_size / 2));
+  }
+  peak_bytes_in_pipe    = 0;
+  resize_interval_start = now;
+}
+
+template<class Upstream>
+void Pipe<Upstream>::release_pipe_size() {
+  PipeBudget::shared().release(pipe_size);
+  pipe_size = 0;
+}
+
 template<class Upstream>
 void Pipe<Upstream>::close_current_segment() {
   if (current_segment != NULL) {
@@ -167,8 +456,11 @@ void Pipe<Upstream>::shutdown () {
 #ifndef NTRACE
   printf("%s: fds=[%d,%d]\n", __PRETTY_FUNCTION__, pipe_fds[0], pipe_fds[1]);
 #endif // ndef NTRACE
+  cancel_commit();
+  cancel_syncs();
   close_current_segment();
   assert(bytes_in_pipe == 0);
+  release_pipe_size();
   manager.deregister_close_and_clear(pipe_fds[1]);
   manager.deregister_close_and_clear(pipe_fds[0]);
 }
@@ -178,7 +470,10 @@ void Pipe<Upstream>::unclean_shutdown () {
 #ifndef NTRACE
   printf("%s: fds=[%d,%d]\n", __PRETTY_FUNCTION__, pipe_fds[0], pipe_fds[1]);
 #endif // ndef NTRACE
+  cancel_commit();
+  cancel_syncs();
   close_current_segment();
+  release_pipe_size();
   manager.deregister_close_and_clear(pipe_fds[1]);
   manager.deregister_close_and_clear(pipe_fds[0]);
   bytes_in_pipe = 0;
@@ -200,8 +495,13 @@ Pipe<Upstream>::Pipe
     acceptor_id     (acceptor_id),
     stream          (stream),
     next_stream_pos (first_stream_pos),
+    next_synced_stream_pos (first_stream_pos),
     read_end        (ReadEnd(*this)),
-    write_end       (WriteEnd(*this)) {
+    write_end       (WriteEnd(*this)),
+    committer       (Committer(*this)),
+    syncer          (Syncer(*this)),
+    splicer         (Splicer(*this)),
+    resize_interval_start (manager.get_current_time()) {
 
   if (pipe2(pipe_fds, O_NONBLOCK) == -1) {
     perror(__PRETTY_FUNCTION__);
@@ -209,21 +509,19 @@ Pipe<Upstream>::Pipe
     abort();
   }
 
-  if (fcntl(pipe_fds[0], F_SETPIPE_SZ, PIPE_SIZE) == -1) {
-    perror(__PRETTY_FUNCTION__);
-    fprintf(stderr, "%s: fcntl(F_SETPIPE_SZ) failed\n", __PRETTY_FUNCTION__);
-    abort();
-  }
+  pipe_size = PipeBudget::shared().acquire(pipe_fds[0], PIPE_MIN_SIZE);
 
 #ifndef NTRACE
   std::cout << __PRETTY_FUNCTION__ << ": "
             << stream << "/" << first_stream_pos << " "
-            << "fds=[" << pipe_fds[0] << "," << pipe_fds[1] << "]"
+            << "fds=[" << pipe_fds[0] << "," << pipe_fds[1] << "] "
+            << "size=" << pipe_size
             << std::endl;
 #endif // ndef NTRACE
 
   manager.register_handler(pipe_fds[0], &read_end,  EPOLLIN);
-  manager.register_handler(pipe_fds[1], &write_end, 0);
+  manager.register_handler(pipe_fds[1], &write_end,
+                           manager.is_edge_triggered() ? EPOLLOUT | EPOLLET : 0);
 }
 
 template<class Upstream>
@@ -251,18 +549,28 @@ template<class Upstream>
 void Pipe<Upstream>::wait_until_writeable() {
   assert(!is_shutdown());
   assert(pipe_fds[1] != -1);
-  manager.modify_handler(pipe_fds[1], &write_end, EPOLLOUT);
+  // Grown at the next commit, which drains it.
+  found_full = true;
+  if (manager.is_edge_triggered()) {
+    /* The upstream just saw EAGAIN, so the pipe is full and the reader will
+     * trigger another edge when it makes space. */
+    waiting_for_space = true;
+  } else {
+    manager.modify_handler(pipe_fds[1], &write_end, EPOLLOUT);
+  }
 }
 
 template<class Upstream>
 void Pipe<Upstream>::record_bytes_in(uint64_t bytes) {
   assert(!is_shutdown());
   bytes_in_pipe += bytes;
+  peak_bytes_in_pipe = std::max(peak_bytes_in_pipe, bytes_in_pipe);
 }
 
 template class Pipe<Client::Socket>;
 template class Pipe<Peer::Socket::ProposalReceiver>;
 template class Pipe<Peer::Socket::PromiseReceiver>;
+template class Pipe<Peer::Socket::CatchUpReceiver>;
 template class Pipe<LocalAcceptor>;
 
 }
@@ -0,0 +1,103 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/PipeBudget.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace Pipeline {
+
+PipeBudget &PipeBudget::shared() {
+  static PipeBudget budget;
+  return budget;
+}
+
+uint64_t PipeBudget::acquire(int fd, uint64_t wanted_size) {
+  int current_size = fcntl(fd, F_GETPIPE_SZ);
+  if (current_size == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fcntl(F_GETPIPE_SZ) failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+  allocated += current_size;
+  return resize(fd, current_size, wanted_size);
+}
+
+uint64_t PipeBudget::resize(int fd, uint64_t current_size, uint64_t wanted_size) {
+  const bool growing = current_size < wanted_size;
+  if (growing) {
+    const uint64_t available = allocated < limit ? limit - allocated : 0;
+    wanted_size = std::min(wanted_size, current_size + available);
+    wanted_size = std::min(wanted_size, ceiling);
+  }
+
+  /* The kernel rounds sizes up to a power of two pages, so ask for a power
+   * of two to stay within the budget. */
+  uint64_t attempt_size = 1;
+  while (attempt_size * 2 <= wanted_size) {
+    attempt_size *= 2;
+  }
+
+  while (growing ? current_size < attempt_size : attempt_size < current_size) {
+    int fcntl_result = fcntl(fd, F_SETPIPE_SZ, attempt_size);
+    if (fcntl_result != -1) {
+      allocated = allocated + fcntl_result - current_size;
+      if (current_size < (uint64_t)fcntl_result) {
+        grow_count += 1;
+      } else {
+        shrink_count += 1;
+      }
+      return fcntl_result;
+    }
+
+    const int fcntl_errno = errno;
+    failure_count += 1;
+#ifndef NTRACE
+    perror(__PRETTY_FUNCTION__);
+    printf("%s (fd=%d): F_SETPIPE_SZ %lu failed, keeping %lu\n",
+      __PRETTY_FUNCTION__, fd, attempt_size, current_size);
+#endif // ndef NTRACE
+
+    if (!growing) {
+      // Shrinking fails with EBUSY if the pipe holds too much; try later.
+      return current_size;
+    }
+
+    if (fcntl_errno == EPERM) {
+      ceiling = std::min(ceiling, attempt_size / 2);
+    }
+
+    attempt_size /= 2;
+  }
+
+  return current_size;
+}
+
+void PipeBudget::release(uint64_t size) {
+  assert(size <= allocated);
+  allocated -= size;
+}
+
+}
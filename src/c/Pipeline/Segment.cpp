@@ -21,12 +21,15 @@
 #include "Pipeline/Segment.h"
 #include "directories.h"
 
+#include <algorithm>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <string.h>
 
 namespace Pipeline {
@@ -43,38 +46,41 @@ Segment::Segment
       - (first_stream_pos & (CLIENT_SEGMENT_DEFAULT_SIZE-1)))
   , term(term)
   , stream_offset(stream.offset)
-  , cache_entry(segment_cache.add(stream,
+  , segment_cache(segment_cache)
+  , cache_entry(segment_cache.add(stream, term,
                                   first_stream_pos + stream.offset,
                                   node_name.id == acceptor_id)) {
 
   char path[PATH_MAX], parent[PATH_MAX];
 
-  ensure_length(snprintf(path, PATH_MAX,
-          "data/clu_%s/n_%08x",
-          node_name.cluster.c_str(), node_name.id));
+  // Directory syncs are left to the caller, to avoid blocking here.
 
-  strncpy(parent, path, PATH_MAX);
+  ensure_length(snprintf(parent, PATH_MAX, "%s", node_name.directory.c_str()));
   ensure_length(snprintf(path, PATH_MAX,
-          "data/clu_%s/n_%08x/own_%08x_str_%08x",
-          node_name.cluster.c_str(), node_name.id,
+          "%s/own_%08x_str_%08x",
+          node_name.directory.c_str(),
           stream.name.owner,
           stream.name.id));
-  ensure_directory(parent, path);
+  if (ensure_directory_without_sync(path)) {
+    unsynced_directories.push_back(parent);
+  }
 
   strncpy(parent, path, PATH_MAX);
   ensure_length(snprintf(path, PATH_MAX,
-          "data/clu_%s/n_%08x/own_%08x_str_%08x/off_%016lx",
-          node_name.cluster.c_str(), node_name.id,
+          "%s/own_%08x_str_%08x/off_%016lx",
+          node_name.directory.c_str(),
           stream.name.owner,
           stream.name.id,
           stream.offset));
-  ensure_directory(parent, path);
+  if (ensure_directory_without_sync(path)) {
+    unsynced_directories.push_back(parent);
+  }
 
   strncpy(parent, path, PATH_MAX);
   if (acceptor_id == node_name.id) {
     ensure_length(snprintf(path, PATH_MAX,
-            "data/clu_%s/n_%08x/own_%08x_str_%08x/off_%016lx/pos_%016lx_trm_%08x_%08x_%08x",
-            node_name.cluster.c_str(), node_name.id,
+            "%s/own_%08x_str_%08x/off_%016lx/pos_%016lx_trm_%08x_%08x_%08x",
+            node_name.directory.c_str(),
             stream.name.owner,
             stream.name.id,
             stream.offset,
@@ -82,8 +88,8 @@ Segment::Segment
             term.era, term.term_number, term.owner));
   } else {
     ensure_length(snprintf(path, PATH_MAX,
-            "data/clu_%s/n_%08x/own_%08x_str_%08x/off_%016lx/pos_%016lx_trm_%08x_%08x_%08x_by_%08x",
-            node_name.cluster.c_str(), node_name.id,
+            "%s/own_%08x_str_%08x/off_%016lx/pos_%016lx_trm_%08x_%08x_%08x_by_%08x",
+            node_name.directory.c_str(),
             stream.name.owner,
             stream.name.id,
             stream.offset,
@@ -91,16 +97,41 @@ Segment::Segment
             term.era, term.term_number, term.owner,
             acceptor_id));
   }
-  fd = open(path, O_CREAT | O_RDWR, 0644);
-  if (fd == -1) {
+
+  // The same slots may be written again in the same term, e.g. when they
+  // are proposed again after a reconnection. Other entries may still refer
+  // to the existing file, so it is reopened rather than replaced.
+  SegmentPool::PreallocatedFile file = segment_cache.take_preallocated_file();
+  if (renameat2(AT_FDCWD, file.path.c_str(), AT_FDCWD, path,
+                RENAME_NOREPLACE) == 0) {
+    fd = file.fd;
+  } else if (errno == EEXIST) {
+    segment_cache.give_back_preallocated_file(file);
+    reopened = true;
+    fd = open(path, O_RDWR);
+    if (fd == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: open(%s) failed\n", __PRETTY_FUNCTION__, path);
+      abort();
+    }
+  } else {
     perror(__PRETTY_FUNCTION__);
-    fprintf(stderr, "%s: open(%s) failed\n", __PRETTY_FUNCTION__, path);
+    fprintf(stderr, "%s: rename(%s, %s) failed\n",
+                    __PRETTY_FUNCTION__, file.path.c_str(), path);
     abort();
   }
 
-  cache_entry.set_fd(fd);
+  cache_entry.set_fd(fd, path);
 
-  sync_directory(parent);
+  // Padded direct writes could overwrite data beyond the end of this
+  // segment in a reopened file.
+  if (segment_cache.is_direct_io() && !reopened) {
+    open_direct(path);
+  }
+
+  strncpy(parent, path, PATH_MAX);
+  *strrchr(parent, '/') = '\0';
+  unsynced_directories.push_back(parent);
 
 #ifndef NTRACE
   printf("%s: opened segment file %s with fd %d\n",
@@ -108,6 +139,15 @@ Segment::Segment
 #endif // ndef NTRACE
 }
 
+void Segment::open_direct(const char *path) {
+  direct_fd = open(path, O_WRONLY | O_DIRECT | O_DSYNC | O_CLOEXEC);
+  if (direct_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: open(%s, O_DIRECT) failed, using the page cache\n",
+                    __PRETTY_FUNCTION__, path);
+  }
+}
+
 Segment::~Segment() {
   shutdown();
 #ifndef NTRACE
@@ -120,9 +160,100 @@ void Segment::shutdown() {
 #ifndef NTRACE
     printf("%s: fd=%d\n", __PRETTY_FUNCTION__, fd);
 #endif // ndef NTRACE
+    // Give back the preallocated space that will now never be used. This
+    // includes a segment that filled up having started at an unaligned
+    // stream position, which never used the start of its file. Direct
+    // writes may still be in flight, padded past the used size, so the
+    // truncation must follow them. A reopened file may hold more data than
+    // this segment, for other entries, so is left as it is.
+    if (!reopened && direct_manager != NULL) {
+      direct_manager->truncate_in_background(fd, get_used_size(), NULL);
+    } else if (!reopened) {
+      SegmentPool::release_unused_space(fd, get_used_size());
+    }
     fd = -1;
+
+    if (direct_fd != -1) {
+      // Any writes still in flight have their own copies of the fd.
+      close(direct_fd);
+      direct_fd = -1;
+    }
+    for (const auto &buffer : staged_buffers) {
+      AlignedBufferPool::give_back(buffer.data);
+    }
+    staged_buffers.clear();
+
+    // The cache entry may be expired as soon as it is closed.
+    segment_cache.close_for_writing(cache_entry);
+  }
+}
+
+ssize_t Segment::read_direct(int pipe_fd, size_t max_length) {
+  assert(is_direct());
+
+  if (staged_buffers.empty()
+      || staged_buffers.back().length == DIRECT_IO_BUFFER_SIZE) {
+    // Only the first buffer of a write starts with a partial block, since
+    // any others follow a full buffer.
+    const size_t carried = staged_buffers.empty() ? tail_length : 0;
+    StagedBuffer buffer = {
+      .data   = static_cast<uint8_t*>(AlignedBufferPool::shared().take()),
+      .offset = (off_t)(direct_end - carried),
+      .length = carried};
+    memcpy(buffer.data, tail, carried);
+    staged_buffers.push_back(buffer);
+  }
+
+  auto &buffer = staged_buffers.back();
+  ssize_t read_result = read(pipe_fd, buffer.data + buffer.length,
+    std::min(max_length, (size_t)DIRECT_IO_BUFFER_SIZE - buffer.length));
+  if (0 < read_result) {
+    buffer.length += read_result;
+    direct_end    += read_result;
+  }
+  return read_result;
+}
+
+void Segment::write_direct_in_background(Epoll::Manager      &manager,
+                                         Epoll::SyncHandler  *handler) {
+  assert(is_direct());
+  assert(!staged_buffers.empty());
+  direct_manager = &manager;
+
+  const auto &last = staged_buffers.back();
+  tail_length = last.length % DIRECT_IO_ALIGNMENT;
+  memcpy(tail, last.data + last.length - tail_length, tail_length);
+
+  for (size_t i = 0; i < staged_buffers.size(); i++) {
+    const auto &buffer = staged_buffers[i];
+    const size_t padded_length
+      = (buffer.length + DIRECT_IO_ALIGNMENT - 1) & ~(size_t)(DIRECT_IO_ALIGNMENT - 1);
+    memset(buffer.data + buffer.length, 0, padded_length - buffer.length);
+    manager.write_in_background(direct_fd, buffer.data, padded_length,
+                                buffer.offset, AlignedBufferPool::give_back,
+                                i + 1 == staged_buffers.size() ? handler : NULL);
+  }
+  staged_buffers.clear();
+}
+
+void Segment::sync_directories_in_background(Epoll::Manager &manager) {
+  for (const auto &directory : unsynced_directories) {
+    int directory_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (directory_fd == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: open(%s) failed\n",
+                      __PRETTY_FUNCTION__, directory.c_str());
+      abort();
+    }
+    if (is_direct()) {
+      // In order with the direct writes of the data.
+      manager.write_in_background(directory_fd, NULL, 0, 0, NULL, NULL);
+    } else {
+      manager.sync_in_background(directory_fd, NULL);
+    }
+    close(directory_fd);
   }
-  cache_entry.close_for_writing();
+  unsynced_directories.clear();
 }
 
 void Segment::record_bytes_in(uint64_t bytes) {
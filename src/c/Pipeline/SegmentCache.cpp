@@ -21,16 +21,26 @@
 #include "Pipeline/LocalAcceptor.h"
 
 #include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits>
+#include <limits.h>
+#include <new>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/sendfile.h>
+#include <sys/stat.h>
 
 namespace Pipeline {
 
 SegmentCache::CacheEntry::CacheEntry
   (const Paxos::Value::OffsetStream &stream,
+   const Paxos::Term                &term,
    const Paxos::Slot                &initial_slot,
    const bool                        is_locally_accepted)
       : stream(stream),
+        term(term),
         slots(Paxos::SlotRange(initial_slot, initial_slot)),
         is_locally_accepted(is_locally_accepted) {}
 
@@ -49,37 +59,210 @@ void SegmentCache::CacheEntry::shutdown() {
 
 void SegmentCache::CacheEntry::extend(uint64_t bytes) {
   slots.set_end(slots.end() + bytes);
+  assert(slots.end() - slots.start() <= CLIENT_SEGMENT_DEFAULT_SIZE);
 }
 
 void SegmentCache::CacheEntry::close_for_writing() {
   closed_for_writing = true;
 }
 
-void SegmentCache::CacheEntry::set_fd(const int new_fd) {
+void SegmentCache::CacheEntry::set_fd(const int new_fd,
+                                      const std::string &new_path) {
   assert(fd == -1);
   assert(!closed_for_writing);
-  fd = new_fd;
+  fd   = new_fd;
+  path = new_path;
+}
+
+SegmentCache::CacheEntry *SegmentCache::EntryArena::create
+  (const Paxos::Value::OffsetStream &stream,
+   const Paxos::Term                &term,
+   const Paxos::Slot                &initial_slot,
+   const bool                        is_locally_accepted) {
+
+  if (free_list == NULL) {
+    blocks.push_back(std::unique_ptr<Cell[]>
+      (new Cell[SEGMENT_CACHE_ARENA_BLOCK_SIZE]));
+    Cell *block = blocks.back().get();
+    for (size_t i = 0; i < SEGMENT_CACHE_ARENA_BLOCK_SIZE; i++) {
+      block[i].next_free = free_list;
+      free_list = &block[i];
+    }
+  }
+
+  Cell *cell = free_list;
+  free_list = cell->next_free;
+  return new (&cell->storage) CacheEntry(stream, term, initial_slot,
+                                         is_locally_accepted);
+}
+
+void SegmentCache::EntryArena::destroy(CacheEntry *entry) {
+  entry->~CacheEntry();
+  Cell *cell = reinterpret_cast<Cell*>(entry);
+  cell->next_free = free_list;
+  free_list = cell;
+}
+
+bool SegmentCache::IndexKey::operator<(const IndexKey &other) const {
+  if (owner  != other.owner)  { return owner  < other.owner; }
+  if (id     != other.id)     { return id     < other.id; }
+  if (offset != other.offset) { return offset < other.offset; }
+  return is_locally_accepted < other.is_locally_accepted;
+}
+
+SegmentCache::~SegmentCache() {
+  for (auto &stream_entries : index) {
+    for (auto &it : stream_entries.second) {
+      arena.destroy(it.second);
+    }
+  }
 }
 
 SegmentCache::CacheEntry &SegmentCache::add
   (const Paxos::Value::OffsetStream &stream,
+   const Paxos::Term                &term,
    const Paxos::Slot                 initial_slot,
          bool                        is_locally_accepted) {
 
-  entries.push_back(std::move(std::unique_ptr<CacheEntry>
-    (new CacheEntry(stream, initial_slot, is_locally_accepted))));
-  return *entries.back();
+  CacheEntry *entry = arena.create(stream, term, initial_slot,
+                                   is_locally_accepted);
+  const IndexKey key = {
+    .owner               = stream.name.owner,
+    .id                  = stream.name.id,
+    .offset              = stream.offset,
+    .is_locally_accepted = is_locally_accepted
+  };
+  index[key].insert(std::make_pair(initial_slot, entry));
+  return *entry;
+}
+
+void SegmentCache::close_for_writing(CacheEntry &entry) {
+  if (entry.closed_for_writing) {
+    return;
+  }
+  entry.close_for_writing();
+  cached_bytes += entry.slots.end() - entry.slots.start();
+  closed_entries_by_end_slot.insert(std::make_pair(entry.slots.end(), &entry));
+}
+
+void SegmentCache::remove_from_index(CacheEntry *entry) {
+  const IndexKey key = {
+    .owner               = entry->stream.name.owner,
+    .id                  = entry->stream.name.id,
+    .offset              = entry->stream.offset,
+    .is_locally_accepted = entry->is_locally_accepted
+  };
+  auto stream_it = index.find(key);
+  assert(stream_it != index.end());
+  auto &stream_entries = stream_it->second;
+
+  auto range = stream_entries.equal_range(entry->slots.start());
+  for (auto entry_it = range.first; entry_it != range.second; ++entry_it) {
+    if (entry_it->second == entry) {
+      stream_entries.erase(entry_it);
+      break;
+    }
+  }
+
+  if (stream_entries.empty()) {
+    index.erase(stream_it);
+  }
 }
 
 void SegmentCache::expire_because_chosen_to(const Paxos::Slot first_unchosen_slot) {
-  entries.erase(std::remove_if(
-    entries.begin(),
-    entries.end(),
-    [first_unchosen_slot](const std::unique_ptr<CacheEntry> &ce) {
-      return ce->closed_for_writing
-          && ce->slots.end() < first_unchosen_slot;
-    }),
-    entries.end());
+  if (this->first_unchosen_slot < first_unchosen_slot) {
+    this->first_unchosen_slot = first_unchosen_slot;
+  }
+
+  auto it = closed_entries_by_end_slot.begin();
+  while (it != closed_entries_by_end_slot.end()
+      && it->first < first_unchosen_slot) {
+    CacheEntry *entry = it->second;
+    it = closed_entries_by_end_slot.erase(it);
+    remove_from_index(entry);
+    cached_bytes -= entry->slots.end() - entry->slots.start();
+
+    if (entry->fd != -1) {
+      if (entry->is_locally_accepted && entry->slots.is_nonempty()) {
+        chosen_segments.push_back({
+          .stream = entry->stream,
+          .slots  = entry->slots,
+          .term   = entry->term,
+          .path   = entry->path});
+        if (SEGMENT_CACHE_MAX_CHOSEN_SEGMENTS < chosen_segments.size()) {
+          chosen_segments.pop_front();
+        }
+      }
+      reclaimer.expire(entry->path, entry->fd, entry->slots.end());
+      entry->fd = -1;
+    }
+    arena.destroy(entry);
+  }
+
+  update_first_unconsumed_slot();
+}
+
+void SegmentCache::add_consumer(const ChosenDataConsumer *consumer) {
+  consumers.push_back(consumer);
+  update_first_unconsumed_slot();
+}
+
+void SegmentCache::remove_consumer(const ChosenDataConsumer *consumer) {
+  consumers.erase(std::remove(consumers.begin(), consumers.end(), consumer),
+                  consumers.end());
+  update_first_unconsumed_slot();
+}
+
+void SegmentCache::update_first_unconsumed_slot() {
+  Paxos::Slot first_unconsumed_slot = first_unchosen_slot;
+  Paxos::Slot first_pinned_slot = std::numeric_limits<Paxos::Slot>::max();
+  for (const auto consumer : consumers) {
+    const Paxos::Slot consumer_slot = consumer->get_first_unconsumed_slot();
+    first_unconsumed_slot = std::min(first_unconsumed_slot, consumer_slot);
+    first_pinned_slot     = std::min(first_pinned_slot,     consumer_slot);
+  }
+  reclaimer.set_first_pinned_slot(first_pinned_slot);
+  reclaimer.set_first_unconsumed_slot(first_unconsumed_slot);
+}
+
+size_t SegmentCache::get_entry_count() const {
+  size_t entry_count = 0;
+  for (const auto &stream_entries : index) {
+    entry_count += stream_entries.second.size();
+  }
+  return entry_count;
+}
+
+const SegmentCache::CacheEntry *SegmentCache::find
+  (const Paxos::Value::OffsetStream &stream,
+   const Paxos::Slot                 slot,
+   const bool                        is_locally_accepted) const {
+
+  const IndexKey key = {
+    .owner               = stream.name.owner,
+    .id                  = stream.name.id,
+    .offset              = stream.offset,
+    .is_locally_accepted = is_locally_accepted
+  };
+  const auto stream_it = index.find(key);
+  if (stream_it == index.end()) {
+    return NULL;
+  }
+
+  const auto &stream_entries = stream_it->second;
+  auto entry_it = stream_entries.upper_bound(slot);
+  while (entry_it != stream_entries.begin()) {
+    --entry_it;
+    if (entry_it->first + CLIENT_SEGMENT_DEFAULT_SIZE <= slot) {
+      break;
+    }
+    const CacheEntry *entry = entry_it->second;
+    // An entry whose file is closed may overlap a newer one, so keep looking.
+    if (entry->fd != -1 && entry->slots.contains(slot)) {
+      return entry;
+    }
+  }
+  return NULL;
 }
 
 SegmentCache::WriteAcceptedDataResult
@@ -90,25 +273,14 @@ SegmentCache::WriteAcceptedDataResult
     return SegmentCache::WriteAcceptedDataResult::succeeded;
   }
 
-  const auto it = std::find_if(
-    entries.cbegin(),
-    entries.cend(),
-    [&stream, &slots](const std::unique_ptr<CacheEntry> &ce) {
-      return ce->stream.name.owner == stream.name.owner
-          && ce->stream.name.id    == stream.name.id
-          && ce->stream.offset     == stream.offset
-          && ce->slots.contains(slots.start())
-          && ce->is_locally_accepted
-          && ce->fd != -1;
-    });
-
-  if (it == entries.cend()) {
+  const CacheEntry *found = find(stream, slots.start(), true);
+  if (found == NULL) {
     fprintf(stderr, "%s: matching CacheEntry not found\n",
                     __PRETTY_FUNCTION__);
     return SegmentCache::WriteAcceptedDataResult::failed;
   }
 
-  CacheEntry &ce = **it;
+  const CacheEntry &ce = *found;
 
   assert(slots.start() >= ce.slots.start());
   off_t file_offset = slots.start() - ce.slots.start();
@@ -139,6 +311,26 @@ SegmentCache::WriteAcceptedDataResult
   return SegmentCache::WriteAcceptedDataResult::succeeded;
 }
 
+bool SegmentCache::locate_accepted_data
+      (const Paxos::Value::OffsetStream &stream,
+       const Paxos::SlotRange           &slots,
+             int                        &fd,
+             off_t                      &file_offset,
+             uint64_t                   &length) const {
+  assert(slots.is_nonempty());
+
+  const CacheEntry *found = find(stream, slots.start(), true);
+  if (found == NULL) {
+    return false;
+  }
+
+  assert(slots.start() >= found->slots.start());
+  fd          = found->fd;
+  file_offset = slots.start() - found->slots.start();
+  length      = std::min(slots.end(), found->slots.end()) - slots.start();
+  return true;
+}
+
 void SegmentCache::locally_accept(const Paxos::Proposal &proposal,
                                         Paxos::SlotRange &slots_to_accept) {
 #ifndef NTRACE
@@ -146,15 +338,17 @@ void SegmentCache::locally_accept(const Paxos::Proposal &proposal,
                                    << " slots_to_ensure=" << slots_to_accept
                                    << std::endl;
 
-  for (const auto &pce : entries) {
-    std::cout << __PRETTY_FUNCTION__ << ": cache entry stream=" << pce->stream
-                                     << " slots="               << pce->slots
-                                     << std::endl;
+  for (const auto &stream_entries : index) {
+    for (const auto &it : stream_entries.second) {
+      std::cout << __PRETTY_FUNCTION__ << ": cache entry stream=" << it.second->stream
+                                       << " slots="               << it.second->slots
+                                       << std::endl;
+    }
   }
 #endif // def NTRACE
 
   LocalAcceptor local_acceptor(proposal, slots_to_accept,
-                               *this, node_name, entries);
+                               *this, node_name);
   local_acceptor.run();
 }
 
@@ -167,18 +361,9 @@ void SegmentCache::ensure_locally_accepted(const Paxos::Proposal &proposal) {
   while (slots_to_ensure.is_nonempty()) {
     const Paxos::Slot first_slot_to_ensure = slots_to_ensure.start();
 
-    const auto locally_accepted_it = std::find_if(
-      entries.cbegin(),
-      entries.cend(),
-      [&stream, &first_slot_to_ensure](const std::unique_ptr<CacheEntry> &ce) {
-        return ce->stream.name.owner == stream.name.owner
-            && ce->stream.name.id    == stream.name.id
-            && ce->stream.offset     == stream.offset
-            && ce->slots.contains(first_slot_to_ensure)
-            && ce->is_locally_accepted;
-      });
-
-    if (locally_accepted_it == entries.cend()) {
+    const CacheEntry *locally_accepted = find(stream, first_slot_to_ensure, true);
+
+    if (locally_accepted == NULL) {
       // Here, have a nonempty range of slots to fill, and the first slot is
       // not locally accepted. Therefore we must have an acceptance from a
       // bound promise that needs to be copied across to a local acceptance
@@ -188,8 +373,286 @@ void SegmentCache::ensure_locally_accepted(const Paxos::Proposal &proposal) {
       return;
     }
 
-    const CacheEntry &locally_accepted = **locally_accepted_it;
-    slots_to_ensure.truncate(locally_accepted.slots.end());
+    slots_to_ensure.truncate(locally_accepted->slots.end());
+  }
+}
+
+void SegmentCache::get_chosen_segments
+      (const Paxos::Slot                 end_slot,
+             std::vector<ChosenSegment> &segments) const {
+  const size_t first_new = segments.size();
+  for (const auto &segment : chosen_segments) {
+    if (segment.slots.end() <= end_slot) {
+      segments.push_back(segment);
+    }
+  }
+  std::sort(segments.begin() + first_new, segments.end(),
+    [](const ChosenSegment &a, const ChosenSegment &b) {
+      return a.slots.start() < b.slots.start();
+    });
+}
+
+Paxos::Slot SegmentCache::first_slot_not_held
+      (const Paxos::Value::OffsetStream &stream,
+       const Paxos::SlotRange           &slots) const {
+  Paxos::Slot slot = slots.start();
+
+  while (slot < slots.end()) {
+    Paxos::Slot held_to = slot;
+
+    const CacheEntry *entry = find(stream, slot, true);
+    if (entry != NULL) {
+      held_to = entry->slots.end();
+    }
+
+    for (const auto &segment : chosen_segments) {
+      if (held_to < segment.slots.end()
+          && segment.slots.contains(slot)
+          && segment.stream.name.owner == stream.name.owner
+          && segment.stream.name.id    == stream.name.id
+          && segment.stream.offset     == stream.offset
+          && access(segment.path.c_str(), F_OK) == 0) {
+        held_to = segment.slots.end();
+      }
+    }
+
+    if (held_to == slot) {
+      break;
+    }
+    slot = held_to;
+  }
+
+  return std::min(slot, slots.end());
+}
+
+bool SegmentCache::locate_chosen_data
+      (const Paxos::Value::OffsetStream &stream,
+       const Paxos::Slot                 slot,
+             ChosenSegment              &segment) const {
+
+  const CacheEntry *entry = find(stream, slot, true);
+  if (entry != NULL && !entry->path.empty()) {
+    segment.stream = entry->stream;
+    segment.slots  = entry->slots;
+    segment.term   = entry->term;
+    segment.path   = entry->path;
+    return true;
+  }
+
+  // Most readers are tailing the stream, so search the newest first.
+  for (auto it = chosen_segments.rbegin(); it != chosen_segments.rend(); ++it) {
+    if (it->slots.contains(slot)
+        && it->stream.name.owner == stream.name.owner
+        && it->stream.name.id    == stream.name.id
+        && it->stream.offset     == stream.offset) {
+      segment = *it;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void SegmentCache::add_compacted_log(const ChosenSegment &log) {
+  auto it = chosen_segments.begin();
+  while (it != chosen_segments.end()) {
+    const bool same_stream = it->stream.name.owner == log.stream.name.owner
+                          && it->stream.name.id    == log.stream.name.id
+                          && it->stream.offset     == log.stream.offset;
+    if (it->path == log.path) {
+      it = chosen_segments.erase(it);
+    } else if (same_stream
+        && log.slots.start() <= it->slots.start()
+        && it->slots.end()   <= log.slots.end()) {
+      reclaimer.supersede(it->path);
+      it = chosen_segments.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  chosen_segments.push_back(log);
+}
+
+void SegmentCache::expire_compacted_log(const ChosenSegment &log) {
+  int fd = open(log.path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: %s has gone\n", __PRETTY_FUNCTION__, log.path.c_str());
+    return;
+  }
+  reclaimer.expire_compacted_log(log.path, fd, log.slots.end());
+}
+
+void SegmentCache::get_entries
+      (std::vector<const CacheEntry*> &entries) const {
+  for (const auto &stream_entries : index) {
+    for (const auto &it : stream_entries.second) {
+      const CacheEntry *entry = it.second;
+      if (!entry->path.empty() && entry->slots.is_nonempty()) {
+        entries.push_back(entry);
+      }
+    }
+  }
+}
+
+void SegmentCache::restore_entry
+      (const Paxos::Value::OffsetStream &stream,
+       const Paxos::Term                &term,
+       const Paxos::SlotRange           &slots,
+       const bool                        is_locally_accepted,
+       const std::string                &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: skipping %s\n", __PRETTY_FUNCTION__, path.c_str());
+    return;
+  }
+
+  CacheEntry &entry = add(stream, term, slots.start(), is_locally_accepted);
+  entry.set_fd(fd, path);
+  entry.extend(slots.end() - slots.start());
+  close_for_writing(entry);
+}
+
+void SegmentCache::restore_chosen_segment(const ChosenSegment &segment) {
+  int fd = open(segment.path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    // Most likely reclaimed before the restart.
+    return;
+  }
+  if (segment.is_compacted_log) {
+    reclaimer.expire_compacted_log(segment.path, fd, segment.slots.end());
+  } else {
+    reclaimer.expire(segment.path, fd, segment.slots.end());
+  }
+
+  chosen_segments.push_back(segment);
+  if (SEGMENT_CACHE_MAX_CHOSEN_SEGMENTS < chosen_segments.size()) {
+    chosen_segments.pop_front();
+  }
+}
+
+static void list_directory(const std::string        &path,
+                                 std::vector<std::string> &names) {
+  DIR *dir = opendir(path.c_str());
+  if (dir == NULL) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: opendir(%s) failed\n",
+                    __PRETTY_FUNCTION__, path.c_str());
+    return;
+  }
+
+  struct dirent *dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    names.push_back(dirent->d_name);
+  }
+  closedir(dir);
+}
+
+void SegmentCache::restore_unlisted_entries
+      (const std::set<std::string>  &listed_paths,
+       std::vector<Paxos::Proposal> &acceptances) {
+  std::vector<std::string> stream_names;
+  list_directory(node_name.directory, stream_names);
+
+  for (const auto &stream_name : stream_names) {
+    Paxos::Value::OffsetStream stream;
+    int consumed = 0;
+    if (sscanf(stream_name.c_str(), "own_%8x_str_%8x%n",
+               &stream.name.owner, &stream.name.id, &consumed) != 2
+        || stream_name[consumed] != '\0') {
+      continue;
+    }
+    const std::string stream_path = node_name.directory + "/" + stream_name;
+
+    std::vector<std::string> offset_names;
+    list_directory(stream_path, offset_names);
+
+    for (const auto &offset_name : offset_names) {
+      if (sscanf(offset_name.c_str(), "off_%16lx%n",
+                 &stream.offset, &consumed) != 1
+          || offset_name[consumed] != '\0') {
+        continue;
+      }
+      const std::string offset_path = stream_path + "/" + offset_name;
+
+      std::vector<std::string> segment_names;
+      list_directory(offset_path, segment_names);
+      std::sort(segment_names.begin(), segment_names.end());
+
+      for (const auto &segment_name : segment_names) {
+        const std::string path = offset_path + "/" + segment_name;
+        if (listed_paths.find(path) != listed_paths.end()) {
+          continue;
+        }
+
+        uint64_t      position;
+        Paxos::Era    era;
+        Paxos::TermNumber term_number;
+        Paxos::NodeId owner, acceptor_id;
+        if (sscanf(segment_name.c_str(), "pos_%16lx_trm_%8x_%8x_%8x%n",
+                   &position, &era, &term_number, &owner, &consumed) != 4) {
+          continue;
+        }
+        const char *suffix = segment_name.c_str() + consumed;
+        const bool is_locally_accepted = *suffix == '\0';
+        if (!is_locally_accepted
+            && (sscanf(suffix, "_by_%8x%n", &acceptor_id, &consumed) != 1
+                || suffix[consumed] != '\0')) {
+          continue;
+        }
+
+        struct stat buf;
+        if (stat(path.c_str(), &buf) == -1) {
+          perror(__PRETTY_FUNCTION__);
+          fprintf(stderr, "%s: skipping %s\n", __PRETTY_FUNCTION__, path.c_str());
+          continue;
+        }
+
+        // A segment is truncated to the data it holds when it is closed, so
+        // one still at its preallocated size was either filled from an
+        // aligned position, in which case the next segment was started
+        // straight after it, or was being written when the node stopped and
+        // holds an unknown amount of data.
+        uint64_t length = buf.st_size;
+        if (length == 0) {
+          continue;
+        }
+        if (length == CLIENT_SEGMENT_DEFAULT_SIZE) {
+          char next_name[NAME_MAX + 1];
+          snprintf(next_name, sizeof next_name, "pos_%016lx_trm_%08x_%08x_%08x%s",
+                   position + CLIENT_SEGMENT_DEFAULT_SIZE,
+                   era, term_number, owner, suffix);
+          if ((position & (CLIENT_SEGMENT_DEFAULT_SIZE - 1)) != 0
+              || !std::binary_search(segment_names.begin(),
+                                     segment_names.end(),
+                                     std::string(next_name))) {
+            fprintf(stderr, "%s: %s was not closed, skipping it\n",
+                            __PRETTY_FUNCTION__, path.c_str());
+            continue;
+          }
+        }
+
+        const Paxos::Term      term(era, term_number, owner);
+        const Paxos::SlotRange slots(position + stream.offset,
+                                     position + stream.offset + length);
+        restore_entry(stream, term, slots, is_locally_accepted, path);
+
+        if (is_locally_accepted) {
+          Paxos::Value value;
+          memset(&value, 0, sizeof value);
+          value.type           = Paxos::Value::Type::stream_content;
+          value.payload.stream = stream;
+          acceptances.push_back({.slots = slots, .term = term, .value = value});
+        }
+
+#ifndef NTRACE
+        printf("%s: restored %s, which was not in the manifest\n",
+          __PRETTY_FUNCTION__, path.c_str());
+#endif // ndef NTRACE
+      }
+    }
   }
 }
 
@@ -0,0 +1,367 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/SegmentManifest.h"
+#include "directories.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Pipeline {
+
+#define SEGMENT_MANIFEST_VERSION 1
+
+static const uint8_t manifest_magic[8]
+  = {'Z', 'C', 'P', 'X', 'M', 'A', 'N', 'I'};
+
+Paxos::Term SegmentManifest::Term::get_paxos_term() const {
+  return Paxos::Term(era, term_number, owner);
+}
+
+void SegmentManifest::Term::copy_from(const Paxos::Term &term) {
+  era         = term.era;
+  term_number = term.term_number;
+  owner       = term.owner;
+}
+
+void SegmentManifest::Snapshot::set_configuration
+      (const Paxos::Configuration &conf) {
+  configuration.clear();
+  for (const auto &entry : conf.entries) {
+    configuration.push_back({.node_id = entry.node_id(),
+                             .weight  = entry.weight()});
+  }
+}
+
+Paxos::Configuration SegmentManifest::Snapshot::get_configuration() const {
+  std::vector<Paxos::Configuration::Entry> entries;
+  for (const auto &entry : configuration) {
+    entries.push_back(Paxos::Configuration::Entry(entry.node_id, entry.weight));
+  }
+  return Paxos::Configuration(entries);
+}
+
+void SegmentManifest::Snapshot::set_open_streams
+      (const std::vector<Paxos::Value::StreamPosition> &streams) {
+  open_streams.clear();
+  for (const auto &stream : streams) {
+    open_streams.push_back({
+      .owner            = stream.name.owner,
+      .id               = stream.name.id,
+      .position         = stream.position,
+      .last_chosen_slot = stream.last_chosen_slot});
+  }
+}
+
+void SegmentManifest::Snapshot::get_open_streams
+      (std::vector<Paxos::Value::StreamPosition> &streams) const {
+  for (const auto &stream : open_streams) {
+    streams.push_back({
+      .name             = {.owner = stream.owner, .id = stream.id},
+      .position         = stream.position,
+      .last_chosen_slot = stream.last_chosen_slot});
+  }
+}
+
+void SegmentManifest::Snapshot::add_acceptance
+      (const Paxos::Proposal &proposal) {
+  Acceptance acceptance;
+  memset(&acceptance, 0, sizeof acceptance);
+  acceptance.start_slot = proposal.slots.start();
+  acceptance.end_slot   = proposal.slots.end();
+  acceptance.term.copy_from(proposal.term);
+  acceptance.type       = proposal.value.type;
+  memcpy(acceptance.payload, &proposal.value.payload,
+         sizeof acceptance.payload);
+  acceptances.push_back(acceptance);
+}
+
+Paxos::Proposal SegmentManifest::Snapshot::get_acceptance
+      (const Acceptance &acceptance) {
+  Paxos::Value value;
+  value.type = Paxos::Value::Type(acceptance.type);
+  memcpy(&value.payload, acceptance.payload, sizeof value.payload);
+  Paxos::Proposal proposal = {
+    .slots = Paxos::SlotRange(acceptance.start_slot, acceptance.end_slot),
+    .term  = acceptance.term.get_paxos_term(),
+    .value = value
+  };
+  return proposal;
+}
+
+bool SegmentManifest::Snapshot::add_segment
+      (const Paxos::Value::OffsetStream &stream,
+       const Paxos::SlotRange           &slots,
+       const Paxos::Term                &term,
+             uint8_t                     flags,
+       const std::string                &path) {
+  if (SEGMENT_MANIFEST_PATH_SIZE <= path.size()) {
+    fprintf(stderr, "%s: path too long: %s\n",
+                    __PRETTY_FUNCTION__, path.c_str());
+    return false;
+  }
+
+  Segment segment;
+  memset(&segment, 0, sizeof segment);
+  segment.owner      = stream.name.owner;
+  segment.id         = stream.name.id;
+  segment.offset     = stream.offset;
+  segment.start_slot = slots.start();
+  segment.end_slot   = slots.end();
+  segment.term.copy_from(term);
+  segment.flags      = flags;
+  memcpy(segment.path, path.c_str(), path.size());
+  segments.push_back(segment);
+  return true;
+}
+
+SegmentManifest::SegmentManifest(const NodeName &node_name)
+  : directory(node_name.directory) {
+  char manifest_path[PATH_MAX];
+  ensure_length(snprintf(manifest_path, PATH_MAX, "%s/n_%08x.manifest",
+                         node_name.directory.c_str(), node_name.id));
+  path = manifest_path;
+}
+
+SegmentManifest::~SegmentManifest() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    should_exit = true;
+  }
+  condition.notify_one();
+
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+void SegmentManifest::checkpoint(std::unique_ptr<Snapshot> snapshot) {
+  memcpy(snapshot->header.magic, manifest_magic, sizeof manifest_magic);
+  snapshot->header.version = SEGMENT_MANIFEST_VERSION;
+  snapshot->header.configuration_entry_count = snapshot->configuration.size();
+  snapshot->header.open_stream_count         = snapshot->open_streams.size();
+  snapshot->header.acceptance_count          = snapshot->acceptances.size();
+  snapshot->header.segment_count             = snapshot->segments.size();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!worker.joinable()) {
+      worker = std::thread(&SegmentManifest::run, this);
+    }
+    pending = std::move(snapshot);
+  }
+  condition.notify_one();
+}
+
+template<class T>
+static void append(std::vector<uint8_t> &bytes, const std::vector<T> &records) {
+  const uint8_t *start = reinterpret_cast<const uint8_t*>(records.data());
+  bytes.insert(bytes.end(), start, start + records.size() * sizeof(T));
+}
+
+void SegmentManifest::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+    while (!pending && !should_exit) {
+      condition.wait(lock);
+    }
+    // The last checkpoint is still written when exiting.
+    if (!pending) {
+      return;
+    }
+
+    std::unique_ptr<Snapshot> snapshot = std::move(pending);
+    lock.unlock();
+
+    std::vector<uint8_t> bytes;
+    const uint8_t *header = reinterpret_cast<const uint8_t*>(&snapshot->header);
+    bytes.insert(bytes.end(), header, header + sizeof snapshot->header);
+    append(bytes, snapshot->configuration);
+    append(bytes, snapshot->open_streams);
+    append(bytes, snapshot->acceptances);
+    append(bytes, snapshot->segments);
+
+    if (bytes != last_written) {
+      sync_segments(*snapshot);
+      write(bytes);
+      last_written.swap(bytes);
+    }
+
+    lock.lock();
+  }
+}
+
+void SegmentManifest::sync_segments(const Snapshot &snapshot) {
+  std::map<std::string, Paxos::Slot> still_named;
+
+  for (const auto &segment : snapshot.segments) {
+    const std::string segment_path(segment.path);
+    const auto it = synced_segments.find(segment_path);
+    if (it != synced_segments.end() && segment.end_slot <= it->second) {
+      still_named[segment_path] = it->second;
+      continue;
+    }
+
+    // A segment that has since been reclaimed is skipped when restoring.
+    int fd = open(segment_path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      continue;
+    }
+    if (fdatasync(fd) == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: fdatasync(%s) failed\n",
+                      __PRETTY_FUNCTION__, segment_path.c_str());
+      abort();
+    }
+    close(fd);
+    still_named[segment_path] = segment.end_slot;
+  }
+
+  synced_segments.swap(still_named);
+}
+
+void SegmentManifest::write(const std::vector<uint8_t> &bytes) {
+  const std::string temporary_path = path + ".tmp";
+
+  int fd = open(temporary_path.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: open(%s) failed\n",
+                    __PRETTY_FUNCTION__, temporary_path.c_str());
+    abort();
+  }
+
+  size_t bytes_written = 0;
+  while (bytes_written < bytes.size()) {
+    ssize_t write_result = ::write(fd, bytes.data() + bytes_written,
+                                       bytes.size() - bytes_written);
+    if (write_result == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: write(%s) failed\n",
+                      __PRETTY_FUNCTION__, temporary_path.c_str());
+      abort();
+    }
+    bytes_written += write_result;
+  }
+
+  if (fdatasync(fd) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fdatasync(%s) failed\n",
+                    __PRETTY_FUNCTION__, temporary_path.c_str());
+    abort();
+  }
+  close(fd);
+
+  if (rename(temporary_path.c_str(), path.c_str()) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: rename(%s, %s) failed\n",
+                    __PRETTY_FUNCTION__, temporary_path.c_str(), path.c_str());
+    abort();
+  }
+
+  sync_directory(directory.c_str());
+}
+
+template<class T>
+static const uint8_t *read_records(const uint8_t *ptr, uint32_t count,
+                                   std::vector<T> &records) {
+  const T *start = reinterpret_cast<const T*>(ptr);
+  records.assign(start, start + count);
+  return ptr + count * sizeof(T);
+}
+
+bool SegmentManifest::load(Snapshot &snapshot) const {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: open(%s) failed\n", __PRETTY_FUNCTION__, path.c_str());
+    }
+    return false;
+  }
+
+  struct stat buf;
+  if (fstat(fd, &buf) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fstat(%s) failed\n", __PRETTY_FUNCTION__, path.c_str());
+    close(fd);
+    return false;
+  }
+
+  const size_t size = buf.st_size;
+  if (size < sizeof(Header)) {
+    fprintf(stderr, "%s: %s is truncated\n", __PRETTY_FUNCTION__, path.c_str());
+    close(fd);
+    return false;
+  }
+
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: mmap(%s) failed\n", __PRETTY_FUNCTION__, path.c_str());
+    return false;
+  }
+
+  const uint8_t *ptr = static_cast<const uint8_t*>(mapping);
+  const Header &header = *reinterpret_cast<const Header*>(ptr);
+
+  const size_t expected_size = sizeof(Header)
+    + header.configuration_entry_count * sizeof(ConfigurationEntry)
+    + header.open_stream_count         * sizeof(OpenStream)
+    + header.acceptance_count          * sizeof(Acceptance)
+    + header.segment_count             * sizeof(Segment);
+
+  bool valid = memcmp(header.magic, manifest_magic, sizeof manifest_magic) == 0
+            && header.version == SEGMENT_MANIFEST_VERSION
+            && size == expected_size;
+
+  if (valid) {
+    snapshot.header = header;
+    ptr += sizeof(Header);
+    ptr = read_records(ptr, header.configuration_entry_count,
+                       snapshot.configuration);
+    ptr = read_records(ptr, header.open_stream_count, snapshot.open_streams);
+    ptr = read_records(ptr, header.acceptance_count,  snapshot.acceptances);
+    ptr = read_records(ptr, header.segment_count,     snapshot.segments);
+    assert(ptr == static_cast<const uint8_t*>(mapping) + size);
+
+    for (auto &segment : snapshot.segments) {
+      segment.path[SEGMENT_MANIFEST_PATH_SIZE - 1] = '\0';
+    }
+  } else {
+    fprintf(stderr, "%s: %s is not a valid manifest\n",
+                    __PRETTY_FUNCTION__, path.c_str());
+  }
+
+  munmap(mapping, size);
+  return valid;
+}
+
+}
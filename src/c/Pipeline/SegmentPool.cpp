@@ -0,0 +1,269 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/SegmentPool.h"
+#include "Pipeline/Segment.h"
+#include "directories.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace Pipeline {
+
+SegmentPool::SegmentPool(const NodeName &node_name)
+  : node_name(node_name) {
+  ensure_length(snprintf(pool_path, PATH_MAX,
+          "%s/pool",
+          node_name.directory.c_str()));
+}
+
+SegmentPool::~SegmentPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    should_exit = true;
+  }
+  condition.notify_one();
+
+  if (worker.joinable()) {
+    worker.join();
+  }
+
+  // Any files left in the pool are adopted again on restart.
+  for (const auto &f : ready_files) {
+    close(f.fd);
+  }
+}
+
+void SegmentPool::start() {
+  assert(!started);
+  ensure_directory(node_name.directory.c_str(), pool_path);
+
+  adopt_existing_files();
+  while (ready_files.size() < SEGMENT_POOL_SIZE) {
+    ready_files.push_back(preallocate_file(next_file_number++));
+  }
+  sync_directory(pool_path);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    started = true;
+  }
+  worker = std::thread(&SegmentPool::run, this);
+}
+
+void SegmentPool::adopt_existing_files() {
+  DIR *dir = opendir(pool_path);
+  if (dir == NULL) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: opendir(%s) failed\n", __PRETTY_FUNCTION__, pool_path);
+    abort();
+  }
+
+  struct dirent *dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    uint64_t file_number;
+    if (sscanf(dirent->d_name, "pre_%lx", &file_number) != 1) {
+      continue;
+    }
+    if (next_file_number <= file_number) {
+      next_file_number = file_number + 1;
+    }
+
+    char path[PATH_MAX];
+    ensure_length(snprintf(path, PATH_MAX, "%s/%s", pool_path, dirent->d_name));
+
+    int fd = open(path, O_RDWR);
+    struct stat buf;
+    if (fd != -1 && fstat(fd, &buf) == 0
+                 && buf.st_size == CLIENT_SEGMENT_DEFAULT_SIZE) {
+      ready_files.push_back({.path = path, .fd = fd});
+    } else {
+      fprintf(stderr, "%s: discarding %s\n", __PRETTY_FUNCTION__, path);
+      if (fd != -1) {
+        close(fd);
+      }
+      unlink(path);
+    }
+  }
+
+  closedir(dir);
+}
+
+SegmentPool::PreallocatedFile SegmentPool::create_file(uint64_t file_number) {
+  char path[PATH_MAX];
+  ensure_length(snprintf(path, PATH_MAX,
+          "%s/pre_%016lx", pool_path, file_number));
+
+  int fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: open(%s) failed\n", __PRETTY_FUNCTION__, path);
+    abort();
+  }
+
+  return {.path = path, .fd = fd};
+}
+
+SegmentPool::PreallocatedFile SegmentPool::preallocate_file(uint64_t file_number) {
+  const PreallocatedFile file = create_file(file_number);
+  const int   fd   = file.fd;
+  const char *path = file.path.c_str();
+
+  if (fallocate(fd, 0, 0, CLIENT_SEGMENT_DEFAULT_SIZE) == -1) {
+    if (errno == EOPNOTSUPP) {
+      // Not all filesystems can preallocate, but the file can still be used.
+      if (ftruncate(fd, CLIENT_SEGMENT_DEFAULT_SIZE) == -1) {
+        perror(__PRETTY_FUNCTION__);
+        fprintf(stderr, "%s: ftruncate(%s) failed\n", __PRETTY_FUNCTION__, path);
+        abort();
+      }
+    } else {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: fallocate(%s) failed\n", __PRETTY_FUNCTION__, path);
+      abort();
+    }
+  }
+
+  if (fsync(fd) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fsync(%s) failed\n", __PRETTY_FUNCTION__, path);
+    abort();
+  }
+
+  return file;
+}
+
+void SegmentPool::run() {
+  while (true) {
+    uint64_t file_number;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      condition.wait(lock, [this] {
+        return should_exit || ready_files.size() < SEGMENT_POOL_SIZE;
+      });
+      if (should_exit) {
+        return;
+      }
+      file_number = next_file_number++;
+    }
+
+    PreallocatedFile file = preallocate_file(file_number);
+    sync_directory(pool_path);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ready_files.push_back(file);
+    }
+  }
+}
+
+SegmentPool::PreallocatedFile SegmentPool::take() {
+  uint64_t file_number;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    assert(started);
+
+    if (!ready_files.empty()) {
+      PreallocatedFile file = ready_files.front();
+      ready_files.pop_front();
+      condition.notify_one();
+      return file;
+    }
+
+    file_number = next_file_number++;
+  }
+
+  // The pool ran dry. Preallocating and syncing a file here would block the
+  // event loop, so the file grows as it is written instead, as a file that
+  // is not preallocated always does.
+#ifndef NTRACE
+  printf("%s: pool empty\n", __PRETTY_FUNCTION__);
+#endif // ndef NTRACE
+  return create_file(file_number);
+}
+
+void SegmentPool::give_back(const PreallocatedFile &file) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ready_files.push_front(file);
+}
+
+void SegmentPool::release_unused_space(int fd, off_t used_size) {
+  struct stat buf;
+  if (fstat(fd, &buf) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fstat() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  if (used_size < buf.st_size && ftruncate(fd, used_size) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: ftruncate() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+}
+
+bool SegmentPool::recycle(const std::string &path) {
+  uint64_t file_number;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!started || SEGMENT_POOL_SIZE <= ready_files.size()) {
+      return false;
+    }
+    file_number = next_file_number++;
+  }
+
+  int fd = open(path.c_str(), O_RDWR);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat buf;
+  if (fstat(fd, &buf) == -1 || buf.st_size != CLIENT_SEGMENT_DEFAULT_SIZE) {
+    close(fd);
+    return false;
+  }
+
+  char new_path[PATH_MAX];
+  ensure_length(snprintf(new_path, PATH_MAX,
+          "%s/pre_%016lx", pool_path, file_number));
+
+  if (rename(path.c_str(), new_path) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: rename(%s, %s) failed\n",
+                    __PRETTY_FUNCTION__, path.c_str(), new_path);
+    abort();
+  }
+  sync_directory(pool_path);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready_files.push_back({.path = new_path, .fd = fd});
+  }
+  return true;
+}
+
+}
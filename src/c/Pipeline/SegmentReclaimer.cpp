@@ -0,0 +1,302 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/SegmentReclaimer.h"
+#include "directories.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace Pipeline {
+
+SegmentReclaimer::SegmentReclaimer(SegmentPool &pool) : pool(pool) {}
+
+SegmentReclaimer::~SegmentReclaimer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    should_exit = true;
+  }
+  condition.notify_one();
+
+  if (worker.joinable()) {
+    worker.join();
+  }
+
+  for (const auto &segment : incoming) {
+    if (segment.fd != -1) {
+      close(segment.fd);
+    }
+  }
+}
+
+void SegmentReclaimer::set_policy(const RetentionPolicy &new_policy) {
+  std::lock_guard<std::mutex> lock(mutex);
+  assert(!worker.joinable());
+  policy = new_policy;
+}
+
+void SegmentReclaimer::expire(const std::string &path, int fd,
+                              Paxos::Slot end_slot) {
+  add_incoming(path, fd, end_slot, false);
+}
+
+void SegmentReclaimer::expire_compacted_log(const std::string &path, int fd,
+                                            Paxos::Slot end_slot) {
+  add_incoming(path, fd, end_slot, true);
+}
+
+void SegmentReclaimer::add_incoming(const std::string &path, int fd,
+                                    Paxos::Slot end_slot,
+                                    bool is_compacted_log) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!worker.joinable()) {
+      worker = std::thread(&SegmentReclaimer::run, this);
+    }
+    incoming.push_back({
+      .path             = path,
+      .fd               = fd,
+      .end_slot         = end_slot,
+      .expired_at       = std::chrono::steady_clock::now(),
+      .bytes            = 0,
+      .superseded       = false,
+      .is_compacted_log = is_compacted_log});
+  }
+  condition.notify_one();
+}
+
+void SegmentReclaimer::set_first_unconsumed_slot(Paxos::Slot slot) {
+  bool changed = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (first_unconsumed_slot < slot) {
+      first_unconsumed_slot = slot;
+      changed = policy.delete_when_consumed;
+    }
+  }
+  if (changed) {
+    condition.notify_one();
+  }
+}
+
+void SegmentReclaimer::supersede(const std::string &path) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    incoming_superseded.push_back(path);
+  }
+  condition.notify_one();
+}
+
+void SegmentReclaimer::set_first_pinned_slot(Paxos::Slot slot) {
+  bool changed = false;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    reclaimed.wait(lock, [this, slot] { return reclaiming_end_slot <= slot; });
+    changed = first_pinned_slot != slot;
+    first_pinned_slot = slot;
+  }
+  if (changed) {
+    condition.notify_one();
+  }
+}
+
+SegmentReclaimer::Usage SegmentReclaimer::get_usage() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return usage;
+}
+
+bool SegmentReclaimer::should_reclaim
+    (const ExpiredSegment                        &segment,
+     const std::chrono::steady_clock::time_point &now,
+           Paxos::Slot                            consumed_slot,
+           Paxos::Slot                            pinned_slot) const {
+
+  if (pinned_slot < segment.end_slot) {
+    return false;
+  }
+
+  if (segment.superseded) {
+    return true;
+  }
+
+  if (0 < policy.max_bytes && policy.max_bytes < usage.retained_bytes) {
+    return true;
+  }
+
+  if (std::chrono::seconds(0) < policy.max_age
+      && segment.expired_at + policy.max_age <= now) {
+    return true;
+  }
+
+  if (policy.delete_when_consumed && segment.end_slot <= consumed_slot) {
+    return true;
+  }
+
+  return false;
+}
+
+bool SegmentReclaimer::reclaim(const ExpiredSegment    &segment,
+                               std::vector<std::string> &directories_to_sync) {
+  if (segment.path.empty()) {
+    return false;
+  }
+
+  bool recycled = false;
+
+  if (segment.is_compacted_log) {
+    const std::string index_path = segment.path + "_idx";
+    if (unlink(segment.path.c_str()) == -1
+        || (unlink(index_path.c_str()) == -1 && errno != ENOENT)) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: unlink(%s) failed\n",
+                      __PRETTY_FUNCTION__, segment.path.c_str());
+      abort();
+    }
+  } else if (!pool.recycle(segment.path)) {
+    if (unlink(segment.path.c_str()) == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: unlink(%s) failed\n",
+                      __PRETTY_FUNCTION__, segment.path.c_str());
+      abort();
+    }
+  } else {
+    recycled = true;
+  }
+
+  std::string directory = segment.path.substr(0, segment.path.rfind('/'));
+  if (std::find(directories_to_sync.begin(),
+                directories_to_sync.end(),
+                directory) == directories_to_sync.end()) {
+    directories_to_sync.push_back(directory);
+  }
+  return recycled;
+}
+
+void SegmentReclaimer::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+    if (incoming.empty() && incoming_superseded.empty() && !should_exit) {
+      if (std::chrono::seconds(0) < policy.max_age && !retained.empty()
+          && retained.front().end_slot <= first_pinned_slot) {
+        condition.wait_until(lock, retained.front().expired_at + policy.max_age);
+      } else {
+        condition.wait(lock);
+      }
+    }
+
+    std::deque<ExpiredSegment> new_segments;
+    new_segments.swap(incoming);
+    std::vector<std::string> superseded_paths;
+    superseded_paths.swap(incoming_superseded);
+    const bool        exiting       = should_exit;
+    const Paxos::Slot consumed_slot = first_unconsumed_slot;
+    const Paxos::Slot pinned_slot   = first_pinned_slot;
+    lock.unlock();
+
+    for (auto &segment : new_segments) {
+      if (segment.fd != -1) {
+        struct stat buf;
+        if (fstat(segment.fd, &buf) == 0) {
+          segment.bytes = buf.st_blocks * 512;
+        }
+        close(segment.fd);
+        segment.fd = -1;
+      }
+      retained.push_back(segment);
+
+      lock.lock();
+      usage.retained_files += 1;
+      usage.retained_bytes += segment.bytes;
+      lock.unlock();
+    }
+
+    if (exiting) {
+      return;
+    }
+
+    for (auto &segment : retained) {
+      if (!segment.superseded
+          && std::find(superseded_paths.begin(), superseded_paths.end(),
+                       segment.path) != superseded_paths.end()) {
+        segment.superseded = true;
+        superseded_count += 1;
+      }
+    }
+
+    std::vector<std::string> directories_to_sync;
+    const auto now = std::chrono::steady_clock::now();
+    auto it = retained.begin();
+    while (it != retained.end()
+        && (it == retained.begin() || 0 < superseded_count)) {
+      // Past the first retained segment, only superseded ones are reclaimed.
+      if ((it == retained.begin() || it->superseded)
+          && should_reclaim(*it, now, consumed_slot, pinned_slot)) {
+        /* A reader may have pinned the segment since the pinned slot was
+         * read above, and may then open its file at any moment, so check
+         * again, and stop anyone else pinning it until it is reclaimed. */
+        lock.lock();
+        if (first_pinned_slot < it->end_slot) {
+          lock.unlock();
+          ++it;
+          continue;
+        }
+        reclaiming_end_slot = it->end_slot;
+        lock.unlock();
+
+        const ExpiredSegment segment = *it;
+        it = retained.erase(it);
+        const bool recycled = reclaim(segment, directories_to_sync);
+        if (segment.superseded) {
+          superseded_count -= 1;
+        }
+
+        lock.lock();
+        reclaiming_end_slot = 0;
+        usage.retained_files  -= 1;
+        usage.retained_bytes  -= segment.bytes;
+        usage.reclaimed_files += 1;
+        usage.reclaimed_bytes += segment.bytes;
+        if (recycled) {
+          usage.recycled_files += 1;
+        }
+        lock.unlock();
+        reclaimed.notify_all();
+      } else {
+        ++it;
+      }
+    }
+
+    for (const auto &directory : directories_to_sync) {
+      sync_directory(directory.c_str());
+    }
+
+    lock.lock();
+  }
+}
+
+}
@@ -0,0 +1,389 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/SendfileShards.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/sendfile.h>
+
+namespace Pipeline {
+
+#define WAKE_TOKEN 0
+
+SendfileShards::Shard::Shard(int completion_fd, int cpu)
+  : completion_fd(completion_fd),
+    epfd(epoll_create1(EPOLL_CLOEXEC)),
+    wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    should_exit(false) {
+
+  if (epfd == -1 || wake_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: epoll_create1() or eventfd() failed\n",
+                    __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  struct epoll_event event;
+  event.events   = EPOLLIN;
+  event.data.u64 = WAKE_TOKEN;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &event) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: epoll_ctl(wake_fd) failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  worker = std::thread(&Shard::run, this);
+
+  if (0 <= cpu) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    int result = pthread_setaffinity_np(worker.native_handle(),
+                                        sizeof cpu_set, &cpu_set);
+    if (result != 0) {
+      fprintf(stderr, "%s: pthread_setaffinity_np(%d) failed: %s\n",
+                      __PRETTY_FUNCTION__, cpu, strerror(result));
+    }
+  }
+}
+
+SendfileShards::Shard::~Shard() {
+  should_exit.store(true);
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof one) != sizeof one) {
+    perror(__PRETTY_FUNCTION__);
+    abort();
+  }
+  worker.join();
+
+  Request request;
+  while (requests.try_pop(request)) {
+    if (request.socket_fd != -1) {
+      close(request.socket_fd);
+      close(request.file_fd);
+    }
+  }
+  for (const auto &request : overflow) {
+    if (request.socket_fd != -1) {
+      close(request.socket_fd);
+      close(request.file_fd);
+    }
+  }
+
+  close(wake_fd);
+  close(epfd);
+}
+
+void SendfileShards::Shard::submit(const Request &request) {
+  if (!overflow.empty() || !requests.try_push(request)) {
+    overflow.push_back(request);
+  }
+
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof one) != sizeof one) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: write(wake_fd) failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+}
+
+void SendfileShards::Shard::flush_overflow() {
+  bool flushed = false;
+  while (!overflow.empty() && requests.try_push(overflow.front())) {
+    overflow.pop_front();
+    flushed = true;
+  }
+
+  if (flushed) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof one) != sizeof one) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: write(wake_fd) failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+  }
+}
+
+void SendfileShards::Shard::run() {
+  struct epoll_event events[64];
+
+  while (!should_exit.load()) {
+    int event_count = epoll_wait(epfd, events, 64, -1);
+    if (event_count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: epoll_wait() failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+
+    for (int i = 0; i < event_count; i++) {
+      const Token token = events[i].data.u64;
+      if (token == WAKE_TOKEN) {
+        uint64_t wake_count;
+        if (read(wake_fd, &wake_count, sizeof wake_count) == -1
+            && errno != EAGAIN) {
+          perror(__PRETTY_FUNCTION__);
+          fprintf(stderr, "%s: read(wake_fd) failed\n", __PRETTY_FUNCTION__);
+          abort();
+        }
+        continue;
+      }
+
+      auto it = jobs.find(token);
+      if (it != jobs.end()) {
+        run_job(it);
+      }
+    }
+
+    Request request;
+    while (requests.try_pop(request)) {
+      if (request.socket_fd == -1) {
+        cancel_job(request.token);
+      } else {
+        start_job(request);
+      }
+    }
+  }
+
+  for (auto &job : jobs) {
+    close(job.second.request.socket_fd);
+    close(job.second.request.file_fd);
+  }
+  jobs.clear();
+}
+
+void SendfileShards::Shard::start_job(const Request &request) {
+  auto it = jobs.insert(std::make_pair(request.token,
+                                       Job{.request    = request,
+                                           .bytes_sent = 0})).first;
+
+  struct epoll_event event;
+  event.events   = EPOLLOUT;
+  event.data.u64 = request.token;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, request.socket_fd, &event) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: epoll_ctl(%d) failed\n",
+                    __PRETTY_FUNCTION__, request.socket_fd);
+    abort();
+  }
+
+  run_job(it);
+}
+
+void SendfileShards::Shard::cancel_job(Token token) {
+  auto it = jobs.find(token);
+  if (it == jobs.end()) {
+    return; // already completed
+  }
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, it->second.request.socket_fd, NULL);
+  close(it->second.request.socket_fd);
+  close(it->second.request.file_fd);
+  jobs.erase(it);
+}
+
+void SendfileShards::Shard::run_job(std::map<Token, Job>::iterator it) {
+  Job &job = it->second;
+
+  while (job.bytes_sent < job.request.length) {
+    ssize_t sendfile_result = sendfile(job.request.socket_fd,
+                                       job.request.file_fd,
+                                       &job.request.offset,
+                                       job.request.length - job.bytes_sent);
+    if (sendfile_result == -1) {
+      if (errno == EAGAIN) {
+        return;
+      }
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: sendfile() failed\n", __PRETTY_FUNCTION__);
+      finish_job(it, true);
+      return;
+    }
+
+    if (sendfile_result == 0) {
+      fprintf(stderr, "%s: sendfile() reached end of file\n",
+                      __PRETTY_FUNCTION__);
+      finish_job(it, true);
+      return;
+    }
+
+    job.bytes_sent += sendfile_result;
+  }
+
+  finish_job(it, false);
+}
+
+void SendfileShards::Shard::finish_job(std::map<Token, Job>::iterator it,
+                                       bool failed) {
+  const Job &job = it->second;
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, job.request.socket_fd, NULL);
+  close(job.request.socket_fd);
+  close(job.request.file_fd);
+
+  const Completion completion = {
+    .token      = job.request.token,
+    .bytes_sent = job.bytes_sent,
+    .failed     = failed
+  };
+  jobs.erase(it);
+
+  /* The main thread never blocks on this shard, so it will make space. */
+  while (!completions.try_push(completion)) {
+    std::this_thread::yield();
+  }
+
+  uint64_t one = 1;
+  if (write(completion_fd, &one, sizeof one) != sizeof one) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: write(completion_fd) failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+}
+
+SendfileShards::SendfileShards(Epoll::Manager &manager, size_t shard_count)
+  : manager(manager),
+    completion_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+
+  if (completion_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: eventfd() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+  manager.register_handler(completion_fd, this, EPOLLIN);
+
+  /* Pin the shards to the CPUs available to this process, leaving the first
+   * one to the main event loop where possible. */
+  std::vector<int> cpus;
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (sched_getaffinity(0, sizeof cpu_set, &cpu_set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &cpu_set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < shard_count; i++) {
+    int cpu = cpus.empty() ? -1 : cpus[(i + 1) % cpus.size()];
+    shards.push_back(std::unique_ptr<Shard>(new Shard(completion_fd, cpu)));
+  }
+}
+
+SendfileShards::~SendfileShards() {
+  shards.clear();
+  manager.deregister_close_and_clear(completion_fd);
+}
+
+size_t SendfileShards::choose_shard() {
+  assert(!shards.empty());
+  size_t shard = next_shard;
+  next_shard = (next_shard + 1) % shards.size();
+  return shard;
+}
+
+SendfileShards::Token SendfileShards::dispatch
+      (Client   *client,
+       size_t    shard,
+       int       socket_fd,
+       int       file_fd,
+       off_t     offset,
+       uint64_t  length) {
+
+  assert(shard < shards.size());
+
+  Request request = {
+    .token     = next_token++,
+    .socket_fd = dup(socket_fd),
+    .file_fd   = dup(file_fd),
+    .offset    = offset,
+    .length    = length
+  };
+
+  if (request.socket_fd == -1 || request.file_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: dup() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  in_flight[request.token] = {.client = client, .shard = shard};
+  shards[shard]->submit(request);
+  return request.token;
+}
+
+void SendfileShards::cancel(Token token) {
+  auto it = in_flight.find(token);
+  if (it == in_flight.end()) {
+    return;
+  }
+
+  Request request = {
+    .token     = token,
+    .socket_fd = -1,
+    .file_fd   = -1,
+    .offset    = 0,
+    .length    = 0
+  };
+  shards[it->second.shard]->submit(request);
+  in_flight.erase(it);
+}
+
+void SendfileShards::handle_readable() {
+  uint64_t completion_count;
+  if (read(completion_fd, &completion_count, sizeof completion_count) == -1) {
+    if (errno == EAGAIN) {
+      return;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: read() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  for (auto &shard : shards) {
+    Completion completion;
+    while (shard->completions.try_pop(completion)) {
+      auto it = in_flight.find(completion.token);
+      if (it == in_flight.end()) {
+        continue; // cancelled
+      }
+      Client *client = it->second.client;
+      in_flight.erase(it);
+      client->sendfile_completed(completion.bytes_sent, completion.failed);
+    }
+    shard->flush_overflow();
+  }
+}
+
+void SendfileShards::handle_writeable() {
+  fprintf(stderr, "%s: unexpected\n", __PRETTY_FUNCTION__);
+  abort();
+}
+
+void SendfileShards::handle_error(const uint32_t events) {
+  fprintf(stderr, "%s (events=%x): unexpected\n", __PRETTY_FUNCTION__, events);
+  abort();
+}
+
+}
@@ -0,0 +1,53 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Subscriber/Listener.h"
+
+namespace Pipeline {
+namespace Subscriber {
+
+Listener::Listener(Epoll::Manager &manager,
+                   SegmentCache   &segment_cache,
+                   const char     *port)
+  : AbstractListener(manager, port),
+    segment_cache(segment_cache) {}
+
+void Listener::handle_accept(int client_fd) {
+  auto it = subscriber_sockets.begin();
+  while (it != subscriber_sockets.end()) {
+    if ((*it)->is_shutdown()) {
+      it = subscriber_sockets.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  subscriber_sockets.push_back(std::unique_ptr<Socket>
+    (new Socket(manager, segment_cache, client_fd)));
+}
+
+void Listener::handle_stream_content(const Paxos::Proposal &proposal) {
+  for (auto &socket : subscriber_sockets) {
+    socket->handle_stream_content(proposal);
+  }
+}
+
+}
+}
@@ -0,0 +1,171 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Subscriber/Socket.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace Pipeline {
+namespace Subscriber {
+
+Socket::Socket(Epoll::Manager &manager,
+               SegmentCache   &segment_cache,
+               const int       fd)
+  : manager       (manager),
+    segment_cache (segment_cache),
+    fd            (fd) {
+
+  manager.register_handler(fd, this, EPOLLIN);
+
+#ifndef NTRACE
+  printf("%s: fd=%d\n", __PRETTY_FUNCTION__, fd);
+#endif // ndef NTRACE
+}
+
+Socket::~Socket() {
+#ifndef NTRACE
+  printf("%s: fd=%d\n", __PRETTY_FUNCTION__, fd);
+#endif // ndef NTRACE
+
+  shutdown();
+}
+
+void Socket::shutdown() {
+  manager.deregister_close_and_clear(fd);
+  reader = NULL;
+}
+
+void Socket::handle_readable() {
+  if (fd == -1) { return; }
+
+  uint8_t buf[sizeof(Request)];
+  uint8_t *read_to = reader ? buf
+                   : reinterpret_cast<uint8_t*>(&request) + request_bytes;
+  size_t read_size = reader ? sizeof buf : sizeof request - request_bytes;
+
+  ssize_t read_result = read(fd, read_to, read_size);
+
+  if (read_result == -1) {
+    if (errno == EAGAIN) {
+      return;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: read() failed\n", __PRETTY_FUNCTION__);
+    shutdown();
+    return;
+  }
+
+  if (read_result == 0) {
+#ifndef NTRACE
+    printf("%s: EOF (fd=%d)\n", __PRETTY_FUNCTION__, fd);
+#endif // ndef NTRACE
+    shutdown();
+    return;
+  }
+
+  if (reader) {
+    fprintf(stderr, "%s (fd=%d): unexpected data after request\n",
+                    __PRETTY_FUNCTION__, fd);
+    shutdown();
+    return;
+  }
+
+  request_bytes += read_result;
+  if (request_bytes < sizeof request) {
+    return;
+  }
+
+  Paxos::Value::StreamName stream = { .owner = request.owner,
+                                      .id    = request.id };
+#ifndef NTRACE
+  printf("%s (fd=%d): subscribed to stream %d.%d\n",
+    __PRETTY_FUNCTION__, fd, stream.owner, stream.id);
+#endif // ndef NTRACE
+  reader = std::unique_ptr<ChosenStreamReader>
+    (new ChosenStreamReader(segment_cache, stream));
+}
+
+void Socket::handle_writeable() {
+  if (fd == -1) { return; }
+  send_chosen_data();
+}
+
+void Socket::handle_error(const uint32_t events) {
+  fprintf(stderr, "%s (fd=%d, events=%x): unexpected\n",
+                  __PRETTY_FUNCTION__, fd, events);
+  shutdown();
+}
+
+void Socket::handle_stream_content(const Paxos::Proposal &proposal) {
+  if (fd == -1 || !reader) { return; }
+
+  const auto &stream = proposal.value.payload.stream.name;
+  if (stream.owner != reader->get_stream().owner
+      || stream.id != reader->get_stream().id) {
+    return;
+  }
+
+  reader->add_chosen(proposal);
+  if (SUBSCRIBER_MAX_LAG_BYTES < reader->get_unread_bytes()) {
+    fprintf(stderr, "%s (fd=%d): subscriber lags by %lu bytes\n",
+                    __PRETTY_FUNCTION__, fd, reader->get_unread_bytes());
+    shutdown();
+    return;
+  }
+
+  if (!waiting_for_writeable) {
+    send_chosen_data();
+  }
+}
+
+void Socket::send_chosen_data() {
+  while (reader->has_unread()) {
+    switch (reader->send_to(fd, SUBSCRIBER_SEND_SIZE)) {
+      case ChosenStreamReader::Result::succeeded:
+        break;
+
+      case ChosenStreamReader::Result::blocked:
+        if (!waiting_for_writeable) {
+          manager.modify_handler(fd, this, EPOLLIN | EPOLLOUT);
+          waiting_for_writeable = true;
+        }
+        return;
+
+      case ChosenStreamReader::Result::unavailable:
+        fprintf(stderr, "%s (fd=%d): chosen data not held locally\n",
+                        __PRETTY_FUNCTION__, fd);
+        shutdown();
+        return;
+
+      case ChosenStreamReader::Result::failed:
+        shutdown();
+        return;
+    }
+  }
+
+  if (waiting_for_writeable) {
+    manager.modify_handler(fd, this, EPOLLIN);
+    waiting_for_writeable = false;
+  }
+}
+
+}
+}
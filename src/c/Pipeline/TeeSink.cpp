@@ -0,0 +1,195 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/TeeSink.h"
+#include "Pipeline/PipeBudget.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace Pipeline {
+
+TeeSink::TeeSink() {
+  if (pipe2(pipe_fds, O_NONBLOCK) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: pipe2() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+
+  // A smaller pipe only means that less is teed and more is read back from
+  // the segment.
+  pipe_size = PipeBudget::shared().acquire(pipe_fds[0], TEE_SINK_PIPE_SIZE);
+
+  devnull_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (devnull_fd == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: open(/dev/null) failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+}
+
+TeeSink::~TeeSink() {
+  PipeBudget::shared().release(pipe_size);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  close(devnull_fd);
+}
+
+uint64_t TeeSink::tee_from(int                               fd,
+                           const Paxos::Value::OffsetStream &stream,
+                           const Paxos::Slot                &start_slot,
+                           uint64_t                          length) {
+  last_tee_trimmable = false;
+
+  ssize_t tee_result = tee(fd, pipe_fds[1], length, SPLICE_F_NONBLOCK);
+  if (tee_result == -1) {
+    if (errno == EAGAIN) {
+      return 0;
+    }
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: tee() failed\n", __PRETTY_FUNCTION__);
+    abort();
+  }
+  if (tee_result == 0) {
+    return 0;
+  }
+
+  extents.push_back({
+    .stream     = stream,
+    .start_slot = start_slot,
+    .length     = (uint64_t)tee_result,
+    .wanted     = true});
+  bytes_teed += tee_result;
+  last_tee_trimmable = true;
+  return tee_result;
+}
+
+void TeeSink::trim_last(uint64_t kept) {
+  if (!last_tee_trimmable) {
+    return;
+  }
+  last_tee_trimmable = false;
+  assert(!extents.empty());
+
+  auto &last = extents.back();
+  if (last.length <= kept) {
+    return;
+  }
+
+  Extent unwanted = last;
+  unwanted.start_slot += kept;
+  unwanted.length     -= kept;
+  unwanted.wanted      = false;
+
+  if (kept == 0) {
+    last = unwanted;
+  } else {
+    last.length = kept;
+    extents.push_back(unwanted);
+  }
+}
+
+void TeeSink::discard(uint64_t length) {
+  assert(claimed_bytes == 0);
+  while (0 < length) {
+    ssize_t splice_result = splice(pipe_fds[0], NULL, devnull_fd, NULL,
+                                   length, SPLICE_F_NONBLOCK);
+    if (splice_result <= 0) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: splice() failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+    length          -= splice_result;
+    bytes_discarded += splice_result;
+  }
+}
+
+uint64_t TeeSink::claim(const Paxos::Value::OffsetStream &stream,
+                        const Paxos::SlotRange           &slots) {
+  while (!extents.empty()) {
+    auto &extent = extents.front();
+
+    const bool same_stream = extent.wanted
+                          && extent.stream.name.owner == stream.name.owner
+                          && extent.stream.name.id    == stream.name.id
+                          && extent.stream.offset     == stream.offset;
+
+    if (same_stream && extent.start_slot == slots.start()) {
+      const uint64_t claimed
+        = std::min(extent.length, slots.end() - slots.start());
+      extent.start_slot += claimed;
+      extent.length     -= claimed;
+      if (extent.length == 0) {
+        extents.pop_front();
+      }
+      claimed_bytes += claimed;
+      return claimed;
+    }
+
+    if (same_stream && slots.start() < extent.start_slot) {
+      // Not teed from the start of these slots, but may be wanted later.
+      return 0;
+    }
+
+    // Not wanted, at least in part: discard the unwanted prefix if possible.
+    if (0 < claimed_bytes) {
+      return 0;
+    }
+
+    uint64_t unwanted = extent.length;
+    if (same_stream) {
+      unwanted = std::min(unwanted, slots.start() - extent.start_slot);
+    }
+    discard(unwanted);
+    extent.start_slot += unwanted;
+    extent.length     -= unwanted;
+    if (extent.length == 0) {
+      extents.pop_front();
+    }
+  }
+
+  return 0;
+}
+
+ssize_t TeeSink::send_claimed(int fd, uint64_t length) {
+  assert(length <= claimed_bytes);
+  ssize_t splice_result = splice(pipe_fds[0], NULL, fd, NULL, length,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+                                               | SPLICE_F_MORE);
+  if (0 < splice_result) {
+    claimed_bytes -= splice_result;
+    bytes_sent    += splice_result;
+  }
+  return splice_result;
+}
+
+void TeeSink::release(uint64_t length) {
+  // Only the current sender claims anything, and it releases all it has.
+  assert(length == claimed_bytes);
+  claimed_bytes = 0;
+  discard(length);
+}
+
+}
@@ -45,25 +45,53 @@ RealWorld::RealWorld(
           node_name.cluster.c_str()));
   ensure_directory("data", path);
 
-  char parent[PATH_MAX];
-  strncpy(parent, path, PATH_MAX);
-  ensure_length(snprintf(path, PATH_MAX,
-          "data/clu_%s/n_%08x",
-          node_name.cluster.c_str(), node_name.id));
-  ensure_directory(parent, path);
+  if (node_name.group != 0) {
+    ensure_directory(path, node_name.group_directory.c_str());
+  }
 
-  strncpy(parent, path, PATH_MAX);
+  ensure_directory(node_name.group_directory.c_str(),
+                   node_name.directory.c_str());
+
+  char parent[PATH_MAX];
+  ensure_length(snprintf(parent, PATH_MAX, "%s", node_name.directory.c_str()));
   ensure_length(snprintf(path, PATH_MAX,
-          "data/clu_%s/n_%08x/n_%08x.log",
-          node_name.cluster.c_str(), node_name.id, node_name.id));
+          "%s/n_%08x.log",
+          node_name.directory.c_str(), node_name.id));
 
-  log_fd = open(path, O_WRONLY | O_CREAT, 0644);
+  log_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
   if (log_fd == -1) {
     perror(__PRETTY_FUNCTION__);
     fprintf(stderr, "%s: open(%s) failed\n", __PRETTY_FUNCTION__, path);
     abort();
   }
 
+  off_t log_end = lseek(log_fd, 0, SEEK_END);
+  if (log_end == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: lseek(%s) failed\n", __PRETTY_FUNCTION__, path);
+    abort();
+  }
+
+  // A line torn by a crash is ended, so that the next one is not joined to it.
+  char last_char = '\n';
+  if (0 < log_end && pread(log_fd, &last_char, 1, log_end - 1) != 1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: pread(%s) failed\n", __PRETTY_FUNCTION__, path);
+    abort();
+  }
+  if (last_char != '\n') {
+    if (write(log_fd, "\n", 1) != 1 || fsync(log_fd) == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: ending torn line in %s failed\n",
+                      __PRETTY_FUNCTION__, path);
+      abort();
+    }
+    log_end += 1;
+  }
+
+  log_offset        = log_end;
+  synced_log_offset = log_end;
+
   sync_directory(parent);
 }
 
@@ -74,6 +102,21 @@ RealWorld::~RealWorld() {
   }
 }
 
+void RealWorld::set_manager(Epoll::Manager *m) {
+  manager = m;
+  if (manager != NULL && wake_up_handler != NULL) {
+    manager->schedule_timer(wake_up_handler, next_wake_up_time);
+  }
+}
+
+void RealWorld::set_wake_up_handler(Epoll::TimerHandler *h) {
+  assert(wake_up_handler == NULL);
+  wake_up_handler = h;
+  if (manager != NULL && wake_up_handler != NULL) {
+    manager->schedule_timer(wake_up_handler, next_wake_up_time);
+  }
+}
+
 void RealWorld::add_chosen_value_handler(Pipeline::Client::ChosenStreamContentHandler *handler) {
   chosen_stream_content_handlers.push_back(handler);
 }
@@ -112,8 +155,7 @@ void RealWorld::send_catch_up(
   const Paxos::Era&               current_era,
   const Paxos::Configuration&     current_configuration,
   const Paxos::NodeId&            next_generated_node_id,
-  const Paxos::Value::StreamName& current_stream,
-  const uint64_t                  current_stream_pos) {
+  const std::vector<Paxos::Value::StreamPosition>& open_streams) {
 
   for (auto &target : targets) {
     target->send_catch_up(destination,
@@ -121,8 +163,7 @@ void RealWorld::send_catch_up(
                          current_era,
                          current_configuration,
                          next_generated_node_id,
-                         current_stream,
-                         current_stream_pos);
+                         open_streams);
   }
 }
 
@@ -137,6 +178,8 @@ void RealWorld::write_log_line(std::ostringstream &os) {
   const char *buf = oss.c_str();
   size_t bytes_to_write = oss.length();
 
+  log_offset += bytes_to_write;
+
   while (bytes_to_write > 0) {
     ssize_t write_result = write(log_fd, buf, bytes_to_write);
     if (write_result == -1) {
@@ -153,6 +196,13 @@ void RealWorld::write_log_line(std::ostringstream &os) {
     }
   }
 
+  if (manager != NULL) {
+    manager->sync_in_background(log_fd, this);
+    actions_awaiting_log_syncs.push_back(std::vector<std::function<void()>>());
+    log_offsets_awaiting_syncs.push_back(log_offset);
+    return;
+  }
+
   int fsync_result = fsync(log_fd);
   if (fsync_result == -1) {
     perror(__PRETTY_FUNCTION__);
@@ -160,6 +210,145 @@ void RealWorld::write_log_line(std::ostringstream &os) {
       __PRETTY_FUNCTION__);
     abort();
   }
+  synced_log_offset = log_offset;
+}
+
+void RealWorld::replay_log(uint64_t from,
+                           Paxos::Term &promise,
+                           std::vector<Paxos::Proposal> &acceptances) const {
+  char path[PATH_MAX];
+  ensure_length(snprintf(path, PATH_MAX,
+          "%s/n_%08x.log",
+          node_name.directory.c_str(), node_name.id));
+
+  FILE *log_file = fopen(path, "r");
+  if (log_file == NULL) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fopen(%s) failed\n", __PRETTY_FUNCTION__, path);
+    return;
+  }
+
+  if (fseek(log_file, from, SEEK_SET) == -1) {
+    perror(__PRETTY_FUNCTION__);
+    fprintf(stderr, "%s: fseek(%s) failed\n", __PRETTY_FUNCTION__, path);
+    fclose(log_file);
+    return;
+  }
+
+  char line[256];
+  while (fgets(line, sizeof line, log_file) != NULL) {
+    // A line without its newline was torn by a crash, and was never synced.
+    if (strchr(line, '\n') == NULL) {
+      break;
+    }
+
+    Paxos::Era        era;
+    Paxos::TermNumber term_number;
+    Paxos::NodeId     owner;
+    Paxos::Slot       start_slot, end_slot;
+    char              type[32];
+    unsigned int      argument = 0;
+    int               consumed = 0;
+
+    // A torn line that was ended after a restart matches only in part.
+    if (sscanf(line, "promise %x.%x.%x at slot %*x made%n",
+                     &era, &term_number, &owner, &consumed) == 3
+        && line[consumed] == '\n') {
+      const Paxos::Term term(era, term_number, owner);
+      if (promise < term) {
+        promise = term;
+      }
+      continue;
+    }
+
+    int fields = sscanf(line,
+      "proposal accepted for slots [%lx,%lx) at term %x.%x.%x: %31s%n",
+      &start_slot, &end_slot, &era, &term_number, &owner, type, &consumed);
+    if (fields < 6) {
+      fprintf(stderr, "%s: unexpected line in %s: %s",
+                      __PRETTY_FUNCTION__, path, line);
+      continue;
+    }
+
+    Paxos::Value value;
+    memset(&value, 0, sizeof value);
+    size_t argument_width = 8;
+    if (strcmp(type, "no-op") == 0) {
+      value.type = Paxos::Value::Type::no_op;
+      argument_width = 0;
+    } else if (strcmp(type, "generate-node-id") == 0) {
+      value.type = Paxos::Value::Type::generate_node_id;
+    } else if (strcmp(type, "reconfiguration_inc") == 0) {
+      value.type = Paxos::Value::Type::reconfiguration_inc;
+    } else if (strcmp(type, "reconfiguration_dec") == 0) {
+      value.type = Paxos::Value::Type::reconfiguration_dec;
+    } else if (strcmp(type, "reconfiguration_mul") == 0) {
+      value.type = Paxos::Value::Type::reconfiguration_mul;
+      argument_width = 2;
+    } else if (strcmp(type, "reconfiguration_div") == 0) {
+      value.type = Paxos::Value::Type::reconfiguration_div;
+      argument_width = 2;
+    } else {
+      fprintf(stderr, "%s: unexpected value in %s: %s",
+                      __PRETTY_FUNCTION__, path, line);
+      continue;
+    }
+
+    // The argument is written at a fixed width, so a torn one is too short.
+    const char *rest = line + consumed;
+    if (argument_width == 0
+          ? strcmp(rest, "\n") != 0
+          : strlen(rest) != argument_width + 2
+            || sscanf(rest, " %x", &argument) != 1) {
+      fprintf(stderr, "%s: unexpected line in %s: %s",
+                      __PRETTY_FUNCTION__, path, line);
+      continue;
+    }
+
+    switch (value.type) {
+      case Paxos::Value::Type::generate_node_id:
+        value.payload.originator = argument;
+        break;
+      case Paxos::Value::Type::reconfiguration_inc:
+      case Paxos::Value::Type::reconfiguration_dec:
+        value.payload.reconfiguration.subject = argument;
+        break;
+      case Paxos::Value::Type::reconfiguration_mul:
+      case Paxos::Value::Type::reconfiguration_div:
+        value.payload.reconfiguration.factor = argument;
+        break;
+      default:
+        break;
+    }
+
+    Paxos::Proposal proposal = {
+      .slots = Paxos::SlotRange(start_slot, end_slot),
+      .term  = Paxos::Term(era, term_number, owner),
+      .value = value
+    };
+    acceptances.push_back(proposal);
+  }
+
+  fclose(log_file);
+}
+
+void RealWorld::after_log_synced(const std::function<void()> &action) {
+  if (actions_awaiting_log_syncs.empty()) {
+    action();
+  } else {
+    actions_awaiting_log_syncs.back().push_back(action);
+  }
+}
+
+void RealWorld::handle_synced() {
+  assert(!actions_awaiting_log_syncs.empty());
+  const auto actions = actions_awaiting_log_syncs.front();
+  actions_awaiting_log_syncs.pop_front();
+  synced_log_offset = log_offsets_awaiting_syncs.front();
+  log_offsets_awaiting_syncs.pop_front();
+  for (const auto &action : actions) {
+    action();
+  }
 }
 
 void RealWorld::record_promise(const Paxos::Term &t, const Paxos::Slot &s) {
@@ -183,9 +372,11 @@ void RealWorld::record_promise(const Paxos::Term &t, const Paxos::Slot &s) {
 }
 
 void RealWorld::make_promise(const Paxos::Promise &promise) {
-  for (auto &target : targets) {
-    target->make_promise(promise);
-  }
+  after_log_synced([this, promise]() {
+    for (auto &target : targets) {
+      target->make_promise(promise);
+    }
+  });
 }
 
 void RealWorld::record_non_stream_content_acceptance(const Paxos::Proposal &proposal) {
@@ -246,22 +437,38 @@ void RealWorld::record_non_stream_content_acceptance(const Paxos::Proposal &prop
 void RealWorld::proposed_and_accepted(const Paxos::Proposal &proposal) {
   if (LIKELY(proposal.value.type == Paxos::Value::Type::stream_content)) {
     segment_cache.ensure_locally_accepted(proposal);
+    for (auto &target : targets) {
+      target->proposed_and_accepted(proposal);
+    }
   } else {
     record_non_stream_content_acceptance(proposal);
+    after_log_synced([this, proposal]() {
+      for (auto &target : targets) {
+        target->proposed_and_accepted(proposal);
+      }
+    });
   }
+}
 
+void RealWorld::proposed(const Paxos::Proposal &proposal) {
+  assert(proposal.value.type == Paxos::Value::Type::stream_content);
   for (auto &target : targets) {
-    target->proposed_and_accepted(proposal);
+    target->proposed(proposal);
   }
 }
 
 void RealWorld::accepted(const Paxos::Proposal &proposal) {
-  if (UNLIKELY(proposal.value.type != Paxos::Value::Type::stream_content)) {
+  if (LIKELY(proposal.value.type == Paxos::Value::Type::stream_content)) {
+    for (auto &target : targets) {
+      target->accepted(proposal);
+    }
+  } else {
     record_non_stream_content_acceptance(proposal);
-  }
-
-  for (auto &target : targets) {
-    target->accepted(proposal);
+    after_log_synced([this, proposal]() {
+      for (auto &target : targets) {
+        target->accepted(proposal);
+      }
+    });
   }
 }
 
@@ -300,12 +507,10 @@ void RealWorld::chosen_non_contiguous_stream_content
 
 void RealWorld::chosen_unknown_stream_content
       (const Paxos::Proposal &proposal,
-       Paxos::Value::StreamName expected_stream,
        uint64_t               first_stream_pos) {
 #ifndef NTRACE
   std::cout << __PRETTY_FUNCTION__
     << " proposal=" << proposal
-    << " expected=" << expected_stream
     << " first_stream_pos=" << first_stream_pos
     << std::endl;
 #endif
@@ -388,18 +593,15 @@ void RealWorld::set_current_time(const Paxos::instant &t) {
   current_time = t;
 }
 
-const Paxos::instant RealWorld::get_next_wake_up_time() const {
-  return next_wake_up_time;
-}
-
 void RealWorld::set_next_wake_up_time(const Paxos::instant &t) {
-  if (next_wake_up_time < t) {
 #ifndef NTRACE
-    std::cout << __PRETTY_FUNCTION__ << ": " <<
-      std::chrono::time_point_cast<std::chrono::milliseconds>
-        (t).time_since_epoch().count() << std::endl;
+  std::cout << __PRETTY_FUNCTION__ << ": " <<
+    std::chrono::time_point_cast<std::chrono::milliseconds>
+      (t).time_since_epoch().count() << std::endl;
 #endif // ndef NTRACE
-    next_wake_up_time = t;
+  next_wake_up_time = t;
+  if (manager != NULL && wake_up_handler != NULL) {
+    manager->schedule_timer(wake_up_handler, next_wake_up_time);
   }
 }
 
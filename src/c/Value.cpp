@@ -53,4 +53,19 @@ std::ostream& operator<<(std::ostream &o, const Value::OffsetStream &os) {
   return o << os.name << "@" << os.offset;
 }
 
+std::ostream& operator<<(std::ostream &o, const Value::StreamPosition &sp) {
+  return o << sp.name << ":" << sp.position << "@" << sp.last_chosen_slot;
+}
+
+std::ostream& operator<<(std::ostream &o,
+                         const std::vector<Value::StreamPosition> &sps) {
+  o << "[";
+  bool first = true;
+  for (const auto &sp : sps) {
+    if (first) { first = false; } else { o << ", "; }
+    o << sp;
+  }
+  return o << "]";
+}
+
 }
@@ -29,6 +29,14 @@
 #include <string>
 
 void ensure_directory(const char *parent, const char *path) {
+  if (ensure_directory_without_sync(path)) {
+    sync_directory(parent);
+  }
+}
+
+/* Returns true if the directory was created, in which case the caller is
+   responsible for syncing its parent. */
+bool ensure_directory_without_sync(const char *path) {
   struct stat buf;
   if (stat(path, &buf) == -1) {
     if (errno == ENOENT) {
@@ -38,7 +46,7 @@ void ensure_directory(const char *parent, const char *path) {
                         __PRETTY_FUNCTION__, path);
         abort();
       }
-      sync_directory(parent);
+      return true;
 
     } else {
       perror(__PRETTY_FUNCTION__);
@@ -52,6 +60,7 @@ void ensure_directory(const char *parent, const char *path) {
                       __PRETTY_FUNCTION__, path);
       abort();
     }
+    return false;
   }
 }
 
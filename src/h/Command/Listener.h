@@ -26,6 +26,7 @@
 #include "Paxos/Legislator.h"
 #include "Pipeline/AbstractListener.h"
 #include "Pipeline/NodeName.h"
+#include "Pipeline/SegmentCache.h"
 
 #include <memory>
 #include <sstream>
@@ -41,6 +42,7 @@ class Socket : public Epoll::Handler {
   Epoll::Manager        &manager;
   Paxos::Legislator     &legislator;
   const NodeName        &node_name;
+  const Pipeline::SegmentCache &segment_cache;
   int                    fd = -1;
   Paxos::Slot            node_id_generation_slot = 0;
 
@@ -52,10 +54,12 @@ public:
   Socket(Epoll::Manager    &manager,
          Paxos::Legislator &legislator,
    const NodeName          &node_name,
+   const Pipeline::SegmentCache &segment_cache,
    const int                fd)
     : manager(manager),
       legislator(legislator),
       node_name(node_name),
+      segment_cache(segment_cache),
       fd(fd) {
 
       manager.register_handler(fd, this, EPOLLIN);
@@ -98,6 +102,16 @@ public:
         if (word == "stat") {
           response << "cluster: " << node_name.cluster << std::endl
                    << legislator << std::endl;
+        } else if (word == "disk") {
+          const auto usage = segment_cache.get_reclaimer_usage();
+          response << "cached segments: " << segment_cache.get_entry_count()
+                   << " (" << segment_cache.get_cached_bytes() << " bytes closed)"
+                   << std::endl
+                   << "retained segments: " << usage.retained_files
+                   << " (" << usage.retained_bytes << " bytes)" << std::endl
+                   << "reclaimed segments: " << usage.reclaimed_files
+                   << " (" << usage.reclaimed_bytes << " bytes, "
+                   << usage.recycled_files << " recycled)" << std::endl;
         } else if (word == "conf") {
           legislator.write_configuration_to(response);
         } else if (word == "new") {
@@ -213,6 +227,7 @@ class Listener : public Pipeline::AbstractListener, public NodeIdGenerationHandl
 
   Paxos::Legislator     &legislator;
   const NodeName        &node_name;
+  const Pipeline::SegmentCache &segment_cache;
   std::vector<std::unique_ptr<Socket>> sockets;
 
 protected:
@@ -225,17 +240,19 @@ protected:
       sockets.end());
 
     sockets.push_back(std::move(std::unique_ptr<Socket>
-      (new Socket(manager, legislator, node_name, client_fd))));
+      (new Socket(manager, legislator, node_name, segment_cache, client_fd))));
   }
 
 public:
   Listener(Epoll::Manager    &manager,
            Paxos::Legislator &legislator,
            const NodeName    &node_name,
+           const Pipeline::SegmentCache &segment_cache,
            const char        *port)
     : AbstractListener(manager, port),
       legislator(legislator),
-      node_name(node_name) {}
+      node_name(node_name),
+      segment_cache(segment_cache) {}
 
   void handle_node_id_generation(Paxos::Slot slot, Paxos::NodeId new_node_id) override {
     for (auto &socket : sockets) {
@@ -24,6 +24,7 @@
 #include "Epoll.h"
 #include "Pipeline/NodeName.h"
 #include "Pipeline/Peer/Protocol.h"
+#include "directories.h"
 
 #include <vector>
 #include <string>
@@ -34,7 +35,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 namespace Command {
 
@@ -235,11 +238,76 @@ private:
     }
   }
 
+  /* Reads back the name saved by save_node_name(), returning false if there
+     is none yet. */
+  static bool load_node_name(std::string &cluster, Paxos::NodeId &node) {
+    std::ifstream node_file("data/node");
+    if (!node_file) {
+      return false;
+    }
+
+    std::string loaded_cluster;
+    Paxos::NodeId loaded_node = 0;
+    node_file >> loaded_cluster >> loaded_node;
+    if (!node_file || loaded_cluster.empty() || loaded_node == 0) {
+      fprintf(stderr, "%s: data/node is corrupt\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+
+    cluster.assign(loaded_cluster);
+    node = loaded_node;
+    return true;
+  }
+
+  /* Durably records the name, replacing any previous one in a single
+     rename so that a crash leaves either the old name or the new one. */
+  static void save_node_name(const std::string &cluster,
+                             const Paxos::NodeId node) {
+    ensure_directory(".", "data");
+
+    FILE *node_file = fopen("data/node.tmp", "w");
+    if (node_file == NULL) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: fopen(data/node.tmp) failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+
+    if (fprintf(node_file, "%s %u\n", cluster.c_str(), node) < 0
+        || fflush(node_file) != 0
+        || fsync(fileno(node_file)) == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: writing data/node.tmp failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+
+    if (fclose(node_file) != 0) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: fclose(data/node.tmp) failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+
+    if (rename("data/node.tmp", "data/node") == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: rename(data/node.tmp) failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+
+    sync_directory("data");
+  }
+
 public:
 
+  /* A node that has run before carries on under the cluster and node id in
+     data/node, so that it finds its own data directory and manifest again.
+     Otherwise it starts a new cluster, or registers with an existing one at
+     one of the given addresses, and saves the name it ends up with. */
   static void get_node_name(std::string &cluster, Paxos::NodeId &node,
                             const std::vector<Address> &addresses) {
 
+    if (load_node_name(cluster, node)) {
+      return;
+    }
+
     if (addresses.empty()) {
       std::ifstream uuid_file("/proc/sys/kernel/random/uuid");
       std::string uuid;
@@ -251,6 +319,8 @@ public:
       Registration r(cluster, node, addresses);
       r.go();
     }
+
+    save_node_name(cluster, node);
   }
 };
 
@@ -0,0 +1,141 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef CONSENSUS_GROUP_H
+#define CONSENSUS_GROUP_H
+
+#include "Command/Listener.h"
+#include "Pipeline/ChosenLogCompactor.h"
+#include "Pipeline/Client/Listener.h"
+#include "Pipeline/Peer/Listener.h"
+#include "Pipeline/Peer/Target.h"
+#include "Pipeline/SegmentManifest.h"
+#include "Pipeline/SendfileShards.h"
+#include "Pipeline/Subscriber/Listener.h"
+#include "Paxos/Legislator.h"
+#include "RealWorld.h"
+#include "Epoll.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/* One independent consensus group hosted by this node, with its own
+   Legislator, slot sequence, data directory and stream namespace. Several
+   groups share the node's event loop. Group G listens for peers and commands
+   on the configured ports plus G and connects to its peers' ports plus G, so
+   peer connections never cross groups. All groups share the client port,
+   relying on SO_REUSEPORT to spread incoming client connections across them
+   by hashing. The Legislator is woken up by this group's timer. */
+class ConsensusGroup : public Epoll::TimerHandler {
+  ConsensusGroup           (const ConsensusGroup&) = delete; // no copying
+  ConsensusGroup &operator=(const ConsensusGroup&) = delete; // no assignment
+
+  const Pipeline::NodeName                              node_name;
+        Pipeline::SegmentCache                          segment_cache;
+        std::vector<std::unique_ptr<Pipeline::Peer::Target>> targets;
+        RealWorld                                       real_world;
+        Paxos::Legislator                               legislator;
+        Pipeline::SegmentManifest                       manifest;
+
+        std::unique_ptr<Pipeline::Client::Listener>     client_listener;
+        std::unique_ptr<Pipeline::Peer::Listener>       peer_listener;
+        std::unique_ptr<Command::Listener>              command_listener;
+        std::unique_ptr<Pipeline::Subscriber::Listener> subscriber_listener;
+        std::unique_ptr<Pipeline::ChosenLogCompactor>   chosen_log_compactor;
+        std::vector<Pipeline::TeeSink*>                 tee_sinks;
+
+public:
+  ConsensusGroup(const std::string&,
+                 const Paxos::NodeId,
+                 const uint32_t,
+                 const Paxos::Configuration&);
+
+  const Pipeline::NodeName &get_node_name() const { return node_name; }
+  Pipeline::SegmentCache   &get_segment_cache()   { return segment_cache; }
+  RealWorld                &get_real_world()      { return real_world; }
+  Paxos::Legislator        &get_legislator()      { return legislator; }
+  Pipeline::Client::Listener &get_client_listener() {
+    return *client_listener;
+  }
+  const std::vector<std::unique_ptr<Pipeline::Peer::Target>> &get_targets() const {
+    return targets;
+  }
+
+  /* Restores the state recorded in this group's manifest, and in its log
+     since the manifest was written, after a restart. To be called before
+     start(). */
+  void recover();
+
+  /* Writes this group's current state to its manifest in the background. */
+  void checkpoint();
+
+  /* Checks that the ports used by the given number of groups do not collide:
+     the peer, command and subscriber ports each take a range of one port
+     per group, and the client port is shared. The subscriber port may be
+     NULL. Returns false, having reported the problem, if any two overlap. */
+  static bool check_port_ranges(const uint32_t group_count,
+                                const char *client_port,
+                                const char *peer_port,
+                                const char *command_port,
+                                const char *subscriber_port);
+
+  /* Opens this group's listeners and connections to its peers. The
+     subscriber port may be NULL, in which case there is no listener for
+     subscribers. */
+  void start(Epoll::Manager&,
+             const char *client_port,
+             const char *peer_port,
+             const char *command_port,
+             const char *subscriber_port,
+             const std::vector<Pipeline::Peer::Target::Address>&,
+             Pipeline::SendfileShards*);
+
+  void start_target_connections();
+
+  /* Compacts this group's chosen stream content into per-stream logs. */
+  void start_chosen_log_compactor(Epoll::Manager&);
+
+  /* Tees client data into a pipe per peer as it is written, to be sent on
+     from there once proposed. To be called after start(). */
+  void start_tee_replication();
+
+  void handle_timeout() override { legislator.handle_wake_up(); }
+
+  /* The given port number plus this group's number. */
+  std::string group_port(const char*) const;
+};
+
+/* Forwards the event loop's clock updates to every group. */
+class ConsensusGroupClocks : public Epoll::ClockCache {
+  std::vector<std::unique_ptr<ConsensusGroup>> &groups;
+
+public:
+  ConsensusGroupClocks(std::vector<std::unique_ptr<ConsensusGroup>> &groups)
+    : groups(groups) {}
+
+  void set_current_time(const timestamp &t) override {
+    for (auto &group : groups) {
+      group->get_real_world().set_current_time(t);
+    }
+  }
+};
+
+#endif // ndef CONSENSUS_GROUP_H
@@ -22,16 +22,48 @@
 #define EPOLL_H
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
+#include <algorithm>
 #include <chrono>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 using timestamp = std::chrono::time_point<std::chrono::steady_clock>;
 
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* Default for the most events returned by a single call to epoll_wait(). */
+#ifndef EPOLL_EVENTS_SIZE
+#define EPOLL_EVENTS_SIZE 64
+#endif // ndef EPOLL_EVENTS_SIZE
+
+/* Width, in milliseconds, of each slot of the timer wheel. */
+#ifndef EPOLL_TIMER_TICK_MS
+#define EPOLL_TIMER_TICK_MS 4
+#endif // ndef EPOLL_TIMER_TICK_MS
+
+/* Number of slots in the timer wheel. */
+#ifndef EPOLL_TIMER_WHEEL_SLOTS
+#define EPOLL_TIMER_WHEEL_SLOTS 512
+#endif // ndef EPOLL_TIMER_WHEEL_SLOTS
+
+/* Submission ring size when using the io_uring backend. */
+#ifndef EPOLL_URING_ENTRIES
+#define EPOLL_URING_ENTRIES 256
+#endif // ndef EPOLL_URING_ENTRIES
+
 namespace Epoll {
 
 class ClockCache {
@@ -40,32 +72,488 @@ class ClockCache {
 };
 
 class Handler {
+  friend class Manager;
+
+    uint64_t wakeup_count    = 0;
+    uint64_t epoll_ctl_count = 0;
+
   public:
     virtual void handle_readable () = 0;
     virtual void handle_writeable() = 0;
     virtual void handle_error    (const uint32_t) = 0;
+
+    /* The number of events delivered to this handler, and of epoll_ctl()
+       calls made on its behalf (excluding its final deregistration). */
+    uint64_t get_wakeup_count()    const { return wakeup_count; }
+    uint64_t get_epoll_ctl_count() const { return epoll_ctl_count; }
+};
+
+/* A DeferredHandler is called back once all the events received by a call to
+   Manager::wait() have been handled, which allows work triggered by several
+   events in the same round to be coalesced. */
+class DeferredHandler {
+  public:
+    virtual void handle_deferred() = 0;
+};
+
+/* A SyncHandler is called back from Manager::wait() when a sync that it
+   requested with Manager::sync_in_background() has completed. */
+class SyncHandler {
+  public:
+    virtual void handle_synced() = 0;
+};
+
+/* A SpliceHandler is called back from Manager::wait() with the result of a
+   splice that it requested with Manager::splice_and_sync_in_background(). */
+class SpliceHandler {
+  public:
+    virtual void handle_spliced(int32_t result) = 0;
+};
+
+/* A TimerHandler is called back from Manager::wait() once the time it passed
+   to Manager::schedule_timer() has been reached. Each handler has at most one
+   pending timer, so scheduling it again replaces the earlier deadline. */
+class TimerHandler {
+  friend class TimerWheel;
+
+    bool      timer_scheduled = false;
+    uint64_t  timer_tick      = 0;
+    timestamp timer_deadline;
+
+  public:
+    virtual void handle_timeout() = 0;
+
+    bool is_timer_scheduled() const { return timer_scheduled; }
+};
+
+/* Pending timers, hashed by deadline into slots of EPOLL_TIMER_TICK_MS each
+   so that scheduling, cancelling and expiring a timer only touch one slot.
+   Timers more than a full turn of the wheel away stay in their slot until
+   their turn comes round. */
+class TimerWheel {
+  TimerWheel           (const TimerWheel&) = delete; // no copying
+  TimerWheel &operator=(const TimerWheel&) = delete; // no assignment
+
+  std::vector<std::vector<TimerHandler*>> slots;
+  uint64_t                                current_tick;
+  size_t                                  timer_count = 0;
+
+  static uint64_t tick_of(const timestamp&);
+
+  std::vector<TimerHandler*> &slot_for(uint64_t tick) {
+    return slots[tick % slots.size()];
+  }
+
+  const std::vector<TimerHandler*> &slot_for(uint64_t tick) const {
+    return slots[tick % slots.size()];
+  }
+
+  public:
+  TimerWheel(const timestamp &now);
+
+  void schedule(TimerHandler*, const timestamp &deadline);
+  void cancel(TimerHandler*);
+
+  bool   is_empty() const { return timer_count == 0; }
+  size_t size()     const { return timer_count; }
+
+  /* The earliest pending deadline. Must not be called when empty. */
+  timestamp next_deadline() const;
+
+  /* Removes every timer whose deadline is no later than now and appends its
+     handler to expired. */
+  void expire(const timestamp &now, std::vector<TimerHandler*> &expired);
 };
 
-void update_clock(std::atomic<bool>*, std::atomic<bool>*);
+/* Calls fdatasync() on a background thread, in the order requested, and
+   increments an eventfd as each one completes. A job may instead write a
+   buffer to its fd, which must then have been opened with O_DSYNC so that
+   the data is durable once written, or truncate its fd once the writes
+   before it are done. */
+class BackgroundSyncs {
+  BackgroundSyncs           (const BackgroundSyncs&) = delete; // no copying
+  BackgroundSyncs &operator=(const BackgroundSyncs&) = delete; // no assignment
+
+public:
+  enum Kind {
+    SYNC,
+    /* Writes length bytes of data at offset and then gives data to
+       release(), on the background thread. */
+    WRITE,
+    /* Truncates fd to length bytes if it is any longer. */
+    TRUNCATE
+  };
+
+  struct Job {
+    Kind     kind;
+    int      fd;
+    void    *data;
+    size_t   length;
+    off_t    offset;
+    void   (*release)(void*);
+  };
+
+private:
+  const int               completion_fd;
+  std::mutex              mutex;
+  std::condition_variable condition;
+  std::deque<Job>         queued_jobs;
+  bool                    should_exit = false;
+  std::thread             worker;
+
+  void run();
+
+  public:
+  BackgroundSyncs(int completion_fd);
+  ~BackgroundSyncs();
+
+  /* Takes ownership of the job's fd, which is closed once the job is done,
+     and of its data. */
+  void submit(const Job&);
+};
+
+/* A minimal io_uring, driven with raw system calls. Requests are queued in
+   the submission ring and submitted all together by the same
+   io_uring_enter() call that waits for completions. */
+class Uring {
+  Uring           (const Uring&) = delete; // no copying
+  Uring &operator=(const Uring&) = delete; // no assignment
+
+  int                  ring_fd = -1;
+
+  void                *sq_ring = NULL;
+  size_t               sq_ring_size = 0;
+  void                *cq_ring = NULL;
+  size_t               cq_ring_size = 0;
+  struct io_uring_sqe *sqes = NULL;
+  size_t               sqes_size = 0;
+
+  unsigned            *sq_head;
+  unsigned            *sq_tail;
+  unsigned             sq_mask;
+  unsigned             sq_entries;
+  unsigned            *sq_array;
+  unsigned            *cq_head;
+  unsigned            *cq_tail;
+  unsigned             cq_mask;
+  struct io_uring_cqe *cqes;
+
+  unsigned             queued = 0;
+
+  struct io_uring_sqe *get_sqe();
+  int enter(unsigned min_complete, int timeout_milliseconds);
+  /* Makes room for the given number of requests, so that a linked chain is
+     never split across two submissions. */
+  void reserve(unsigned count);
+
+  public:
+  struct Completion {
+    uint64_t user_data;
+    int32_t  result;
+    uint32_t flags;
+  };
+
+  Uring(unsigned entries);
+  ~Uring();
+
+  /* One-shot unless multishot is set, in which case it stays armed for as
+     long as completions carry IORING_CQE_F_MORE. */
+  void poll_add(int fd, uint32_t events, bool multishot, uint64_t user_data);
+  void poll_remove(uint64_t target_user_data);
+  void fdatasync(int fd, uint64_t user_data);
+
+  /* Splices length bytes from the pipe fd_in to fd_out at off_out, and then
+     syncs fd_out, as a linked pair: if the splice fails or comes up short
+     then the sync completes with -ECANCELED. */
+  void splice_then_fdatasync(int fd_in, int fd_out, uint64_t off_out,
+                             uint32_t length,
+                             uint64_t splice_user_data,
+                             uint64_t sync_user_data);
+
+  /* Submits the queued requests and waits until at least one completion is
+     available or the timeout (negative means none) has passed, then
+     appends all available completions to the vector. */
+  void submit_and_wait(int timeout_milliseconds, std::vector<Completion>&);
+};
 
 class Manager {
   Manager           (const Manager&) = delete; // no copying
   Manager &operator=(const Manager&) = delete; // no assignment
 
+  public:
+  enum class Backend { epoll, io_uring };
+
+  private:
   const int epfd;
   ClockCache &clock_cache;
 
-  std::atomic<bool> clock_updater_should_exit;
-  std::atomic<bool> clock_needs_updating;
-  std::thread       clock_updater;
+  std::vector<struct epoll_event> events;
+  bool                            edge_triggered  = false;
+
+  uint64_t                        wait_count      = 0;
+  uint64_t                        events_received = 0;
+  uint64_t                        epoll_ctl_count = 0;
+  uint64_t                        sync_count      = 0;
+
+  timestamp current_time;
+
+  struct Deferral {
+    DeferredHandler *handler;
+    timestamp        not_before;
+  };
+  std::vector<Deferral> deferrals;
+  std::vector<Deferral> running_deferrals;
+
+  class SyncCompletions : public Handler {
+    Manager &manager;
+    public:
+    SyncCompletions(Manager &manager) : manager(manager) {}
+
+    void handle_readable() override { manager.handle_sync_completions(); }
+    void handle_writeable() override { abort(); }
+    void handle_error(const uint32_t) override { abort(); }
+  };
+
+  int                              sync_completion_fd = -1;
+  SyncCompletions                  sync_completions;
+  std::unique_ptr<BackgroundSyncs> background_syncs;
+  std::deque<SyncHandler*>         sync_handlers;
+
+  /* Timers are kept in a wheel and a single timerfd, created on first use,
+     is armed for the earliest deadline so that wait() blocks until it is due
+     and no longer. */
+  class TimerExpiries : public Handler {
+    Manager &manager;
+    public:
+    TimerExpiries(Manager &manager) : manager(manager) {}
+
+    void handle_readable() override { manager.handle_timer_expiries(); }
+    void handle_writeable() override { abort(); }
+    void handle_error(const uint32_t) override { abort(); }
+  };
+
+  int                        timer_fd = -1;
+  TimerExpiries              timer_expiries;
+  TimerWheel                 timers;
+  std::vector<TimerHandler*> running_timers;
+  bool                       timer_fd_armed = false;
+  timestamp                  timer_fd_deadline;
+
+  void handle_timer_expiries() {
+    uint64_t expiry_count;
+    ssize_t read_result = read(timer_fd, &expiry_count, sizeof expiry_count);
+    if (read_result == -1 && errno != EAGAIN) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: read() failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+    /* The timers themselves are run by run_timers(). */
+  }
+
+  void arm_timer_fd() {
+    if (timer_fd == -1) {
+      return;
+    }
+
+    struct itimerspec spec = {};
+    if (timers.is_empty()) {
+      if (!timer_fd_armed) {
+        return;
+      }
+      timer_fd_armed = false;
+    } else {
+      const timestamp deadline = timers.next_deadline();
+      if (timer_fd_armed && deadline == timer_fd_deadline) {
+        return;
+      }
+      timer_fd_armed    = true;
+      timer_fd_deadline = deadline;
+
+      /* steady_clock is CLOCK_MONOTONIC. A zero it_value would disarm the
+         timer, so round it up to the first nanosecond. */
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+                  (deadline.time_since_epoch()).count();
+      if (ns <= 0) {
+        ns = 1;
+      }
+      spec.it_value.tv_sec  = ns / 1000000000;
+      spec.it_value.tv_nsec = ns % 1000000000;
+    }
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: timerfd_settime() failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+  }
+
+  void run_timers() {
+    if (timers.is_empty()) {
+      return;
+    }
+
+    assert(running_timers.empty());
+    timers.expire(current_time, running_timers);
+
+    for (size_t i = 0; i < running_timers.size(); i++) {
+      TimerHandler *handler = running_timers[i];
+      if (handler != NULL) { // else cancelled while running an earlier timer
+        handler->handle_timeout();
+      }
+    }
+    running_timers.clear();
+  }
+
+  /* With the io_uring backend, each registered fd has a poll request, which
+     is one-shot and re-armed after its event is handled so as to behave like
+     level-triggered epoll, or multishot for EPOLLET. Completions for
+     superseded registrations are recognised by their generation and
+     ignored. Syncs are submitted as IORING_OP_FSYNC requests, and a splice
+     that is to be synced as an IORING_OP_SPLICE linked to its sync. */
+  struct UringRegistration {
+    Handler  *handler    = NULL;
+    uint32_t  events     = 0;
+    uint32_t  generation = 0;
+    bool      armed      = false;
+  };
+  struct UringSync {
+    SyncHandler *handler;
+    int          fd;
+    bool         done;
+  };
+  struct UringSplice {
+    SpliceHandler *handler;
+    int            pipe_fd;
+    int            fd;
+    int32_t        result;
+    bool           done;
+  };
+  std::unique_ptr<Uring>           uring;
+  std::vector<UringRegistration>   uring_registrations; // indexed by fd
+  uint32_t                         uring_generation = 0;
+  std::vector<Uring::Completion>   uring_completions;
+  std::deque<UringSync>            uring_syncs;
+  uint64_t                         uring_first_sync = 0;
+  std::deque<UringSplice>          uring_splices;
+  uint64_t                         uring_first_splice = 0;
+
+  void uring_ctl(int op, int fd, Handler *handler, uint32_t events);
+  void uring_arm(int fd);
+  void uring_sync(int fd, SyncHandler *handler);
+  void uring_sync_completed(uint64_t sync, int32_t result);
+  void uring_splice_completed(uint64_t splice, int32_t result);
+  void uring_wait(int timeout_milliseconds);
+
+  void handle_sync_completions() {
+    uint64_t completion_count;
+    ssize_t read_result = read(sync_completion_fd,
+                               &completion_count, sizeof completion_count);
+    if (read_result == -1) {
+      if (errno == EAGAIN) {
+        return;
+      }
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: read() failed\n", __PRETTY_FUNCTION__);
+      abort();
+    }
+    assert(read_result == sizeof completion_count);
+    assert(completion_count <= sync_handlers.size());
+
+    while (completion_count > 0) {
+      completion_count -= 1;
+      SyncHandler *handler = sync_handlers.front();
+      sync_handlers.pop_front();
+      if (handler != NULL) {
+        handler->handle_synced();
+      }
+    }
+  }
+
+  int clamp_timeout_for_deferrals(int timeout_milliseconds) const {
+    if (deferrals.empty()) {
+      return timeout_milliseconds;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    for (const auto &d : deferrals) {
+      if (d.not_before <= now) {
+        return 0;
+      }
+      int ms_to_deferral = std::chrono::duration_cast<std::chrono::milliseconds>
+                              (d.not_before - now).count() + 1;
+      if (timeout_milliseconds < 0 || ms_to_deferral < timeout_milliseconds) {
+        timeout_milliseconds = ms_to_deferral;
+      }
+    }
+    return timeout_milliseconds;
+  }
+
+  void run_deferrals() {
+    if (deferrals.empty()) {
+      return;
+    }
+
+    assert(running_deferrals.empty());
+    running_deferrals.swap(deferrals);
+    auto now = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < running_deferrals.size(); i++) {
+      auto d = running_deferrals[i];
+      if (d.handler == NULL) {
+        continue; // cancelled while running an earlier deferral
+      }
+      if (now < d.not_before) {
+        deferrals.push_back(d);
+        continue;
+      }
+      d.handler->handle_deferred();
+    }
+    running_deferrals.clear();
+  }
+
+  /* Called once per wait() rather than per event, so that handlers see a
+     consistent time throughout each round. */
+  void refresh_clock_cache() {
+    current_time = std::chrono::steady_clock::now();
+    clock_cache.set_current_time(current_time);
+  }
+
+  void dispatch(Handler *handler, uint32_t event_bits) {
+    assert(handler != NULL);
+    handler->wakeup_count++;
+
+    if (event_bits & ~(EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLRDHUP)) {
+      handler->handle_error(event_bits);
+    } else {
+      if (event_bits & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) {
+        handler->handle_readable();
+      }
+      if (event_bits & EPOLLOUT) {
+        handler->handle_writeable();
+      }
+    }
+  }
 
   void ctl_and_verify(int op,
                       int fd,
                       Handler *handler,
                       uint32_t events) {
+    if (uring) {
+      epoll_ctl_count++;
+      if (handler != NULL) {
+        handler->epoll_ctl_count++;
+      }
+      uring_ctl(op, fd, handler, events);
+      return;
+    }
+
     struct epoll_event event;
     event.events = events;
     event.data.ptr = static_cast<void*>(handler);
+    epoll_ctl_count++;
+    if (handler != NULL) {
+      handler->epoll_ctl_count++;
+    }
     if (epoll_ctl(epfd, op, fd, &event) == -1) {
       perror(__PRETTY_FUNCTION__);
       fprintf(stderr, "%s: epoll_ctl(%d, %d, %d, %u/%p) failed\n",
@@ -75,15 +563,18 @@ class Manager {
   }
 
   public:
-  Manager(ClockCache &clock_cache)
-      : epfd(epoll_create(1)),
+  Manager(ClockCache &clock_cache, Backend backend = Backend::epoll)
+      : epfd(backend == Backend::epoll ? epoll_create(1) : -1),
         clock_cache(clock_cache),
-        clock_updater_should_exit(false),
-        clock_needs_updating(true),
-        clock_updater(update_clock, &clock_needs_updating,
-                                    &clock_updater_should_exit) {
-
-    if (epfd == -1) {
+        events(EPOLL_EVENTS_SIZE),
+        current_time(std::chrono::steady_clock::now()),
+        sync_completions(*this),
+        timer_expiries(*this),
+        timers(current_time) {
+
+    if (backend == Backend::io_uring) {
+      uring.reset(new Uring(EPOLL_URING_ENTRIES));
+    } else if (epfd == -1) {
       perror(__PRETTY_FUNCTION__);
       abort();
     }
@@ -98,13 +589,49 @@ class Manager {
     printf("%s: epfd=%d\n", __PRETTY_FUNCTION__, epfd);
 #endif // ndef NTRACE
 
+    background_syncs.reset();
+    if (sync_completion_fd != -1) {
+      close(sync_completion_fd);
+    }
+
+    if (timer_fd != -1) {
+      close(timer_fd);
+    }
+
+    uring.reset();
+    for (const auto &s : uring_syncs) {
+      close(s.fd);
+    }
+    for (const auto &s : uring_splices) {
+      close(s.pipe_fd);
+      close(s.fd);
+    }
+
     if (epfd != -1) {
       close(epfd);
     }
-    clock_updater_should_exit.store(true);
-    clock_updater.join();
   }
 
+  /* Sets the most events returned by a single call to epoll_wait(). Events
+     beyond this are returned by the next call. */
+  void set_max_events(size_t max_events) {
+    assert(0 < max_events);
+    events.resize(max_events);
+  }
+
+  /* In edge-triggered mode, handlers that support it register with EPOLLET
+     and leave their registration alone, ignoring events they do not need
+     and instead working until EAGAIN before waiting again. It must be set
+     before any handlers are registered. */
+  void set_edge_triggered(bool e) { edge_triggered = e; }
+  bool is_edge_triggered() const  { return edge_triggered; }
+
+  uint64_t get_wait_count()      const { return wait_count; }
+  uint64_t get_event_count()     const { return events_received; }
+  uint64_t get_epoll_ctl_count() const { return epoll_ctl_count; }
+  /* Syncs requested in the background, including synced writes. */
+  uint64_t get_sync_count()      const { return sync_count; }
+
   void register_handler(int fd, Handler *handler, uint32_t events) {
     ctl_and_verify(EPOLL_CTL_ADD, fd, handler, events);
   }
@@ -125,45 +652,214 @@ class Manager {
     }
   }
 
+  /* Arrange for handler->handle_deferred() to be called at the end of the
+     current (or next) call to wait(), but no earlier than not_before. */
+  void defer(DeferredHandler *handler,
+             const timestamp &not_before = timestamp()) {
+    assert(handler != NULL);
+    deferrals.push_back({.handler = handler, .not_before = not_before});
+  }
+
+  void cancel_deferred(DeferredHandler *handler) {
+    deferrals.erase(std::remove_if(
+      deferrals.begin(),
+      deferrals.end(),
+      [handler](const Deferral &d) { return d.handler == handler; }),
+      deferrals.end());
+
+    for (auto &d : running_deferrals) {
+      if (d.handler == handler) {
+        d.handler = NULL;
+      }
+    }
+  }
+
+  /* Arrange for handler->handle_timeout() to be called from wait() once
+     deadline has passed, replacing any timer it already has. */
+  void schedule_timer(TimerHandler *handler, const timestamp &deadline) {
+    assert(handler != NULL);
+
+    if (timer_fd == -1) {
+      timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (timer_fd == -1) {
+        perror(__PRETTY_FUNCTION__);
+        fprintf(stderr, "%s: timerfd_create() failed\n", __PRETTY_FUNCTION__);
+        abort();
+      }
+      register_handler(timer_fd, &timer_expiries, EPOLLIN);
+    }
+
+    timers.schedule(handler, deadline);
+  }
+
+  void cancel_timer(TimerHandler *handler) {
+    timers.cancel(handler);
+
+    for (auto &h : running_timers) {
+      if (h == handler) {
+        h = NULL;
+      }
+    }
+  }
+
+  /* The time at which the current round of wait() started. */
+  const timestamp &get_current_time() const { return current_time; }
+
+  /* Arrange for fd to be synced on a background thread, after which
+     handler->handle_synced() is called from wait() unless handler is NULL.
+     Completions are delivered in the order in which they were requested. */
+  void sync_in_background(int fd, SyncHandler *handler) {
+    sync_count++;
+    if (uring) {
+      uring_sync(fd, handler);
+      return;
+    }
+
+    submit_background_job(BackgroundSyncs::SYNC, fd, NULL, 0, 0, NULL,
+                          handler);
+  }
+
+  /* Arrange for length bytes of data to be written to fd at offset on the
+     background thread, after which release(data) is called there and
+     handler->handle_synced() is called from wait() unless handler is NULL.
+     The fd must have been opened with O_DSYNC, and may be O_DIRECT. If data
+     is NULL then fd is synced instead. Unlike sync_in_background(), this
+     always uses the background thread, even with io_uring, so that all the
+     requests made this way complete in order with each other. */
+  void write_in_background(int fd, void *data, size_t length, off_t offset,
+                           void (*release)(void*), SyncHandler *handler) {
+    sync_count++;
+    submit_background_job(
+      data == NULL ? BackgroundSyncs::SYNC : BackgroundSyncs::WRITE,
+      fd, data, length, offset, release, handler);
+  }
+
+  /* Arrange for fd to be truncated to length bytes, if it is longer, on the
+     background thread, after which handler->handle_synced() is called from
+     wait() unless handler is NULL. Completes in order with the requests made
+     with write_in_background(), so may follow writes to the same file. */
+  void truncate_in_background(int fd, size_t length, SyncHandler *handler) {
+    submit_background_job(BackgroundSyncs::TRUNCATE, fd, NULL, length, 0,
+                          NULL, handler);
+  }
+
+  /* Whether splice_and_sync_in_background() may be used, which needs the
+     io_uring backend. */
+  bool can_splice_in_background() const { return uring.get() != NULL; }
+
+  /* The generation of the latest io_uring registration, which identifies
+     its poll completions. It wraps long before reaching the tags of other
+     completions, and may be set so that the wrap can be tested. */
+  uint32_t get_uring_generation() const { return uring_generation; }
+  void set_uring_generation(uint32_t generation) {
+    uring_generation = generation;
+  }
+
+  /* Arrange for length bytes to be spliced from the pipe pipe_fd to fd at
+     offset, and for fd to be synced once they have been, without blocking
+     the event loop. From wait(), spliced->handle_spliced() is then called
+     with the result of the splice, and synced->handle_synced() is called
+     once the sync has completed, in order with other syncs as for
+     sync_in_background(). Either handler may be NULL. The pipe must not be
+     read from until the splice has completed. */
+  void splice_and_sync_in_background(int pipe_fd, int fd, off_t offset,
+                                     size_t length,
+                                     SpliceHandler *spliced,
+                                     SyncHandler   *synced);
+
+private:
+  void submit_background_job(BackgroundSyncs::Kind kind,
+                             int fd, void *data, size_t length, off_t offset,
+                             void (*release)(void*), SyncHandler *handler) {
+    if (!background_syncs) {
+      sync_completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (sync_completion_fd == -1) {
+        perror(__PRETTY_FUNCTION__);
+        fprintf(stderr, "%s: eventfd() failed\n", __PRETTY_FUNCTION__);
+        abort();
+      }
+      register_handler(sync_completion_fd, &sync_completions, EPOLLIN);
+      background_syncs.reset(new BackgroundSyncs(sync_completion_fd));
+    }
+
+    /* The caller may close fd before the sync completes, so sync a copy. */
+    int dup_fd = dup(fd);
+    if (dup_fd == -1) {
+      perror(__PRETTY_FUNCTION__);
+      fprintf(stderr, "%s: dup(%d) failed\n", __PRETTY_FUNCTION__, fd);
+      abort();
+    }
+
+    sync_handlers.push_back(handler);
+    background_syncs->submit({
+      .kind    = kind,
+      .fd      = dup_fd,
+      .data    = data,
+      .length  = length,
+      .offset  = offset,
+      .release = release});
+  }
+
+public:
+
+  void cancel_syncs(SyncHandler *handler) {
+    for (auto &h : sync_handlers) {
+      if (h == handler) {
+        h = NULL;
+      }
+    }
+    for (auto &s : uring_syncs) {
+      if (s.handler == handler) {
+        s.handler = NULL;
+      }
+    }
+  }
+
+  void cancel_splices(SpliceHandler *handler) {
+    for (auto &s : uring_splices) {
+      if (s.handler == handler) {
+        s.handler = NULL;
+      }
+    }
+  }
+
   void wait(int timeout_milliseconds) {
 #ifndef NTRACE
     printf("\n%s: timeout=%d\n", __PRETTY_FUNCTION__, timeout_milliseconds);
 #endif // ndef NTRACE
 
-#define EPOLL_EVENTS_SIZE 20
-    struct epoll_event events[EPOLL_EVENTS_SIZE];
-    int event_count = epoll_wait(epfd,
-                                 events,
-                                 EPOLL_EVENTS_SIZE,
-                                 timeout_milliseconds);
-#undef EPOLL_EVENTS_SIZE
+    arm_timer_fd();
 
-    if (clock_needs_updating.load()) {
-      clock_needs_updating.store(false);
-      clock_cache.set_current_time(std::chrono::steady_clock::now());
+    if (uring) {
+      uring_wait(clamp_timeout_for_deferrals(timeout_milliseconds));
+      run_timers();
+      run_deferrals();
+      return;
     }
 
+    int event_count = epoll_wait(epfd,
+                                 events.data(),
+                                 events.size(),
+                                 clamp_timeout_for_deferrals
+                                        (timeout_milliseconds));
+
+    refresh_clock_cache();
+
 #ifndef NTRACE
     printf("%s: %d events received\n", __PRETTY_FUNCTION__, event_count);
 #endif // ndef NTRACE
 
+    wait_count++;
+    if (0 < event_count) {
+      events_received += event_count;
+    }
+
     for (int i = 0; i < event_count; i++) {
-      auto &e = events[i];
-      auto event_bits = e.events;
-      auto handler = static_cast<Handler*>(e.data.ptr);
-      assert(handler != NULL);
-
-      if (event_bits & ~(EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLRDHUP)) {
-        handler->handle_error(event_bits);
-      } else {
-        if (event_bits & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) {
-          handler->handle_readable();
-        }
-        if (event_bits & EPOLLOUT) {
-          handler->handle_writeable();
-        }
-      }
+      dispatch(static_cast<Handler*>(events[i].data.ptr), events[i].events);
     }
+
+    run_timers();
+    run_deferrals();
   }
 };
 
@@ -106,8 +106,13 @@ class Legislator {
 
     /* RSM state */
     NodeId            _next_generated_node_id = 2;
-    Value::StreamName _current_stream = {.owner = 0, .id = 0};
-    uint64_t          _current_stream_pos     = 0;
+    /* Open streams, whose content may be interleaved. */
+    std::vector<Value::StreamPosition> _open_streams;
+    const size_t      _max_open_streams       = 64;
+
+    std::vector<Value::StreamPosition>::iterator
+      find_open_stream(const Value::StreamName&);
+    void open_stream(const Value::StreamName&, uint64_t, Slot);
 
     const bool is_leading() const {
       return _role == Role::leader || _role == Role::incumbent;
@@ -150,6 +155,36 @@ class Legislator {
       return _palladium.next_chosen_slot();
     }
 
+    const Era &get_current_era() const {
+      return _palladium.get_current_era();
+    }
+
+    const Configuration &get_current_configuration() const {
+      return _palladium.get_current_configuration();
+    }
+
+    const Term &get_min_acceptable_term() const {
+      return _palladium.get_min_acceptable_term();
+    }
+
+    const std::vector<Proposal> &get_sent_acceptances() const {
+      return _palladium.get_sent_acceptances();
+    }
+
+    const NodeId &get_next_generated_node_id() const {
+      return _next_generated_node_id;
+    }
+
+    const std::vector<Value::StreamPosition> &get_open_streams() const {
+      return _open_streams;
+    }
+
+    /* Puts back the state saved before a restart. Must be called before
+       any messages have been handled. Sends nothing. */
+    void restore(const Slot&, const Era&, const Configuration&,
+      const NodeId&, const std::vector<Value::StreamPosition>&,
+      const std::vector<Proposal>&, const Term&);
+
     bool activation_will_yield_proposals() const {
       return is_leading()
            && _palladium.activation_will_yield_proposals()
@@ -165,7 +200,7 @@ class Legislator {
     void handle_request_catch_up(const NodeId&);
     void unsafely_stage_coup();
     void handle_send_catch_up(const Slot&, const Era&, const Configuration&,
-      const NodeId&, const Value::StreamName&, const uint64_t);
+      const NodeId&, const std::vector<Value::StreamPosition>&);
 
     void abdicate_to(const NodeId&);
     void start_term(const NodeId&);
@@ -187,6 +222,35 @@ class Legislator {
       handle_accepted(sender, proposal);
     }
 
+    /* A proposal that its proposer has yet to accept, which it does
+       separately, so this only accepts it. */
+    void handle_proposed(const Proposal &proposal) {
+      handle_proposal(proposal, false);
+    }
+
+    /* Activates slots for stream content as activate_slots() does, but
+       before this node has made the content durable, so the other nodes are
+       sent the proposal alone. Returns the proposal, which is empty if none
+       was made, to be passed to accept_own_proposal() once the content is
+       durable. */
+    Proposal propose_slots(const Value &value, const uint64_t count) {
+      assert(value.type == Value::Type::stream_content);
+      if (UNLIKELY(_role == Role::follower)) {
+        return {.slots = SlotRange(0, 0),
+                .term  = _palladium.next_activated_term(),
+                .value = value};
+      }
+      const Proposal proposal = _palladium.activate(value, count);
+      if (proposal.slots.is_nonempty()) {
+        _world.proposed(proposal);
+      }
+      return proposal;
+    }
+
+    void accept_own_proposal(const Proposal &proposal) {
+      handle_proposal(proposal, false);
+    }
+
   private:
     void handle_proposal(const Proposal &proposal, bool send_proposal) {
       if (proposal.slots.is_empty()) { return; }
@@ -198,7 +262,14 @@ class Legislator {
         _world.accepted(proposal);
       }
 
-      handle_accepted(_palladium.node_id(), proposal);
+      // Stream content is not in the log, so is not waiting for it to sync.
+      if (LIKELY(proposal.value.type == Value::Type::stream_content)) {
+        handle_accepted(_palladium.node_id(), proposal);
+      } else {
+        _world.after_log_synced([this, proposal]() {
+          handle_accepted(_palladium.node_id(), proposal);
+        });
+      }
 
       if (UNLIKELY(_change_era_restricted_by_term
         && proposal.term.era <= _change_era_after_proposal_from_era)) {
@@ -230,31 +301,31 @@ class Legislator {
           uint64_t first_written_stream_pos
             = chosen.slots.start() - chosen.value.payload.stream.offset;
 
-          if (LIKELY(payload.stream.name.owner == _current_stream.owner
-                  && payload.stream.name.id    == _current_stream.id)) {
+          auto open_stream_it = find_open_stream(payload.stream.name);
+          if (LIKELY(open_stream_it != _open_streams.end())) {
 
-            if (LIKELY(_current_stream_pos == first_written_stream_pos)) {
-              _current_stream_pos += chosen_slot_count;
+            if (LIKELY(open_stream_it->position == first_written_stream_pos)) {
+              open_stream_it->position         += chosen_slot_count;
+              open_stream_it->last_chosen_slot  = chosen.slots.start();
               _world.chosen_stream_content(chosen);
             } else {
+              const uint64_t expected_stream_pos = open_stream_it->position;
+              _open_streams.erase(open_stream_it); // Need a new stream.
               _world.chosen_non_contiguous_stream_content
                   (chosen,
-                   _current_stream_pos,
+                   expected_stream_pos,
                    first_written_stream_pos);
-
-              _current_stream_pos = 0; // Need a new stream.
             }
 
           } else {
 
             if (first_written_stream_pos == 0) {
-              _current_stream     = payload.stream.name;
-              _current_stream_pos = chosen_slot_count;
+              open_stream(payload.stream.name, chosen_slot_count,
+                          chosen.slots.start());
               _world.chosen_stream_content(chosen);
             } else {
               _world.chosen_unknown_stream_content
-                  (chosen, _current_stream,
-                   first_written_stream_pos);
+                  (chosen, first_written_stream_pos);
             }
           }
 
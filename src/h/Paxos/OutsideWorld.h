@@ -25,6 +25,7 @@
 #include "Paxos/Proposal.h"
 
 #include <chrono>
+#include <functional>
 
 namespace Paxos {
 
@@ -46,15 +47,22 @@ class OutsideWorld {
       const Era&,
       const Configuration&,
       const NodeId&,
-      const Value::StreamName&,
-      const uint64_t) = 0;
+      const std::vector<Value::StreamPosition>&) = 0;
     virtual void prepare_term(const Term&) = 0;
 
     virtual void record_promise(const Term&, const Slot&) = 0;
     virtual void make_promise(const Promise&) = 0;
     virtual void proposed_and_accepted(const Proposal&) = 0;
+    /* Stream content proposed before this node has accepted it, for which
+       accepted() follows once it has. */
+    virtual void proposed(const Proposal&) = 0;
     virtual void accepted(const Proposal&) = 0;
 
+    /* Runs the action once every promise and acceptance recorded so far is
+       durable, which may be straight away. A node's own promises and
+       acceptances only count towards its quorums from then on. */
+    virtual void after_log_synced(const std::function<void()>&) = 0;
+
     /* Stream content was successfully committed. The stream
        is identified in the Proposal argument, and the other
        argument is the stream position of the first byte committed. */
@@ -65,13 +73,13 @@ class OutsideWorld {
     virtual void chosen_non_contiguous_stream_content
                             (const Proposal&, uint64_t, uint64_t) = 0;
 
-    /* Stream content was committed, but for a stream other than the
-       current one. If stream content is committed at the start
-       of a stream then this simply opens a new stream - see
-       chosen_stream_content(); this is called if the new stream content
-       was not at the start of the stream. */
+    /* Stream content was committed, but for a stream that is not
+       open. If stream content is committed at the start of a stream
+       then this simply opens a new stream - see chosen_stream_content();
+       this is called if the new stream content was not at the start of
+       the stream, which is given by the other argument. */
     virtual void chosen_unknown_stream_content
-                    (const Proposal&, Value::StreamName, uint64_t) = 0;
+                    (const Proposal&, uint64_t) = 0;
 
     /* Some new node IDs were generated by this node, which normally
        happens when a new node is registering. The new ID should be
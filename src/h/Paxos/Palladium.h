@@ -68,6 +68,16 @@ private:
                        Configuration::Weight,
                  const Configuration::Weight);
 
+  /* Returns the largest of the given ends that is reached by a strict
+   * majority (by weight) of the acceptors, or 0 if there is none. An end of
+   * 0 denotes an acceptor that has not accepted the candidate term. Reorders
+   * both arrays. */
+  static const Slot
+    find_quorum_end(Slot*,
+                    Configuration::Weight*,
+                    const size_t,
+                    const uint32_t);
+
 #ifndef NDEBUG
   uint16_t                slow_paths_taken = 0;
 #define RECORD_SLOW_PATH slow_paths_taken += 1
@@ -119,10 +129,15 @@ private:
   void split_active_slot_states_at(const Slot slot);
   void record_current_configuration();
 
-  const bool check_for_quorums(Proposal &chosen_message) const {
+  /* With this many acceptors or fewer, searching the subsets of acceptors
+   * for a quorum is quicker than building and sorting the coverage arrays
+   * below. */
+#ifndef PALLADIUM_RECURSIVE_QUORUM_MAX_ACCEPTORS
+#define PALLADIUM_RECURSIVE_QUORUM_MAX_ACCEPTORS 5
+#endif // ndef PALLADIUM_RECURSIVE_QUORUM_MAX_ACCEPTORS
 
-    auto total_weight = current_configuration.total_weight();
-    if (total_weight == 0) { return false; }
+  const bool check_for_quorums_recursively
+      (Proposal &chosen_message, const uint32_t total_weight) const {
 
     for (auto acceptor_iterator  = received_acceptances.cbegin();
               acceptor_iterator != received_acceptances.cend();
@@ -170,6 +185,97 @@ private:
     return false;
   }
 
+  /* Scratch space for check_for_quorums(), laid out as separate arrays
+   * (one entry per element of received_acceptances) so that the weighted
+   * coverage computation works over contiguous memory without allocating. */
+  std::vector<Slot>                  quorum_ends;
+  std::vector<Configuration::Weight> quorum_weights;
+  std::vector<Term>                  quorum_terms_tried;
+
+  const bool check_for_quorums(Proposal &chosen_message) {
+
+    const uint32_t total_weight = current_configuration.total_weight();
+    if (total_weight == 0) { return false; }
+
+    const size_t acceptor_count = received_acceptances.size();
+    if (acceptor_count <= PALLADIUM_RECURSIVE_QUORUM_MAX_ACCEPTORS) {
+      return check_for_quorums_recursively(chosen_message, total_weight);
+    }
+
+    quorum_ends   .resize(acceptor_count);
+    quorum_weights.resize(acceptor_count);
+    quorum_terms_tried.clear();
+
+    for (size_t candidate_index = 0;
+                candidate_index < acceptor_count;
+                candidate_index++) {
+
+      const auto &candidate = received_acceptances[candidate_index];
+      if (candidate.weight == 0) {
+        continue;
+      }
+
+      for (auto &accepted_message : candidate.proposals) {
+        if (accepted_message.slots.start() != first_unchosen_slot) {
+          continue;
+        }
+        if (accepted_message.slots.is_empty()) {
+          continue;
+        }
+        if (accepted_message.term.era + 1 < current_era) {
+          continue;
+        }
+
+        /* Usually every acceptor reports the same term, so only look at
+         * each term once. */
+        if (std::find(quorum_terms_tried.cbegin(),
+                      quorum_terms_tried.cend(),
+                      accepted_message.term) != quorum_terms_tried.cend()) {
+          continue;
+        }
+        quorum_terms_tried.push_back(accepted_message.term);
+
+        for (size_t i = 0; i < acceptor_count; i++) {
+          Slot max_end = 0;
+          for (auto &other_message : received_acceptances[i].proposals) {
+            if (other_message.slots.start() == first_unchosen_slot
+                && other_message.term == accepted_message.term
+                && max_end < other_message.slots.end()) {
+              max_end = other_message.slots.end();
+            }
+          }
+          quorum_ends[i] = max_end;
+          quorum_weights[i] = received_acceptances[i].weight;
+        }
+
+        const Slot quorum_end = find_quorum_end(quorum_ends.data(),
+                                                quorum_weights.data(),
+                                                acceptor_count,
+                                                total_weight);
+        if (quorum_end <= first_unchosen_slot) {
+          continue;
+        }
+
+        chosen_message = {
+          .slots = SlotRange(first_unchosen_slot, quorum_end),
+          .term  = accepted_message.term,
+          .value = accepted_message.value,
+        };
+
+        if (is_reconfiguration(chosen_message.value.type)) {
+          // Can only choose one value if it is an reconfiguration,
+          // as the subsequent values have different configurations.
+          chosen_message.slots
+              .set_end(chosen_message.slots.start() + 1);
+        }
+
+        return true;
+      }
+    }
+
+    return false;
+  }
+
   void handle_chosen(const Proposal &chosen_message) {
 
     const auto &slot = chosen_message.slots.end();
@@ -383,6 +489,9 @@ public:
   const Era &get_current_era() const
     { return current_era; }
 
+  const std::vector<Proposal> &get_sent_acceptances() const
+    { return sent_acceptances; }
+
   const bool has_active_slots() const
     { return first_unchosen_slot < first_inactive_slot; }
 
@@ -50,6 +50,14 @@ struct Value {
     StreamOffset offset;
   };
 
+  /* How much of an open stream has been chosen. Streams are forgotten in
+   * order of their last_chosen_slot when there are too many open. */
+  struct StreamPosition {
+    StreamName name;
+    uint64_t   position;
+    Slot       last_chosen_slot;
+  };
+
   union Reconfiguration {
     NodeId                   subject; // For _inc and _dec: the affected node
     Configuration::Weight    factor;  // For _mul and _div: the multiplier or divisor
@@ -74,6 +82,8 @@ struct Value {
 std::ostream& operator<<(std::ostream&, const Value&);
 std::ostream& operator<<(std::ostream&, const Value::StreamName&);
 std::ostream& operator<<(std::ostream&, const Value::OffsetStream&);
+std::ostream& operator<<(std::ostream&, const Value::StreamPosition&);
+std::ostream& operator<<(std::ostream&, const std::vector<Value::StreamPosition>&);
 
 inline const bool operator==(const Value&, const Value&)
     __attribute__((always_inline));
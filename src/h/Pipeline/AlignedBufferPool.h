@@ -0,0 +1,70 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_ALIGNED_BUFFER_POOL_H
+#define PIPELINE_ALIGNED_BUFFER_POOL_H
+
+#include <mutex>
+#include <stddef.h>
+#include <vector>
+
+namespace Pipeline {
+
+/* Buffers for O_DIRECT writes, whose addresses, lengths and file offsets
+   must all be multiples of the device's logical block size. Buffers are
+   taken on the event loop's thread and given back on the background thread
+   once written, so the pool is shared and locked. Up to
+   ALIGNED_BUFFER_POOL_SIZE spare buffers are kept for reuse. */
+#ifndef DIRECT_IO_ALIGNMENT
+#define DIRECT_IO_ALIGNMENT 4096
+#endif // ndef DIRECT_IO_ALIGNMENT
+
+#ifndef DIRECT_IO_BUFFER_SIZE
+#define DIRECT_IO_BUFFER_SIZE (1<<22)
+#endif // ndef DIRECT_IO_BUFFER_SIZE
+
+#ifndef ALIGNED_BUFFER_POOL_SIZE
+#define ALIGNED_BUFFER_POOL_SIZE 16
+#endif // ndef ALIGNED_BUFFER_POOL_SIZE
+
+class AlignedBufferPool {
+  AlignedBufferPool           (const AlignedBufferPool&) = delete; // no copying
+  AlignedBufferPool &operator=(const AlignedBufferPool&) = delete; // no assignment
+
+  std::mutex          mutex;
+  std::vector<void*>  spare_buffers;
+
+  AlignedBufferPool() {}
+  ~AlignedBufferPool();
+
+public:
+  static AlignedBufferPool &shared();
+
+  /* Returns a buffer of DIRECT_IO_BUFFER_SIZE bytes aligned to
+     DIRECT_IO_ALIGNMENT. */
+  void *take();
+
+  /* Gives a buffer back to the shared pool, from any thread. */
+  static void give_back(void*);
+};
+
+}
+
+#endif // ndef PIPELINE_ALIGNED_BUFFER_POOL_H
@@ -0,0 +1,152 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_CHOSEN_LOG_COMPACTOR_H
+#define PIPELINE_CHOSEN_LOG_COMPACTOR_H
+
+#include "Pipeline/Client/ChosenStreamContentHandler.h"
+#include "Pipeline/SegmentCache.h"
+#include "Epoll.h"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Pipeline {
+
+/* Rewrites the chosen content of each stream, which is spread across
+   segment files from different terms and acceptors, into one contiguous log
+   file per stream alongside them, named chosen_<first stream position>.
+   Each log has an index file, named by adding _idx, of IndexRecords saying
+   which term each part of the log was accepted in. The copying and syncing
+   happen on a background thread, which reports back to the main event loop
+   over an eventfd. Once a log durably holds the whole of a chosen segment,
+   the segment is handed to the SegmentCache to be dropped. If the chosen
+   content is not held locally then the log stops and a new one starts at
+   the next content that is. A log that has stopped is never written again,
+   and is handed to the SegmentCache to be kept according to its retention
+   policy. A log is never started over an existing file of the same name;
+   that content is then left in its segments. */
+class ChosenLogCompactor : public Epoll::Handler,
+                           public Client::ChosenStreamContentHandler,
+                           public SegmentCache::ChosenDataConsumer {
+  ChosenLogCompactor           (const ChosenLogCompactor&) = delete; // no copying
+  ChosenLogCompactor &operator=(const ChosenLogCompactor&) = delete; // no assignment
+
+public:
+  /* The log holds the content of these slots at file offset start_slot less
+   * the log's first slot. Adjacent content from the same term shares a
+   * record. */
+  struct IndexRecord {
+    Paxos::Slot       start_slot;
+    Paxos::Slot       end_slot;
+    Paxos::Era        era;
+    Paxos::TermNumber term_number;
+    Paxos::NodeId     term_owner;
+  }
+  __attribute__((packed));
+
+private:
+  /* Copy some chosen content from a segment file to the stream's log. An
+   * empty source path means that the content is not held locally. */
+  struct Job {
+    Paxos::Value::OffsetStream stream;
+    Paxos::SlotRange           slots;
+    Paxos::Term                term;
+    std::string                source_path;
+    off_t                      source_offset;
+  };
+
+  struct LogKey {
+    Paxos::NodeId              owner;
+    Paxos::Value::StreamId     id;
+    Paxos::Value::StreamOffset offset;
+
+    bool operator<(const LogKey&) const;
+  };
+
+  struct Log {
+    Paxos::Value::OffsetStream stream;
+    std::string                path;
+    int                        fd       = -1;
+    int                        index_fd = -1;
+    Paxos::SlotRange           slots;
+    std::vector<IndexRecord>   records;
+    size_t                     first_unwritten_record = 0;
+    bool                       unsynced = false;
+
+    Log() : slots(0, 0) {}
+  };
+
+  Epoll::Manager              &manager;
+  SegmentCache                &segment_cache;
+  int                          completion_fd;
+
+  /* Main thread only: the first slot of each job not yet completed. */
+  std::deque<Paxos::Slot>      jobs_in_flight;
+
+  mutable std::mutex           mutex;
+  std::condition_variable      condition;
+  std::deque<Job>              incoming;
+  std::vector<SegmentCache::ChosenSegment> completed_logs;
+  std::vector<SegmentCache::ChosenSegment> completed_finished_logs;
+  size_t                       completed_jobs = 0;
+  bool                         should_exit    = false;
+  std::thread                  worker;
+
+  /* Worker only */
+  std::map<LogKey, Log>        logs;
+  std::string                  source_path;
+  int                          source_fd = -1;
+  std::vector<SegmentCache::ChosenSegment> synced_logs;
+  std::vector<SegmentCache::ChosenSegment> finished_logs;
+
+  void run();
+  void run_job(const Job&, std::vector<Log*>&);
+  bool start_log(Log&, const Job&);
+  void finish_log(Log&);
+  void close_log(Log&);
+  static SegmentCache::ChosenSegment describe_log(const Log&);
+  void sync_log(Log&);
+  bool open_source(const std::string&);
+  void close_source();
+
+public:
+  ChosenLogCompactor(Epoll::Manager&, SegmentCache&);
+  ~ChosenLogCompactor();
+
+  void handle_stream_content(const Paxos::Proposal&) override;
+  void handle_non_contiguous_stream_content(const Paxos::Proposal&) override {}
+  void handle_unknown_stream_content(const Paxos::Proposal&) override {}
+
+  Paxos::Slot get_first_unconsumed_slot() const override;
+
+  void handle_readable() override;
+  void handle_writeable() override;
+  void handle_error(const uint32_t) override;
+};
+
+}
+
+#endif // ndef PIPELINE_CHOSEN_LOG_COMPACTOR_H
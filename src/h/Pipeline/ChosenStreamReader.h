@@ -0,0 +1,90 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_CHOSEN_STREAM_READER_H
+#define PIPELINE_CHOSEN_STREAM_READER_H
+
+#include "Paxos/Proposal.h"
+#include "Pipeline/SegmentCache.h"
+
+#include <deque>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace Pipeline {
+
+/* Reads the chosen content of one stream, in order, straight from the
+   locally-accepted segment files that hold it, with sendfile() to a socket.
+   It learns what has been chosen from add_chosen(), and pins the files it
+   has yet to read, and the one it has open, so that they are not reclaimed
+   underneath it. */
+class ChosenStreamReader : public SegmentCache::ChosenDataConsumer {
+  ChosenStreamReader           (const ChosenStreamReader&) = delete; // no copying
+  ChosenStreamReader &operator=(const ChosenStreamReader&) = delete; // no assignment
+
+  /* Chosen content of the stream that has yet to be read. */
+  struct Extent {
+    Paxos::Value::OffsetStream stream;
+    Paxos::SlotRange           slots;
+  };
+
+        SegmentCache              &segment_cache;
+  const Paxos::Value::StreamName   stream;
+        std::deque<Extent>         unread;
+        uint64_t                   unread_bytes = 0;
+        Paxos::Slot                first_unread_slot;
+
+  /* The segment file holding the start of the first unread extent. */
+        int                        segment_fd = -1;
+        SegmentCache::ChosenSegment segment;
+
+  bool open_segment();
+  void close_segment();
+  void consume(uint64_t);
+
+public:
+  enum Result : uint8_t {
+    succeeded,
+    blocked,
+    unavailable, // the content is not held in any local segment file
+    failed
+  };
+
+  ChosenStreamReader(SegmentCache&, const Paxos::Value::StreamName&);
+  ~ChosenStreamReader();
+
+  const Paxos::Value::StreamName &get_stream() const { return stream; }
+
+  /* Records that the given content of this stream has been chosen. */
+  void add_chosen(const Paxos::Proposal&);
+
+  bool has_unread() const { return !unread.empty(); }
+  uint64_t get_unread_bytes() const { return unread_bytes; }
+
+  /* Sends up to the given number of bytes of unread content to the given
+     fd with sendfile(), consuming what was sent. */
+  Result send_to(int, size_t);
+
+  Paxos::Slot get_first_unconsumed_slot() const override;
+};
+
+}
+
+#endif // ndef PIPELINE_CHOSEN_STREAM_READER_H
@@ -0,0 +1,89 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_CLIENT_ACTIVATION_SCHEDULER_H
+#define PIPELINE_CLIENT_ACTIVATION_SCHEDULER_H
+
+#include "Pipeline/SegmentCache.h"
+#include "Epoll.h"
+
+#include <deque>
+
+namespace Pipeline {
+namespace Client {
+
+class Socket;
+
+/* Shares the activation of slots between the client sockets. Each socket
+   writes data with a fixed stream offset, which only holds while no other
+   stream activates any slots, so at most one socket may have writes in
+   flight at once. Sockets take turns in FIFO order. A turn only ends when
+   another socket is waiting and the active socket has written its quantum of
+   bytes or held the turn for its quantum of time, since every change of turn
+   starts a new segment for the stream. */
+#ifndef CLIENT_ACTIVATION_QUANTUM_BYTES
+#define CLIENT_ACTIVATION_QUANTUM_BYTES (CLIENT_SEGMENT_DEFAULT_SIZE/4)
+#endif // ndef CLIENT_ACTIVATION_QUANTUM_BYTES
+
+#ifndef CLIENT_ACTIVATION_QUANTUM_MILLISECONDS
+#define CLIENT_ACTIVATION_QUANTUM_MILLISECONDS 100
+#endif // ndef CLIENT_ACTIVATION_QUANTUM_MILLISECONDS
+
+class ActivationScheduler : public Epoll::DeferredHandler {
+  ActivationScheduler           (const ActivationScheduler&) = delete; // no copying
+  ActivationScheduler &operator=(const ActivationScheduler&) = delete; // no assignment
+
+private:
+  Epoll::Manager      &manager;
+  Socket              *active       = NULL;
+  uint64_t             active_bytes = 0;
+  std::chrono::steady_clock::time_point turn_deadline;
+  bool                 timer_armed  = false;
+  std::deque<Socket*>  waiting;
+
+  bool turn_used_up() const;
+  void enqueue(Socket*);
+  void start_turn(Socket*);
+  void end_turn();
+  void arm_timer();
+
+public:
+  ActivationScheduler(Epoll::Manager &manager) : manager(manager) {}
+  ~ActivationScheduler();
+
+  /* Whether the socket may write more data now. If not, it is queued and
+     Socket::turn_granted() is called when its turn comes. */
+  bool request_turn(Socket*);
+
+  /* The socket has activated slots for some of the data it wrote. */
+  void record_activation(Socket*, uint64_t);
+
+  /* All of the socket's writes have been activated. */
+  void writes_activated(Socket*);
+
+  void remove(Socket*);
+
+  void handle_deferred() override;
+};
+
+}
+}
+
+#endif // ndef PIPELINE_CLIENT_ACTIVATION_SCHEDULER_H
@@ -0,0 +1,94 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_CLIENT_FLOW_CONTROL_H
+#define PIPELINE_CLIENT_FLOW_CONTROL_H
+
+#include "Pipeline/SegmentCache.h"
+#include "Paxos/Legislator.h"
+#include "Epoll.h"
+
+#include <vector>
+
+namespace Pipeline {
+namespace Client {
+
+class Socket;
+
+/* Bounds how far slot activation may run ahead of the chosen slots. While the
+   window is exceeded the client sockets stop reading (by dropping EPOLLIN)
+   rather than spinning, and they resume when chosen values drain the window.
+   Values other than stream content can also drain it, so the window is also
+   rechecked periodically while any socket is throttled. */
+#ifndef CLIENT_INFLIGHT_WINDOW_BYTES
+#define CLIENT_INFLIGHT_WINDOW_BYTES CLIENT_SEGMENT_DEFAULT_SIZE
+#endif // ndef CLIENT_INFLIGHT_WINDOW_BYTES
+
+#ifndef CLIENT_THROTTLE_RECHECK_MILLISECONDS
+#define CLIENT_THROTTLE_RECHECK_MILLISECONDS 50
+#endif // ndef CLIENT_THROTTLE_RECHECK_MILLISECONDS
+
+class FlowControl : public Epoll::DeferredHandler {
+  FlowControl           (const FlowControl&) = delete; // no copying
+  FlowControl &operator=(const FlowControl&) = delete; // no assignment
+
+private:
+        Epoll::Manager                        &manager;
+  const Paxos::Legislator                     &legislator;
+        uint64_t                               window_bytes
+                                                 = CLIENT_INFLIGHT_WINDOW_BYTES;
+        std::vector<Socket*>                   throttled;
+        std::chrono::steady_clock::time_point  throttled_since;
+        std::chrono::steady_clock::duration    throttled_time
+                                                 = std::chrono::steady_clock::duration::zero();
+        uint64_t                               throttle_count = 0;
+        bool                                   timer_armed    = false;
+
+  void arm_timer();
+
+public:
+  FlowControl(Epoll::Manager &manager, const Paxos::Legislator &legislator)
+    : manager(manager), legislator(legislator) {}
+  ~FlowControl();
+
+  void set_window_bytes(uint64_t);
+  uint64_t get_window_bytes() const { return window_bytes; }
+
+  bool window_exceeded() const;
+
+  /* The socket has stopped reading because the window is exceeded;
+     Socket::window_reopened() is called once it drains. */
+  void throttle(Socket*);
+  void remove(Socket*);
+
+  /* Some slots were chosen, so the window may have drained. */
+  void slots_chosen();
+
+  /* Total time for which at least one socket was throttled. */
+  std::chrono::steady_clock::duration get_throttled_time() const;
+  uint64_t get_throttle_count() const { return throttle_count; }
+
+  void handle_deferred() override;
+};
+
+}
+}
+
+#endif // ndef PIPELINE_CLIENT_FLOW_CONTROL_H
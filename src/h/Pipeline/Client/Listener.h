@@ -27,8 +27,10 @@
 #include "Paxos/Legislator.h"
 #include "Pipeline/Client/Socket.h"
 
+#include <map>
 #include <memory>
 #include <string.h>
+#include <vector>
 
 namespace Pipeline {
 namespace Client {
@@ -40,7 +42,13 @@ class Listener : public AbstractListener,
   SegmentCache      &segment_cache;
   const NodeName    &node_name;
   Paxos::Value::StreamId next_stream_id = 0;
-  std::vector<std::unique_ptr<Socket>> client_sockets;
+  ActivationScheduler scheduler;
+  FlowControl         flow_control;
+  std::map<Paxos::Value::StreamId, std::unique_ptr<Socket>> client_sockets;
+  const std::vector<TeeSink*>   *tee_sinks = NULL;
+
+  Socket *find_socket(const Paxos::Proposal&) const;
+  void skip_stream_id(const Paxos::Value::StreamName&);
 
   protected:
   void handle_accept(int client_fd) override;
@@ -48,6 +56,15 @@ class Listener : public AbstractListener,
   public:
     Listener(Epoll::Manager&, SegmentCache&, Paxos::Legislator&,
              const NodeName&, const char*);
+    FlowControl &get_flow_control() { return flow_control; }
+    Paxos::Value::StreamId get_next_stream_id() const { return next_stream_id; }
+
+    /* Client data accepted from now on is also teed into these, one per
+       follower. */
+    void set_tee_sinks(const std::vector<TeeSink*> *sinks) {
+      tee_sinks = sinks;
+    }
+
     void handle_stream_content(const Paxos::Proposal&);
     void handle_unknown_stream_content(const Paxos::Proposal&);
     void handle_non_contiguous_stream_content(const Paxos::Proposal&);
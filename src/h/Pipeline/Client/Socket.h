@@ -22,9 +22,13 @@
 #define PIPELINE_CLIENT_SOCKET_H
 
 #include "Pipeline/Pipe.h"
+#include "Pipeline/Client/ActivationScheduler.h"
+#include "Pipeline/Client/FlowControl.h"
 #include "Epoll.h"
 #include "Paxos/Legislator.h"
 
+#include <deque>
+
 namespace Pipeline {
 namespace Client {
 
@@ -35,6 +39,8 @@ class Socket : public Epoll::Handler {
 private:
         Epoll::Manager            &manager;
         Paxos::Legislator         &legislator;
+        ActivationScheduler       &scheduler;
+        FlowControl               &flow_control;
 
   const NodeName                  &node_name;
   const Paxos::Value::StreamName   stream;
@@ -48,6 +54,8 @@ private:
         /* Next position to be confirmed as durably written */
         uint64_t                   written_stream_pos      = 0;
 #endif // ndef NDEBUG
+        /* Next position to be proposed to the other nodes */
+        uint64_t                   proposed_stream_pos     = 0;
         /* Next position to be acknowledged to the client */
         uint64_t                   acknowledged_stream_pos = 0;
         /* Next position to be committed/chosen */
@@ -55,6 +63,14 @@ private:
 
         int                        fd;
         bool                       waiting_for_downstream = false;
+        bool                       throttled              = false;
+
+  /* When the data is teed to the followers it does not wait for this node's
+     sync, so nor does its proposal: each write is proposed as soon as it is
+     in the segment, and accepted here once it is synced. */
+        bool                       propose_before_sync    = false;
+        std::deque<Paxos::Proposal>
+                                   unaccepted_proposals;
 
   void shutdown_if_self(const Paxos::Proposal&);
   void shutdown();
@@ -63,6 +79,8 @@ public:
   Socket (Epoll::Manager&,
           SegmentCache&,
           Paxos::Legislator&,
+          ActivationScheduler&,
+          FlowControl&,
           const NodeName&,
           const Paxos::Value::StreamName,
           const int);
@@ -71,10 +89,16 @@ public:
 
   bool is_shutdown() const;
 
+  void set_tee_sinks(const std::vector<TeeSink*> *sinks) {
+    pipe.set_tee_sinks(sinks);
+    propose_before_sync = sinks != NULL;
+  }
+
   void handle_readable() override;
   void handle_writeable() override;
   void handle_error(const uint32_t) override;
 
+  bool ready_to_write_data();
   bool ok_to_write_data(uint64_t) const;
   const Paxos::Term &get_term_for_next_write() const;
   const Paxos::Value::StreamOffset get_offset_for_next_write(uint64_t) const;
@@ -82,9 +106,15 @@ public:
   void downstream_became_writeable();
   void downstream_closed();
   void downstream_wrote_bytes(uint64_t, uint64_t);
+  void downstream_wrote_unsynced_bytes(uint64_t, uint64_t);
 
   void send_pending_acknowledgement(bool);
 
+  void turn_granted();
+  bool has_writes_in_flight() const;
+
+  void window_reopened();
+
   void handle_stream_content(const Paxos::Proposal&);
   void handle_unknown_stream_content(const Paxos::Proposal&);
   void handle_non_contiguous_stream_content(const Paxos::Proposal&);
@@ -45,15 +45,15 @@ class LocalAcceptor {
         Epoll::Manager       manager;
         ValidateArgs         validate_args;
         Pipe<LocalAcceptor>  pipe;
-        std::vector<std::unique_ptr<SegmentCache::CacheEntry>> &entries;
+  const SegmentCache        &segment_cache;
 
 public:
   LocalAcceptor(const Paxos::Proposal  &proposal,
                       Paxos::SlotRange &slots_to_accept,
                       SegmentCache     &segment_cache,
-                const NodeName         &node_name,
-                      std::vector<std::unique_ptr<SegmentCache::CacheEntry>> &entries);
+                const NodeName         &node_name);
 
+  bool ready_to_write_data() { return true; }
   bool ok_to_write_data(uint64_t) { return true; }
 
   const Paxos::Term &get_term_for_next_write() {
@@ -65,6 +65,7 @@ public:
   }
 
   void downstream_wrote_bytes(uint64_t, uint64_t);
+  void downstream_wrote_unsynced_bytes(uint64_t, uint64_t) {}
   void downstream_closed();
   void downstream_became_writeable();
 
@@ -26,12 +26,19 @@
 
 namespace Pipeline {
 
+/* A node may host several independent consensus groups, numbered from zero.
+   Each keeps its data in its own directory: group 0 uses data/clu_X/n_Y as
+   it always has, and group G uses data/clu_X/grp_G/n_Y. */
 struct NodeName {
   const std::string   &cluster;
   const Paxos::NodeId  id;
+  const uint32_t       group;
+  const std::string    group_directory;
+  const std::string    directory;
 
-  NodeName(const std::string &cluster, const Paxos::NodeId id)
-    : cluster(cluster), id(id) {}
+  NodeName(const std::string &cluster,
+           const Paxos::NodeId id,
+           const uint32_t      group = 0);
 
   NodeName           (const NodeName&) = delete;
   NodeName &operator=(const NodeName&) = delete;
@@ -0,0 +1,332 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_PEER_OUTBOUND_RING_H
+#define PIPELINE_PEER_OUTBOUND_RING_H
+
+#include "Pipeline/Peer/Protocol.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <limits>
+#include <memory>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+
+namespace Pipeline {
+namespace Peer {
+
+/* The frames queued for a peer but not yet written, in a ring of CAPACITY
+   bytes that is allocated up front. Frames are only dropped once it is full.
+   Positions in the ring count bytes since it was last cleared, so that a
+   frame's position identifies it until it is written.
+
+   Once a START_STREAMING_* frame is queued, nothing after it is written on
+   the current connection, which is then handed over to a sender. Frames
+   queued after it are kept for the next connection to the same peer, and
+   are discarded if that connection turns out to be to a different peer or
+   to use a different protocol version. */
+template<size_t CAPACITY>
+class OutboundRing {
+  OutboundRing           (const OutboundRing&) = delete; // no copying
+  OutboundRing &operator=(const OutboundRing&) = delete; // no assignment
+
+  /* Messages of these types only matter in their latest form, so a new one
+     supersedes a queued, unstarted frame of the same type in place instead of
+     queueing another frame. For an accepted frame for stream content this
+     means extending it to cover an adjacent or overlapping acceptance. */
+  enum SupersedableFrame : uint8_t {
+    seek_votes_or_catch_up_frame,
+    offer_vote_frame,
+    prepare_term_frame,
+    accepted_stream_content_frame,
+    supersedable_frame_count
+  };
+
+  std::unique_ptr<uint8_t[]> buffer;
+  uint64_t                   written = 0;
+  uint64_t                   queued  = 0;
+  uint64_t                   latest_frames[supersedable_frame_count];
+
+  /* Type and end position of the queued START_STREAMING_* frame, if any. */
+  uint8_t                    streaming_frame_type = 0;
+  uint64_t                   streaming_frame_end  = 0;
+  /* The peer whose connection was just handed over, while reconnecting to
+     it, and the protocol version in which the frames kept for it are laid
+     out. */
+  Paxos::NodeId              handed_over_peer_id  = 0;
+  uint32_t                   handed_over_version  = 0;
+
+  uint64_t                   frames_queued     = 0;
+  uint64_t                   frames_merged     = 0;
+  uint64_t                   frames_superseded = 0;
+  uint64_t                   frames_dropped    = 0;
+
+  static bool get_supersedable_frame(uint8_t type, SupersedableFrame &frame) {
+    switch (type) {
+      case MESSAGE_TYPE_SEEK_VOTES_OR_CATCH_UP:
+        frame = seek_votes_or_catch_up_frame;  return true;
+      case MESSAGE_TYPE_OFFER_VOTE:
+        frame = offer_vote_frame;              return true;
+      case MESSAGE_TYPE_PREPARE_TERM:
+        frame = prepare_term_frame;            return true;
+      case MESSAGE_TYPE_ACCEPTED | VALUE_TYPE_STREAM_CONTENT:
+        frame = accepted_stream_content_frame; return true;
+      default:
+        return false;
+    }
+  }
+
+  void forget_latest_frames() {
+    for (auto &position : latest_frames) {
+      position = std::numeric_limits<uint64_t>::max();
+    }
+  }
+
+  void copy_in(uint64_t position, const void *ptr, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(ptr);
+    const size_t start = position % CAPACITY;
+    const size_t first = std::min(size, CAPACITY - start);
+    memcpy(buffer.get() + start, bytes, first);
+    memcpy(buffer.get(), bytes + first, size - first);
+  }
+
+  void copy_out(uint64_t position, void *ptr, size_t size) const {
+    uint8_t *bytes = static_cast<uint8_t*>(ptr);
+    const size_t start = position % CAPACITY;
+    const size_t first = std::min(size, CAPACITY - start);
+    memcpy(bytes, buffer.get() + start, first);
+    memcpy(bytes + first, buffer.get(), size - first);
+  }
+
+  bool supersede(const Protocol::FrameHeader &header,
+                 const Protocol::FrameLayout &layout,
+                 const Protocol::Message     &next,
+                 const Protocol::Value       &next_value) {
+    SupersedableFrame frame;
+    if (!get_supersedable_frame(header.type, frame)) {
+      return false;
+    }
+
+    const uint64_t position = latest_frames[frame];
+    if (position < written || queued <= position) {
+      // Already started, or no longer queued.
+      return false;
+    }
+
+    Protocol::Message queued_message;
+    copy_out(position + layout.header_size, &queued_message,
+             layout.message_size);
+
+    switch (frame) {
+      case seek_votes_or_catch_up_frame:
+        if (next.seek_votes_or_catch_up.slot
+              < queued_message.seek_votes_or_catch_up.slot
+         || next.seek_votes_or_catch_up.term.get_paxos_term()
+              < queued_message.seek_votes_or_catch_up.term.get_paxos_term()) {
+          return false;
+        }
+        break;
+
+      case offer_vote_frame:
+        if (next.offer_vote.term.get_paxos_term()
+              < queued_message.offer_vote.term.get_paxos_term()) {
+          return false;
+        }
+        break;
+
+      case prepare_term_frame:
+        if (next.prepare_term.term.get_paxos_term()
+              < queued_message.prepare_term.term.get_paxos_term()) {
+          return false;
+        }
+        break;
+
+      default: {
+        Protocol::Value queued_value;
+        copy_out(position + layout.header_size + layout.message_size,
+                 &queued_value, layout.value_size);
+        auto &accepted = queued_message.accepted;
+        if (memcmp(&accepted.term, &next.accepted.term,
+                   sizeof accepted.term) != 0
+            || memcmp(&queued_value, &next_value, layout.value_size) != 0
+            || next.accepted.start_slot < accepted.start_slot
+            || accepted.end_slot < next.accepted.start_slot) {
+          return false;
+        }
+        if (accepted.end_slot < next.accepted.end_slot) {
+          accepted.end_slot = next.accepted.end_slot;
+          copy_in(position + layout.header_size, &accepted, sizeof accepted);
+        }
+        frames_merged++;
+        return true;
+      }
+    }
+
+    copy_in(position + layout.header_size, &next, layout.message_size);
+    frames_superseded++;
+    return true;
+  }
+
+public:
+  OutboundRing() : buffer(new uint8_t[CAPACITY]) {
+    forget_latest_frames();
+  }
+
+  /* Queues a frame with the given parts, to be followed by the given number
+     of trailing bytes which the caller then append()s, or supersedes a
+     queued frame with it, in which case there is nothing new to write.
+     Returns false, counting the frame as dropped, if it does not fit. */
+  bool queue(const Protocol::FrameHeader &header,
+             const Protocol::FrameLayout &layout,
+             const Protocol::Message     &message,
+             const Protocol::Value       &value,
+                   size_t                 trailing_bytes = 0) {
+    if (trailing_bytes == 0 && supersede(header, layout, message, value)) {
+      return true;
+    }
+
+    if (written + CAPACITY < queued + layout.size() + trailing_bytes) {
+      frames_dropped++;
+      return false;
+    }
+
+    const uint64_t frame_start = queued;
+    append(&header,  layout.header_size);
+    append(&message, layout.message_size);
+    append(&value,   layout.value_size);
+    frames_queued++;
+
+    SupersedableFrame frame;
+    if (get_supersedable_frame(header.type, frame)) {
+      latest_frames[frame] = frame_start;
+    }
+
+    switch (header.type) {
+      case MESSAGE_TYPE_START_STREAMING_PROMISES:
+      case MESSAGE_TYPE_START_STREAMING_PROPOSALS:
+      case MESSAGE_TYPE_START_STREAMING_CATCH_UP:
+      case MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS:
+        assert(streaming_frame_type == 0);
+        streaming_frame_type = header.type;
+        streaming_frame_end  = queued;
+        break;
+    }
+    return true;
+  }
+
+  void append(const void *ptr, size_t size) {
+    assert(queued + size <= written + CAPACITY);
+    copy_in(queued, ptr, size);
+    queued += size;
+  }
+
+  /* Counts a frame that the caller refused to queue. */
+  void drop_frame() { frames_dropped++; }
+
+  /* The type of the queued START_STREAMING_* frame, or 0 if there is none. */
+  uint8_t get_streaming_frame_type() const { return streaming_frame_type; }
+
+  /* The peer for which frames are kept while reconnecting, or 0. */
+  Paxos::NodeId get_handed_over_peer_id() const { return handed_over_peer_id; }
+
+  bool has_unwritten() const { return written < queued; }
+
+  /* Bytes of frames queued but not yet written. */
+  uint64_t get_depth() const { return queued - written; }
+
+  /* Describes the bytes that may be written on the current connection, which
+     end at any queued START_STREAMING_* frame, in up to two iovecs. Returns
+     how many it used, or 0 if there is nothing to write. */
+  int get_unwritten(struct iovec iov[2]) const {
+    const uint64_t limit
+      = streaming_frame_type != 0 ? streaming_frame_end : queued;
+    if (limit <= written) {
+      return 0;
+    }
+
+    const size_t start = written % CAPACITY;
+    const size_t size  = limit - written;
+    iov[0].iov_base = buffer.get() + start;
+    iov[0].iov_len  = std::min(size, CAPACITY - start);
+    if (iov[0].iov_len == size) {
+      return 1;
+    }
+    iov[1].iov_base = buffer.get();
+    iov[1].iov_len  = size - iov[0].iov_len;
+    return 2;
+  }
+
+  void consume(size_t size) {
+    assert(written + size <= queued);
+    written += size;
+  }
+
+  /* To be called once get_unwritten() has nothing left. If that was because
+     a START_STREAMING_* frame has been written, returns its type and keeps
+     what follows it for the next connection to the given peer, which uses
+     the given protocol version. Otherwise returns 0. */
+  uint8_t finish_writing(const Paxos::NodeId &peer_id, uint32_t version) {
+    const uint8_t type = streaming_frame_type;
+    if (type != 0) {
+      assert(written == streaming_frame_end);
+      streaming_frame_type = 0;
+      handed_over_peer_id  = peer_id;
+      handed_over_version  = version;
+    } else if (written == queued) {
+      written = queued = 0;
+      forget_latest_frames();
+    }
+    return type;
+  }
+
+  /* To be called once a new connection's handshake completes. Discards the
+     frames kept since the last handover unless the connection is to the
+     same peer, using the same protocol version. */
+  void reconnected(const Paxos::NodeId &peer_id, uint32_t version) {
+    if (handed_over_peer_id == 0) {
+      return;
+    }
+    if (handed_over_peer_id != peer_id || handed_over_version != version) {
+      written = queued;
+      streaming_frame_type = 0;
+    }
+    handed_over_peer_id = 0;
+  }
+
+  /* Discards everything, when the connection fails. */
+  void clear() {
+    written              = 0;
+    queued               = 0;
+    streaming_frame_type = 0;
+    handed_over_peer_id  = 0;
+    forget_latest_frames();
+  }
+
+  uint64_t get_frames_queued()     const { return frames_queued;     }
+  uint64_t get_frames_merged()     const { return frames_merged;     }
+  uint64_t get_frames_superseded() const { return frames_superseded; }
+  uint64_t get_frames_dropped()    const { return frames_dropped;    }
+};
+
+}}
+
+#endif // ndef PIPELINE_PEER_OUTBOUND_RING_H
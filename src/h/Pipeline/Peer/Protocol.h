@@ -25,8 +25,24 @@
 #include "Paxos/Value.h"
 #include "Pipeline/NodeName.h"
 
+#include <sys/uio.h>
+
 #define CLUSTER_ID_LENGTH 36  // length of a GUID string
-#define PROTOCOL_VERSION  1
+#define PROTOCOL_VERSION  6
+
+/* Oldest version accepted from a peer. Each connection uses the lower of the
+   two versions in its handshakes. */
+#define MIN_PROTOCOL_VERSION 3
+
+/* First version in which each frame is only as long as its type requires. */
+#define PROTOCOL_VERSION_VARIABLE_FRAMES 4
+
+/* First version in which chosen segments are transferred on catch-up. */
+#define PROTOCOL_VERSION_CATCH_UP_TRANSFER 5
+
+/* First version in which stream content may be proposed before the proposer
+   has accepted it. */
+#define PROTOCOL_VERSION_EARLY_PROPOSALS 6
 
 namespace Pipeline {
 namespace Peer {
@@ -36,6 +52,7 @@ struct Handshake {
   uint32_t      protocol_version = PROTOCOL_VERSION;
   char          cluster_id[CLUSTER_ID_LENGTH+1];
   Paxos::NodeId node_id;
+  uint32_t      group;
 } __attribute__((packed));
 
 void send_handshake(int, const NodeName&);
@@ -46,7 +63,9 @@ void send_handshake(int, const NodeName&);
 #define RECEIVE_HANDSHAKE_INVALID     3
 #define RECEIVE_HANDSHAKE_SUCCESS     4
 
-int receive_handshake(int, Handshake&, size_t&, const std::string&);
+int receive_handshake(int, Handshake&, size_t&, const NodeName&);
+
+uint32_t negotiated_version(const Handshake&);
 
 /*
 
@@ -55,11 +74,22 @@ Protocol - start with a handshake:
 - 36 bytes cluster ID
 - 1 byte null terminator
 - 4 bytes node ID
+- 4 bytes consensus group
 
 Then sequence of messages. Each message starts
 with an identifying byte followed by some (or fewer)
 bytes according to its type.
 
+Up to version 3 every frame is the same size: the type byte, then
+sizeof(Message) bytes, then sizeof(Value) bytes, whatever the type.
+
+From version 4 a frame comprises:
+- 1 byte message type
+- 1 byte body length
+- the message, sized according to the bottom nibble of the type
+- the value, if the type carries one, sized according to the top nibble
+The body length is checked against the type.
+
 */
 
 struct Term {
@@ -111,19 +141,22 @@ union Message {
 #define MESSAGE_TYPE_REQUEST_CATCH_UP 0x04
 
 /* Type 0x05: send_catch_up(const NodeId&, const Slot&, const Era&,
-                            const Configuration&, const NodeId&, const NodeId&,
-                            const Value::StreamId&, const * uint64_t)
+                            const Configuration&, const NodeId&,
+                            const std::vector<Value::StreamPosition>&)
     - (first NodeId parameter is destination, not included in message)
     - 8 bytes slot number
     - 4 bytes era
     - 4 bytes next-generated node id
-    - 4 bytes current stream owner
-    - 4 bytes current stream id
-    - 8 bytes current stream position
-    - Configuration:
-      - 4 bytes entry count, then repeated this many times:
-        - 4 bytes node id
-        - 1 byte weight
+    - 4 bytes open stream count
+    - 4 bytes configuration entry count
+    - Configuration entries, repeated as many times as the entry count:
+      - 4 bytes node id
+      - 1 byte weight
+    - Open streams, repeated as many times as the open stream count:
+      - 4 bytes stream owner
+      - 4 bytes stream id
+      - 8 bytes stream position
+      - 8 bytes slot number of last chosen content
 */
 
 #define MESSAGE_TYPE_SEND_CATCH_UP 0x05
@@ -131,9 +164,7 @@ union Message {
     Paxos::Slot            slot;
     Paxos::Era             era;
     Paxos::NodeId          next_generated_node_id;
-    Paxos::NodeId          current_stream_owner;
-    Paxos::Value::StreamId current_stream_id;
-    uint64_t               current_stream_position;
+    uint32_t               open_stream_count;
     uint32_t               configuration_size;
   } __attribute__((packed));
   send_catch_up               send_catch_up;
@@ -143,6 +174,13 @@ union Message {
     Paxos::Configuration::Weight weight;
   } __attribute__((packed));
 
+  struct open_stream_entry {
+    Paxos::NodeId          owner;
+    Paxos::Value::StreamId id;
+    uint64_t               position;
+    Paxos::Slot            last_chosen_slot;
+  } __attribute__((packed));
+
 /* Type 0x06: prepare_term(const Term&)
     - 12 bytes term (4 bytes era, 4 bytes term number, 4 bytes owner id)
 */
@@ -265,8 +303,50 @@ union Message {
   } __attribute__((packed));
   start_streaming_proposals   start_streaming_proposals;
 
+/* Type 0x0e: start streaming chosen segments (from version 5)
+    - 8 bytes end slot: only segments ending at or before it are sent
+
+   The connection is then used for a catch-up transfer. For each segment:
+    - sender sends a CatchUpSegment describing it
+    - receiver replies with a CatchUpResume: the first slot of the segment
+      that it does not already hold, or its end slot to skip it
+    - sender sends the raw stream data from the resume slot to the end slot
+   The sender closes the connection after the last segment.
+*/
+
+#define MESSAGE_TYPE_START_STREAMING_CATCH_UP 0x0e
+  struct start_streaming_catch_up {
+    Paxos::Slot                end_slot;
+  } __attribute__((packed));
+  start_streaming_catch_up    start_streaming_catch_up;
+
+/* Type 0x0f: start streaming proposals not yet accepted by the proposer
+   (from version 6)
+    - as for type 0x0d
+
+   The proposer only sends its own acceptance of the data, as an accepted
+   message, once the data is durable. Until then the receiver accepts the
+   data without counting the proposer's acceptance. */
+
+#define MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS 0x0f
+  struct start_streaming_proposals
+                              start_streaming_early_proposals;
+
 };
 
+struct CatchUpSegment {
+  Paxos::NodeId              stream_owner;
+  Paxos::Value::StreamId     stream_id;
+  Paxos::Value::StreamOffset stream_offset;
+  Paxos::Slot                start_slot;
+  Paxos::Slot                end_slot;
+  Term                       term;
+} __attribute__((packed));
+
+struct CatchUpResume {
+  Paxos::Slot                resume_slot;
+} __attribute__((packed));
+
 union Value {
 
 /* Value 0x0t: no-op
@@ -345,6 +425,42 @@ union Value {
 
 };
 
+struct FrameHeader {
+  uint8_t type;
+  uint8_t body_length; // from version 4 only
+} __attribute__((packed));
+
+struct FrameLayout {
+  size_t header_size;
+  size_t message_size;
+  size_t value_size;
+
+  size_t body_size() const { return message_size + value_size; }
+  size_t size()      const { return header_size + body_size(); }
+};
+
+/* The layout of a frame whose type is not yet known, i.e. the part that must
+   be received before calling get_frame_layout(). */
+void get_receiving_frame_layout(uint32_t, FrameLayout&);
+
+/* The layout of a frame of the given type, or false if the type is
+   unknown. */
+bool get_frame_layout(uint32_t, uint8_t, FrameLayout&);
+
+#define PARSE_FRAME_INCOMPLETE  0
+#define PARSE_FRAME_INVALID     1
+#define PARSE_FRAME_COMPLETE    2
+
+/* Determines the layout of the frame at the start of the given received
+   data, and whether all of it has been received. */
+int parse_frame(uint32_t, const uint8_t*, size_t, FrameLayout&);
+
+/* Fills in the iovecs describing the rest of a frame of the given layout
+   after the first `done` bytes, returning how many were used (at most 3). */
+int get_frame_iovecs(const FrameLayout&,
+                     FrameHeader&, Message&, Value&,
+                     size_t, struct iovec*);
+
 }}}
 
 
@@ -26,6 +26,13 @@
 #include "Epoll.h"
 #include "Paxos/Legislator.h"
 
+#include <memory>
+#include <vector>
+
+#ifndef PEER_RECEIVE_BUFFER_SIZE
+#define PEER_RECEIVE_BUFFER_SIZE (1<<16)
+#endif // ndef PEER_RECEIVE_BUFFER_SIZE
+
 namespace Pipeline {
 namespace Peer {
 
@@ -45,7 +52,12 @@ private:
           Pipe<PromiseReceiver>      pipe;
           bool                       waiting_for_downstream = false;
 
+    /* Stream data that the Socket read before handing over the fd, which
+       must be written to the pipe before anything more is read. */
+          std::vector<uint8_t>       buffered_data;
+
     void shutdown();
+    void write_buffered_data();
 
   public:
     PromiseReceiver(Epoll::Manager &manager,
@@ -59,11 +71,14 @@ private:
               Paxos::Value::OffsetStream,
               Paxos::Slot        first_slot);
 
+    void receive_buffered(const uint8_t*, size_t);
+
     bool is_shutdown() const;
     void handle_readable() override;
     void handle_writeable() override;
     void handle_error(const uint32_t) override;
 
+    bool ready_to_write_data() { return true; }
     bool ok_to_write_data(uint64_t);
     const Paxos::Term &get_term_for_next_write() const;
     const Paxos::Value::StreamOffset get_offset_for_next_write(uint64_t) const;
@@ -71,6 +86,7 @@ private:
     void downstream_became_writeable();
     void downstream_closed();
     void downstream_wrote_bytes(uint64_t next_stream_pos, uint64_t bytes_sent);
+    void downstream_wrote_unsynced_bytes(uint64_t, uint64_t) {}
   };
 
 
@@ -81,10 +97,18 @@ private:
     const Paxos::NodeId              peer_id;
           int                        fd;
           Paxos::Proposal            proposal;
+    /* Whether the proposer has already accepted the data it sends, or only
+       sends its acceptance once the data is durable. */
+    const bool                       accepted_by_proposer;
           Pipe<ProposalReceiver>     pipe;
           bool                       waiting_for_downstream = false;
 
+    /* Stream data that the Socket read before handing over the fd, which
+       must be written to the pipe before anything more is read. */
+          std::vector<uint8_t>       buffered_data;
+
     void shutdown();
+    void write_buffered_data();
 
   public:
     ProposalReceiver(Epoll::Manager &manager,
@@ -95,13 +119,17 @@ private:
               int                fd,
         const Paxos::Term       &term,
               Paxos::Value::OffsetStream,
-              Paxos::Slot        first_slot);
+              Paxos::Slot        first_slot,
+              bool               accepted_by_proposer);
+
+    void receive_buffered(const uint8_t*, size_t);
 
     bool is_shutdown() const;
     void handle_readable() override;
     void handle_writeable() override;
     void handle_error(const uint32_t) override;
 
+    bool ready_to_write_data() { return true; }
     bool ok_to_write_data(uint64_t);
     const Paxos::Term &get_term_for_next_write() const;
     const Paxos::Value::StreamOffset get_offset_for_next_write(uint64_t) const;
@@ -109,8 +137,80 @@ private:
     void downstream_became_writeable();
     void downstream_closed();
     void downstream_wrote_bytes(uint64_t next_stream_pos, uint64_t bytes_sent);
+    void downstream_wrote_unsynced_bytes(uint64_t, uint64_t) {}
   };
 
+public:
+  /* The receiver that takes over a catch-up connection is public so that it
+     can be driven over a socketpair in the tests. */
+
+  /* Receives chosen segments from a peer that is catching this node up,
+     writing each through its own Pipe as if locally accepted. Before each
+     segment it tells the peer how much of it is already held here, so that an
+     interrupted transfer resumes where it stopped. */
+  class CatchUpReceiver : public Epoll::Handler {
+    enum class State : uint8_t {
+      receiving_offer,
+      sending_resume,
+      receiving_data,
+      waiting_for_sync
+    };
+
+          Epoll::Manager            &manager;
+          SegmentCache              &segment_cache;
+    const NodeName                  &node_name;
+    const Paxos::NodeId              peer_id;
+          int                        fd;
+          State                      state = State::receiving_offer;
+
+          Protocol::CatchUpSegment   offer;
+          size_t                     offer_bytes_received = 0;
+          Protocol::CatchUpResume    resume;
+          size_t                     resume_bytes_sent    = 0;
+          Paxos::Value::OffsetStream stream;
+          Paxos::Term                term;
+          uint64_t                   bytes_remaining      = 0;
+          bool                       waiting_for_downstream = false;
+
+    /* The pipe for the current segment, and the one for the previous
+       segment which cannot be destroyed from within its own callback. */
+          std::unique_ptr<Pipe<CatchUpReceiver>> pipe;
+          std::unique_ptr<Pipe<CatchUpReceiver>> finished_pipe;
+
+    void shutdown();
+    size_t receive_offer(const uint8_t*, size_t);
+    void handle_offer();
+    void send_resume();
+
+  public:
+    CatchUpReceiver(Epoll::Manager &manager,
+              SegmentCache      &segment_cache,
+        const NodeName          &node_name,
+              Paxos::NodeId      peer_id,
+              int                fd);
+
+    void receive_buffered(const uint8_t*, size_t);
+
+    bool is_shutdown() const;
+    void handle_readable() override;
+    void handle_writeable() override;
+    void handle_error(const uint32_t) override;
+
+    bool ready_to_write_data() { return true; }
+    bool ok_to_write_data(uint64_t) { return true; }
+    const Paxos::Term &get_term_for_next_write() const { return term; }
+    const Paxos::Value::StreamOffset get_offset_for_next_write(uint64_t) const {
+      return stream.offset;
+    }
+
+    void downstream_became_writeable();
+    void downstream_closed();
+    void downstream_wrote_bytes(uint64_t, uint64_t) {}
+    void downstream_wrote_unsynced_bytes(uint64_t, uint64_t) {}
+  };
+
+private:
+
         Epoll::Manager            &manager;
         SegmentCache              &segment_cache;
         Paxos::Legislator         &legislator;
@@ -119,22 +219,30 @@ private:
 
         std::unique_ptr<PromiseReceiver>  promise_receiver  = NULL;
         std::unique_ptr<ProposalReceiver> proposal_receiver = NULL;
+        std::unique_ptr<CatchUpReceiver>  catch_up_receiver = NULL;
 
         int                        fd;
 
   Paxos::NodeId       peer_id = 0;
   Protocol::Handshake received_handshake;
   size_t              received_handshake_size = 0;
+  uint32_t            protocol_version = PROTOCOL_VERSION;
+
+  /* Received data not yet handled. Complete frames are handled where they
+     lie; only a trailing partial frame is moved back to the start. */
+  std::vector<uint8_t> receive_buffer;
+  size_t               receive_start = 0;
+  size_t               receive_end   = 0;
 
-  uint8_t           current_message_type = 0;
-  Protocol::Message current_message;
-  Protocol::Value   current_value;
-  size_t            size_received = 0;
-  bool get_paxos_value(Paxos::Value&);
+  bool get_paxos_value(uint8_t, const Protocol::Value&, Paxos::Value&);
+  void handle_message(uint8_t, const Protocol::Message&,
+                               const Protocol::Value&);
 
+  bool                      receiving_catch_up_entries = false;
+  Protocol::Message         catch_up_message;
   std::vector<Paxos::Configuration::Entry> received_entries;
-  Protocol::Message::configuration_entry   current_entry;
-  size_t                                   current_entry_size = 0;
+  std::vector<Paxos::Value::StreamPosition> received_open_streams;
+  size_t handle_catch_up_entries(const uint8_t*, size_t);
 
   void shutdown();
 
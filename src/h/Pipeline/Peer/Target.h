@@ -22,16 +22,41 @@
 #define PIPELINE_PEER_TARGET_H
 
 #include "Pipeline/SegmentCache.h"
+#include "Pipeline/SendfileShards.h"
+#include "Pipeline/TeeSink.h"
 #include "Epoll.h"
 #include "Paxos/Legislator.h"
+#include "Pipeline/Peer/OutboundRing.h"
 #include "Pipeline/Peer/Protocol.h"
 
+#include <deque>
 #include <memory>
+#include <vector>
+
+/* Size of the ring of frames queued for a peer, which is allocated up front.
+   Messages are only dropped once it is full. */
+#ifndef TARGET_OUTBOUND_BUFFER_SIZE
+#define TARGET_OUTBOUND_BUFFER_SIZE (1<<16)
+#endif // ndef TARGET_OUTBOUND_BUFFER_SIZE
+
+/* Default rate at which chosen segments are sent to a peer that is catching
+   up, so that the transfer does not crowd out the live stream
+   (0 = unlimited). */
+#ifndef TARGET_CATCH_UP_BYTES_PER_SECOND
+#define TARGET_CATCH_UP_BYTES_PER_SECOND (1ul<<26)
+#endif // ndef TARGET_CATCH_UP_BYTES_PER_SECOND
+
+/* Largest single sendfile() of a catch-up transfer, which also bounds how
+   far the transfer may burst above its rate. */
+#ifndef TARGET_CATCH_UP_CHUNK_SIZE
+#define TARGET_CATCH_UP_CHUNK_SIZE (1ul<<20)
+#endif // ndef TARGET_CATCH_UP_CHUNK_SIZE
 
 namespace Pipeline {
 namespace Peer {
 
-class Target : public Epoll::Handler {
+class Target : public Epoll::Handler,
+               public Epoll::DeferredHandler {
   Target           (const Target&) = delete; // no copying
   Target &operator=(const Target&) = delete; // no assignment
 
@@ -59,15 +84,60 @@ class Target : public Epoll::Handler {
     void handle_error(const uint32_t) override;
   };
 
-  class ProposedAndAcceptedSender : public Epoll::Handler {
+public:
+  /* The senders that take over a streaming connection are public so that
+     they can be driven over a socketpair in the tests. */
+
+  /* Streams the accepted data for a run of proposals to a follower. The
+     data is located when each proposal is sent and queued as extents of the
+     segment files holding it, so that the whole queue can be written back
+     to back, across segment boundaries, until the socket blocks. Where the
+     data is still in the Target's TeeSink it is claimed and spliced from
+     there instead. Pins the slots it has yet to send so that the files
+     holding them are not reclaimed, and so recycled, while it has them
+     open. */
+  class ProposedAndAcceptedSender : public Epoll::Handler,
+                                    public SendfileShards::Client,
+                                    public SegmentCache::ChosenDataConsumer {
+    /* Part of a segment file still to be sent. The file descriptor is a
+       duplicate owned by the extent, so the data stays readable even if the
+       cache entry is expired and closed in the meantime. Data claimed from
+       the TeeSink has no file descriptor. */
+    struct Extent {
+      int      fd;
+      int      source_fd;
+      off_t    offset;
+      uint64_t length;
+      bool     teed;
+    };
+
           Epoll::Manager             &manager;
           SegmentCache               &segment_cache;
           int                         fd;
           Paxos::SlotRange            slots;
     const Paxos::Value::OffsetStream  stream;
+          std::deque<Extent>          extents;
           bool                        waiting_to_be_writeable = true;
+          bool                        expired                 = false;
+          bool                        corked                  = false;
+
+    /* If not NULL, data is claimed from here where possible. Only the
+       current sender of the Target claims anything. */
+          TeeSink                    *tee_sink;
+
+    /* If not NULL, the data is sent by a shard, one job at a time. */
+          SendfileShards             *shards;
+          size_t                      shard                   = 0;
+          bool                        job_in_flight           = false;
+          SendfileShards::Token       job_token               = 0;
 
     void shutdown();
+    void dispatch_job();
+    bool queue_extents(const Paxos::SlotRange&);
+    void consume(uint64_t);
+    void set_cork(bool);
+    uint64_t get_teed_bytes_queued() const;
+    void release_teed_extents();
 
   public:
     ProposedAndAcceptedSender(Epoll::Manager&,
@@ -75,17 +145,83 @@ class Target : public Epoll::Handler {
                         const NodeName&,
                         int,
                         const Paxos::SlotRange&,
-                        const Paxos::Value::OffsetStream&);
+                        const Paxos::Value::OffsetStream&,
+                              SendfileShards*,
+                              TeeSink*);
 
     ~ProposedAndAcceptedSender();
 
     bool send(const Paxos::Value::OffsetStream&,
               const Paxos::SlotRange&);
 
+    /* No more slots will be sent, so close the connection once the
+       outstanding ones are written, letting the receiver finish its segment. */
+    void expire();
+
     bool is_shutdown() const;
     void handle_readable() override;
     void handle_writeable() override;
     void handle_error(const uint32_t) override;
+    void sendfile_completed(uint64_t, bool) override;
+    Paxos::Slot get_first_unconsumed_slot() const override;
+  };
+
+  /* Sends the retained chosen segments to a peer that is catching up, one at
+     a time in slot order, resuming each from wherever the peer says it got
+     to. Pins the segments it has yet to send so that they are not reclaimed
+     underneath it. */
+  class CatchUpSender : public Epoll::Handler,
+                        public Epoll::TimerHandler,
+                        public SegmentCache::ChosenDataConsumer {
+    enum class State : uint8_t {
+      sending_offer,
+      awaiting_resume,
+      sending_data
+    };
+
+          Epoll::Manager             &manager;
+          SegmentCache               &segment_cache;
+          int                         fd;
+          std::vector<SegmentCache::ChosenSegment>
+                                      segments;
+          size_t                      next_segment = 0;
+          State                       state = State::sending_offer;
+
+          int                         segment_fd = -1;
+          Protocol::CatchUpSegment    offer;
+          size_t                      offer_bytes_sent = 0;
+          Protocol::CatchUpResume     resume;
+          size_t                      resume_bytes_received = 0;
+          off_t                       send_offset = 0;
+          uint64_t                    send_remaining = 0;
+
+    const uint64_t                    bytes_per_second;
+          uint64_t                    budget;
+          timestamp                   budget_updated;
+          bool                        waiting_for_budget = false;
+
+    void shutdown();
+    bool start_next_segment();
+    void close_segment();
+    void send_offer();
+    void send_data();
+    void refill_budget();
+
+  public:
+    CatchUpSender(      Epoll::Manager&,
+                        SegmentCache&,
+                        int,
+                  const Paxos::Slot &end_slot,
+                        uint64_t     bytes_per_second);
+
+    ~CatchUpSender();
+
+    bool is_shutdown() const;
+    void handle_readable() override;
+    void handle_writeable() override;
+    void handle_error(const uint32_t) override;
+    void handle_timeout() override;
+    Paxos::Slot get_first_unconsumed_slot() const override;
   };
 
 public:
@@ -98,23 +234,37 @@ public:
   };
 
 private:
+  /* The message being built, before it is copied onto the outbound queue. */
   struct CurrentMessage {
-    uint8_t           type = 0xff;
-    Protocol::Message message;
-    Protocol::Value   value;
-    size_t            still_to_send = 0;
+    Protocol::FrameHeader header = { 0xff, 0 };
+    Protocol::FrameLayout layout;
+    Protocol::Message     message;
+    Protocol::Value       value;
   }                          current_message;
   bool                       waiting_to_become_writeable = true;
   Paxos::SlotRange           streaming_slots;
   Paxos::Value::OffsetStream streaming_stream;
+  Paxos::Slot                streaming_catch_up_end_slot = 0;
+
+  /* Frames not yet written, flushed with a single writev() once all the
+     events of the current wakeup have been handled. */
+  OutboundRing<TARGET_OUTBOUND_BUFFER_SIZE>
+                             outbound;
+  bool                       flush_deferred = false;
+  uint64_t                   write_count    = 0;
+
   void set_current_message_value(const Paxos::Value&);
   bool prepare_to_send(uint8_t);
+  bool queue_current_message(size_t trailing_bytes = 0);
 
   const Address             address;
         Epoll::Manager     &manager;
         SegmentCache       &segment_cache;
         Paxos::Legislator  &legislator;
   const NodeName           &node_name;
+        SendfileShards     *shards;
+        std::unique_ptr<TeeSink>
+                            tee_sink = NULL;
         Paxos::NodeId       peer_id = 0;
 
         int                 fd = -1;
@@ -122,6 +272,7 @@ private:
         bool                sent_handshake = false;
         Protocol::Handshake received_handshake;
         size_t              received_handshake_bytes = 0;
+        uint32_t            protocol_version = PROTOCOL_VERSION;
 
         std::vector<std::unique_ptr<BoundPromiseSender>>
                             bound_promise_senders;
@@ -129,23 +280,60 @@ private:
                             expired_proposed_and_accepted_senders;
         std::unique_ptr<ProposedAndAcceptedSender>
                             current_proposed_and_accepted_sender = NULL;
+        /* The frame that started the current sender, which says whether the
+           peer counts this node as having accepted what it sends. */
+        uint8_t             current_proposals_frame_type = 0;
+        std::unique_ptr<CatchUpSender>
+                            catch_up_sender = NULL;
+        uint64_t            catch_up_bytes_per_second
+                              = TARGET_CATCH_UP_BYTES_PER_SECOND;
 
   bool is_connected() const;
   bool is_connected_to(const Paxos::NodeId &n) const;
   void shutdown();
 
   uint8_t value_type(const Paxos::Value::Type &t);
+  void send_proposed_stream(const Paxos::Proposal&, uint8_t);
 
 public:
   Target(const Address           &address,
                Epoll::Manager    &manager,
                SegmentCache      &segment_cache,
                Paxos::Legislator &legislator,
-         const NodeName          &node_name);
+         const NodeName          &node_name,
+               SendfileShards    *shards = NULL);
+
+  ~Target();
 
   void handle_readable() override;
   void handle_writeable() override;
   void handle_error(const uint32_t) override;
+  void handle_deferred() override;
+
+  uint64_t get_frames_queued()     const {
+    return outbound.get_frames_queued();
+  }
+  uint64_t get_frames_merged()     const {
+    return outbound.get_frames_merged();
+  }
+  uint64_t get_frames_superseded() const {
+    return outbound.get_frames_superseded();
+  }
+  uint64_t get_frames_dropped()    const {
+    return outbound.get_frames_dropped();
+  }
+  uint64_t get_write_count()       const { return write_count; }
+  /* Bytes of frames queued but not yet written. */
+  uint64_t get_outbound_depth()    const { return outbound.get_depth(); }
+
+  void set_catch_up_rate(uint64_t bytes_per_second) {
+    catch_up_bytes_per_second = bytes_per_second;
+  }
+
+  /* Creates the sink into which the leader tees client data for this
+     peer, unless the data is sent by shards. */
+  TeeSink *enable_tee_sink();
+  const TeeSink *get_tee_sink() const { return tee_sink.get(); }
 
   void start_connection();
 
@@ -162,12 +350,12 @@ public:
     const Paxos::Era               &current_era,
     const Paxos::Configuration     &current_configuration,
     const Paxos::NodeId            &next_generated_node_id,
-    const Paxos::Value::StreamName &current_stream,
-    const uint64_t                  current_stream_pos);
+    const std::vector<Paxos::Value::StreamPosition> &open_streams);
 
   void prepare_term(const Paxos::Term &term);
   void make_promise(const Paxos::Promise &promise);
   void proposed_and_accepted(const Paxos::Proposal &proposal);
+  void proposed(const Paxos::Proposal &proposal);
   void accepted(const Paxos::Proposal &proposal);
 
 };
@@ -21,13 +21,62 @@
 #ifndef PIPELINE_PIPE_H
 #define PIPELINE_PIPE_H
 
+#include "Pipeline/PipeBudget.h"
 #include "Pipeline/Segment.h"
+#include "Pipeline/TeeSink.h"
 #include "Epoll.h"
 #include "Paxos/Value.h"
 
+#include <deque>
+#include <vector>
+
 namespace Pipeline {
 
-#define PIPE_SIZE (1<<26)
+/* Each pipe starts at PIPE_MIN_SIZE and adapts its size to the data that
+   flows through it: it doubles, up to PIPE_MAX_SIZE, each time the upstream
+   finds it full, and halves, down to PIPE_MIN_SIZE, after any
+   PIPE_RESIZE_INTERVAL_MILLISECONDS in which it was never more than a
+   quarter full. All sizes are subject to the PipeBudget. */
+#ifndef PIPE_MIN_SIZE
+#define PIPE_MIN_SIZE (1<<20)
+#endif // ndef PIPE_MIN_SIZE
+
+#ifndef PIPE_MAX_SIZE
+#define PIPE_MAX_SIZE (1<<26)
+#endif // ndef PIPE_MAX_SIZE
+
+#ifndef PIPE_RESIZE_INTERVAL_MILLISECONDS
+#define PIPE_RESIZE_INTERVAL_MILLISECONDS 1000
+#endif // ndef PIPE_RESIZE_INTERVAL_MILLISECONDS
+
+/* Data arriving in the pipe is not written to the segment straight away: all
+   the data that arrives during one round of Epoll::Manager::wait() is written
+   and synced together, and only then reported upstream. If at least
+   PIPE_GROUP_COMMIT_BYTES, or a quarter of the pipe's current size, are
+   waiting then they are committed immediately. If
+   PIPE_GROUP_COMMIT_MILLISECONDS is nonzero then the commit is delayed for up
+   to that long after the first uncommitted data arrives.
+
+   Committed data is synced on a background thread (or, in direct I/O mode,
+   written there: see Segment) and is only reported upstream once the sync
+   has completed, so that the event loop is not blocked waiting for the
+   disk. With the io_uring backend, the splice into the segment is not done
+   on the event loop either, but submitted along with the sync as a linked
+   pair of requests; the pipe is not read again until the splice completes.
+   As soon as committed data is in the segment file, before it is synced, it
+   is reported upstream by downstream_wrote_unsynced_bytes, except in direct
+   I/O mode where it only reaches the file in the background.
+
+   Before each commit the upstream is asked whether it is ready_to_write_data;
+   if not, the data stays in the pipe until the upstream calls
+   upstream_became_ready(). */
+#ifndef PIPE_GROUP_COMMIT_BYTES
+#define PIPE_GROUP_COMMIT_BYTES (PIPE_MAX_SIZE/4)
+#endif // ndef PIPE_GROUP_COMMIT_BYTES
+
+#ifndef PIPE_GROUP_COMMIT_MILLISECONDS
+#define PIPE_GROUP_COMMIT_MILLISECONDS 0
+#endif // ndef PIPE_GROUP_COMMIT_MILLISECONDS
 
 template <class Upstream>
 class Pipe {
@@ -57,6 +106,41 @@ private:
     void handle_error(const uint32_t) override;
   };
 
+  class Committer : public Epoll::DeferredHandler {
+  private:
+    Pipe &pipe;
+  public:
+    Committer(Pipe &pipe) : pipe(pipe) {}
+
+    void handle_deferred() override;
+  };
+
+  class Syncer : public Epoll::SyncHandler {
+  private:
+    Pipe &pipe;
+  public:
+    Syncer(Pipe &pipe) : pipe(pipe) {}
+
+    void handle_synced() override;
+  };
+
+  class Splicer : public Epoll::SpliceHandler {
+  private:
+    Pipe &pipe;
+  public:
+    Splicer(Pipe &pipe) : pipe(pipe) {}
+
+    void handle_spliced(int32_t) override;
+  };
+
+  /* Data written to a segment whose sync has not yet completed. */
+  struct UnsyncedWrite {
+    uint64_t                   start_pos;
+    uint64_t                   byte_count;
+    Paxos::Term                term;
+    Paxos::Value::StreamOffset offset;
+  };
+
         Epoll::Manager            &manager;
         Upstream                  &upstream;
         SegmentCache              &segment_cache;
@@ -67,16 +151,47 @@ private:
 
         Segment                   *current_segment = NULL;
         uint64_t                   next_stream_pos;
+        uint64_t                   next_synced_stream_pos;
         uint64_t                   bytes_in_pipe = 0;
+        bool                       commit_scheduled = false;
+        bool                       eof_after_syncs  = false;
+        bool                       waiting_for_upstream = false;
+        /* In edge-triggered mode the write end stays registered for
+           EPOLLOUT, so this records whether the upstream wants to hear of
+           it. */
+        bool                       waiting_for_space    = false;
+        std::deque<UnsyncedWrite>  unsynced_writes;
+        /* Bytes being spliced into the segment in the background, if any. */
+        uint64_t                   bytes_being_spliced = 0;
+
+        /* Current size of the pipe's buffer, and what is known of the
+           demand for it since it was last resized. */
+        uint64_t                   pipe_size = 0;
+        uint64_t                   peak_bytes_in_pipe = 0;
+        bool                       found_full = false;
+        /* If not NULL, each commit is also teed into these. */
+  const std::vector<TeeSink*>     *tee_sinks = NULL;
 
         int                        pipe_fds[2];
         ReadEnd                    read_end;
         WriteEnd                   write_end;
-
+        Committer                  committer;
+        Syncer                     syncer;
+        Splicer                    splicer;
+        timestamp                  resize_interval_start;
+
+  void schedule_commit();
+  void cancel_commit();
+  void commit();
+  void handle_synced();
+  void handle_spliced(int32_t);
+  void cancel_syncs();
   void handle_writeable();
   void close_current_segment();
   void shutdown();
   void unclean_shutdown();
+  void adapt_pipe_size();
+  void release_pipe_size();
 
 public:
   Pipe (Epoll::Manager&,
@@ -106,6 +221,16 @@ public:
   void wait_until_writeable();
 
   void record_bytes_in(uint64_t);
+
+  void upstream_became_ready();
+
+  void set_tee_sinks(const std::vector<TeeSink*> *sinks) {
+    tee_sinks = sinks;
+  }
+
+  bool has_unsynced_writes() const {
+    return !unsynced_writes.empty();
+  }
 };
 
 }
@@ -0,0 +1,78 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_PIPE_BUDGET_H
+#define PIPELINE_PIPE_BUDGET_H
+
+#include <stdint.h>
+
+namespace Pipeline {
+
+/* Limits the total size of the kernel buffers of all the pipes in this
+   process, which are all resized through here and all run on the event
+   loop's thread. A resize gets as much of what it asks for as the budget
+   and the kernel allow, and never fails outright: if F_SETPIPE_SZ is
+   refused then smaller sizes are tried, down to the current size. A size
+   refused for lack of privilege (above /proc/sys/fs/pipe-max-size) is
+   remembered and not asked for again. */
+#ifndef PIPE_MEMORY_BUDGET
+#define PIPE_MEMORY_BUDGET (1ul<<30)
+#endif // ndef PIPE_MEMORY_BUDGET
+
+class PipeBudget {
+  PipeBudget           (const PipeBudget&) = delete; // no copying
+  PipeBudget &operator=(const PipeBudget&) = delete; // no assignment
+
+  uint64_t limit      = PIPE_MEMORY_BUDGET;
+  uint64_t allocated  = 0;
+  uint64_t ceiling    = UINT64_MAX;
+
+  uint64_t grow_count    = 0;
+  uint64_t shrink_count  = 0;
+  uint64_t failure_count = 0;
+
+  PipeBudget() {}
+
+public:
+  static PipeBudget &shared();
+
+  void set_limit(uint64_t bytes) { limit = bytes; }
+
+  /* Accounts for a newly-created pipe and tries to resize it to the given
+     size, returning its resulting size. */
+  uint64_t acquire(int, uint64_t);
+
+  /* Tries to resize a pipe from the first given size to the second,
+     returning its resulting size. */
+  uint64_t resize(int, uint64_t, uint64_t);
+
+  /* Accounts for closing a pipe of the given size. */
+  void release(uint64_t);
+
+  uint64_t get_limit()         const { return limit;         }
+  uint64_t get_allocated()     const { return allocated;     }
+  uint64_t get_grow_count()    const { return grow_count;    }
+  uint64_t get_shrink_count()  const { return shrink_count;  }
+  uint64_t get_failure_count() const { return failure_count; }
+};
+
+}
+
+#endif // ndef PIPELINE_PIPE_BUDGET_H
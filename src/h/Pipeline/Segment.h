@@ -23,27 +23,64 @@
 
 #include "Paxos/Value.h"
 #include "Paxos/Term.h"
+#include "Pipeline/AlignedBufferPool.h"
 #include "Pipeline/NodeName.h"
 #include "Pipeline/SegmentCache.h"
+#include "Epoll.h"
+
+#include <string>
+#include <vector>
 
 namespace Pipeline {
 
+/* If the SegmentCache is in direct I/O mode then the segment's data is not
+   spliced into the file and synced, but read from the pipe into aligned
+   buffers and written with O_DIRECT | O_DSYNC on the background thread,
+   which bypasses the page cache and needs no separate sync. Each write
+   starts on a block boundary, so the last partial block of one write is
+   kept and written again at the start of the next, and each write is padded
+   out to a whole block. The padding past the end of the data is truncated
+   away on shutdown, on the background thread after the last write. If the
+   file system does not support O_DIRECT then
+   the segment falls back to the usual path. */
 class Segment {
   Segment           (const Segment&) = delete; // no copying
   Segment &operator=(const Segment&) = delete; // no assignment
 
 private:
+  struct StagedBuffer {
+    uint8_t *data;
+    off_t    offset;
+    size_t   length;
+  };
+
   uint64_t next_stream_pos;
   uint64_t remaining_space;
   int      fd = -1;
+  /* Whether the file already existed, rather than coming from the pool. */
+  bool     reopened = false;
   const Paxos::Term                &term;
   const Paxos::Value::StreamOffset  stream_offset;
+        SegmentCache               &segment_cache;
         SegmentCache::CacheEntry   &cache_entry;
 
-public:
+  /* Directories whose entries have changed since they were last synced */
+  std::vector<std::string> unsynced_directories;
 
-#define CLIENT_SEGMENT_DEFAULT_SIZE_BITS 28 // 256MB
-#define CLIENT_SEGMENT_DEFAULT_SIZE (1ul<<CLIENT_SEGMENT_DEFAULT_SIZE_BITS)
+  /* Direct I/O state: the fd opened with O_DIRECT, the file offset just past
+     the data read so far, the buffers read but not yet written, the last
+     partial block of the data already written, and the manager whose
+     background thread is writing it. */
+  int                       direct_fd  = -1;
+  uint64_t                  direct_end = 0;
+  std::vector<StagedBuffer> staged_buffers;
+  uint8_t                   tail[DIRECT_IO_ALIGNMENT];
+  size_t                    tail_length = 0;
+  Epoll::Manager           *direct_manager = NULL;
+
+  void open_direct(const char*);
+
+public:
 
   Segment(SegmentCache&,
     const NodeName&,
@@ -73,8 +110,29 @@ public:
     return next_stream_pos;
   }
 
+  /* The offset in the file at which the next bytes are to be written. */
+  uint64_t get_used_size() const {
+    return cache_entry.slots.end() - cache_entry.slots.start();
+  }
+
   void record_bytes_in(uint64_t);
 
+  bool is_direct() const { return direct_fd != -1; }
+
+  /* In direct I/O mode, reads up to the given number of bytes from the given
+     pipe into aligned buffers, with the same result as splice(). */
+  ssize_t read_direct(int, size_t);
+
+  /* In direct I/O mode, writes everything read since the last call in the
+     background, after which handler->handle_synced() is called unless
+     handler is NULL. */
+  void write_direct_in_background(Epoll::Manager&, Epoll::SyncHandler*);
+
+  /* Requests background syncs of any directories that were changed when
+     creating this segment; these complete before any subsequently-requested
+     sync of the segment's data. */
+  void sync_directories_in_background(Epoll::Manager&);
+
   const Paxos::Term &get_term() const {
     return term;
   }
@@ -23,10 +23,29 @@
 
 #include "Paxos/Proposal.h"
 #include "Pipeline/NodeName.h"
+#include "Pipeline/SegmentPool.h"
+#include "Pipeline/SegmentReclaimer.h"
+#include <deque>
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <type_traits>
+#include <vector>
 
 namespace Pipeline {
 
+#define CLIENT_SEGMENT_DEFAULT_SIZE_BITS 28 // 256MB
+#define CLIENT_SEGMENT_DEFAULT_SIZE (1ul<<CLIENT_SEGMENT_DEFAULT_SIZE_BITS)
+
+/* How many expired chosen segments to remember as sources for catching up a
+ * lagging peer. Their files may be reclaimed in the meantime, so this only
+ * bounds the bookkeeping, not what is kept on disk. */
+#ifndef SEGMENT_CACHE_MAX_CHOSEN_SEGMENTS
+#define SEGMENT_CACHE_MAX_CHOSEN_SEGMENTS 4096
+#endif // ndef SEGMENT_CACHE_MAX_CHOSEN_SEGMENTS
+
 class SegmentCache {
 public:
   SegmentCache           (const SegmentCache&) = delete;
@@ -34,12 +53,15 @@ public:
 
   struct CacheEntry {
     const Paxos::Value::OffsetStream stream;
+    const Paxos::Term                term;
           Paxos::SlotRange           slots;
           bool                       closed_for_writing = false;
     const bool                       is_locally_accepted;
           int                        fd = -1;
+          std::string                path;
 
     CacheEntry(const Paxos::Value::OffsetStream &stream,
+               const Paxos::Term                &term,
                const Paxos::Slot                &initial_slot,
                const bool                        is_locally_accepted);
 
@@ -48,26 +70,152 @@ public:
     void shutdown();
     void extend(uint64_t bytes);
     void close_for_writing();
-    void set_fd(const int new_fd);
+    void set_fd(const int new_fd, const std::string &new_path);
     CacheEntry           (const CacheEntry&) = delete;
     CacheEntry &operator=(const CacheEntry&) = delete;
   };
 
 private:
-  std::vector<std::unique_ptr<CacheEntry>> entries;
+  /* Node-stable storage for CacheEntry objects, allocated a block at a time
+   * and reused via a free list. */
+  class EntryArena {
+    EntryArena           (const EntryArena&) = delete; // no copying
+    EntryArena &operator=(const EntryArena&) = delete; // no assignment
+
+#define SEGMENT_CACHE_ARENA_BLOCK_SIZE 256
+
+    union Cell {
+      Cell *next_free;
+      typename std::aligned_storage<sizeof(CacheEntry),
+                                    alignof(CacheEntry)>::type storage;
+    };
+
+    std::vector<std::unique_ptr<Cell[]>> blocks;
+    Cell *free_list = NULL;
+
+  public:
+    EntryArena() {}
+
+    CacheEntry *create(const Paxos::Value::OffsetStream&,
+                       const Paxos::Term&,
+                       const Paxos::Slot&,
+                       const bool);
+    void destroy(CacheEntry*);
+  };
+
+  /* Entries are indexed by their stream and whether they were accepted
+   * locally, and then by their first slot. No entry spans more than
+   * CLIENT_SEGMENT_DEFAULT_SIZE slots, which bounds how far back a search for
+   * an entry containing a given slot must look. */
+  struct IndexKey {
+    Paxos::NodeId              owner;
+    Paxos::Value::StreamId     id;
+    Paxos::Value::StreamOffset offset;
+    bool                       is_locally_accepted;
+
+    bool operator<(const IndexKey&) const;
+  };
+
+  using EntriesByStartSlot = std::multimap<Paxos::Slot, CacheEntry*>;
+
+  EntryArena                             arena;
+  std::map<IndexKey, EntriesByStartSlot> index;
+  /* Entries that are closed for writing, by their end slot, so that expiry
+   * need only look at the entries that are actually expiring. */
+  std::multimap<Paxos::Slot, CacheEntry*> closed_entries_by_end_slot;
   const NodeName &node_name;
+  SegmentPool     pool;
+  SegmentReclaimer reclaimer;
+  uint64_t        cached_bytes = 0;
+  Paxos::Slot     first_unchosen_slot = 0;
+  bool            direct_io = false;
+
+public:
+  /* A locally-accepted segment that has been expired because it was chosen,
+   * whose file may still be retained and sent to a lagging peer. */
+  struct ChosenSegment {
+    Paxos::Value::OffsetStream stream;
+    Paxos::SlotRange           slots;
+    Paxos::Term                term;
+    std::string                path;
+    bool                       is_compacted_log;
+  };
+
+private:
+  std::deque<ChosenSegment> chosen_segments; // in the order they were chosen
+
+public:
+  /* Something that reads chosen data from the segment files, which must
+   * therefore not be deleted before it is consumed. */
+  class ChosenDataConsumer {
+  public:
+    virtual Paxos::Slot get_first_unconsumed_slot() const = 0;
+  };
+
+private:
+  std::vector<const ChosenDataConsumer*> consumers;
+
   void locally_accept(const Paxos::Proposal&, Paxos::SlotRange&);
+  void remove_from_index(CacheEntry*);
+  void update_first_unconsumed_slot();
 
 public:
   SegmentCache(const NodeName &node_name)
-    : node_name(node_name) {}
+    : node_name(node_name),
+      pool(node_name),
+      reclaimer(pool) {}
+
+  ~SegmentCache();
+
+  /* Starts the pool of preallocated files, once the node's directory
+     exists and before any segment is opened. */
+  void start_pool() { pool.start(); }
+
+  SegmentPool::PreallocatedFile take_preallocated_file() {
+    return pool.take();
+  }
+
+  void give_back_preallocated_file(const SegmentPool::PreallocatedFile &file) {
+    pool.give_back(file);
+  }
 
   CacheEntry &add(const Paxos::Value::OffsetStream &stream,
+                  const Paxos::Term                &term,
                   const Paxos::Slot                 initial_slot,
                         bool                        is_locally_accepted);
 
+  void close_for_writing(CacheEntry&);
+
+  /* Removes entries that are wholly chosen and closed for writing, and hands
+   * their files over to the reclaimer. */
   void expire_because_chosen_to(const Paxos::Slot first_unchosen_slot);
 
+  void set_retention_policy(const RetentionPolicy &policy) {
+    reclaimer.set_policy(policy);
+  }
+
+  /* Whether new segments are written with O_DIRECT rather than through the
+     page cache: see Segment. */
+  void set_direct_io(bool enabled) { direct_io = enabled; }
+  bool is_direct_io() const { return direct_io; }
+
+  void add_consumer(const ChosenDataConsumer*);
+  void remove_consumer(const ChosenDataConsumer*);
+  /* To be called when a consumer has made progress. */
+  void consumers_progressed() { update_first_unconsumed_slot(); }
+
+  size_t get_entry_count() const;
+  uint64_t get_cached_bytes() const { return cached_bytes; }
+  SegmentReclaimer::Usage get_reclaimer_usage() const {
+    return reclaimer.get_usage();
+  }
+
+  /* Find an entry for the given stream that contains the given slot and
+   * whose file is open. Returns NULL if there is no such entry. */
+  const CacheEntry *find(const Paxos::Value::OffsetStream&,
+                         const Paxos::Slot,
+                         const bool is_locally_accepted) const;
+
   enum WriteAcceptedDataResult : uint8_t {
     failed,
     blocked,
@@ -79,7 +227,70 @@ public:
                 const Paxos::Value::OffsetStream &stream,
                 Paxos::SlotRange &slots);
 
+  /* Finds the file holding the accepted data for the start of the given
+   * slots, and how much of it is in that file. Returns false if there is no
+   * such file. */
+  bool locate_accepted_data(const Paxos::Value::OffsetStream&,
+                            const Paxos::SlotRange&,
+                            int      &fd,
+                            off_t    &file_offset,
+                            uint64_t &length) const;
+
   void ensure_locally_accepted(const Paxos::Proposal&);
+
+  /* Appends the remembered chosen segments that end no later than end_slot,
+   * ordered by their first slot. */
+  void get_chosen_segments(const Paxos::Slot end_slot,
+                           std::vector<ChosenSegment>&) const;
+
+  /* The first slot of the given range, starting from its start, whose data
+   * is not held locally either in a locally-accepted entry or in a retained
+   * chosen segment, or its end if it is all held. */
+  Paxos::Slot first_slot_not_held(const Paxos::Value::OffsetStream&,
+                                  const Paxos::SlotRange&) const;
+
+  /* Finds the locally-accepted segment holding the given slot of the stream,
+   * whether it is still cached or was expired when chosen. Returns false if
+   * there is no such segment. */
+  bool locate_chosen_data(const Paxos::Value::OffsetStream&,
+                          const Paxos::Slot,
+                                ChosenSegment&) const;
+
+  /* Records a compacted log that durably holds the chosen content of the
+   * given slots of its stream, replacing any earlier record of the same log.
+   * The chosen segments that it wholly covers are forgotten and their files
+   * are reclaimed once no reader has them pinned. */
+  void add_compacted_log(const ChosenSegment&);
+
+  /* Hands a compacted log that will not be written again to the reclaimer,
+   * so that it is kept according to the retention policy like the segments
+   * that it replaced. */
+  void expire_compacted_log(const ChosenSegment&);
+
+  /* Appends the entries that hold data in a file, for checkpointing. */
+  void get_entries(std::vector<const CacheEntry*>&) const;
+
+  /* Re-adds an entry, closed for writing, whose file was written before a
+   * restart. Skips it if the file no longer exists. */
+  void restore_entry(const Paxos::Value::OffsetStream&,
+                     const Paxos::Term&,
+                     const Paxos::SlotRange&,
+                     const bool is_locally_accepted,
+                     const std::string &path);
+
+  /* Re-adds the segment files written before a restart that are not among
+   * the given paths, having been created since the last checkpoint, and
+   * appends the acceptances of the data in those that were accepted locally.
+   * Skips any file that was still being written when the node stopped,
+   * since how much of it holds data is not known. */
+  void restore_unlisted_entries(const std::set<std::string>&,
+                                std::vector<Paxos::Proposal>&);
+
+  /* Re-adds a chosen segment or compacted log that was remembered before a
+   * restart, handing its file back to the reclaimer: a log is never written
+   * again once the compactor that wrote it has stopped. Skips it if the file
+   * no longer exists. */
+  void restore_chosen_segment(const ChosenSegment&);
 };
 
 
@@ -0,0 +1,169 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_SEGMENT_MANIFEST_H
+#define PIPELINE_SEGMENT_MANIFEST_H
+
+#include "Paxos/Proposal.h"
+#include "Pipeline/NodeName.h"
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef SEGMENT_MANIFEST_PATH_SIZE
+#define SEGMENT_MANIFEST_PATH_SIZE 256
+#endif // ndef SEGMENT_MANIFEST_PATH_SIZE
+
+namespace Pipeline {
+
+/* A checkpoint of the node's state, from which it can restart without
+   scanning its segment files or re-replicating what it already holds. It
+   lives in n_<id>.manifest in the node's directory and consists of a Header
+   followed by arrays of the records below, all of fixed size so that the
+   file can simply be mapped and read in place on restart. It is replaced
+   atomically by a background thread, after syncing every segment file that
+   it names, so it only describes data that is durable. Promises made and
+   non-stream values accepted since the checkpoint are in the node's log,
+   from log_offset onwards. */
+class SegmentManifest {
+  SegmentManifest           (const SegmentManifest&) = delete; // no copying
+  SegmentManifest &operator=(const SegmentManifest&) = delete; // no assignment
+
+public:
+  struct Term {
+    Paxos::Era        era;
+    Paxos::TermNumber term_number;
+    Paxos::NodeId     owner;
+
+    Paxos::Term get_paxos_term() const;
+    void copy_from(const Paxos::Term&);
+  } __attribute__((packed));
+
+  struct Header {
+    uint8_t     magic[8];
+    uint32_t    version;
+    uint32_t    configuration_entry_count;
+    uint32_t    open_stream_count;
+    uint32_t    acceptance_count;
+    uint32_t    segment_count;
+    Paxos::Slot first_unchosen_slot;
+    Paxos::Era  era;
+    Paxos::NodeId next_generated_node_id;
+    Term        min_acceptable_term;
+    uint64_t    log_offset;
+  } __attribute__((packed));
+
+  struct ConfigurationEntry {
+    Paxos::NodeId                node_id;
+    Paxos::Configuration::Weight weight;
+  } __attribute__((packed));
+
+  struct OpenStream {
+    Paxos::NodeId          owner;
+    Paxos::Value::StreamId id;
+    uint64_t               position;
+    Paxos::Slot            last_chosen_slot;
+  } __attribute__((packed));
+
+  /* The payload is a copy of the value's Paxos::Value::Payload. */
+  struct Acceptance {
+    Paxos::Slot start_slot;
+    Paxos::Slot end_slot;
+    Term        term;
+    uint8_t     type;
+    uint8_t     payload[sizeof(Paxos::Value::Payload)];
+  } __attribute__((packed));
+
+  enum SegmentFlags : uint8_t {
+    locally_accepted = 0x01,
+    chosen           = 0x02,
+    compacted_log    = 0x04
+  };
+
+  struct Segment {
+    Paxos::NodeId              owner;
+    Paxos::Value::StreamId     id;
+    Paxos::Value::StreamOffset offset;
+    Paxos::Slot                start_slot;
+    Paxos::Slot                end_slot;
+    Term                       term;
+    uint8_t                    flags;
+    char                       path[SEGMENT_MANIFEST_PATH_SIZE];
+  } __attribute__((packed));
+
+  struct Snapshot {
+    Header                          header;
+    std::vector<ConfigurationEntry> configuration;
+    std::vector<OpenStream>         open_streams;
+    std::vector<Acceptance>         acceptances;
+    std::vector<Segment>            segments;
+
+    void set_configuration(const Paxos::Configuration&);
+    Paxos::Configuration get_configuration() const;
+    void set_open_streams(const std::vector<Paxos::Value::StreamPosition>&);
+    void get_open_streams(std::vector<Paxos::Value::StreamPosition>&) const;
+    void add_acceptance(const Paxos::Proposal&);
+    static Paxos::Proposal get_acceptance(const Acceptance&);
+    /* Returns false if the path does not fit. */
+    bool add_segment(const Paxos::Value::OffsetStream&,
+                     const Paxos::SlotRange&,
+                     const Paxos::Term&,
+                     uint8_t flags,
+                     const std::string &path);
+  };
+
+private:
+  std::string                 path;
+  std::string                 directory;
+
+  std::mutex                  mutex;
+  std::condition_variable     condition;
+  std::unique_ptr<Snapshot>   pending;
+  bool                        should_exit = false;
+  std::thread                 worker;
+
+  /* Only accessed by the worker */
+  std::vector<uint8_t>        last_written;
+  std::map<std::string, Paxos::Slot> synced_segments;
+
+  void run();
+  void sync_segments(const Snapshot&);
+  void write(const std::vector<uint8_t>&);
+
+public:
+  SegmentManifest(const NodeName&);
+  ~SegmentManifest();
+
+  /* Hands the snapshot to the background thread to be written, replacing
+     any that it has not yet started writing. */
+  void checkpoint(std::unique_ptr<Snapshot>);
+
+  /* Reads the manifest written before a restart, if there is a valid one. */
+  bool load(Snapshot&) const;
+};
+
+}
+
+#endif // ndef PIPELINE_SEGMENT_MANIFEST_H
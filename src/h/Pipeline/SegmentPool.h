@@ -0,0 +1,97 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_SEGMENT_POOL_H
+#define PIPELINE_SEGMENT_POOL_H
+
+#include "Pipeline/NodeName.h"
+
+#include <limits.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+
+namespace Pipeline {
+
+/* Keeps a few empty segment files ready for use, preallocated to their full
+   size, so that writes to a segment are overwrites of space that is already
+   allocated and opening a new segment only needs a rename(). The pool is
+   filled when it is started, before the event loop runs, and then refilled
+   on a background thread. If it is nonetheless empty then take() returns a
+   new file that is not preallocated, rather than preallocating one on the
+   event loop's thread. */
+class SegmentPool {
+  SegmentPool           (const SegmentPool&) = delete; // no copying
+  SegmentPool &operator=(const SegmentPool&) = delete; // no assignment
+
+public:
+  struct PreallocatedFile {
+    std::string path;
+    int         fd;
+  };
+
+private:
+#define SEGMENT_POOL_SIZE 2
+
+  const NodeName              &node_name;
+        char                   pool_path[PATH_MAX];
+        uint64_t               next_file_number = 0;
+
+        std::mutex             mutex;
+        std::condition_variable condition;
+        std::deque<PreallocatedFile> ready_files;
+        bool                   should_exit = false;
+        bool                   started     = false;
+        std::thread            worker;
+
+  void adopt_existing_files();
+  PreallocatedFile create_file(uint64_t);
+  PreallocatedFile preallocate_file(uint64_t);
+  void run();
+
+public:
+  SegmentPool(const NodeName&);
+  ~SegmentPool();
+
+  /* Creates the pool's directory, whose parent must exist, fills the pool
+     and starts the background thread. Must be called before take(). */
+  void start();
+
+  PreallocatedFile take();
+
+  /* Returns a file from take() to the pool, unused. */
+  void give_back(const PreallocatedFile&);
+
+  /* Gives back the preallocated space beyond the given size of a file that
+     was taken from the pool and will not be written to any further. */
+  static void release_unused_space(int fd, off_t used_size);
+
+  /* Moves a full-sized file that is no longer needed back into the pool, if
+     the pool has room for it, so that its space can be reused. Returns
+     whether the file was recycled. */
+  bool recycle(const std::string &path);
+};
+
+}
+
+#endif // ndef PIPELINE_SEGMENT_POOL_H
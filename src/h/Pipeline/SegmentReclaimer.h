@@ -0,0 +1,148 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_SEGMENT_RECLAIMER_H
+#define PIPELINE_SEGMENT_RECLAIMER_H
+
+#include "Paxos/basic_types.h"
+#include "Pipeline/SegmentPool.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Pipeline {
+
+/* Which segment files to keep once they have been expired from the
+   SegmentCache, and which compacted logs to keep once they are finished. A
+   file is deleted as soon as any of the enabled limits is
+   exceeded; if none is enabled then files are kept forever. Files that are
+   pinned by a reader are kept regardless of the policy. */
+struct RetentionPolicy {
+  /* Keep at most this many bytes of expired segments (0 = unlimited) */
+  uint64_t             max_bytes = 0;
+  /* Keep expired segments for at most this long (0 = unlimited) */
+  std::chrono::seconds max_age   = std::chrono::seconds(0);
+  /* Delete segments as soon as they are chosen and have been consumed */
+  bool                 delete_when_consumed = false;
+};
+
+/* Closes, deletes or recycles the files of expired segments on a background
+   thread, according to a RetentionPolicy. The thread is started on first
+   use. */
+class SegmentReclaimer {
+  SegmentReclaimer           (const SegmentReclaimer&) = delete; // no copying
+  SegmentReclaimer &operator=(const SegmentReclaimer&) = delete; // no assignment
+
+public:
+  struct Usage {
+    uint64_t retained_files  = 0;
+    uint64_t retained_bytes  = 0;
+    uint64_t reclaimed_files = 0;
+    uint64_t reclaimed_bytes = 0;
+    uint64_t recycled_files  = 0;
+  };
+
+private:
+  struct ExpiredSegment {
+    std::string                           path;
+    int                                   fd;
+    Paxos::Slot                           end_slot;
+    std::chrono::steady_clock::time_point expired_at;
+    uint64_t                              bytes;
+    bool                                  superseded;
+    /* A compacted log is deleted along with its index, never recycled. */
+    bool                                  is_compacted_log;
+  };
+
+  SegmentPool                &pool;
+  RetentionPolicy             policy;
+
+  mutable std::mutex          mutex;
+  std::condition_variable     condition;
+  /* Notified when a file has been reclaimed. */
+  std::condition_variable     reclaimed;
+  std::deque<ExpiredSegment>  incoming;
+  std::vector<std::string>    incoming_superseded;
+  Paxos::Slot                 first_unconsumed_slot = 0;
+  Paxos::Slot                 first_pinned_slot
+                                = std::numeric_limits<Paxos::Slot>::max();
+  /* The end slot of the segment whose file is being reclaimed, if any,
+     which may not be pinned until it is gone. */
+  Paxos::Slot                 reclaiming_end_slot = 0;
+  Usage                       usage;
+  bool                        should_exit = false;
+  std::thread                 worker;
+
+  /* Only accessed by the worker */
+  std::deque<ExpiredSegment>  retained;
+  size_t                      superseded_count = 0;
+
+  void add_incoming(const std::string&, int, Paxos::Slot, bool);
+  bool should_reclaim(const ExpiredSegment&,
+                      const std::chrono::steady_clock::time_point&,
+                      Paxos::Slot, Paxos::Slot) const;
+  /* Called without the mutex held, so as not to stall the event loop, but
+     with reclaiming_end_slot set so that the segment cannot be pinned while
+     its file is being removed. Returns whether the file was recycled. */
+  bool reclaim(const ExpiredSegment&, std::vector<std::string>&);
+  void run();
+
+public:
+  SegmentReclaimer(SegmentPool&);
+  ~SegmentReclaimer();
+
+  void set_policy(const RetentionPolicy&);
+
+  /* Takes ownership of fd. */
+  void expire(const std::string &path, int fd, Paxos::Slot end_slot);
+
+  /* As expire(), for a compacted log that will not be written again. */
+  void expire_compacted_log(const std::string &path, int fd,
+                            Paxos::Slot end_slot);
+
+  void set_first_unconsumed_slot(Paxos::Slot);
+
+  /* The expired segment at this path is no longer needed because its content
+   * is held elsewhere, so it is reclaimed as soon as it is not pinned,
+   * regardless of the policy. */
+  void supersede(const std::string &path);
+
+  /* Segments that end after this slot are being read and are not reclaimed
+   * until it advances past them. Unlike the unconsumed slot, this may move
+   * backwards when a new reader starts. Once this returns, no segment that
+   * ends after the slot is reclaimed, so a reader may open the files that it
+   * has pinned; it must not keep any file open once its pin has moved past
+   * the end of that file's segment, since the file may then be recycled.
+   * If the slot moves back over a segment whose file is being reclaimed
+   * then this waits for that one file to be removed. */
+  void set_first_pinned_slot(Paxos::Slot);
+
+  Usage get_usage() const;
+};
+
+}
+
+#endif // ndef PIPELINE_SEGMENT_RECLAIMER_H
@@ -0,0 +1,142 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_SENDFILE_SHARDS_H
+#define PIPELINE_SENDFILE_SHARDS_H
+
+#include "Epoll.h"
+#include "SpscQueue.h"
+
+#include <deque>
+#include <map>
+#include <sys/types.h>
+#include <vector>
+
+namespace Pipeline {
+
+/* Runs sendfile() from segment files to peer sockets on a set of worker
+   threads, each pinned to a core and running its own event loop, so that
+   replicating several streams to several peers can use more than one core.
+   The Legislator and SegmentCache stay on the main thread, which hands jobs
+   to each worker over an SPSC queue and takes completions back over another,
+   with eventfds for wakeups. Jobs carry their own duplicates of the file
+   descriptors involved, so the main thread may close its copies at any time;
+   a cancelled job just closes the duplicates without completing. */
+#ifndef SENDFILE_SHARD_QUEUE_CAPACITY
+#define SENDFILE_SHARD_QUEUE_CAPACITY 1024
+#endif // ndef SENDFILE_SHARD_QUEUE_CAPACITY
+
+class SendfileShards : public Epoll::Handler {
+  SendfileShards           (const SendfileShards&) = delete; // no copying
+  SendfileShards &operator=(const SendfileShards&) = delete; // no assignment
+
+public:
+  class Client {
+  public:
+    virtual void sendfile_completed(uint64_t bytes_sent, bool failed) = 0;
+  };
+
+  using Token = uint64_t;
+
+private:
+  struct Request {
+    Token    token;
+    int      socket_fd; // -1 to cancel the job with this token
+    int      file_fd;
+    off_t    offset;
+    uint64_t length;
+  };
+
+  struct Completion {
+    Token    token;
+    uint64_t bytes_sent;
+    bool     failed;
+  };
+
+  class Shard {
+    Shard           (const Shard&) = delete; // no copying
+    Shard &operator=(const Shard&) = delete; // no assignment
+
+    struct Job {
+      Request  request;
+      uint64_t bytes_sent;
+    };
+
+    const int                   completion_fd;
+          int                   epfd;
+          int                   wake_fd;
+          std::atomic<bool>     should_exit;
+          std::map<Token, Job>  jobs; // worker thread only
+          std::thread           worker;
+
+    void run();
+    void start_job(const Request&);
+    void cancel_job(Token);
+    void run_job(std::map<Token, Job>::iterator);
+    void finish_job(std::map<Token, Job>::iterator, bool failed);
+
+  public:
+    SpscQueue<Request,    SENDFILE_SHARD_QUEUE_CAPACITY> requests;
+    SpscQueue<Completion, SENDFILE_SHARD_QUEUE_CAPACITY> completions;
+    /* Requests that did not fit in the queue; main thread only. */
+    std::deque<Request>                                  overflow;
+
+    Shard(int completion_fd, int cpu);
+    ~Shard();
+
+    void submit(const Request&);
+    void flush_overflow();
+  };
+
+  struct InFlight {
+    Client *client;
+    size_t  shard;
+  };
+
+  Epoll::Manager                      &manager;
+  int                                  completion_fd;
+  std::vector<std::unique_ptr<Shard>>  shards;
+  std::map<Token, InFlight>            in_flight;
+  Token                                next_token = 1;
+  size_t                               next_shard = 0;
+
+public:
+  SendfileShards(Epoll::Manager&, size_t shard_count);
+  ~SendfileShards();
+
+  /* Spreads clients across the shards. */
+  size_t choose_shard();
+
+  /* Sends length bytes of file_fd from offset to socket_fd on the given shard,
+     then calls client->sendfile_completed() from the main event loop. */
+  Token dispatch(Client*, size_t shard,
+                 int socket_fd, int file_fd, off_t offset, uint64_t length);
+
+  /* The client will not be called back for this job. */
+  void cancel(Token);
+
+  void handle_readable() override;
+  void handle_writeable() override;
+  void handle_error(const uint32_t) override;
+};
+
+}
+
+#endif // ndef PIPELINE_SENDFILE_SHARDS_H
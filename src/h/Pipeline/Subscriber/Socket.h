@@ -0,0 +1,89 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_SUBSCRIBER_SOCKET_H
+#define PIPELINE_SUBSCRIBER_SOCKET_H
+
+#include "Pipeline/ChosenStreamReader.h"
+#include "Epoll.h"
+
+#include <memory>
+
+#ifndef SUBSCRIBER_SEND_SIZE
+#define SUBSCRIBER_SEND_SIZE (1ul<<24)
+#endif // ndef SUBSCRIBER_SEND_SIZE
+
+/* A subscriber that falls this far behind is disconnected, since the files
+   it has yet to read are pinned, which stops every retained segment after
+   them from being reclaimed. */
+#ifndef SUBSCRIBER_MAX_LAG_BYTES
+#define SUBSCRIBER_MAX_LAG_BYTES (1ul<<30)
+#endif // ndef SUBSCRIBER_MAX_LAG_BYTES
+
+namespace Pipeline {
+namespace Subscriber {
+
+/* A connection to a subscriber, which sends a Request naming a stream and
+   then receives that stream's content, as it is chosen, sent straight from
+   the segment files with sendfile(). The subscription starts from the
+   content chosen after the request arrives. The connection is closed if the
+   content is not held locally, or if the subscriber lags by more than
+   SUBSCRIBER_MAX_LAG_BYTES. */
+class Socket : public Epoll::Handler {
+  Socket           (const Socket&) = delete; // no copying
+  Socket &operator=(const Socket&) = delete; // no assignment
+
+public:
+  struct Request {
+    Paxos::NodeId          owner;
+    Paxos::Value::StreamId id;
+  }
+  __attribute__((packed));
+
+private:
+        Epoll::Manager                     &manager;
+        SegmentCache                       &segment_cache;
+        int                                 fd;
+
+        Request                             request;
+        size_t                              request_bytes = 0;
+        std::unique_ptr<ChosenStreamReader> reader;
+        bool                                waiting_for_writeable = false;
+
+  void send_chosen_data();
+  void shutdown();
+
+public:
+  Socket(Epoll::Manager&, SegmentCache&, const int);
+  ~Socket();
+
+  bool is_shutdown() const { return fd == -1; }
+
+  void handle_readable() override;
+  void handle_writeable() override;
+  void handle_error(const uint32_t) override;
+
+  void handle_stream_content(const Paxos::Proposal&);
+};
+
+}
+}
+
+#endif // ndef PIPELINE_SUBSCRIBER_SOCKET_H
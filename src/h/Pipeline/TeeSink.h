@@ -0,0 +1,122 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef PIPELINE_TEE_SINK_H
+#define PIPELINE_TEE_SINK_H
+
+#include "Paxos/SlotRange.h"
+#include "Paxos/Value.h"
+
+#include <deque>
+#include <sys/types.h>
+
+namespace Pipeline {
+
+/* A pipe belonging to one follower, into which the leader tee()s the client
+   data in each commit just before splicing it into the segment. This shares
+   the pages rather than copying them, so once the data is proposed it can be
+   spliced straight from here to the follower's socket without reading it
+   back from the segment file.
+
+   The data may only be sent once it is proposed. With tee sinks the client
+   socket proposes each write as soon as it is in the segment, before the
+   leader's own sync, using a start frame that tells the follower not to
+   count the leader's acceptance, which is sent separately once the sync
+   completes. A peer that predates this is only sent the data after the sync,
+   as before. Data is claimed from the front of the pipe
+   in slot order as proposals are sent. Anything else that reaches the front
+   (because its commit was cancelled, or it was sent from the segment file
+   instead) is discarded, as long as nothing is claimed ahead of it; until
+   then, the claim falls back to the segment file. If the pipe is full, tee()
+   takes only what fits and the rest is also sent from the segment file.
+
+   There is one sink per follower, shared by all the client streams, and a
+   follower is sent one stream at a time. So while several clients write
+   concurrently, claiming one stream's data discards any other streams' data
+   ahead of it in the pipe, which is then sent from the segment files. Only
+   a single busy stream reliably avoids the reads; a sink per stream would
+   cost a pipe per stream per follower out of the PipeBudget. */
+/* The size is subject to the PipeBudget. */
+#ifndef TEE_SINK_PIPE_SIZE
+#define TEE_SINK_PIPE_SIZE (1<<24)
+#endif // ndef TEE_SINK_PIPE_SIZE
+
+class TeeSink {
+  TeeSink           (const TeeSink&) = delete; // no copying
+  TeeSink &operator=(const TeeSink&) = delete; // no assignment
+
+  /* A run of teed data in the pipe, not yet claimed. */
+  struct Extent {
+    Paxos::Value::OffsetStream stream;
+    Paxos::Slot                start_slot;
+    uint64_t                   length;
+    bool                       wanted;
+  };
+
+  int                pipe_fds[2];
+  uint64_t           pipe_size;
+  int                devnull_fd;
+  std::deque<Extent> extents;
+  /* Bytes at the front of the pipe claimed but not yet sent. */
+  uint64_t           claimed_bytes = 0;
+  /* Whether the last extent came from the last tee_from(), and is still
+     whole. */
+  bool               last_tee_trimmable = false;
+
+  uint64_t           bytes_teed      = 0;
+  uint64_t           bytes_sent      = 0;
+  uint64_t           bytes_discarded = 0;
+
+  void discard(uint64_t);
+
+public:
+  TeeSink();
+  ~TeeSink();
+
+  /* Duplicates up to the given number of bytes from the front of the given
+     pipe, which hold the given slots of the given stream, and returns how
+     many were duplicated. */
+  uint64_t tee_from(int, const Paxos::Value::OffsetStream&,
+                    const Paxos::Slot&, uint64_t);
+
+  /* Marks all but the given number of bytes of the last tee_from() as
+     unwanted, since only that many were written to the segment. */
+  void trim_last(uint64_t);
+
+  /* Claims as many bytes as are at the front of the pipe from the start of
+     the given slots of the given stream, which may be none. */
+  uint64_t claim(const Paxos::Value::OffsetStream&, const Paxos::SlotRange&);
+
+  /* Splices up to the given number of claimed bytes to the given fd, with
+     the same result as splice(). */
+  ssize_t send_claimed(int, uint64_t);
+
+  /* Gives up all the claimed bytes, of which there are the given number,
+     without sending them. */
+  void release(uint64_t);
+
+  uint64_t get_bytes_teed()      const { return bytes_teed;      }
+  uint64_t get_bytes_sent()      const { return bytes_sent;      }
+  uint64_t get_bytes_discarded() const { return bytes_discarded; }
+};
+
+}
+
+#endif // ndef PIPELINE_TEE_SINK_H
@@ -28,7 +28,12 @@
 #include "Command/NodeIdGenerationHandler.h"
 #include "Pipeline/NodeName.h"
 
-class RealWorld : public Paxos::OutsideWorld, public Epoll::ClockCache {
+#include <deque>
+#include <functional>
+
+class RealWorld : public Paxos::OutsideWorld,
+                  public Epoll::ClockCache,
+                  public Epoll::SyncHandler {
   RealWorld           (const RealWorld&) = delete; // no copying
   RealWorld &operator=(const RealWorld&) = delete; // no assignment
 
@@ -42,7 +47,17 @@ class RealWorld : public Paxos::OutsideWorld, public Epoll::ClockCache {
   std::vector<std::unique_ptr<Pipeline::Peer::Target>> &targets;
 
   Command::NodeIdGenerationHandler *node_id_generation_handler = NULL;
+  Epoll::TimerHandler              *wake_up_handler            = NULL;
   int log_fd = -1;
+  uint64_t log_offset = 0;
+  uint64_t synced_log_offset = 0;
+
+  /* If set, the log is synced in the background and any messages that depend
+     on a log line being durable are held back until its sync completes. */
+  Epoll::Manager *manager = NULL;
+  std::deque<std::vector<std::function<void()>>> actions_awaiting_log_syncs;
+  std::deque<uint64_t> log_offsets_awaiting_syncs;
+
   void write_log_line(std::ostringstream&);
   void record_non_stream_content_acceptance(const Paxos::Proposal&);
 
@@ -55,6 +70,27 @@ public:
 
   void set_node_id_generation_handler(Command::NodeIdGenerationHandler*);
 
+  /* The length of the log known to be synced, from which replay_log() will
+     find every line written since. A crash may lose lines after this, which
+     are then overwritten since the log is appended to, so a checkpoint must
+     not record an offset beyond it. */
+  uint64_t get_synced_log_offset() const { return synced_log_offset; }
+
+  /* Reads back the lines of the log from the given offset onwards, raising
+     the promise to the greatest one found and appending the acceptances, for
+     recovering what happened after the last checkpoint. */
+  void replay_log(uint64_t from,
+                  Paxos::Term &promise,
+                  std::vector<Paxos::Proposal> &acceptances) const;
+
+  void set_manager(Epoll::Manager*);
+
+  /* Once both this and the manager are set, the handler's timer is kept
+     scheduled for the next wake-up time. */
+  void set_wake_up_handler(Epoll::TimerHandler*);
+
+  void handle_synced() override;
+
   void add_chosen_value_handler(Pipeline::Client::ChosenStreamContentHandler *handler);
 
   void seek_votes_or_catch_up(const Paxos::Slot &first_unchosen_slot,
@@ -73,8 +109,7 @@ public:
     const Paxos::Era&             current_era,
     const Paxos::Configuration&   current_configuration,
     const Paxos::NodeId&          next_generated_node_id,
-    const Paxos::Value::StreamName& current_stream,
-    const uint64_t                current_stream_pos) override;
+    const std::vector<Paxos::Value::StreamPosition>& open_streams) override;
 
   void prepare_term(const Paxos::Term &term) override;
 
@@ -82,6 +117,10 @@ public:
 
   void make_promise(const Paxos::Promise &promise) override;
 
+  void proposed(const Paxos::Proposal &proposal) override;
+
+  void after_log_synced(const std::function<void()> &action) override;
+
   void proposed_and_accepted(const Paxos::Proposal &proposal) override;
 
   void accepted(const Paxos::Proposal &proposal) override;
@@ -95,7 +134,6 @@ public:
 
   void chosen_unknown_stream_content
         (const Paxos::Proposal &proposal,
-         Paxos::Value::StreamName expected_stream,
          uint64_t               first_stream_pos) override;
 
   void chosen_generate_node_ids(const Paxos::Proposal &p, Paxos::NodeId n) override;
@@ -109,8 +147,6 @@ public:
 
   void set_current_time(const Paxos::instant &t) override;
 
-  const Paxos::instant get_next_wake_up_time() const;
-
   void set_next_wake_up_time(const Paxos::instant &t) override;
 };
 
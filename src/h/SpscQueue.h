@@ -0,0 +1,82 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+
+/* A bounded lock-free queue for passing items from exactly one producer thread
+   to exactly one consumer thread. The indices only ever increase, so the
+   queue is full when they differ by CAPACITY. Each index is on its own cache
+   line so that the two threads do not contend over it. */
+template<class T, size_t CAPACITY>
+class SpscQueue {
+  SpscQueue           (const SpscQueue&) = delete; // no copying
+  SpscQueue &operator=(const SpscQueue&) = delete; // no assignment
+
+  static_assert(0 < CAPACITY && (CAPACITY & (CAPACITY - 1)) == 0,
+                "CAPACITY must be a power of two");
+
+#define SPSC_QUEUE_CACHE_LINE_SIZE 64
+
+  /* Written only by the consumer */
+  std::atomic<size_t> head;
+  char                head_padding[SPSC_QUEUE_CACHE_LINE_SIZE
+                                    - sizeof(std::atomic<size_t>)];
+  /* Written only by the producer */
+  std::atomic<size_t> tail;
+  char                tail_padding[SPSC_QUEUE_CACHE_LINE_SIZE
+                                    - sizeof(std::atomic<size_t>)];
+  T                   items[CAPACITY];
+
+public:
+  SpscQueue() : head(0), tail(0) {}
+
+  /* Called by the producer. Returns false if the queue is full. */
+  bool try_push(const T &item) {
+    const size_t current_tail = tail.load(std::memory_order_relaxed);
+    if (current_tail - head.load(std::memory_order_acquire) == CAPACITY) {
+      return false;
+    }
+    items[current_tail & (CAPACITY - 1)] = item;
+    tail.store(current_tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* Called by the consumer. Returns false if the queue is empty. */
+  bool try_pop(T &item) {
+    const size_t current_head = head.load(std::memory_order_relaxed);
+    if (current_head == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = items[current_head & (CAPACITY - 1)];
+    head.store(current_head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool is_empty() const {
+    return head.load(std::memory_order_acquire)
+        == tail.load(std::memory_order_acquire);
+  }
+};
+
+#endif // ndef SPSC_QUEUE_H
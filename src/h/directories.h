@@ -22,6 +22,7 @@
 #define DIRECTORIES_H
 
 void ensure_directory(const char*, const char*);
+bool ensure_directory_without_sync(const char*);
 void ensure_length(int);
 void sync_directory(const char*);
 
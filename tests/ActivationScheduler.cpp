@@ -0,0 +1,150 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Client/Socket.h"
+#include "RealWorld.h"
+
+#include <assert.h>
+#include <iostream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace Paxos;
+using namespace Pipeline;
+using Pipeline::Client::ActivationScheduler;
+using Pipeline::Client::FlowControl;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+/* A client socket whose peer never sends anything, so it only ever asks for
+   turns when the test does so on its behalf. */
+struct TestClient {
+  int             peer_fd;
+  std::unique_ptr<Client::Socket>
+                  socket;
+
+  TestClient(Epoll::Manager      &manager,
+             SegmentCache        &segment_cache,
+             Legislator          &legislator,
+             ActivationScheduler &scheduler,
+             FlowControl         &flow_control,
+             const NodeName      &node_name,
+             Value::StreamId      stream_id) {
+    int fds[2];
+    const int socketpair_result __attribute__((unused))
+      = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(socketpair_result == 0);
+    peer_fd = fds[1];
+    socket  = std::unique_ptr<Client::Socket>(new Client::Socket(
+                manager, segment_cache, legislator, scheduler, flow_control,
+                node_name, {.owner = node_name.id, .id = stream_id},
+                fds[0]));
+  }
+
+  ~TestClient() {
+    socket = NULL;
+    close(peer_fd);
+  }
+};
+
+}
+
+void activation_scheduler_tests() {
+  const std::string cluster("activation-scheduler-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  {
+    std::vector<std::unique_ptr<Peer::Target>> targets;
+    SegmentCache segment_cache(node_name);
+    RealWorld real_world(node_name, segment_cache, targets);
+    Legislator legislator(real_world, 1, 0, 0, Configuration(1));
+    NullClock clock;
+    Epoll::Manager manager(clock);
+    ActivationScheduler scheduler(manager);
+    FlowControl flow_control(manager, legislator);
+
+    TestClient client_a(manager, segment_cache, legislator,
+                 scheduler, flow_control, node_name, 1);
+    TestClient client_b(manager, segment_cache, legislator,
+                 scheduler, flow_control, node_name, 2);
+    TestClient client_c(manager, segment_cache, legislator,
+                 scheduler, flow_control, node_name, 3);
+    Client::Socket *const a = client_a.socket.get();
+    Client::Socket *const b = client_b.socket.get();
+    Client::Socket *const c = client_c.socket.get();
+
+    /* The first socket to ask gets the turn, and keeps it past its quantum
+       while nobody else is waiting. */
+    assert(scheduler.request_turn(a));
+    scheduler.record_activation(a, CLIENT_ACTIVATION_QUANTUM_BYTES);
+    assert(scheduler.request_turn(a));
+
+    /* Once another socket waits, a used-up turn passes to it at the next
+       request, and the yielding socket queues behind it. */
+    assert(!scheduler.request_turn(b));
+    assert(!scheduler.request_turn(a));
+    assert(scheduler.request_turn(b));
+    assert(!scheduler.request_turn(c));
+    assert(!scheduler.request_turn(c));
+
+    /* A turn that is not used up survives its writes being activated. */
+    scheduler.record_activation(b, CLIENT_ACTIVATION_QUANTUM_BYTES/2);
+    scheduler.writes_activated(b);
+    assert(scheduler.request_turn(b));
+
+    /* Filling the quantum ends the turn as soon as the writes are activated,
+       and the waiting sockets follow in FIFO order. */
+    scheduler.record_activation(b, CLIENT_ACTIVATION_QUANTUM_BYTES/2);
+    scheduler.writes_activated(b);
+    assert(scheduler.request_turn(a));
+    assert(!scheduler.request_turn(c));
+
+    /* A turn also ends once it has been held for its quantum of time. */
+    scheduler.handle_deferred();
+    assert(scheduler.request_turn(a));
+    usleep((CLIENT_ACTIVATION_QUANTUM_MILLISECONDS + 10) * 1000);
+    scheduler.handle_deferred();
+    assert(scheduler.request_turn(c));
+
+    /* Removing the active socket hands its turn on, and a removed waiter is
+       skipped. */
+    assert(!scheduler.request_turn(b));
+    assert(!scheduler.request_turn(a));
+    scheduler.remove(b);
+    scheduler.remove(c);
+    assert(scheduler.request_turn(a));
+    scheduler.record_activation(a, CLIENT_ACTIVATION_QUANTUM_BYTES);
+    scheduler.writes_activated(a);
+    assert(scheduler.request_turn(a));
+  }
+
+  remove_node_directory(node_name);
+
+  std::cout << "activation_scheduler_tests(): passed" << std::endl;
+}
@@ -0,0 +1,206 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Peer/Socket.h"
+#include "Pipeline/Peer/Target.h"
+#include "Pipeline/Segment.h"
+
+#include <assert.h>
+#include <chrono>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace Paxos;
+using namespace Pipeline;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+/* Four chunks' worth per second, so the first chunk goes straight away and
+   each later one waits a quarter of a second. */
+const uint64_t RATE = 4 * TARGET_CATCH_UP_CHUNK_SIZE;
+
+/* Long enough to send the first chunk, but short of the wait for the
+   next. */
+const std::chrono::milliseconds CUT_AFTER(100);
+
+uint8_t content_at(uint64_t stream_pos) {
+  return stream_pos * 7 + 3;
+}
+
+void write_segment(SegmentCache &segment_cache, const NodeName &node_name,
+                   const Value::OffsetStream &stream, size_t length) {
+  Segment segment(segment_cache, node_name, node_name.id, stream,
+                  Term(0, 1, 1), stream.offset);
+  std::vector<uint8_t> data(length);
+  for (size_t i = 0; i < length; i++) {
+    data[i] = content_at(i);
+  }
+  const ssize_t write_result __attribute__((unused))
+    = write(segment.get_fd(), data.data(), length);
+  assert(write_result == (ssize_t)length);
+  segment.record_bytes_in(length);
+  segment.shutdown();
+}
+
+/* A CatchUpSender and CatchUpReceiver at either end of a socketpair. */
+struct Transfer {
+  std::unique_ptr<Peer::Target::CatchUpSender>   sender;
+  std::unique_ptr<Peer::Socket::CatchUpReceiver> receiver;
+
+  Transfer(Epoll::Manager &manager,
+           SegmentCache   &sender_cache,
+           SegmentCache   &receiver_cache,
+     const NodeName       &receiver_name,
+     const Slot            end_slot) {
+    int fds[2];
+    const int socketpair_result __attribute__((unused))
+      = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(socketpair_result == 0);
+
+    // The sender only modifies the registration it is given.
+    manager.register_handler(fds[0], NULL, 0);
+    sender.reset(new Peer::Target::CatchUpSender(
+      manager, sender_cache, fds[0], end_slot, RATE));
+
+    receiver.reset(new Peer::Socket::CatchUpReceiver(
+      manager, receiver_cache, receiver_name, 1, fds[1]));
+    manager.register_handler(fds[1], receiver.get(), EPOLLIN);
+  }
+
+  void run_until_received(Epoll::Manager &manager) {
+    while (!receiver->is_shutdown()) {
+      manager.wait(10);
+    }
+  }
+};
+
+void expect_content(const SegmentCache::ChosenSegment &segment) {
+  const size_t length = segment.slots.end() - segment.slots.start();
+  std::vector<uint8_t> data(length);
+
+  const int fd = open(segment.path.c_str(), O_RDONLY);
+  assert(fd != -1);
+  const ssize_t read_result __attribute__((unused))
+    = pread(fd, data.data(), length, 0);
+  assert(read_result == (ssize_t)length);
+  close(fd);
+
+  for (size_t i = 0; i < length; i++) {
+    assert(data[i] == content_at(segment.slots.start() + i));
+  }
+}
+
+}
+
+void catch_up_tests() {
+  const std::string cluster("catch-up-test");
+  const NodeName sender_name  (cluster, 1);
+  const NodeName receiver_name(cluster, 2);
+  reset_node_directory(sender_name);
+  reset_node_directory(receiver_name);
+
+  // Ends part-way through a chunk, so the cut falls within the segment.
+  const Slot end_slot = 3 * TARGET_CATCH_UP_CHUNK_SIZE + 12345;
+  const Value::OffsetStream stream = {.name = {.owner = 1, .id = 1},
+                                      .offset = 0};
+
+  {
+    NullClock clock;
+    Epoll::Manager manager(clock);
+
+    SegmentCache sender_cache(sender_name);
+    sender_cache.start_pool();
+    write_segment(sender_cache, sender_name, stream, end_slot);
+    // A segment is only expired once a slot beyond its end is chosen.
+    sender_cache.expire_because_chosen_to(end_slot + 1);
+
+    SegmentCache receiver_cache(receiver_name);
+    receiver_cache.start_pool();
+
+    // Cut the connection while the sender waits for budget, part-way
+    // through the segment. The receiver keeps what has arrived.
+    Slot cut_slot;
+    {
+      Transfer transfer(manager, sender_cache, receiver_cache,
+                        receiver_name, end_slot);
+      const auto cut_time = std::chrono::steady_clock::now() + CUT_AFTER;
+      while (std::chrono::steady_clock::now() < cut_time) {
+        manager.wait(10);
+      }
+      assert(!transfer.sender->is_shutdown());
+      transfer.sender.reset();
+      transfer.run_until_received(manager);
+
+      cut_slot = receiver_cache.first_slot_not_held(stream,
+                                                    SlotRange(0, end_slot));
+      assert(0 < cut_slot);
+      assert(cut_slot < end_slot);
+    }
+
+    // A new transfer resumes from the cut, at no more than the given rate.
+    {
+      const auto start_time = std::chrono::steady_clock::now();
+      Transfer transfer(manager, sender_cache, receiver_cache,
+                        receiver_name, end_slot);
+      transfer.run_until_received(manager);
+      const auto elapsed = std::chrono::steady_clock::now() - start_time;
+
+      assert(transfer.sender->is_shutdown());
+      assert(receiver_cache.first_slot_not_held(stream,
+                                                SlotRange(0, end_slot))
+          == end_slot);
+
+      const uint64_t throttled_bytes __attribute__((unused))
+        = end_slot - cut_slot - TARGET_CATCH_UP_CHUNK_SIZE;
+      assert(std::chrono::microseconds(throttled_bytes * 1000000 / RATE)
+          <= elapsed);
+    }
+
+    // The receiver holds the data in two segments, split at the cut.
+    receiver_cache.expire_because_chosen_to(end_slot + 1);
+    std::vector<SegmentCache::ChosenSegment> segments;
+    receiver_cache.get_chosen_segments(end_slot, segments);
+    assert(segments.size() == 2);
+    assert(segments[0].slots.start() == 0);
+    assert(segments[0].slots.end()   == cut_slot);
+    assert(segments[1].slots.start() == cut_slot);
+    assert(segments[1].slots.end()   == end_slot);
+    for (const auto &segment : segments) {
+      expect_content(segment);
+    }
+  }
+
+  remove_node_directory(sender_name);
+  remove_node_directory(receiver_name);
+
+  std::cout << "catch_up_tests(): passed" << std::endl;
+}
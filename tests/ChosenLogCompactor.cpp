@@ -0,0 +1,198 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/ChosenLogCompactor.h"
+#include "Pipeline/Segment.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace Paxos;
+using namespace Pipeline;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+uint8_t content_at(uint64_t stream_pos) {
+  return stream_pos * 11 + 5;
+}
+
+/* Writes a locally-accepted segment, returning its directory. */
+std::string write_segment(SegmentCache &segment_cache,
+                          const NodeName &node_name,
+                          const Value::OffsetStream &stream,
+                          const Term &term,
+                          uint64_t first_stream_pos, size_t length) {
+  Segment segment(segment_cache, node_name, node_name.id, stream, term,
+                  first_stream_pos);
+  std::vector<uint8_t> data(length);
+  for (size_t i = 0; i < length; i++) {
+    data[i] = content_at(first_stream_pos + i);
+  }
+  const ssize_t write_result __attribute__((unused))
+    = write(segment.get_fd(), data.data(), length);
+  assert(write_result == (ssize_t)length);
+  segment.record_bytes_in(length);
+  const std::string path = segment_cache.find(
+    stream, first_stream_pos + stream.offset, true)->path;
+  segment.shutdown();
+  return path.substr(0, path.rfind('/'));
+}
+
+Proposal chosen(const Value::OffsetStream &stream, Slot start, Slot end) {
+  Proposal proposal = {.slots = SlotRange(start, end), .term = Term(0, 2, 1)};
+  proposal.value.type           = Value::Type::stream_content;
+  proposal.value.payload.stream = stream;
+  return proposal;
+}
+
+void wait_for_jobs(Epoll::Manager &manager, ChosenLogCompactor &compactor) {
+  for (int i = 0; i < 1000 && compactor.get_first_unconsumed_slot()
+                                != std::numeric_limits<Slot>::max(); i++) {
+    manager.wait(10);
+  }
+  assert(compactor.get_first_unconsumed_slot()
+      == std::numeric_limits<Slot>::max());
+}
+
+std::vector<uint8_t> read_file(const std::string &path) {
+  std::vector<uint8_t> data;
+  const int fd = open(path.c_str(), O_RDONLY);
+  assert(fd != -1);
+  uint8_t buffer[4096];
+  ssize_t read_result;
+  while (0 < (read_result = read(fd, buffer, sizeof buffer))) {
+    data.insert(data.end(), buffer, buffer + read_result);
+  }
+  close(fd);
+  return data;
+}
+
+bool exists(const std::string &path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+}
+
+void chosen_log_compactor_tests() {
+  const std::string cluster("chosen-log-compactor-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  {
+    NullClock clock;
+    Epoll::Manager manager(clock);
+    SegmentCache segment_cache(node_name);
+    segment_cache.start_pool();
+    RetentionPolicy policy;
+    policy.delete_when_consumed = true;
+    segment_cache.set_retention_policy(policy);
+
+    const Value::OffsetStream a = {.name = {.owner = 1, .id = 1},
+                                   .offset = 0};
+    const Value::OffsetStream b = {.name = {.owner = 1, .id = 2},
+                                   .offset = 300};
+
+    // Two terms' worth of a, so the index has two records.
+    const std::string a_directory = write_segment(segment_cache, node_name,
+                                      a, Term(0, 1, 1), 0,   100);
+    write_segment(segment_cache, node_name, a, Term(0, 2, 1), 100, 200);
+    const std::string b_directory = write_segment(segment_cache, node_name,
+                                      b, Term(0, 2, 1), 0,   50);
+
+    // Left by an earlier run, so not to be overwritten.
+    const std::string b_log_path = b_directory + "/chosen_0000000000000000";
+    {
+      const int fd = open(b_log_path.c_str(), O_WRONLY | O_CREAT, 0644);
+      assert(fd != -1);
+      const ssize_t write_result __attribute__((unused)) = write(fd, "keep", 4);
+      assert(write_result == 4);
+      close(fd);
+    }
+
+    ChosenLogCompactor compactor(manager, segment_cache);
+    compactor.handle_stream_content(chosen(a, 0, 300));
+    compactor.handle_stream_content(chosen(b, 300, 350));
+    segment_cache.expire_because_chosen_to(1000);
+    wait_for_jobs(manager, compactor);
+
+    const std::string a_log_path = a_directory + "/chosen_0000000000000000";
+    const std::vector<uint8_t> a_log = read_file(a_log_path);
+    assert(a_log.size() == 300);
+    for (size_t i = 0; i < a_log.size(); i++) {
+      assert(a_log[i] == content_at(i));
+    }
+
+    const std::vector<uint8_t> a_index = read_file(a_log_path + "_idx");
+    assert(a_index.size() == 2 * sizeof(ChosenLogCompactor::IndexRecord));
+    ChosenLogCompactor::IndexRecord records[2];
+    memcpy(records, a_index.data(), sizeof records);
+    assert(records[0].start_slot  == 0);
+    assert(records[0].end_slot    == 100);
+    assert(records[0].term_number == 1);
+    assert(records[1].start_slot  == 100);
+    assert(records[1].end_slot    == 300);
+    assert(records[1].term_number == 2);
+
+    SegmentCache::ChosenSegment located
+      = {.stream = a, .slots = SlotRange(0, 0)};
+    bool located_ok __attribute__((unused))
+      = segment_cache.locate_chosen_data(a, 150, located);
+    assert(located_ok);
+    assert(located.is_compacted_log);
+    assert(located.path == a_log_path);
+    assert(located.slots.start() == 0 && located.slots.end() == 300);
+
+    // The existing file was left alone, and b stays in its segment.
+    const std::vector<uint8_t> b_log = read_file(b_log_path);
+    assert(b_log.size() == 4 && memcmp(b_log.data(), "keep", 4) == 0);
+    assert(!exists(b_log_path + "_idx"));
+    located_ok = segment_cache.locate_chosen_data(b, 300, located);
+    assert(located_ok);
+    assert(!located.is_compacted_log);
+
+    /* Content that is not held finishes the log, which is then subject to
+     * the retention policy: consumed, so deleted along with its index. */
+    compactor.handle_stream_content(chosen(a, 1000, 1100));
+    wait_for_jobs(manager, compactor);
+    for (int i = 0; i < 1000 && exists(a_log_path); i++) {
+      usleep(1000);
+    }
+    assert(!exists(a_log_path));
+    assert(!exists(a_log_path + "_idx"));
+  }
+
+  remove_node_directory(node_name);
+
+  std::cout << "chosen_log_compactor_tests(): passed" << std::endl;
+}
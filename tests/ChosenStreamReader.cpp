@@ -0,0 +1,223 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/ChosenStreamReader.h"
+#include "Pipeline/Segment.h"
+#include "Pipeline/Subscriber/Socket.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace Paxos;
+using namespace Pipeline;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+/* The byte at each stream position, so that content read back can be
+   checked against where it came from. */
+uint8_t content_at(uint64_t stream_pos) {
+  return stream_pos * 7 + 3;
+}
+
+void write_segment(SegmentCache &segment_cache, const NodeName &node_name,
+                   const Value::OffsetStream &stream,
+                   uint64_t first_stream_pos, size_t length) {
+  Segment segment(segment_cache, node_name, node_name.id, stream,
+                  Term(0, 1, 1), first_stream_pos);
+  std::vector<uint8_t> data(length);
+  for (size_t i = 0; i < length; i++) {
+    data[i] = content_at(first_stream_pos + i);
+  }
+  const ssize_t write_result __attribute__((unused))
+    = write(segment.get_fd(), data.data(), length);
+  assert(write_result == (ssize_t)length);
+  segment.record_bytes_in(length);
+  segment.shutdown();
+}
+
+Proposal chosen(const Value::OffsetStream &stream, Slot start, Slot end) {
+  Proposal proposal = {.slots = SlotRange(start, end), .term = Term(0, 1, 1)};
+  proposal.value.type           = Value::Type::stream_content;
+  proposal.value.payload.stream = stream;
+  return proposal;
+}
+
+/* Reads exactly the given number of bytes, which must all be available. */
+void expect_content(int fd, uint64_t first_stream_pos, size_t length) {
+  std::vector<uint8_t> data(length);
+  size_t received = 0;
+  while (received < length) {
+    const ssize_t read_result = read(fd, data.data() + received,
+                                     length - received);
+    assert(0 < read_result);
+    received += read_result;
+  }
+  for (size_t i = 0; i < length; i++) {
+    assert(data[i] == content_at(first_stream_pos + i));
+  }
+}
+
+void reader_tests(SegmentCache &segment_cache,
+                  const Value::OffsetStream &stream) {
+  int fds[2];
+  const int pipe_result __attribute__((unused)) = pipe2(fds, O_NONBLOCK);
+  assert(pipe_result == 0);
+
+  ChosenStreamReader reader(segment_cache, stream.name);
+  assert(!reader.has_unread());
+  assert(reader.get_first_unconsumed_slot()
+      == std::numeric_limits<Slot>::max());
+
+  // Contiguous content is merged, across the two segments.
+  reader.add_chosen(chosen(stream, 0,   60));
+  reader.add_chosen(chosen(stream, 60,  100));
+  reader.add_chosen(chosen(stream, 100, 300));
+  assert(reader.get_unread_bytes() == 300);
+  assert(reader.get_first_unconsumed_slot() == 0);
+
+  ChosenStreamReader::Result result __attribute__((unused));
+  result = reader.send_to(fds[1], 50);
+  assert(result == ChosenStreamReader::Result::succeeded);
+  expect_content(fds[0], 0, 50);
+  assert(reader.get_unread_bytes() == 250);
+  // The open segment stays pinned from its start.
+  assert(reader.get_first_unconsumed_slot() == 0);
+
+  // Stops at the end of the first segment, and closes it.
+  result = reader.send_to(fds[1], 1000);
+  assert(result == ChosenStreamReader::Result::succeeded);
+  expect_content(fds[0], 50, 50);
+  assert(reader.get_first_unconsumed_slot() == 100);
+
+  result = reader.send_to(fds[1], 50);
+  assert(result == ChosenStreamReader::Result::succeeded);
+  expect_content(fds[0], 100, 50);
+  assert(reader.get_unread_bytes() == 150);
+  assert(reader.get_first_unconsumed_slot() == 100);
+
+  // Reading to the end closes it.
+  result = reader.send_to(fds[1], 1000);
+  assert(result == ChosenStreamReader::Result::succeeded);
+  expect_content(fds[0], 150, 150);
+  assert(!reader.has_unread());
+  assert(reader.get_unread_bytes() == 0);
+  assert(reader.get_first_unconsumed_slot() == 300);
+
+  // Content that is not held locally.
+  reader.add_chosen(chosen(stream, 1000, 1100));
+  assert(reader.get_first_unconsumed_slot() == 1000);
+  result = reader.send_to(fds[1], 1000);
+  assert(result == ChosenStreamReader::Result::unavailable);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+/* A Subscriber::Socket that has subscribed to the given stream, and the
+   subscriber's end of its connection. */
+struct Subscription {
+  int                                 fd;
+  std::unique_ptr<Subscriber::Socket> socket;
+
+  Subscription(Epoll::Manager &manager, SegmentCache &segment_cache,
+               const Value::StreamName &stream) {
+    int fds[2];
+    const int socketpair_result __attribute__((unused))
+      = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(socketpair_result == 0);
+    fd = fds[0];
+    socket.reset(new Subscriber::Socket(manager, segment_cache, fds[1]));
+
+    const Subscriber::Socket::Request request
+      = {.owner = stream.owner, .id = stream.id};
+    const ssize_t write_result __attribute__((unused))
+      = write(fd, &request, sizeof request);
+    assert(write_result == sizeof request);
+    socket->handle_readable();
+  }
+
+  ~Subscription() {
+    socket.reset();
+    close(fd);
+  }
+};
+
+void subscriber_tests(SegmentCache &segment_cache,
+                      const Value::OffsetStream &stream) {
+  NullClock clock;
+  Epoll::Manager manager(clock);
+
+  {
+    Subscription subscription(manager, segment_cache, stream.name);
+    subscription.socket->handle_stream_content(chosen(stream, 0, 300));
+    assert(!subscription.socket->is_shutdown());
+    expect_content(subscription.fd, 0, 300);
+  }
+
+  {
+    // Too far behind to keep up with, even if it were held.
+    Subscription subscription(manager, segment_cache, stream.name);
+    subscription.socket->handle_stream_content(chosen(stream, 0, 100));
+    expect_content(subscription.fd, 0, 100);
+    subscription.socket->handle_stream_content(
+      chosen(stream, 100, 101 + SUBSCRIBER_MAX_LAG_BYTES));
+    assert(subscription.socket->is_shutdown());
+  }
+}
+
+}
+
+void chosen_stream_reader_tests() {
+  const std::string cluster("chosen-stream-reader-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  {
+    SegmentCache segment_cache(node_name);
+    segment_cache.start_pool();
+    const Value::OffsetStream stream = {.name = {.owner = 1, .id = 1},
+                                        .offset = 0};
+    write_segment(segment_cache, node_name, stream, 0,   100);
+    write_segment(segment_cache, node_name, stream, 100, 200);
+    // The first is read from a retained file, the second from the cache.
+    segment_cache.expire_because_chosen_to(150);
+    assert(segment_cache.get_entry_count() == 1);
+
+    reader_tests(segment_cache, stream);
+    subscriber_tests(segment_cache, stream);
+  }
+
+  remove_node_directory(node_name);
+
+  std::cout << "chosen_stream_reader_tests(): passed" << std::endl;
+}
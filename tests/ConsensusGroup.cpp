@@ -0,0 +1,133 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "ConsensusGroup.h"
+#include "Command/Registration.h"
+
+#include <cassert>
+#include <iostream>
+#include <unistd.h>
+
+void reset_node_directory(const Pipeline::NodeName&);
+void remove_node_directory(const Pipeline::NodeName&);
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+}
+
+static void check_ports(const bool      expected,
+                        const uint32_t  group_count,
+                        const char     *client_port,
+                        const char     *peer_port,
+                        const char     *command_port,
+                        const char     *subscriber_port) {
+  const bool result __attribute__((unused)) = ConsensusGroup::check_port_ranges
+    (group_count, client_port, peer_port, command_port, subscriber_port);
+  assert(result == expected);
+}
+
+void consensus_group_port_tests() {
+  // One group uses exactly the configured ports.
+  check_ports(true,  1, "41000", "41001", "41002", NULL);
+  check_ports(true,  1, "41000", "41001", "41002", "41003");
+  check_ports(false, 1, "41000", "41001", "41001", NULL);
+
+  // Each group takes the next port of each range, but shares the client port.
+  check_ports(true,  4, "41000", "41010", "41020", "41030");
+  check_ports(true,  4, "41000", "41001", "41005", "41009");
+  check_ports(false, 4, "41000", "41001", "41004", NULL);
+  check_ports(false, 4, "41003", "41000", "41010", NULL);
+  check_ports(false, 4, "41000", "41010", "41020", "41022");
+  check_ports(false, 4, "41000", "41010", "41007", NULL);
+
+  // Ranges must fit below 65536.
+  check_ports(true,  2, "41000", "65534", "41002", NULL);
+  check_ports(false, 2, "41000", "65535", "41002", NULL);
+  check_ports(false, 1, "41000", "41001", "x", NULL);
+
+  std::cout << "consensus_group_port_tests(): passed" << std::endl;
+}
+
+void consensus_group_restart_tests() {
+  unlink("data/node");
+
+  // A new node starts a cluster, and is the same node when it restarts.
+  std::string cluster_name;
+  Paxos::NodeId node_id = 0;
+  const std::vector<Command::Registration::Address> no_addresses;
+  Command::Registration::get_node_name(cluster_name, node_id, no_addresses);
+  assert(!cluster_name.empty());
+  assert(node_id == 1);
+
+  std::string restarted_cluster_name;
+  Paxos::NodeId restarted_node_id = 0;
+  Command::Registration::get_node_name(restarted_cluster_name,
+                                       restarted_node_id, no_addresses);
+  assert(restarted_cluster_name == cluster_name);
+  assert(restarted_node_id == node_id);
+
+  const Paxos::Configuration conf(node_id);
+  const std::vector<Paxos::Value::StreamPosition> open_streams
+    = {{.name = {.owner = node_id, .id = 7},
+        .position = 100, .last_chosen_slot = 40}};
+
+  {
+    ConsensusGroup group(cluster_name, node_id, 0, conf);
+    reset_node_directory(group.get_node_name());
+    group.recover();
+    group.get_legislator().restore(42, 0, conf, 2, open_streams,
+                                   std::vector<Paxos::Proposal>(),
+                                   Paxos::Term(0, 1, node_id));
+    group.checkpoint();
+    // The manifest is written before the group is destroyed.
+  }
+
+  // Under the same name the restarted group finds its manifest.
+  NullClock clock;
+  Epoll::Manager manager(clock);
+  {
+    ConsensusGroup group(restarted_cluster_name, restarted_node_id, 0, conf);
+    group.recover();
+    assert(group.get_legislator().get_next_chosen_slot() == 42);
+    const auto &restored_streams __attribute__((unused))
+      = group.get_legislator().get_open_streams();
+    assert(restored_streams.size() == 1);
+    assert(restored_streams[0].name.owner == node_id);
+    assert(restored_streams[0].name.id == 7);
+    assert(restored_streams[0].position == 100);
+
+    // New clients do not take the id of the stream that is still open.
+    group.start(manager, "0", "0", "0", NULL,
+                std::vector<Pipeline::Peer::Target::Address>(), NULL);
+    assert(group.get_client_listener().get_next_stream_id() == 8);
+
+    remove_node_directory(group.get_node_name());
+    rmdir(group.get_node_name().group_directory.c_str());
+  }
+
+  unlink("data/node");
+
+  std::cout << "consensus_group_restart_tests(): passed" << std::endl;
+}
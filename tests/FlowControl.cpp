@@ -0,0 +1,184 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Client/Socket.h"
+#include "RealWorld.h"
+
+#include <assert.h>
+#include <iostream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace Paxos;
+using namespace Pipeline;
+using Pipeline::Client::ActivationScheduler;
+using Pipeline::Client::FlowControl;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+const Value no_op = {.type = Value::Type::no_op};
+
+/* Elects node 1 of a two-node cluster by playing the part of node 2, so that
+   nothing is chosen again until node 2 is said to have accepted it. */
+Term become_leader(RealWorld &real_world, Legislator &legislator) {
+  auto now = std::chrono::steady_clock::now();
+  real_world.set_current_time(now);
+  legislator.handle_wake_up();
+  real_world.set_current_time(now + std::chrono::seconds(10));
+  legislator.handle_wake_up();
+  legislator.handle_offer_vote(2, Term(0, 0, 0));
+
+  const Term term = legislator.get_next_activated_term();
+  legislator.handle_promise(2, Promise(Promise::Type::multi, 0, 0, term));
+  legislator.handle_accepted(2, {.slots = SlotRange(0, 1),
+                                 .term  = term,
+                                 .value = no_op});
+  assert(legislator.activation_will_yield_proposals());
+  assert(legislator.get_next_chosen_slot() == 1);
+  return term;
+}
+
+/* A client socket whose peer has finished sending, so that reading from it
+   closes it. Reading is what the window stops, so this shows whether the
+   socket is throttled without any data reaching its pipe. */
+struct TestClient {
+  int             peer_fd;
+  std::unique_ptr<Client::Socket>
+                  socket;
+
+  TestClient(Epoll::Manager      &manager,
+             SegmentCache        &segment_cache,
+             Legislator          &legislator,
+             ActivationScheduler &scheduler,
+             FlowControl         &flow_control,
+             const NodeName      &node_name,
+             Value::StreamId      stream_id) {
+    int fds[2];
+    const int socketpair_result __attribute__((unused))
+      = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(socketpair_result == 0);
+    peer_fd = fds[1];
+    socket  = std::unique_ptr<Client::Socket>(new Client::Socket(
+                manager, segment_cache, legislator, scheduler, flow_control,
+                node_name, {.owner = node_name.id, .id = stream_id},
+                fds[0]));
+    shutdown(peer_fd, SHUT_WR);
+  }
+
+  ~TestClient() {
+    socket = NULL;
+    close(peer_fd);
+  }
+
+  bool is_closed() const {
+    char c;
+    return read(peer_fd, &c, 1) == 0;
+  }
+};
+
+}
+
+void flow_control_tests() {
+  const std::string cluster("flow-control-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  {
+    std::vector<std::unique_ptr<Peer::Target>> targets;
+    SegmentCache segment_cache(node_name);
+    RealWorld real_world(node_name, segment_cache, targets);
+    Configuration conf(1);
+    conf.increment_weight(2);
+    Legislator legislator(real_world, 1, 0, 0, conf);
+    const Term term = become_leader(real_world, legislator);
+
+    NullClock clock;
+    Epoll::Manager manager(clock);
+    ActivationScheduler scheduler(manager);
+    FlowControl flow_control(manager, legislator);
+    flow_control.set_window_bytes(100);
+
+    TestClient a(manager, segment_cache, legislator,
+                 scheduler, flow_control, node_name, 1);
+    TestClient b(manager, segment_cache, legislator,
+                 scheduler, flow_control, node_name, 2);
+    TestClient c(manager, segment_cache, legislator,
+                 scheduler, flow_control, node_name, 3);
+
+    /* Running more than a window ahead of the chosen slots stops the
+       sockets from reading; both count as one throttling. */
+    legislator.activate_slots(no_op, 100);
+    assert(!flow_control.window_exceeded());
+    legislator.activate_slots(no_op, 1);
+    assert(flow_control.window_exceeded());
+    assert(flow_control.get_throttled_time()
+        == std::chrono::steady_clock::duration::zero());
+
+    a.socket->handle_readable();
+    b.socket->handle_readable();
+    assert(!a.is_closed());
+    assert(!b.is_closed());
+    assert(flow_control.get_throttle_count() == 1);
+
+    /* The periodic recheck releases nothing while the window is full. */
+    flow_control.handle_deferred();
+    a.socket->handle_readable();
+    assert(!a.is_closed());
+
+    /* Choosing the slots drains the window and releases every socket. */
+    legislator.handle_accepted(2, {.slots = SlotRange(1, 102),
+                                   .term  = term,
+                                   .value = no_op});
+    assert(!flow_control.window_exceeded());
+    flow_control.slots_chosen();
+    const auto throttled_time = flow_control.get_throttled_time();
+    assert(throttled_time > std::chrono::steady_clock::duration::zero());
+    usleep(1000);
+    assert(flow_control.get_throttled_time() == throttled_time);
+
+    a.socket->handle_readable();
+    b.socket->handle_readable();
+    assert(a.is_closed());
+    assert(b.is_closed());
+
+    /* Narrowing the window throttles afresh, and widening it releases. */
+    legislator.activate_slots(no_op, 50);
+    flow_control.set_window_bytes(10);
+    c.socket->handle_readable();
+    assert(!c.is_closed());
+    assert(flow_control.get_throttle_count() == 2);
+
+    flow_control.set_window_bytes(100);
+    c.socket->handle_readable();
+    assert(c.is_closed());
+  }
+
+  remove_node_directory(node_name);
+
+  std::cout << "flow_control_tests(): passed" << std::endl;
+}
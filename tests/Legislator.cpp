@@ -82,16 +82,14 @@ public:
                      const Era             &era,
                      const Configuration   &configuration,
                      const NodeId          &last_generated_node,
-                     const Value::StreamName &current_stream,
-                     const uint64_t         current_stream_pos) override {
+                     const std::vector<Value::StreamPosition> &open_streams) override {
     std::cout << "RESPONSE: send_catch_up("
       << recipient            << ", "
       << slot                 << ", "
       << era                  << ", "
       << configuration        << ", "
       << last_generated_node  << ", "
-      << current_stream       << ", "
-      << current_stream_pos   << ")" << std::endl;
+      << open_streams         << ")" << std::endl;
   }
 
   void prepare_term(const Term &term) override {
@@ -114,11 +112,20 @@ public:
       << proposal << ")" << std::endl;
   }
 
+  void proposed(const Proposal &proposal) override {
+    std::cout << "RESPONSE: proposed("
+      << proposal << ")" << std::endl;
+  }
+
   void accepted(const Proposal &proposal) override {
     std::cout << "RESPONSE: accepted("
       << proposal << ")" << std::endl;
   }
 
+  void after_log_synced(const std::function<void()> &action) override {
+    action();
+  }
+
   void chosen_stream_content(const Proposal &proposal) override {
     chosen(proposal);
   }
@@ -129,7 +136,7 @@ public:
   }
 
   void chosen_unknown_stream_content
-      (const Proposal &proposal, Value::StreamName, uint64_t) override {
+      (const Proposal &proposal, uint64_t) override {
     chosen(proposal);
   }
 
@@ -221,4 +228,14 @@ void legislator_test() {
   std::cout << std::endl << "TEST: handle_proposed_and_accepted(3," << prop << ")" << std::endl;
   legislator.handle_proposed_and_accepted(3, prop);
   std::cout << legislator << std::endl;
+
+  std::vector<Value::StreamPosition> open_streams;
+  open_streams.push_back({.name = {.owner = 1, .id = 1},
+                          .position = 100, .last_chosen_slot = 150});
+  open_streams.push_back({.name = {.owner = 2, .id = 1},
+                          .position = 200, .last_chosen_slot = 220});
+  std::cout << std::endl << "TEST: handle_send_catch_up(300, 1, conf, 4, "
+            << open_streams << ")" << std::endl;
+  legislator.handle_send_catch_up(300, 1, conf, 4, open_streams);
+  std::cout << legislator << std::endl;
 }
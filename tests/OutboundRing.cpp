@@ -0,0 +1,340 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Peer/OutboundRing.h"
+
+#include <assert.h>
+#include <iostream>
+#include <string.h>
+#include <vector>
+
+using namespace Pipeline::Peer;
+
+namespace {
+
+struct Frame {
+  Protocol::FrameHeader header;
+  Protocol::FrameLayout layout;
+  Protocol::Message     message;
+  Protocol::Value       value;
+
+  Frame(uint8_t type) {
+    memset(&header,  0, sizeof header);
+    memset(&message, 0, sizeof message);
+    memset(&value,   0, sizeof value);
+    header.type = type;
+    const bool layout_result __attribute__((unused))
+      = Protocol::get_frame_layout(PROTOCOL_VERSION, type, layout);
+    assert(layout_result);
+    header.body_length = layout.body_size();
+  }
+};
+
+Frame seek_votes(Paxos::Slot slot, const Paxos::Term &term) {
+  Frame frame(MESSAGE_TYPE_SEEK_VOTES_OR_CATCH_UP);
+  frame.message.seek_votes_or_catch_up.slot = slot;
+  frame.message.seek_votes_or_catch_up.term.copy_from(term);
+  return frame;
+}
+
+Frame prepare_term(const Paxos::Term &term) {
+  Frame frame(MESSAGE_TYPE_PREPARE_TERM);
+  frame.message.prepare_term.term.copy_from(term);
+  return frame;
+}
+
+Frame accepted(Paxos::Slot start_slot, Paxos::Slot end_slot,
+               const Paxos::Term &term, Paxos::Value::StreamId stream_id) {
+  Frame frame(MESSAGE_TYPE_ACCEPTED | VALUE_TYPE_STREAM_CONTENT);
+  frame.message.accepted.start_slot = start_slot;
+  frame.message.accepted.end_slot   = end_slot;
+  frame.message.accepted.term.copy_from(term);
+  frame.value.stream_content.stream_owner = 1;
+  frame.value.stream_content.stream_id    = stream_id;
+  return frame;
+}
+
+Frame start_streaming_proposals(Paxos::Slot first_slot) {
+  Frame frame(MESSAGE_TYPE_START_STREAMING_PROPOSALS);
+  frame.message.start_streaming_proposals.first_slot = first_slot;
+  return frame;
+}
+
+template<size_t CAPACITY>
+bool queue(OutboundRing<CAPACITY> &ring, const Frame &frame) {
+  return ring.queue(frame.header, frame.layout, frame.message, frame.value);
+}
+
+/* Writes everything that may be written, returning it. */
+template<size_t CAPACITY>
+std::vector<uint8_t> write_all(OutboundRing<CAPACITY> &ring) {
+  std::vector<uint8_t> bytes;
+  struct iovec iov[2];
+  memset(iov, 0, sizeof iov);
+  int iovcnt;
+  while ((iovcnt = ring.get_unwritten(iov)) != 0) {
+    for (int i = 0; i < iovcnt; i++) {
+      const uint8_t *start = static_cast<const uint8_t*>(iov[i].iov_base);
+      bytes.insert(bytes.end(), start, start + iov[i].iov_len);
+      ring.consume(iov[i].iov_len);
+    }
+  }
+  return bytes;
+}
+
+/* Splits written bytes into the messages of their frames, which all have the
+   given layout. */
+std::vector<Protocol::Message> messages_of(const std::vector<uint8_t> &bytes,
+                                           const Protocol::FrameLayout &layout) {
+  assert(bytes.size() % layout.size() == 0);
+  std::vector<Protocol::Message> messages;
+  for (size_t i = 0; i < bytes.size(); i += layout.size()) {
+    Protocol::Message message;
+    memcpy(&message, bytes.data() + i + layout.header_size,
+           layout.message_size);
+    messages.push_back(message);
+  }
+  return messages;
+}
+
+void wrap_tests() {
+  const Frame frame = seek_votes(1, Paxos::Term(0, 1, 1));
+  const size_t frame_size = frame.layout.size();
+  OutboundRing<64> ring;
+  const size_t capacity_in_frames = 64 / frame_size;
+  assert(2 <= capacity_in_frames);
+
+  // Distinct slots and falling terms, so that nothing is superseded.
+  Paxos::Slot slot = 0;
+  for (size_t i = 0; i < capacity_in_frames; i++) {
+    const bool queue_result __attribute__((unused))
+      = queue(ring, seek_votes(slot, Paxos::Term(0, 100 - slot, 1)));
+    assert(queue_result);
+    slot++;
+  }
+  bool queue_result __attribute__((unused))
+    = queue(ring, seek_votes(slot, Paxos::Term(0, 1, 1)));
+  assert(!queue_result);
+  assert(ring.get_frames_dropped() == 1);
+
+  // Writing part of the first frame makes room for one more, which wraps.
+  struct iovec iov[2];
+  memset(iov, 0, sizeof iov);
+  int iovcnt __attribute__((unused)) = ring.get_unwritten(iov);
+  assert(iovcnt == 1);
+  assert(iov[0].iov_len == capacity_in_frames * frame_size);
+  std::vector<uint8_t> written(static_cast<uint8_t*>(iov[0].iov_base),
+                               static_cast<uint8_t*>(iov[0].iov_base)
+                                 + frame_size);
+  ring.consume(frame_size);
+  queue_result = queue(ring, seek_votes(slot++, Paxos::Term(0, 1, 1)));
+  assert(queue_result);
+  assert(ring.get_depth() == capacity_in_frames * frame_size);
+
+  iovcnt = ring.get_unwritten(iov);
+  assert(iovcnt == 2);
+  assert(iov[1].iov_base < iov[0].iov_base);
+  const std::vector<uint8_t> rest = write_all(ring);
+  written.insert(written.end(), rest.begin(), rest.end());
+
+  const auto messages = messages_of(written, frame.layout);
+  assert(messages.size() == capacity_in_frames + 1);
+  for (size_t i = 0; i < messages.size(); i++) {
+    assert(messages[i].seek_votes_or_catch_up.slot == i);
+  }
+
+  // Once everything is written the ring starts again from the beginning.
+  uint8_t sent_type __attribute__((unused))
+    = ring.finish_writing(2, PROTOCOL_VERSION);
+  assert(sent_type == 0);
+  assert(ring.get_depth() == 0);
+  queue_result = queue(ring, seek_votes(slot, Paxos::Term(0, 1, 1)));
+  assert(queue_result);
+  iovcnt = ring.get_unwritten(iov);
+  assert(iovcnt == 1);
+  assert(iov[0].iov_len == frame_size);
+}
+
+void supersession_tests() {
+  OutboundRing<1024> ring;
+  const Paxos::Term term(0, 5, 1);
+  const Frame first = seek_votes(10, term);
+  const size_t frame_size = first.layout.size();
+
+  queue(ring, first);
+  queue(ring, prepare_term(term));
+  // Later, so it replaces the queued frame without moving it.
+  queue(ring, seek_votes(12, term));
+  queue(ring, seek_votes(12, Paxos::Term(0, 6, 1)));
+  assert(ring.get_frames_queued()     == 2);
+  assert(ring.get_frames_superseded() == 2);
+  assert(ring.get_depth() == frame_size + prepare_term(term).layout.size());
+
+  // Earlier, so it is queued separately.
+  queue(ring, seek_votes(11, Paxos::Term(0, 6, 1)));
+  assert(ring.get_frames_queued() == 3);
+
+  // A newer prepare_term replaces the older, but not an even older one.
+  queue(ring, prepare_term(Paxos::Term(0, 7, 1)));
+  queue(ring, prepare_term(Paxos::Term(0, 4, 1)));
+  assert(ring.get_frames_queued()     == 4);
+  assert(ring.get_frames_superseded() == 3);
+
+  const std::vector<uint8_t> bytes = write_all(ring);
+  Protocol::Message message;
+  memcpy(&message, bytes.data() + first.layout.header_size,
+         first.layout.message_size);
+  assert(message.seek_votes_or_catch_up.slot == 12);
+  assert(message.seek_votes_or_catch_up.term.get_paxos_term()
+      == Paxos::Term(0, 6, 1));
+  memcpy(&message, bytes.data() + frame_size
+                 + prepare_term(term).layout.header_size,
+         prepare_term(term).layout.message_size);
+  assert(message.prepare_term.term.get_paxos_term() == Paxos::Term(0, 7, 1));
+  ring.finish_writing(2, PROTOCOL_VERSION);
+
+  // A frame that has started to be written is left alone.
+  queue(ring, seek_votes(20, term));
+  ring.consume(1);
+  queue(ring, seek_votes(21, term));
+  assert(ring.get_frames_superseded() == 3);
+  assert(ring.get_depth() == 2 * frame_size - 1);
+}
+
+void accepted_extension_tests() {
+  OutboundRing<1024> ring;
+  const Paxos::Term term(0, 5, 1);
+  const Frame first = accepted(100, 200, term, 1);
+
+  queue(ring, first);
+  queue(ring, accepted(150, 300, term, 1)); // overlapping
+  queue(ring, accepted(300, 400, term, 1)); // adjacent
+  queue(ring, accepted(120, 180, term, 1)); // already covered
+  assert(ring.get_frames_queued() == 1);
+  assert(ring.get_frames_merged() == 3);
+
+  queue(ring, accepted(401, 500, term, 1));                 // a gap
+  queue(ring, accepted(500, 600, Paxos::Term(0, 6, 1), 1)); // another term
+  queue(ring, accepted(600, 700, Paxos::Term(0, 6, 1), 2)); // another stream
+  assert(ring.get_frames_queued() == 4);
+  assert(ring.get_frames_merged() == 3);
+
+  const auto messages = messages_of(write_all(ring), first.layout);
+  assert(messages.size() == 4);
+  assert(messages[0].accepted.start_slot == 100);
+  assert(messages[0].accepted.end_slot   == 400);
+  assert(messages[1].accepted.start_slot == 401);
+  assert(messages[2].accepted.end_slot   == 600);
+  assert(messages[3].accepted.start_slot == 600);
+
+  // Only the latest accepted frame is extended.
+  queue(ring, accepted(400, 401, term, 1));
+  assert(ring.get_frames_queued() == 5);
+}
+
+void handover_tests() {
+  OutboundRing<1024> ring;
+  const Paxos::Term term(0, 5, 1);
+  const Frame before = prepare_term(term);
+  const Frame streaming = start_streaming_proposals(100);
+  const Frame after = seek_votes(10, term);
+
+  queue(ring, before);
+  queue(ring, streaming);
+  assert(ring.get_streaming_frame_type()
+      == MESSAGE_TYPE_START_STREAMING_PROPOSALS);
+  queue(ring, after);
+
+  // Only up to the end of the streaming frame goes on this connection.
+  size_t written_size __attribute__((unused)) = write_all(ring).size();
+  assert(written_size == before.layout.size() + streaming.layout.size());
+  uint8_t sent_type __attribute__((unused))
+    = ring.finish_writing(2, PROTOCOL_VERSION);
+  assert(sent_type == MESSAGE_TYPE_START_STREAMING_PROPOSALS);
+  assert(ring.get_handed_over_peer_id() == 2);
+  assert(ring.get_streaming_frame_type() == 0);
+  assert(ring.has_unwritten());
+
+  // Still superseded while waiting for the next connection.
+  queue(ring, seek_votes(11, term));
+  assert(ring.get_frames_superseded() == 1);
+
+  // The same peer, so the kept frame is sent on the next connection.
+  ring.reconnected(2, PROTOCOL_VERSION);
+  assert(ring.get_handed_over_peer_id() == 0);
+  const auto messages = messages_of(write_all(ring), after.layout);
+  assert(messages.size() == 1);
+  assert(messages[0].seek_votes_or_catch_up.slot == 11);
+  sent_type = ring.finish_writing(2, PROTOCOL_VERSION);
+  assert(sent_type == 0);
+  assert(ring.get_depth() == 0);
+
+  // A different peer, or protocol version, gets none of the kept frames.
+  for (int i = 0; i < 2; i++) {
+    queue(ring, streaming);
+    queue(ring, after);
+    write_all(ring);
+    ring.finish_writing(2, PROTOCOL_VERSION);
+    if (i == 0) {
+      ring.reconnected(3, PROTOCOL_VERSION);
+    } else {
+      ring.reconnected(2, PROTOCOL_VERSION - 1);
+    }
+    assert(!ring.has_unwritten());
+    assert(ring.get_streaming_frame_type() == 0);
+    sent_type = ring.finish_writing(3, PROTOCOL_VERSION);
+    assert(sent_type == 0);
+    assert(ring.get_depth() == 0);
+  }
+
+  // Another streaming frame may be queued once the first is handed over,
+  // and is handed over in turn on the next connection.
+  queue(ring, streaming);
+  queue(ring, after);
+  write_all(ring);
+  ring.finish_writing(2, PROTOCOL_VERSION);
+  queue(ring, start_streaming_proposals(200));
+  queue(ring, before);
+  ring.reconnected(2, PROTOCOL_VERSION);
+  written_size = write_all(ring).size();
+  assert(written_size == after.layout.size() + streaming.layout.size());
+  sent_type = ring.finish_writing(2, PROTOCOL_VERSION);
+  assert(sent_type == MESSAGE_TYPE_START_STREAMING_PROPOSALS);
+  assert(ring.get_depth() == before.layout.size());
+
+  // A failed connection discards everything.
+  queue(ring, streaming);
+  queue(ring, after);
+  ring.clear();
+  assert(!ring.has_unwritten());
+  assert(ring.get_streaming_frame_type() == 0);
+  assert(ring.get_handed_over_peer_id() == 0);
+}
+
+}
+
+void outbound_ring_tests() {
+  wrap_tests();
+  supersession_tests();
+  accepted_extension_tests();
+  handover_tests();
+
+  std::cout << "outbound_ring_tests(): passed" << std::endl;
+}
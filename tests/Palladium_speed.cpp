@@ -155,3 +155,71 @@ void palladium_leader_speed_test() {
   std::cout << "Duration: " << time_span.count() << "s" << std::endl;
 }
 
+
+/* Quorum detection with every acceptor in the configuration reporting its
+ * acceptances, each lagging the leader by a different amount, so that the
+ * chosen slots are determined by a different subset of acceptors each time. */
+static void palladium_quorum_speed_test(const NodeId node_count) {
+  Configuration conf(1);
+  for (NodeId n = 2; n <= node_count; n++) {
+    conf.increment_weight(n);
+  }
+
+  Palladium pal(1, 0, 0, conf);
+  for (NodeId n = 1; n <= node_count; n++) {
+    pal.handle_promise(n, Promise(Promise::Type::multi, 0, 0, Term(0,0,1)));
+  }
+
+  const Slot iterations = 200000;
+  const Slot lag_limit  = 4;
+  uint64_t   chosen_count = 0;
+
+  auto t1 = high_resolution_clock::now();
+  for (Slot i = 0; i < iterations; i++) {
+    Value value = { .type = Value::Type::stream_content };
+    value.payload.stream.name.owner = 1;
+    value.payload.stream.name.id    = 2;
+    value.payload.stream.offset     = 0;
+
+    assert(pal.activation_will_yield_proposals());
+    const auto activate_result = pal.activate(value, 1500);
+    const auto proposal_result __attribute__((unused))
+      = pal.handle_proposal(activate_result);
+    assert(proposal_result);
+    pal.handle_accepted(1, activate_result);
+
+    for (NodeId peer = 2; peer <= node_count; peer++) {
+      const Slot lag = (peer + i) % lag_limit;
+      if (i < lag) { continue; }
+
+      pal.handle_accepted(peer, {
+        .slots = {
+          .start = 0,
+          .end   = (i + 1 - lag) * 1500
+        },
+        .term  = pal.next_activated_term(),
+        .value = value
+      });
+
+      if (pal.check_for_chosen_slots().slots.is_nonempty()) {
+        chosen_count += 1;
+      }
+    }
+  }
+  auto t2 = high_resolution_clock::now();
+
+  assert(pal.next_chosen_slot() + lag_limit * 1500
+           >= pal.next_activated_slot());
+
+  duration<double> time_span = duration_cast<duration<double>>(t2 - t1);
+  std::cout << "palladium_quorum_speed_test(" << node_count << "): "
+            << chosen_count << " choices in "
+            << time_span.count() << "s" << std::endl;
+}
+
+void palladium_quorum_speed_tests() {
+  palladium_quorum_speed_test(3);
+  palladium_quorum_speed_test(5);
+  palladium_quorum_speed_test(9);
+  palladium_quorum_speed_test(15);
+}
@@ -0,0 +1,266 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Client/Socket.h"
+#include "Pipeline/PipeBudget.h"
+#include "RealWorld.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <iostream>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace Paxos;
+using namespace Pipeline;
+using Pipeline::Client::ActivationScheduler;
+using Pipeline::Client::FlowControl;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+const Value no_op = {.type = Value::Type::no_op};
+
+/* Elects node 1 of a two-node cluster by playing the part of node 2, so that
+   the client sockets' writes can be activated. */
+void become_leader(RealWorld &real_world, Legislator &legislator) {
+  auto now = std::chrono::steady_clock::now();
+  real_world.set_current_time(now);
+  legislator.handle_wake_up();
+  real_world.set_current_time(now + std::chrono::seconds(10));
+  legislator.handle_wake_up();
+  legislator.handle_offer_vote(2, Term(0, 0, 0));
+
+  const Term term = legislator.get_next_activated_term();
+  legislator.handle_promise(2, Promise(Promise::Type::multi, 0, 0, term));
+  legislator.handle_accepted(2, {.slots = SlotRange(0, 1),
+                                 .term  = term,
+                                 .value = no_op});
+  assert(legislator.activation_will_yield_proposals());
+}
+
+/* A client socket, and the client's end of its connection. */
+struct TestClient {
+  int             peer_fd;
+  std::unique_ptr<Client::Socket>
+                  socket;
+
+  TestClient(Epoll::Manager      &manager,
+             SegmentCache        &segment_cache,
+             Legislator          &legislator,
+             ActivationScheduler &scheduler,
+             FlowControl         &flow_control,
+             const NodeName      &node_name,
+             Value::StreamId      stream_id) {
+    int fds[2];
+    const int socketpair_result __attribute__((unused))
+      = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(socketpair_result == 0);
+    peer_fd = fds[1];
+    socket  = std::unique_ptr<Client::Socket>(new Client::Socket(
+                manager, segment_cache, legislator, scheduler, flow_control,
+                node_name, {.owner = node_name.id, .id = stream_id},
+                fds[0]));
+  }
+
+  ~TestClient() {
+    socket = NULL;
+    close(peer_fd);
+  }
+
+  /* Writes as much of the given data as the connection will take. */
+  size_t send(const uint8_t *data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+      const ssize_t write_result = write(peer_fd, data + sent, length - sent);
+      if (write_result == -1) {
+        assert(errno == EAGAIN);
+        break;
+      }
+      sent += write_result;
+    }
+    return sent;
+  }
+
+  /* Finishes the stream, and waits for everything written to be synced. */
+  void finish(Epoll::Manager &manager) {
+    shutdown(peer_fd, SHUT_WR);
+    const auto deadline = std::chrono::steady_clock::now()
+                        + std::chrono::seconds(10);
+    while (!socket->is_shutdown()
+        && std::chrono::steady_clock::now() < deadline) {
+      manager.wait(10);
+    }
+    assert(socket->is_shutdown());
+  }
+};
+
+/* Several reads from the socket within one round of wait() are written to
+   the segment and synced together. */
+void group_commit_tests(Epoll::Manager      &manager,
+                        SegmentCache        &segment_cache,
+                        Legislator          &legislator,
+                        ActivationScheduler &scheduler,
+                        FlowControl         &flow_control,
+                        const NodeName      &node_name) {
+  TestClient client(manager, segment_cache, legislator,
+                    scheduler, flow_control, node_name, 1);
+  const uint8_t data[1000] = {};
+
+  // The first write to a segment also syncs the directories holding it.
+  client.send(data, sizeof data);
+  client.socket->handle_readable();
+  manager.wait(0);
+  while (client.socket->has_writes_in_flight()) {
+    manager.wait(10);
+  }
+
+  const uint64_t sync_count     __attribute__((unused))
+    = manager.get_sync_count();
+  const Slot     activated_slot __attribute__((unused))
+    = legislator.get_next_activated_slot();
+  for (int i = 0; i < 3; i++) {
+    client.send(data, sizeof data);
+    client.socket->handle_readable();
+  }
+  assert(manager.get_sync_count() == sync_count);
+
+  manager.wait(0);
+#ifndef NFSYNC
+  assert(manager.get_sync_count() == sync_count + 1);
+#else // ndef NFSYNC
+  assert(manager.get_sync_count() == sync_count);
+#endif // ndef NFSYNC
+  while (client.socket->has_writes_in_flight()) {
+    manager.wait(10);
+  }
+  assert(legislator.get_next_activated_slot()
+      == activated_slot + 3 * sizeof data);
+
+  client.finish(manager);
+}
+
+/* With edge-triggered pipe write ends, a socket that has filled its pipe
+   while waiting for its turn resumes reading once the pipe is drained. */
+void edge_triggered_tests(Epoll::Manager      &manager,
+                          SegmentCache        &segment_cache,
+                          Legislator          &legislator,
+                          ActivationScheduler &scheduler,
+                          FlowControl         &flow_control,
+                          const NodeName      &node_name) {
+  TestClient client_a(manager, segment_cache, legislator,
+                      scheduler, flow_control, node_name, 2);
+  TestClient client_b(manager, segment_cache, legislator,
+                      scheduler, flow_control, node_name, 3);
+  Client::Socket *const a = client_a.socket.get();
+
+  // A pipe buffer may hold more than a page of data spliced from a socket,
+  // so it takes rather more than the pipe's size to fill it.
+  std::vector<uint8_t> data(32 * PIPE_MIN_SIZE);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = i * 7 + 3;
+  }
+
+  // While the other socket has the turn, nothing is committed, so the pipe
+  // fills up and the socket stops reading. This must take less than the
+  // turn's quantum of time.
+  assert(scheduler.request_turn(a));
+  const uint64_t grow_count     __attribute__((unused))
+    = PipeBudget::shared().get_grow_count();
+  const Slot     activated_slot __attribute__((unused))
+    = legislator.get_next_activated_slot();
+  size_t sent = 0;
+  size_t stalled_rounds = 0;
+  while (stalled_rounds < 3) {
+    const size_t sent_this_round
+      = client_b.send(data.data() + sent, data.size() - sent);
+    sent += sent_this_round;
+    stalled_rounds = sent_this_round == 0 ? stalled_rounds + 1 : 0;
+    manager.wait(0);
+  }
+  assert(PIPE_MIN_SIZE <= sent);
+  assert(sent < data.size());
+  assert(legislator.get_next_activated_slot() == activated_slot);
+
+  // Passing the turn on drains the pipe, after which it is read to the end.
+  scheduler.remove(a);
+  for (int i = 0; i < 1000 && sent < data.size(); i++) {
+    sent += client_b.send(data.data() + sent, data.size() - sent);
+    manager.wait(10);
+  }
+  assert(sent == data.size());
+  client_b.finish(manager);
+
+  // The pipe was found full, and so was grown.
+  assert(grow_count < PipeBudget::shared().get_grow_count());
+  assert(legislator.get_next_activated_slot()
+      == activated_slot + data.size());
+}
+
+void run_tests(bool edge_triggered) {
+  const std::string cluster("pipe-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  {
+    std::vector<std::unique_ptr<Peer::Target>> targets;
+    SegmentCache segment_cache(node_name);
+    segment_cache.start_pool();
+    RealWorld real_world(node_name, segment_cache, targets);
+    Configuration conf(1);
+    conf.increment_weight(2);
+    Legislator legislator(real_world, 1, 0, 0, conf);
+    become_leader(real_world, legislator);
+
+    NullClock clock;
+    Epoll::Manager manager(clock);
+    manager.set_edge_triggered(edge_triggered);
+    ActivationScheduler scheduler(manager);
+    FlowControl flow_control(manager, legislator);
+    // Node 2 never accepts anything, so nothing is ever chosen.
+    flow_control.set_window_bytes(1ul<<30);
+
+    group_commit_tests(manager, segment_cache, legislator,
+                       scheduler, flow_control, node_name);
+    if (edge_triggered) {
+      edge_triggered_tests(manager, segment_cache, legislator,
+                           scheduler, flow_control, node_name);
+    }
+  }
+
+  remove_node_directory(node_name);
+}
+
+}
+
+void pipe_tests() {
+  run_tests(false);
+  run_tests(true);
+
+  std::cout << "pipe_tests(): passed" << std::endl;
+}
@@ -0,0 +1,227 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/PipeBudget.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace Pipeline;
+
+namespace {
+
+struct TestPipe {
+  int fds[2];
+
+  TestPipe() {
+    const int pipe_result __attribute__((unused)) = pipe2(fds, O_NONBLOCK);
+    assert(pipe_result == 0);
+  }
+
+  ~TestPipe() {
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  uint64_t get_size() const {
+    return fcntl(fds[0], F_GETPIPE_SZ);
+  }
+};
+
+void accounting_tests() {
+  auto &budget = PipeBudget::shared();
+  const uint64_t original_limit = budget.get_limit();
+  const uint64_t allocated      = budget.get_allocated();
+  const uint64_t grow_count     __attribute__((unused))
+    = budget.get_grow_count();
+  const uint64_t shrink_count   __attribute__((unused))
+    = budget.get_shrink_count();
+  uint64_t result __attribute__((unused));
+
+  // Grows to a power of two no larger than asked.
+  TestPipe first;
+  const uint64_t default_size = first.get_size();
+  result = budget.acquire(first.fds[0], 3 * default_size);
+  assert(result == 2 * default_size);
+  assert(first.get_size() == result);
+  assert(budget.get_allocated()  == allocated + 2 * default_size);
+  assert(budget.get_grow_count() == grow_count + 1);
+
+  // Grows only as far as the budget allows.
+  budget.set_limit(allocated + 6 * default_size);
+  TestPipe second;
+  result = budget.acquire(second.fds[0], 8 * default_size);
+  assert(result == 4 * default_size);
+  assert(second.get_size() == result);
+  assert(budget.get_allocated() == allocated + 6 * default_size);
+
+  // A new pipe over the budget keeps its default size.
+  TestPipe third;
+  result = budget.acquire(third.fds[0], 8 * default_size);
+  assert(result == default_size);
+  assert(third.get_size() == default_size);
+  assert(budget.get_allocated()  == allocated + 7 * default_size);
+  assert(budget.get_grow_count() == grow_count + 2);
+
+  // Shrinking frees budget for growing.
+  result = budget.resize(second.fds[0], 4 * default_size, default_size);
+  assert(result == default_size);
+  assert(second.get_size() == default_size);
+  assert(budget.get_allocated()    == allocated + 4 * default_size);
+  assert(budget.get_shrink_count() == shrink_count + 1);
+  result = budget.resize(third.fds[0], default_size, 4 * default_size);
+  assert(result == 2 * default_size);
+  assert(budget.get_allocated()  == allocated + 5 * default_size);
+  assert(budget.get_grow_count() == grow_count + 3);
+
+  budget.release(2 * default_size);
+  budget.release(default_size);
+  budget.release(2 * default_size);
+  assert(budget.get_allocated() == allocated);
+  budget.set_limit(original_limit);
+}
+
+void shrink_busy_tests() {
+  auto &budget = PipeBudget::shared();
+  const uint64_t allocated     __attribute__((unused))
+    = budget.get_allocated();
+  const uint64_t shrink_count  __attribute__((unused))
+    = budget.get_shrink_count();
+  const uint64_t failure_count __attribute__((unused))
+    = budget.get_failure_count();
+  uint64_t result __attribute__((unused));
+
+  TestPipe pipe;
+  const uint64_t default_size = pipe.get_size();
+  const uint64_t size = budget.acquire(pipe.fds[0], 4 * default_size);
+  assert(size == 4 * default_size);
+
+  // Holding more than fits in the smaller size, so shrinking fails with
+  // EBUSY and the pipe keeps its size.
+  char data[4096];
+  memset(data, 'x', sizeof(data));
+  for (uint64_t written = 0; written < 2 * default_size;
+                             written += sizeof(data)) {
+    const ssize_t write_result __attribute__((unused))
+      = write(pipe.fds[1], data, sizeof(data));
+    assert(write_result == sizeof(data));
+  }
+  result = budget.resize(pipe.fds[0], size, default_size);
+  assert(result == size);
+  assert(pipe.get_size() == size);
+  assert(budget.get_allocated()     == allocated + size);
+  assert(budget.get_shrink_count()  == shrink_count);
+  assert(budget.get_failure_count() == failure_count + 1);
+
+  // Once drained, it shrinks.
+  for (uint64_t read_bytes = 0; read_bytes < 2 * default_size;
+                                read_bytes += sizeof(data)) {
+    const ssize_t read_result __attribute__((unused))
+      = read(pipe.fds[0], data, sizeof(data));
+    assert(read_result == sizeof(data));
+  }
+  result = budget.resize(pipe.fds[0], size, default_size);
+  assert(result == default_size);
+  assert(budget.get_allocated()     == allocated + default_size);
+  assert(budget.get_shrink_count()  == shrink_count + 1);
+  assert(budget.get_failure_count() == failure_count + 1);
+
+  budget.release(default_size);
+  assert(budget.get_allocated() == allocated);
+}
+
+uint64_t read_pipe_max_size() {
+  FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+  assert(file != NULL);
+  unsigned long pipe_max_size = 0;
+  const int fscanf_result __attribute__((unused))
+    = fscanf(file, "%lu", &pipe_max_size);
+  assert(fscanf_result == 1);
+  fclose(file);
+  return pipe_max_size;
+}
+
+/* Runs in a child process, since it may drop privileges to be refused. */
+void ceiling_tests_unprivileged() {
+  if (geteuid() == 0 && setuid(65534) == -1) {
+    // Cannot be refused for lack of privilege.
+    exit(0);
+  }
+
+  auto &budget = PipeBudget::shared();
+  const uint64_t pipe_max_size = read_pipe_max_size();
+  const uint64_t failure_count __attribute__((unused))
+    = budget.get_failure_count();
+
+  // Refused above pipe-max-size, or the per-user limits, so backs off.
+  uint64_t size;
+  {
+    TestPipe pipe;
+    size = budget.acquire(pipe.fds[0], 4 * pipe_max_size);
+    assert(size <= pipe_max_size);
+    assert(pipe.get_size() == size);
+    assert(failure_count + 2 <= budget.get_failure_count());
+    budget.release(size);
+  }
+
+  // The refused size is not asked for again.
+  const uint64_t second_failure_count __attribute__((unused))
+    = budget.get_failure_count();
+  TestPipe pipe;
+  const uint64_t second_size __attribute__((unused))
+    = budget.acquire(pipe.fds[0], 4 * pipe_max_size);
+  assert(second_size == size);
+  assert(budget.get_failure_count() == second_failure_count);
+  budget.release(second_size);
+
+  exit(0);
+}
+
+void ceiling_tests() {
+  fflush(stdout);
+  const pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    ceiling_tests_unprivileged();
+  }
+
+  int status;
+  const pid_t waitpid_result __attribute__((unused))
+    = waitpid(pid, &status, 0);
+  assert(waitpid_result == pid);
+  assert(WIFEXITED(status));
+  assert(WEXITSTATUS(status) == 0);
+}
+
+}
+
+void pipe_budget_tests() {
+  accounting_tests();
+  shrink_busy_tests();
+  ceiling_tests();
+
+  std::cout << "pipe_budget_tests(): passed" << std::endl;
+}
@@ -0,0 +1,148 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Peer/Target.h"
+#include "Pipeline/Segment.h"
+
+#include <assert.h>
+#include <iostream>
+#include <memory>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace Paxos;
+using namespace Pipeline;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+uint8_t content_at(uint64_t stream_pos) {
+  return stream_pos * 7 + 3;
+}
+
+void write_segment(SegmentCache &segment_cache, const NodeName &node_name,
+                   const Value::OffsetStream &stream,
+                   uint64_t first_stream_pos, size_t length) {
+  Segment segment(segment_cache, node_name, node_name.id, stream,
+                  Term(0, 1, 1), first_stream_pos);
+  std::vector<uint8_t> data(length);
+  for (size_t i = 0; i < length; i++) {
+    data[i] = content_at(first_stream_pos + i);
+  }
+  const ssize_t write_result __attribute__((unused))
+    = write(segment.get_fd(), data.data(), length);
+  assert(write_result == (ssize_t)length);
+  segment.record_bytes_in(length);
+  segment.shutdown();
+}
+
+}
+
+void proposed_and_accepted_sender_tests() {
+  const std::string cluster("proposed-and-accepted-sender-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  // The second file is too big to fit in the socket buffer, so the sender
+  // is left part-way through it.
+  const Slot first_end = 100000;
+  const Slot second_end = first_end + (1<<22);
+  const Value::OffsetStream stream = {.name = {.owner = 1, .id = 1},
+                                      .offset = 0};
+
+  {
+    NullClock clock;
+    Epoll::Manager manager(clock);
+
+    SegmentCache segment_cache(node_name);
+    segment_cache.start_pool();
+    write_segment(segment_cache, node_name, stream, 0, first_end);
+    write_segment(segment_cache, node_name, stream, first_end,
+                  second_end - first_end);
+    assert(segment_cache.get_entry_count() == 2);
+
+    int fds[2];
+    const int socketpair_result __attribute__((unused))
+      = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(socketpair_result == 0);
+
+    // The sender only modifies the registration it is given.
+    manager.register_handler(fds[0], NULL, 0);
+    std::unique_ptr<Peer::Target::ProposedAndAcceptedSender> sender(
+      new Peer::Target::ProposedAndAcceptedSender(manager, segment_cache,
+        node_name, fds[0], SlotRange(0, first_end / 2), stream, NULL, NULL));
+    assert(!sender->is_shutdown());
+
+    // Only a contiguous continuation of the same stream is accepted, and
+    // nothing is sent until the socket is writeable.
+    assert(!sender->send(stream, SlotRange(second_end, second_end + 1)));
+    assert(sender->send(stream, SlotRange(first_end / 2, second_end)));
+    assert(sender->get_first_unconsumed_slot() == 0);
+
+    // The queued extents hold their own file descriptors, so the data can
+    // still be sent once the cache entries are expired and closed.
+    segment_cache.expire_because_chosen_to(second_end + 1);
+    assert(segment_cache.get_entry_count() == 0);
+
+    std::vector<uint8_t> received;
+    while (received.size() < second_end) {
+      manager.wait(10);
+
+      uint8_t buf[65536];
+      ssize_t read_result;
+      while (0 < (read_result = read(fds[1], buf, sizeof buf))) {
+        received.insert(received.end(), buf, buf + read_result);
+      }
+      assert(read_result == -1 && errno == EAGAIN);
+
+      // The pin only moves past what has been sent.
+      assert(received.size() <= sender->get_first_unconsumed_slot());
+      assert(sender->get_first_unconsumed_slot() <= second_end);
+    }
+
+    assert(received.size() == second_end);
+    for (size_t i = 0; i < received.size(); i++) {
+      assert(received[i] == content_at(i));
+    }
+    assert(sender->get_first_unconsumed_slot() == second_end);
+
+    // Once expired with nothing left to send, the connection is closed.
+    assert(!sender->is_shutdown());
+    sender->expire();
+    assert(sender->is_shutdown());
+    const ssize_t eof_result __attribute__((unused))
+      = read(fds[1], received.data(), 1);
+    assert(eof_result == 0);
+
+    close(fds[1]);
+  }
+
+  remove_node_directory(node_name);
+
+  std::cout << "proposed_and_accepted_sender_tests(): passed" << std::endl;
+}
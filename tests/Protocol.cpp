@@ -0,0 +1,143 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Peer/Protocol.h"
+
+#include <cassert>
+#include <iostream>
+#include <string.h>
+
+using namespace Pipeline::Peer;
+
+static void catch_up_frame_tests() {
+  Protocol::Handshake handshake;
+  handshake.protocol_version = PROTOCOL_VERSION_CATCH_UP_TRANSFER - 1;
+  assert(Protocol::negotiated_version(handshake)
+      == PROTOCOL_VERSION_CATCH_UP_TRANSFER - 1);
+  handshake.protocol_version = PROTOCOL_VERSION + 1;
+  assert(Protocol::negotiated_version(handshake) == PROTOCOL_VERSION);
+
+  // The wire format of the transfer itself.
+  assert(sizeof(Protocol::Message::start_streaming_catch_up) == 8);
+  assert(sizeof(Protocol::CatchUpSegment) == 44);
+  assert(sizeof(Protocol::CatchUpResume)  == 8);
+
+  Protocol::FrameLayout layout;
+  bool layout_ok __attribute__((unused)) = Protocol::get_frame_layout(
+    PROTOCOL_VERSION_CATCH_UP_TRANSFER,
+    MESSAGE_TYPE_START_STREAMING_CATCH_UP, layout);
+  assert(layout_ok);
+  assert(layout.header_size  == sizeof(Protocol::FrameHeader));
+  assert(layout.message_size == 8);
+  assert(layout.value_size   == 0);
+
+  // Unknown before the version that introduced it.
+  layout_ok = Protocol::get_frame_layout(
+    PROTOCOL_VERSION_CATCH_UP_TRANSFER - 1,
+    MESSAGE_TYPE_START_STREAMING_CATCH_UP, layout);
+  assert(!layout_ok);
+
+  uint8_t frame[sizeof(Protocol::FrameHeader)
+              + sizeof(Protocol::Message::start_streaming_catch_up)];
+  Protocol::FrameHeader header = {
+    .type        = MESSAGE_TYPE_START_STREAMING_CATCH_UP,
+    .body_length = sizeof(Protocol::Message::start_streaming_catch_up)};
+  Protocol::Message message;
+  message.start_streaming_catch_up.end_slot = 12345;
+  memcpy(frame, &header, sizeof header);
+  memcpy(frame + sizeof header, &message.start_streaming_catch_up,
+         sizeof message.start_streaming_catch_up);
+
+  int parse_result __attribute__((unused));
+  parse_result = Protocol::parse_frame(PROTOCOL_VERSION_CATCH_UP_TRANSFER,
+                                       frame, sizeof frame, layout);
+  assert(parse_result == PARSE_FRAME_COMPLETE);
+  assert(layout.size() == sizeof frame);
+  Protocol::Message parsed;
+  memcpy(&parsed, frame + layout.header_size, layout.message_size);
+  assert(parsed.start_streaming_catch_up.end_slot == 12345);
+
+  parse_result = Protocol::parse_frame(PROTOCOL_VERSION_CATCH_UP_TRANSFER,
+                                       frame, sizeof frame - 1, layout);
+  assert(parse_result == PARSE_FRAME_INCOMPLETE);
+
+  parse_result = Protocol::parse_frame(PROTOCOL_VERSION_CATCH_UP_TRANSFER - 1,
+                                       frame, sizeof frame, layout);
+  assert(parse_result == PARSE_FRAME_INVALID);
+
+  frame[1] += 1;
+  parse_result = Protocol::parse_frame(PROTOCOL_VERSION_CATCH_UP_TRANSFER,
+                                       frame, sizeof frame, layout);
+  assert(parse_result == PARSE_FRAME_INVALID);
+}
+
+static void early_proposals_frame_tests() {
+  Protocol::FrameLayout layout;
+  bool layout_ok __attribute__((unused)) = Protocol::get_frame_layout(
+    PROTOCOL_VERSION_EARLY_PROPOSALS,
+    MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS, layout);
+  assert(layout_ok);
+  assert(layout.message_size
+      == sizeof(Protocol::Message::start_streaming_proposals));
+  assert(layout.value_size   == 0);
+
+  // Unknown before the version that introduced it, so an older peer is
+  // never sent it.
+  layout_ok = Protocol::get_frame_layout(
+    PROTOCOL_VERSION_EARLY_PROPOSALS - 1,
+    MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS, layout);
+  assert(!layout_ok);
+
+  uint8_t frame[sizeof(Protocol::FrameHeader)
+              + sizeof(Protocol::Message::start_streaming_early_proposals)];
+  Protocol::FrameHeader header = {
+    .type        = MESSAGE_TYPE_START_STREAMING_EARLY_PROPOSALS,
+    .body_length = sizeof(Protocol::Message::start_streaming_early_proposals)};
+  Protocol::Message message;
+  memset(&message, 0, sizeof message);
+  message.start_streaming_early_proposals.stream_owner  = 2;
+  message.start_streaming_early_proposals.stream_id     = 7;
+  message.start_streaming_early_proposals.stream_offset = 100;
+  message.start_streaming_early_proposals.first_slot    = 150;
+  memcpy(frame, &header, sizeof header);
+  memcpy(frame + sizeof header, &message.start_streaming_early_proposals,
+         sizeof message.start_streaming_early_proposals);
+
+  int parse_result __attribute__((unused));
+  parse_result = Protocol::parse_frame(PROTOCOL_VERSION_EARLY_PROPOSALS,
+                                       frame, sizeof frame, layout);
+  assert(parse_result == PARSE_FRAME_COMPLETE);
+  Protocol::Message parsed;
+  memcpy(&parsed, frame + layout.header_size, layout.message_size);
+  assert(parsed.start_streaming_early_proposals.stream_owner  == 2);
+  assert(parsed.start_streaming_early_proposals.stream_id     == 7);
+  assert(parsed.start_streaming_early_proposals.stream_offset == 100);
+  assert(parsed.start_streaming_early_proposals.first_slot    == 150);
+
+  parse_result = Protocol::parse_frame(PROTOCOL_VERSION_EARLY_PROPOSALS - 1,
+                                       frame, sizeof frame, layout);
+  assert(parse_result == PARSE_FRAME_INVALID);
+}
+
+void protocol_tests() {
+  catch_up_frame_tests();
+  early_proposals_frame_tests();
+  std::cout << "protocol_tests(): passed" << std::endl;
+}
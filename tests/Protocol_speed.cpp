@@ -0,0 +1,174 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Peer/Protocol.h"
+
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace Pipeline::Peer;
+using namespace std::chrono;
+
+/* Receives one frame at a time, reading no further than its end. */
+static void receive_frames_singly(int fd, uint32_t version, uint8_t type,
+                                  size_t frame_count, uint64_t &read_count) {
+  Protocol::FrameHeader header;
+  Protocol::FrameLayout layout;
+  Protocol::Message     message;
+  Protocol::Value       value;
+
+  for (size_t i = 0; i < frame_count; i++) {
+    size_t size_received = 0;
+    Protocol::get_receiving_frame_layout(version, layout);
+    while (size_received < layout.size()) {
+      struct iovec iov[3];
+      int iovcnt = Protocol::get_frame_iovecs(layout,
+        header, message, value, size_received, iov);
+      ssize_t readv_result = readv(fd, iov, iovcnt);
+      assert(readv_result > 0);
+      read_count += 1;
+      size_received += readv_result;
+
+      if (size_received == layout.header_size
+          && version >= PROTOCOL_VERSION_VARIABLE_FRAMES) {
+        bool layout_ok __attribute__((unused))
+          = Protocol::get_frame_layout(version, header.type, layout);
+        assert(layout_ok);
+        assert(header.body_length == layout.body_size());
+      }
+    }
+    assert(header.type == type);
+  }
+}
+
+/* Receives as much as is available at once and parses the frames where they
+ * lie, as Peer::Socket does. */
+static void receive_frames_batched(int fd, uint32_t version, uint8_t type,
+                                   size_t frame_count, uint64_t &read_count) {
+  const size_t buffer_size = 1<<16;
+  static uint8_t buffer[buffer_size];
+  size_t start = 0, end = 0;
+
+  while (frame_count > 0) {
+    ssize_t read_result = read(fd, buffer + end, buffer_size - end);
+    assert(read_result > 0);
+    read_count += 1;
+    end += read_result;
+
+    while (frame_count > 0) {
+      Protocol::FrameLayout layout;
+      const int parse_result
+        = Protocol::parse_frame(version, buffer + start, end - start, layout);
+      assert(parse_result != PARSE_FRAME_INVALID);
+      if (parse_result == PARSE_FRAME_INCOMPLETE) { break; }
+      assert(buffer[start] == type);
+      start += layout.size();
+      frame_count -= 1;
+    }
+
+    memmove(buffer, buffer + start, end - start);
+    end  -= start;
+    start = 0;
+  }
+  (void)type;
+}
+
+/* Sends batches of frames of the given type through a socketpair and then
+ * receives them, reporting the bytes on the wire and the receiving time and
+ * number of reads per message under each framing. */
+static void protocol_framing_speed_test(const char *name, uint8_t type,
+                                        bool batched) {
+  const size_t batch_size  = 100;
+  const size_t batch_count = 2000;
+
+  for (uint32_t version = MIN_PROTOCOL_VERSION;
+                version <= PROTOCOL_VERSION;
+                version++) {
+
+    int fds[2];
+    int socketpair_result = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(socketpair_result == 0);
+    (void)socketpair_result;
+
+    Protocol::FrameHeader send_header = { type, 0 };
+    Protocol::FrameLayout send_layout;
+    Protocol::Message     send_message;
+    Protocol::Value       send_value;
+    memset(&send_message, 0, sizeof send_message);
+    memset(&send_value,   0, sizeof send_value);
+    bool layout_ok __attribute__((unused))
+      = Protocol::get_frame_layout(version, type, send_layout);
+    assert(layout_ok);
+    send_header.body_length = send_layout.body_size();
+
+    uint64_t bytes_on_wire = 0;
+    uint64_t read_count    = 0;
+    duration<double> receive_time(0);
+
+    for (size_t batch = 0; batch < batch_count; batch++) {
+      for (size_t i = 0; i < batch_size; i++) {
+        struct iovec iov[3];
+        int iovcnt = Protocol::get_frame_iovecs(send_layout,
+          send_header, send_message, send_value, 0, iov);
+        ssize_t writev_result = writev(fds[0], iov, iovcnt);
+        assert(writev_result == (ssize_t)send_layout.size());
+        bytes_on_wire += writev_result;
+      }
+
+      auto t1 = high_resolution_clock::now();
+      if (batched) {
+        receive_frames_batched(fds[1], version, type, batch_size, read_count);
+      } else {
+        receive_frames_singly (fds[1], version, type, batch_size, read_count);
+      }
+      auto t2 = high_resolution_clock::now();
+      receive_time += duration_cast<duration<double>>(t2 - t1);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+
+    const size_t message_count = batch_size * batch_count;
+    std::cout << "protocol_framing_speed_test(" << name
+              << ", v" << version
+              << (batched ? ", batched" : ", single") << "): "
+              << bytes_on_wire / message_count << " bytes/message, "
+              << receive_time.count() * 1e9 / message_count << "ns/message, "
+              << (double)read_count / message_count << " reads/message"
+              << std::endl;
+  }
+}
+
+void protocol_framing_speed_tests() {
+  for (int batched = 0; batched <= 1; batched++) {
+    protocol_framing_speed_test("accepted",
+      MESSAGE_TYPE_ACCEPTED | VALUE_TYPE_STREAM_CONTENT, batched);
+    protocol_framing_speed_test("offer_vote",
+      MESSAGE_TYPE_OFFER_VOTE, batched);
+    protocol_framing_speed_test("seek_votes_or_catch_up",
+      MESSAGE_TYPE_SEEK_VOTES_OR_CATCH_UP, batched);
+    protocol_framing_speed_test("offer_catch_up",
+      MESSAGE_TYPE_OFFER_CATCH_UP, batched);
+  }
+}
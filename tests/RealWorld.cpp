@@ -0,0 +1,208 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "RealWorld.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Paxos;
+using namespace Pipeline;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+std::string log_path(const NodeName &node_name) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/n_%08x.log",
+           node_name.directory.c_str(), node_name.id);
+  return path;
+}
+
+__attribute__((unused))
+uint64_t log_size(const NodeName &node_name) {
+  struct stat buf;
+  const int stat_result __attribute__((unused))
+    = stat(log_path(node_name).c_str(), &buf);
+  assert(stat_result == 0);
+  return buf.st_size;
+}
+
+Proposal generate_node_id(Slot slot, const Term &term, NodeId originator) {
+  Value value;
+  memset(&value, 0, sizeof value);
+  value.type               = Value::Type::generate_node_id;
+  value.payload.originator = originator;
+  return {.slots = SlotRange(slot, slot + 1), .term = term, .value = value};
+}
+
+Proposal reconfiguration_inc(Slot slot, const Term &term, NodeId subject) {
+  Value value;
+  memset(&value, 0, sizeof value);
+  value.type                            = Value::Type::reconfiguration_inc;
+  value.payload.reconfiguration.subject = subject;
+  return {.slots = SlotRange(slot, slot + 2), .term = term, .value = value};
+}
+
+void replay_tests(const NodeName &node_name) {
+  std::vector<std::unique_ptr<Peer::Target>> targets;
+  SegmentCache segment_cache(node_name);
+
+  uint64_t checkpoint_offset;
+  {
+    RealWorld real_world(node_name, segment_cache, targets);
+    assert(real_world.get_synced_log_offset() == 0);
+
+    // Without a manager each line is synced as it is written.
+    real_world.record_promise(Term(0, 2, 1), 10);
+    real_world.accepted(generate_node_id(10, Term(0, 2, 1), 4));
+    checkpoint_offset = real_world.get_synced_log_offset();
+    assert(checkpoint_offset == log_size(node_name));
+
+    real_world.record_promise(Term(0, 3, 2), 11);
+    real_world.accepted(reconfiguration_inc(11, Term(0, 3, 2), 5));
+    assert(real_world.get_synced_log_offset() == log_size(node_name));
+  }
+
+  // Everything, from the start.
+  Term promise(0, 1, 1);
+  std::vector<Proposal> acceptances;
+  RealWorld real_world(node_name, segment_cache, targets);
+  real_world.replay_log(0, promise, acceptances);
+  assert(promise == Term(0, 3, 2));
+  assert(acceptances.size() == 2);
+  assert(acceptances[0].slots.start() == 10);
+  assert(acceptances[0].term          == Term(0, 2, 1));
+  assert(acceptances[0].value         == generate_node_id(10, Term(0, 2, 1), 4).value);
+  assert(acceptances[1].slots.end()   == 13);
+  assert(acceptances[1].value         == reconfiguration_inc(11, Term(0, 3, 2), 5).value);
+
+  // Only what came after the checkpoint, which does not lower the promise.
+  promise = Term(0, 4, 1);
+  acceptances.clear();
+  real_world.replay_log(checkpoint_offset, promise, acceptances);
+  assert(promise == Term(0, 4, 1));
+  assert(acceptances.size() == 1);
+  assert(acceptances[0].slots.start() == 11);
+}
+
+void torn_line_tests(const NodeName &node_name) {
+  std::vector<std::unique_ptr<Peer::Target>> targets;
+  SegmentCache segment_cache(node_name);
+
+  const char torn[] = "promise 00000000.00000009.00000001 at sl";
+  const int fd = open(log_path(node_name).c_str(), O_WRONLY | O_APPEND);
+  assert(fd != -1);
+  const ssize_t write_result __attribute__((unused))
+    = write(fd, torn, strlen(torn));
+  assert(write_result == (ssize_t)strlen(torn));
+
+  // The torn line is never replayed, alone or before the next line.
+  Term promise(0, 1, 1);
+  std::vector<Proposal> acceptances;
+  {
+    RealWorld real_world(node_name, segment_cache, targets);
+    real_world.replay_log(0, promise, acceptances);
+    assert(promise == Term(0, 3, 2));
+    assert(acceptances.size() == 2);
+  }
+  close(fd);
+
+  RealWorld real_world(node_name, segment_cache, targets);
+  assert(real_world.get_synced_log_offset() == log_size(node_name));
+  real_world.accepted(generate_node_id(20, Term(0, 5, 1), 6));
+
+  promise = Term(0, 1, 1);
+  acceptances.clear();
+  real_world.replay_log(0, promise, acceptances);
+  assert(promise == Term(0, 3, 2));
+  assert(acceptances.size() == 3);
+  assert(acceptances[2].slots.start() == 20);
+}
+
+void background_sync_tests(const NodeName &node_name) {
+  std::vector<std::unique_ptr<Peer::Target>> targets;
+  SegmentCache segment_cache(node_name);
+  NullClock clock;
+  Epoll::Manager manager(clock);
+
+  RealWorld real_world(node_name, segment_cache, targets);
+  real_world.set_manager(&manager);
+  const uint64_t initial_offset = real_world.get_synced_log_offset();
+
+  // With nothing awaiting a sync, an action runs straight away.
+  bool ran_before_promise = false;
+  real_world.after_log_synced([&ran_before_promise]() {
+    ran_before_promise = true;
+  });
+  assert(ran_before_promise);
+
+  // The offset only moves once the line's sync completes, and so do the
+  // actions that depend on the line, such as counting the node's own promise.
+  real_world.record_promise(Term(0, 6, 1), 30);
+  assert(real_world.get_synced_log_offset() == initial_offset);
+  bool ran_after_promise = false;
+  real_world.after_log_synced([&ran_after_promise]() {
+    ran_after_promise = true;
+  });
+  assert(!ran_after_promise);
+
+  for (int i = 0; i < 1000
+               && real_world.get_synced_log_offset() == initial_offset; i++) {
+    manager.wait(10);
+  }
+  assert(real_world.get_synced_log_offset() == log_size(node_name));
+  assert(ran_after_promise);
+
+  Term promise(0, 1, 1);
+  std::vector<Proposal> acceptances;
+  real_world.replay_log(initial_offset, promise, acceptances);
+  assert(promise == Term(0, 6, 1));
+  assert(acceptances.empty());
+}
+
+}
+
+void real_world_tests() {
+  const std::string cluster("real-world-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  replay_tests(node_name);
+  torn_line_tests(node_name);
+  background_sync_tests(node_name);
+
+  remove_node_directory(node_name);
+
+  std::cout << "real_world_tests(): passed" << std::endl;
+}
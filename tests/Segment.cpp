@@ -0,0 +1,269 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Segment.h"
+#include "Pipeline/SegmentCache.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace Paxos;
+using namespace Pipeline;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+__attribute__((unused))
+static off_t file_size(const std::string &path) {
+  struct stat buf;
+  const int stat_result __attribute__((unused)) = stat(path.c_str(), &buf);
+  assert(stat_result == 0);
+  return buf.st_size;
+}
+
+/* Writes the given number of bytes to the segment as a commit would. */
+static void write_to_segment(Segment &segment, size_t length) {
+  std::vector<uint8_t> data(length, 0xa5);
+  const ssize_t write_result __attribute__((unused))
+    = write(segment.get_fd(), data.data(), length);
+  assert(write_result == (ssize_t)length);
+  segment.record_bytes_in(length);
+}
+
+static void segment_truncation_tests(SegmentCache &segment_cache,
+                                     const NodeName &node_name) {
+  const Term term(0, 1, 1);
+
+  {
+    // Closed before it filled up.
+    const Value::OffsetStream stream = {.name = {.owner = 1, .id = 1},
+                                        .offset = 0};
+    Segment segment(segment_cache, node_name, 1, stream, term, 0);
+    write_to_segment(segment, 10000);
+    const std::string path = segment_cache.find(stream, 0, true)->path;
+    assert(file_size(path) == CLIENT_SEGMENT_DEFAULT_SIZE);
+
+    segment.shutdown();
+    assert(file_size(path) == 10000);
+  }
+
+  {
+    // Started at an unaligned position, and filled up.
+    const Value::OffsetStream stream = {.name = {.owner = 1, .id = 2},
+                                        .offset = 0};
+    const uint64_t first_stream_pos = 3 * CLIENT_SEGMENT_DEFAULT_SIZE - 12345;
+    Segment segment(segment_cache, node_name, 1, stream, term,
+                    first_stream_pos);
+    assert(segment.get_remaining_space() == 12345);
+
+    write_to_segment(segment, 12345);
+    assert(segment.is_shutdown());
+    const std::string path
+      = segment_cache.find(stream, first_stream_pos, true)->path;
+    assert(file_size(path) == 12345);
+  }
+}
+
+static ino_t file_inode(const std::string &path) {
+  struct stat buf;
+  const int stat_result __attribute__((unused)) = stat(path.c_str(), &buf);
+  assert(stat_result == 0);
+  return buf.st_ino;
+}
+
+static void segment_reopen_tests(SegmentCache &segment_cache,
+                                 const NodeName &node_name) {
+  const Term term(0, 1, 1);
+  const Value::OffsetStream stream = {.name = {.owner = 1, .id = 4},
+                                      .offset = 0};
+
+  Segment first(segment_cache, node_name, 2, stream, term, 0);
+  write_to_segment(first, 10000);
+  const std::string path = segment_cache.find(stream, 0, false)->path;
+  const ino_t inode __attribute__((unused)) = file_inode(path);
+  first.shutdown();
+  assert(file_size(path) == 10000);
+
+  // The same slots again, in the same term, reopen the existing file
+  // rather than replacing it, and leave its other data in place.
+  Segment second(segment_cache, node_name, 2, stream, term, 0);
+  assert(file_inode(path) == inode);
+  write_to_segment(second, 5000);
+  second.shutdown();
+  assert(file_inode(path) == inode);
+  assert(file_size(path) == 10000);
+}
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+class SyncCounter : public Epoll::SyncHandler {
+public:
+  int requested = 0;
+  int count     = 0;
+  void handle_synced() override { count += 1; }
+};
+
+/* The byte at each position in the file. */
+static uint8_t content_at(uint64_t position) {
+  return position * 7 + 3;
+}
+
+/* Passes the given number of bytes to the segment through a pipe as a
+   commit would in direct I/O mode, and writes them in the background. */
+static void write_direct_to_segment(Segment &segment, Epoll::Manager &manager,
+                                    SyncCounter &synced, size_t length) {
+  int pipe_fds[2];
+  const int pipe_result __attribute__((unused)) = pipe2(pipe_fds, O_NONBLOCK);
+  assert(pipe_result == 0);
+
+  const uint64_t start = segment.get_used_size();
+  std::vector<uint8_t> chunk;
+  size_t read_bytes = 0;
+  while (read_bytes < length) {
+    chunk.clear();
+    for (size_t i = read_bytes; i < length && chunk.size() < 4096; i++) {
+      chunk.push_back(content_at(start + i));
+    }
+    const ssize_t write_result __attribute__((unused))
+      = write(pipe_fds[1], chunk.data(), chunk.size());
+    assert(write_result == (ssize_t)chunk.size());
+
+    // May be split between buffers.
+    const size_t chunk_end = read_bytes + chunk.size();
+    while (read_bytes < chunk_end) {
+      const ssize_t read_result
+        = segment.read_direct(pipe_fds[0], length - read_bytes);
+      assert(0 < read_result);
+      read_bytes += read_result;
+    }
+  }
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+
+  segment.sync_directories_in_background(manager);
+  segment.write_direct_in_background(manager, &synced);
+  synced.requested += 1;
+  segment.record_bytes_in(length);
+}
+
+/* Waits for everything requested in the background so far. */
+static void wait_for_background_writes(Epoll::Manager &manager,
+                                       int fd, SyncCounter &synced) {
+  manager.write_in_background(fd, NULL, 0, 0, NULL, &synced);
+  synced.requested += 1;
+  for (int i = 0; i < 1000 && synced.count < synced.requested; i++) {
+    manager.wait(10);
+  }
+  assert(synced.count == synced.requested);
+}
+
+static void segment_direct_io_tests(const NodeName &node_name) {
+  SegmentCache segment_cache(node_name);
+  segment_cache.start_pool();
+  NullClock clock;
+  Epoll::Manager manager(clock);
+  SyncCounter synced;
+  const Term term(0, 1, 1);
+  const Value::OffsetStream stream = {.name = {.owner = 1, .id = 3},
+                                      .offset = 0};
+
+  segment_cache.set_direct_io(true);
+  Segment segment(segment_cache, node_name, 1, stream, term, 0);
+  segment_cache.set_direct_io(false);
+  if (!segment.is_direct()) {
+    printf("%s: O_DIRECT not supported here, skipped\n", __PRETTY_FUNCTION__);
+    return;
+  }
+
+  // Partial blocks are carried over and rewritten at the start of the next
+  // write, the last of which spans several buffers.
+  write_direct_to_segment(segment, manager, synced, 5000);
+  const std::string path = segment_cache.find(stream, 0, true)->path;
+  const int fd = open(path.c_str(), O_RDONLY);
+  assert(fd != -1);
+  write_direct_to_segment(segment, manager, synced, 3000);
+  write_direct_to_segment(segment, manager, synced, 192);
+  write_direct_to_segment(segment, manager, synced,
+                          2 * DIRECT_IO_BUFFER_SIZE + 1234);
+  uint64_t used_size = segment.get_used_size();
+  assert(used_size == 8192 + 2 * DIRECT_IO_BUFFER_SIZE + 1234);
+
+  // Each write is padded to a whole block, written over by the next.
+  wait_for_background_writes(manager, fd, synced);
+  assert(synced.count == 5);
+  assert(file_size(path) == CLIENT_SEGMENT_DEFAULT_SIZE);
+  uint8_t padding[DIRECT_IO_ALIGNMENT];
+  const ssize_t padding_result __attribute__((unused))
+    = pread(fd, padding, sizeof(padding), used_size);
+  assert(padding_result == (ssize_t)sizeof(padding));
+  for (size_t i = 0; i < DIRECT_IO_ALIGNMENT; i++) {
+    assert(padding[i] == 0);
+  }
+
+  // The padding is truncated away after the writes, even those still in
+  // flight at shutdown.
+  write_direct_to_segment(segment, manager, synced, 100);
+  used_size += 100;
+  segment.shutdown();
+  wait_for_background_writes(manager, fd, synced);
+  assert(file_size(path) == (off_t)used_size);
+
+  std::vector<uint8_t> data(used_size);
+  const ssize_t read_result __attribute__((unused))
+    = pread(fd, data.data(), used_size, 0);
+  assert(read_result == (ssize_t)used_size);
+  for (uint64_t i = 0; i < used_size; i++) {
+    assert(data[i] == content_at(i));
+  }
+  close(fd);
+}
+
+void segment_tests() {
+  const std::string cluster("segment-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  {
+    SegmentCache segment_cache(node_name);
+    segment_cache.start_pool();
+    segment_truncation_tests(segment_cache, node_name);
+  }
+
+  {
+    SegmentCache segment_cache(node_name);
+    segment_cache.start_pool();
+    segment_reopen_tests(segment_cache, node_name);
+  }
+
+  segment_direct_io_tests(node_name);
+
+  remove_node_directory(node_name);
+
+  std::cout << "segment_tests(): passed" << std::endl;
+}
@@ -0,0 +1,311 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/Segment.h"
+#include "Pipeline/SegmentCache.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits>
+#include <limits.h>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace Paxos;
+using namespace Pipeline;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+/* Writes a whole locally-accepted segment and closes it, returning the path
+   of its file. */
+static std::string write_segment(SegmentCache &segment_cache,
+                                 const NodeName &node_name,
+                                 const Value::OffsetStream &stream,
+                                 uint64_t first_stream_pos, size_t length) {
+  Segment segment(segment_cache, node_name, node_name.id, stream,
+                  Term(0, 1, 1), first_stream_pos);
+  std::vector<uint8_t> data(length, 0x5a);
+  const ssize_t write_result __attribute__((unused))
+    = write(segment.get_fd(), data.data(), length);
+  assert(write_result == (ssize_t)length);
+  segment.record_bytes_in(length);
+  const std::string path = segment_cache.find(
+    stream, first_stream_pos + stream.offset, true)->path;
+  segment.shutdown();
+  return path;
+}
+
+__attribute__((unused))
+static bool has_slots(const SegmentCache::ChosenSegment &segment,
+                      Slot start, Slot end) {
+  return segment.slots.start() == start && segment.slots.end() == end;
+}
+
+static void chosen_segment_tests(const NodeName &node_name) {
+  SegmentCache segment_cache(node_name);
+  segment_cache.start_pool();
+
+  const Value::OffsetStream a = {.name = {.owner = 1, .id = 1},
+                                 .offset = 1000};
+  const Value::OffsetStream b = {.name = {.owner = 1, .id = 2},
+                                 .offset = 5000};
+  const Value::OffsetStream a_elsewhere __attribute__((unused))
+    = {.name = a.name, .offset = 0};
+
+  write_segment(segment_cache, node_name, a, 0,   100);  // [1000,1100)
+  const std::string a2_path
+    = write_segment(segment_cache, node_name, a, 100, 200);  // [1100,1300)
+  write_segment(segment_cache, node_name, b, 0,   50);   // [5000,5050)
+
+  std::vector<SegmentCache::ChosenSegment> segments;
+  segment_cache.get_chosen_segments(std::numeric_limits<Slot>::max(),
+                                    segments);
+  assert(segments.empty());
+
+  // Held in the cache before it is chosen.
+  assert(segment_cache.first_slot_not_held(a, SlotRange(1000, 1300)) == 1300);
+  assert(segment_cache.first_slot_not_held(a, SlotRange(1000, 2000)) == 1300);
+  assert(segment_cache.first_slot_not_held(a, SlotRange(900,  2000)) == 900);
+
+  segment_cache.expire_because_chosen_to(6000);
+  assert(segment_cache.get_entry_count() == 0);
+
+  // Only those that end in time, in slot order.
+  segment_cache.get_chosen_segments(1300, segments);
+  assert(segments.size() == 2);
+  assert(has_slots(segments[0], 1000, 1100));
+  assert(has_slots(segments[1], 1100, 1300));
+  assert(segments[1].path  == a2_path);
+  assert(segments[1].term  == Term(0, 1, 1));
+  assert(!segments[1].is_compacted_log);
+
+  // Appended after what is already there.
+  segment_cache.get_chosen_segments(6000, segments);
+  assert(segments.size() == 5);
+  assert(has_slots(segments[2], 1000, 1100));
+  assert(has_slots(segments[4], 5000, 5050));
+  assert(segments[4].stream.name.id == 2);
+
+  // Still held, now in the retained files.
+  assert(segment_cache.first_slot_not_held(a, SlotRange(1000, 1300)) == 1300);
+  assert(segment_cache.first_slot_not_held(a, SlotRange(1050, 1200)) == 1200);
+  assert(segment_cache.first_slot_not_held(b, SlotRange(4000, 5050)) == 4000);
+  assert(segment_cache.first_slot_not_held(b, SlotRange(5000, 6000)) == 5050);
+  assert(segment_cache.first_slot_not_held(a_elsewhere, SlotRange(1000, 1300))
+      == 1000);
+
+  // A file that has gone no longer counts.
+  const int unlink_result __attribute__((unused)) = unlink(a2_path.c_str());
+  assert(unlink_result == 0);
+  assert(segment_cache.first_slot_not_held(a, SlotRange(1000, 1300)) == 1100);
+}
+
+__attribute__((unused))
+static bool exists(const std::string &path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+static void wait_for_reclaimed_files(const SegmentReclaimer &reclaimer,
+                                     uint64_t count) {
+  for (int i = 0; i < 1000
+               && reclaimer.get_usage().reclaimed_files < count; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  assert(reclaimer.get_usage().reclaimed_files == count);
+}
+
+static void reclaimer_pin_tests(const NodeName &node_name) {
+  SegmentPool pool(node_name);
+  SegmentReclaimer reclaimer(pool);
+  RetentionPolicy policy;
+  policy.delete_when_consumed = true;
+  reclaimer.set_policy(policy);
+
+  std::vector<std::string> paths;
+  for (int i = 0; i < 3; i++) {
+    paths.push_back(node_name.directory + "/reclaimer_test_"
+                                        + std::to_string(i));
+    const int fd = open(paths.back().c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    reclaimer.expire(paths.back(), fd, 100 * (i + 1));
+  }
+
+  // Consumed, but the second is pinned, so only the first may go.
+  reclaimer.set_first_pinned_slot(150);
+  reclaimer.set_first_unconsumed_slot(1000);
+  wait_for_reclaimed_files(reclaimer, 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  assert(reclaimer.get_usage().reclaimed_files == 1);
+  assert(!exists(paths[0]));
+  assert(exists(paths[1]));
+  assert(exists(paths[2]));
+
+  // The pin may move backwards, and then forwards past everything.
+  reclaimer.set_first_pinned_slot(50);
+  reclaimer.set_first_pinned_slot(std::numeric_limits<Slot>::max());
+  wait_for_reclaimed_files(reclaimer, 3);
+  assert(!exists(paths[1]));
+  assert(!exists(paths[2]));
+
+  const auto usage __attribute__((unused)) = reclaimer.get_usage();
+  assert(usage.retained_files == 0);
+  assert(usage.recycled_files == 0); // the pool was never started
+}
+
+static void reclaimer_recycle_tests(const NodeName &node_name) {
+  SegmentPool pool(node_name);
+  pool.start();
+  SegmentReclaimer reclaimer(pool);
+  RetentionPolicy policy;
+  policy.delete_when_consumed = true;
+  reclaimer.set_policy(policy);
+
+  // Makes room in the pool.
+  const auto taken = pool.take();
+  close(taken.fd);
+  unlink(taken.path.c_str());
+
+  const std::string path = node_name.directory + "/reclaimer_recycle_test";
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(fd != -1);
+  const int ftruncate_result __attribute__((unused))
+    = ftruncate(fd, CLIENT_SEGMENT_DEFAULT_SIZE);
+  assert(ftruncate_result == 0);
+  reclaimer.expire(path, fd, 100);
+
+  // Recycled into the pool once consumed, after which the pin may move
+  // back without waiting.
+  reclaimer.set_first_pinned_slot(std::numeric_limits<Slot>::max());
+  reclaimer.set_first_unconsumed_slot(100);
+  wait_for_reclaimed_files(reclaimer, 1);
+  reclaimer.set_first_pinned_slot(0);
+  assert(!exists(path));
+
+  const auto usage __attribute__((unused)) = reclaimer.get_usage();
+  assert(usage.retained_files == 0);
+  assert(usage.recycled_files == 1);
+}
+
+static std::string make_file(const NodeName &node_name,
+                             const Value::OffsetStream &stream,
+                             const char *segment_name, off_t size) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/own_%08x_str_%08x",
+           node_name.directory.c_str(), stream.name.owner, stream.name.id);
+  mkdir(path, 0755);
+  snprintf(path + strlen(path), PATH_MAX - strlen(path), "/off_%016lx",
+           stream.offset);
+  mkdir(path, 0755);
+  snprintf(path + strlen(path), PATH_MAX - strlen(path), "/%s",
+           segment_name);
+
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  assert(fd != -1);
+  const int ftruncate_result __attribute__((unused)) = ftruncate(fd, size);
+  assert(ftruncate_result == 0);
+  close(fd);
+  return path;
+}
+
+static void unlisted_entry_tests(const NodeName &node_name) {
+  reset_node_directory(node_name);
+
+  const Value::OffsetStream c = {.name = {.owner = 2, .id = 1},
+                                 .offset = 500};
+  const Value::OffsetStream d = {.name = {.owner = 2, .id = 2},
+                                 .offset = 0};
+  const Value::OffsetStream e = {.name = {.owner = 2, .id = 3},
+                                 .offset = 0};
+
+  std::set<std::string> listed_paths;
+  {
+    SegmentCache segment_cache(node_name);
+    segment_cache.start_pool();
+    listed_paths.insert(write_segment(segment_cache, node_name, c, 0, 100));
+    write_segment(segment_cache, node_name, c, 100, 50);
+  }
+
+  // Copied from another acceptor, so held but not accepted here.
+  make_file(node_name, c, "pos_0000000000000096_trm_00000000_00000002_00000003"
+                          "_by_00000003", 20);
+  // Filled, as the next segment was started.
+  make_file(node_name, d, "pos_0000000000000000_trm_00000000_00000001_00000001",
+            CLIENT_SEGMENT_DEFAULT_SIZE);
+  make_file(node_name, d, "pos_0000000010000000_trm_00000000_00000001_00000001",
+            10);
+  // Being written when the node stopped.
+  make_file(node_name, e, "pos_0000000000000000_trm_00000000_00000001_00000001",
+            CLIENT_SEGMENT_DEFAULT_SIZE);
+  make_file(node_name, e, "pos_0000000000000064_trm_00000000_00000001_00000001",
+            CLIENT_SEGMENT_DEFAULT_SIZE);
+  // Not a segment.
+  make_file(node_name, e, "chosen_0000000000000000", 100);
+
+  SegmentCache segment_cache(node_name);
+  std::vector<Proposal> acceptances;
+  segment_cache.restore_unlisted_entries(listed_paths, acceptances);
+
+  assert(segment_cache.get_entry_count() == 4);
+  assert(segment_cache.find(c, 500, true)  == NULL);
+  assert(segment_cache.find(c, 600, true)  != NULL);
+  assert(segment_cache.find(c, 649, true)  != NULL);
+  assert(segment_cache.find(c, 650, true)  == NULL);
+  assert(segment_cache.find(c, 650, false) != NULL);
+  assert(segment_cache.find(c, 650, false)->term == Term(0, 2, 3));
+  assert(segment_cache.find(d, CLIENT_SEGMENT_DEFAULT_SIZE + 9, true) != NULL);
+  assert(segment_cache.find(e, 0, true) == NULL);
+
+  assert(acceptances.size() == 3);
+  for (const auto &acceptance __attribute__((unused)) : acceptances) {
+    assert(acceptance.value.type == Value::Type::stream_content);
+  }
+  assert(acceptances[0].slots.start() == 600);
+  assert(acceptances[0].slots.end()   == 650);
+  assert(acceptances[0].term          == Term(0, 1, 1));
+  assert(acceptances[0].value.payload.stream.offset == 500);
+  assert(acceptances[1].slots.start() == 0);
+  assert(acceptances[1].slots.end()   == CLIENT_SEGMENT_DEFAULT_SIZE);
+  assert(acceptances[2].slots.start() == CLIENT_SEGMENT_DEFAULT_SIZE);
+  assert(acceptances[2].slots.end()   == CLIENT_SEGMENT_DEFAULT_SIZE + 10);
+}
+
+void segment_cache_tests() {
+  const std::string cluster("segment-cache-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  chosen_segment_tests(node_name);
+  reclaimer_pin_tests(node_name);
+  reclaimer_recycle_tests(node_name);
+  unlisted_entry_tests(node_name);
+
+  remove_node_directory(node_name);
+
+  std::cout << "segment_cache_tests(): passed" << std::endl;
+}
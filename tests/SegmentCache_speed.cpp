@@ -0,0 +1,102 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/SegmentCache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace Paxos;
+using namespace Pipeline;
+using namespace std::chrono;
+
+void segment_cache_speed_test() {
+  const std::string cluster("segment-cache-speed-test");
+  const NodeName node_name(cluster, 1);
+  SegmentCache segment_cache(node_name);
+
+  const Slot     entry_size   = 1500;
+  const uint32_t stream_count = 10;
+  const uint32_t entry_count  = 10000;
+  const Term     term(0, 1, 1);
+
+  // Only entries with open files are found, so each needs an fd.
+  struct rlimit open_files;
+  getrlimit(RLIMIT_NOFILE, &open_files);
+  if (open_files.rlim_cur < entry_count + 100) {
+    open_files.rlim_cur = std::min<rlim_t>(entry_count + 100, open_files.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &open_files);
+  }
+  const int devnull_fd = open("/dev/null", O_RDONLY);
+  assert(devnull_fd != -1);
+
+  // Streams are interleaved, so each stream's entries are not contiguous.
+  for (uint32_t i = 0; i < entry_count; i++) {
+    Value::OffsetStream stream = {
+      .name   = {.owner = 1, .id = i % stream_count},
+      .offset = 0
+    };
+    auto &entry = segment_cache.add(stream, term, i * entry_size, true);
+    const int entry_fd = dup(devnull_fd);
+    assert(entry_fd != -1);
+    entry.set_fd(entry_fd, "");
+    entry.extend(entry_size);
+    segment_cache.close_for_writing(entry);
+  }
+
+  auto t1 = high_resolution_clock::now();
+
+  const uint32_t lookup_count = 1000000;
+  for (uint32_t i = 0; i < lookup_count; i++) {
+    const uint32_t entry_index = (i * 7919) % entry_count;
+    Value::OffsetStream stream = {
+      .name   = {.owner = 1, .id = entry_index % stream_count},
+      .offset = 0
+    };
+    const Slot slot = entry_index * entry_size + (i % entry_size);
+    const auto entry __attribute__((unused))
+      = segment_cache.find(stream, slot, true);
+    assert(entry != NULL);
+    assert(entry->slots.contains(slot));
+    assert(entry->stream.name.id == stream.name.id);
+  }
+
+  auto t2 = high_resolution_clock::now();
+
+  for (uint32_t i = 0; i < entry_count; i += 10) {
+    segment_cache.expire_because_chosen_to(i * entry_size);
+  }
+
+  auto t3 = high_resolution_clock::now();
+  close(devnull_fd);
+
+  duration<double> lookup_time_span = duration_cast<duration<double>>(t2 - t1);
+  std::cout << "SegmentCache lookups: " << lookup_count
+            << " in " << entry_count << " entries" << std::endl;
+  std::cout << "Duration: " << lookup_time_span.count() << "s" << std::endl;
+
+  duration<double> expiry_time_span = duration_cast<duration<double>>(t3 - t2);
+  std::cout << "SegmentCache expiry passes: " << entry_count / 10 << std::endl;
+  std::cout << "Duration: " << expiry_time_span.count() << "s" << std::endl;
+}
@@ -0,0 +1,179 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/SegmentManifest.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace Paxos;
+using namespace Pipeline;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+template<class T>
+static bool same_records(const std::vector<T> &a, const std::vector<T> &b) {
+  return a.size() == b.size()
+      && memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+static std::string manifest_path(const NodeName &node_name) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/n_%08x.manifest",
+           node_name.directory.c_str(), node_name.id);
+  return path;
+}
+
+static void round_trip_tests(const NodeName &node_name) {
+  SegmentManifest::Snapshot nothing;
+  {
+    const SegmentManifest manifest(node_name);
+    const bool load_result __attribute__((unused)) = manifest.load(nothing);
+    assert(!load_result);
+  }
+
+  std::unique_ptr<SegmentManifest::Snapshot> snapshot
+    (new SegmentManifest::Snapshot());
+  memset(&snapshot->header, 0, sizeof snapshot->header);
+  snapshot->header.first_unchosen_slot    = 12345;
+  snapshot->header.era                    = 3;
+  snapshot->header.next_generated_node_id = 7;
+  snapshot->header.min_acceptable_term.copy_from(Term(3, 9, 2));
+  snapshot->header.log_offset             = 678;
+
+  Configuration conf(1);
+  conf.increment_weight(2);
+  conf.increment_weight(2);
+  snapshot->set_configuration(conf);
+
+  std::vector<Value::StreamPosition> open_streams = {
+    {.name = {.owner = 1, .id = 2}, .position = 300, .last_chosen_slot = 1300},
+    {.name = {.owner = 2, .id = 1}, .position = 0,   .last_chosen_slot = 12000}
+  };
+  snapshot->set_open_streams(open_streams);
+
+  Value generate_node_id;
+  memset(&generate_node_id, 0, sizeof generate_node_id);
+  generate_node_id.type               = Value::Type::generate_node_id;
+  generate_node_id.payload.originator = 5;
+  snapshot->add_acceptance({.slots = SlotRange(12345, 12346),
+                            .term  = Term(3, 9, 2),
+                            .value = generate_node_id});
+
+  const Value::OffsetStream stream = {.name = {.owner = 1, .id = 2},
+                                      .offset = 1000};
+  Value stream_content;
+  memset(&stream_content, 0, sizeof stream_content);
+  stream_content.type           = Value::Type::stream_content;
+  stream_content.payload.stream = stream;
+  snapshot->add_acceptance({.slots = SlotRange(12346, 12400),
+                            .term  = Term(3, 9, 2),
+                            .value = stream_content});
+
+  // The files need not exist: those that do not are not synced.
+  bool add_result __attribute__((unused));
+  add_result = snapshot->add_segment(stream, SlotRange(1000, 1300),
+    Term(3, 8, 1), SegmentManifest::locally_accepted,
+    node_name.directory + "/a");
+  assert(add_result);
+  add_result = snapshot->add_segment(stream, SlotRange(1300, 1500),
+    Term(3, 9, 2), SegmentManifest::chosen | SegmentManifest::compacted_log,
+    node_name.directory + "/b");
+  assert(add_result);
+  add_result = snapshot->add_segment(stream, SlotRange(1500, 1600),
+    Term(3, 9, 2), 0, std::string(SEGMENT_MANIFEST_PATH_SIZE, 'x'));
+  assert(!add_result);
+  assert(snapshot->segments.size() == 2);
+
+  const SegmentManifest::Snapshot expected = *snapshot;
+
+  {
+    SegmentManifest manifest(node_name);
+    manifest.checkpoint(std::move(snapshot));
+    // The last checkpoint is written before the destructor returns.
+  }
+
+  const SegmentManifest manifest(node_name);
+  SegmentManifest::Snapshot loaded;
+  const bool load_result __attribute__((unused)) = manifest.load(loaded);
+  assert(load_result);
+
+  assert(loaded.header.first_unchosen_slot    == 12345);
+  assert(loaded.header.era                    == 3);
+  assert(loaded.header.next_generated_node_id == 7);
+  assert(loaded.header.min_acceptable_term.get_paxos_term() == Term(3, 9, 2));
+  assert(loaded.header.log_offset             == 678);
+  assert(loaded.header.segment_count          == 2);
+  assert(same_records(loaded.configuration, expected.configuration));
+  assert(same_records(loaded.open_streams,  expected.open_streams));
+  assert(same_records(loaded.acceptances,   expected.acceptances));
+  assert(same_records(loaded.segments,      expected.segments));
+
+  const Configuration loaded_conf = loaded.get_configuration();
+  assert(loaded_conf.entries.size() == 2);
+  assert(loaded_conf.entries[0].node_id() == 1);
+  assert(loaded_conf.entries[0].weight()  == 1);
+  assert(loaded_conf.entries[1].node_id() == 2);
+  assert(loaded_conf.entries[1].weight()  == 2);
+
+  std::vector<Value::StreamPosition> loaded_streams;
+  loaded.get_open_streams(loaded_streams);
+  assert(loaded_streams.size() == 2);
+  assert(loaded_streams[1].name.owner       == 2);
+  assert(loaded_streams[1].last_chosen_slot == 12000);
+
+  const Proposal acceptance __attribute__((unused))
+    = SegmentManifest::Snapshot::get_acceptance(loaded.acceptances[1]);
+  assert(acceptance.slots.start() == 12346);
+  assert(acceptance.slots.end()   == 12400);
+  assert(acceptance.term          == Term(3, 9, 2));
+  assert(acceptance.value         == stream_content);
+
+  assert(std::string(loaded.segments[1].path) == node_name.directory + "/b");
+  assert(loaded.segments[1].flags
+      == (SegmentManifest::chosen | SegmentManifest::compacted_log));
+
+  // A torn manifest is ignored.
+  const int truncate_result __attribute__((unused))
+    = truncate(manifest_path(node_name).c_str(),
+               sizeof(SegmentManifest::Header) + 1);
+  assert(truncate_result == 0);
+  SegmentManifest::Snapshot torn;
+  const bool torn_result __attribute__((unused)) = manifest.load(torn);
+  assert(!torn_result);
+}
+
+void segment_manifest_tests() {
+  const std::string cluster("segment-manifest-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+
+  round_trip_tests(node_name);
+
+  remove_node_directory(node_name);
+
+  std::cout << "segment_manifest_tests(): passed" << std::endl;
+}
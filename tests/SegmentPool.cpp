@@ -0,0 +1,93 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/SegmentCache.h"
+#include "Pipeline/SegmentPool.h"
+
+#include <assert.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Pipeline;
+
+void reset_node_directory(const NodeName&);
+void remove_node_directory(const NodeName&);
+
+__attribute__((unused))
+static off_t file_size(int fd) {
+  struct stat buf;
+  const int fstat_result __attribute__((unused)) = fstat(fd, &buf);
+  assert(fstat_result == 0);
+  return buf.st_size;
+}
+
+void segment_pool_tests() {
+  const std::string cluster("segment-pool-test");
+  const NodeName node_name(cluster, 1);
+  reset_node_directory(node_name);
+  const std::string pool_path = node_name.directory + "/pool";
+
+  {
+    SegmentPool pool(node_name);
+    pool.start();
+
+    auto file = pool.take();
+    assert(file.fd != -1);
+    assert(file.path.compare(0, pool_path.size() + 5,
+                             pool_path + "/pre_") == 0);
+    assert(file_size(file.fd) == CLIENT_SEGMENT_DEFAULT_SIZE);
+
+    struct stat buf;
+    const int stat_result __attribute__((unused))
+      = stat(file.path.c_str(), &buf);
+    assert(stat_result == 0);
+    assert(buf.st_size == CLIENT_SEGMENT_DEFAULT_SIZE);
+
+    // Each file taken is distinct.
+    auto other_file = pool.take();
+    assert(other_file.path != file.path);
+    assert(file_size(other_file.fd) == CLIENT_SEGMENT_DEFAULT_SIZE);
+
+    // A file given back is the next to be taken.
+    pool.give_back(other_file);
+    auto same_file __attribute__((unused)) = pool.take();
+    assert(same_file.path == other_file.path);
+    assert(same_file.fd   == other_file.fd);
+
+    // Unused space is given back, but a file is never extended.
+    SegmentPool::release_unused_space(file.fd, 12345);
+    assert(file_size(file.fd) == 12345);
+    SegmentPool::release_unused_space(file.fd, 54321);
+    assert(file_size(file.fd) == 12345);
+    SegmentPool::release_unused_space(other_file.fd,
+                                      CLIENT_SEGMENT_DEFAULT_SIZE);
+    assert(file_size(other_file.fd) == CLIENT_SEGMENT_DEFAULT_SIZE);
+
+    close(file.fd);
+    unlink(file.path.c_str());
+    close(other_file.fd);
+    unlink(other_file.path.c_str());
+  }
+
+  remove_node_directory(node_name);
+
+  std::cout << "segment_pool_tests(): passed" << std::endl;
+}
@@ -0,0 +1,80 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+#include "SpscQueue.h"
+
+#include <iostream>
+#include <cassert>
+#include <memory>
+#include <thread>
+
+void spsc_queue_tests() {
+  SpscQueue<uint64_t, 4> small;
+  uint64_t item;
+  bool succeeded __attribute__((unused));
+
+  assert(small.is_empty());
+  succeeded = small.try_pop(item);
+  assert(!succeeded);
+
+  for (uint64_t i = 0; i < 4; i++) {
+    succeeded = small.try_push(i);
+    assert(succeeded);
+  }
+  succeeded = small.try_push(4);
+  assert(!succeeded);
+
+  succeeded = small.try_pop(item);
+  assert(succeeded);
+  assert(item == 0);
+  succeeded = small.try_push(4);
+  assert(succeeded);
+
+  for (uint64_t i = 1; i <= 4; i++) {
+    succeeded = small.try_pop(item);
+    assert(succeeded);
+    assert(item == i);
+  }
+  assert(small.is_empty());
+
+  /* Items pass between threads in order and without loss. */
+  const uint64_t item_count = 1000000;
+  std::unique_ptr<SpscQueue<uint64_t, 1024>> queue
+    (new SpscQueue<uint64_t, 1024>);
+
+  std::thread producer([&queue, item_count]() {
+    for (uint64_t i = 0; i < item_count; i++) {
+      while (!queue->try_push(i)) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  for (uint64_t expected = 0; expected < item_count; ) {
+    if (queue->try_pop(item)) {
+      assert(item == expected);
+      expected += 1;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  assert(queue->is_empty());
+
+  std::cout << "spsc_queue_tests(): passed " << item_count
+            << " items between threads" << std::endl;
+}
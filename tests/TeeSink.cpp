@@ -0,0 +1,210 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Pipeline/TeeSink.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+
+using namespace Pipeline;
+
+namespace {
+
+const Paxos::Value::OffsetStream stream = {.name = {.owner = 1, .id = 1},
+                                           .offset = 0};
+const Paxos::Value::OffsetStream other  = {.name = {.owner = 1, .id = 2},
+                                           .offset = 0};
+
+uint8_t byte_at(const Paxos::Slot slot) {
+  return slot % 251;
+}
+
+void make_pipe(int fds[2]) {
+  const int pipe_result __attribute__((unused)) = pipe2(fds, O_NONBLOCK);
+  assert(pipe_result == 0);
+}
+
+/* Writes the content of the given slots into the source pipe and tees it,
+   as the leader does just before splicing it into the segment, then drains
+   the source as the splice would. Returns how much was teed. */
+uint64_t tee(TeeSink &sink, const int source[2],
+             const Paxos::Value::OffsetStream &from_stream,
+             Paxos::Slot start_slot, Paxos::Slot end_slot) {
+  std::vector<uint8_t> data;
+  for (Paxos::Slot slot = start_slot; slot < end_slot; slot++) {
+    data.push_back(byte_at(slot));
+  }
+  const ssize_t write_result __attribute__((unused))
+    = write(source[1], data.data(), data.size());
+  assert(write_result == (ssize_t)data.size());
+
+  const uint64_t teed
+    = sink.tee_from(source[0], from_stream, start_slot, data.size());
+
+  const ssize_t read_result __attribute__((unused))
+    = read(source[0], data.data(), data.size());
+  assert(read_result == (ssize_t)data.size());
+  return teed;
+}
+
+/* Sends the given number of claimed bytes and checks that they hold the
+   given slots. */
+void send_and_check(TeeSink &sink, const int destination[2],
+                    Paxos::Slot start_slot, uint64_t length) {
+  const ssize_t send_result __attribute__((unused))
+    = sink.send_claimed(destination[1], length);
+  assert(send_result == (ssize_t)length);
+
+  std::vector<uint8_t> data(length);
+  const ssize_t read_result __attribute__((unused))
+    = read(destination[0], data.data(), length);
+  assert(read_result == (ssize_t)length);
+  for (uint64_t i = 0; i < length; i++) {
+    assert(data[i] == byte_at(start_slot + i));
+  }
+}
+
+void claim_tests(const int source[2], const int destination[2]) {
+  TeeSink sink;
+  uint64_t result __attribute__((unused));
+
+  result = tee(sink, source, stream, 0, 100);
+  assert(result == 100);
+  assert(sink.get_bytes_teed() == 100);
+
+  // Claimed in slot order, in as many pieces as the proposals.
+  result = sink.claim(stream, Paxos::SlotRange(0, 60));
+  assert(result == 60);
+  send_and_check(sink, destination, 0, 60);
+  result = sink.claim(stream, Paxos::SlotRange(60, 150));
+  assert(result == 40);
+  send_and_check(sink, destination, 60, 40);
+
+  // Nothing left to claim, so the rest comes from the segment.
+  result = sink.claim(stream, Paxos::SlotRange(100, 150));
+  assert(result == 0);
+  assert(sink.get_bytes_sent()      == 100);
+  assert(sink.get_bytes_discarded() == 0);
+}
+
+void discard_tests(const int source[2], const int destination[2]) {
+  TeeSink sink;
+  uint64_t result __attribute__((unused));
+
+  // Only half of the commit reached the segment, so the rest is unwanted
+  // and is discarded when it reaches the front of the pipe.
+  tee(sink, source, stream, 100, 200);
+  sink.trim_last(50);
+  result = sink.claim(stream, Paxos::SlotRange(100, 150));
+  assert(result == 50);
+  send_and_check(sink, destination, 100, 50);
+
+  tee(sink, source, stream, 150, 250);
+  result = sink.claim(stream, Paxos::SlotRange(150, 250));
+  assert(result == 100);
+  assert(sink.get_bytes_discarded() == 50);
+  send_and_check(sink, destination, 150, 100);
+
+  // Sent from the segment instead, so skipped over.
+  tee(sink, source, stream, 250, 350);
+  result = sink.claim(stream, Paxos::SlotRange(300, 400));
+  assert(result == 50);
+  assert(sink.get_bytes_discarded() == 100);
+  send_and_check(sink, destination, 300, 50);
+
+  // Another stream's data at the front of the pipe is discarded, since
+  // the sender for this peer only ever sends one stream at a time.
+  tee(sink, source, other, 0, 100);
+  tee(sink, source, stream, 350, 400);
+  result = sink.claim(stream, Paxos::SlotRange(350, 400));
+  assert(result == 50);
+  assert(sink.get_bytes_discarded() == 200);
+  send_and_check(sink, destination, 350, 50);
+
+  // Claimed bytes that are given up are discarded too.
+  tee(sink, source, stream, 400, 500);
+  result = sink.claim(stream, Paxos::SlotRange(400, 500));
+  assert(result == 100);
+  sink.release(100);
+  assert(sink.get_bytes_discarded() == 300);
+  assert(sink.get_bytes_sent()      == 250);
+}
+
+void fallback_tests(const int source[2], const int destination[2]) {
+  TeeSink sink;
+  uint64_t result __attribute__((unused));
+
+  // Teed from later than the start of the proposal, so the start is sent
+  // from the segment, leaving the teed data for later.
+  tee(sink, source, stream, 500, 600);
+  result = sink.claim(stream, Paxos::SlotRange(450, 600));
+  assert(result == 0);
+  assert(sink.get_bytes_discarded() == 0);
+  result = sink.claim(stream, Paxos::SlotRange(500, 600));
+  assert(result == 100);
+
+  // Nothing is discarded from behind claimed bytes, so a claim of
+  // anything else falls back to the segment until they are sent.
+  tee(sink, source, other, 0, 100);
+  tee(sink, source, stream, 600, 700);
+  result = sink.claim(stream, Paxos::SlotRange(600, 700));
+  assert(result == 0);
+  assert(sink.get_bytes_discarded() == 0);
+  send_and_check(sink, destination, 500, 100);
+  result = sink.claim(stream, Paxos::SlotRange(600, 700));
+  assert(result == 100);
+  assert(sink.get_bytes_discarded() == 100);
+  send_and_check(sink, destination, 600, 100);
+
+  // Nothing more is teed into a full pipe, so the rest is sent from the
+  // segment.
+  Paxos::Slot slot = 700;
+  while ((result = tee(sink, source, stream, slot, slot + 4096)) == 4096) {
+    slot += 4096;
+  }
+  assert(sink.get_bytes_teed() == 300 + slot - 700 + result);
+  result = tee(sink, source, stream, slot + 4096, slot + 8192);
+  assert(result == 0);
+  result = sink.claim(stream, Paxos::SlotRange(700, 800));
+  assert(result == 100);
+  sink.release(100);
+}
+
+}
+
+void tee_sink_tests() {
+  int source[2], destination[2];
+  make_pipe(source);
+  make_pipe(destination);
+
+  claim_tests(source, destination);
+  discard_tests(source, destination);
+  fallback_tests(source, destination);
+
+  close(source[0]);
+  close(source[1]);
+  close(destination[0]);
+  close(destination[1]);
+
+  std::cout << "tee_sink_tests(): passed" << std::endl;
+}
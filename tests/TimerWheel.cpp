@@ -0,0 +1,102 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+#include "Epoll.h"
+
+#include <iostream>
+#include <cassert>
+
+namespace {
+
+class TestTimer : public Epoll::TimerHandler {
+public:
+  int timeout_count = 0;
+  void handle_timeout() override { timeout_count++; }
+};
+
+}
+
+void timer_wheel_tests() {
+  const timestamp start = std::chrono::steady_clock::now();
+  const auto ms = [start](int n) {
+    return start + std::chrono::milliseconds(n);
+  };
+
+  Epoll::TimerWheel wheel(start);
+  std::vector<Epoll::TimerHandler*> expired;
+  TestTimer a, b, c;
+
+  assert(wheel.is_empty());
+  wheel.expire(start, expired);
+  assert(expired.empty());
+
+  wheel.schedule(&a, ms(100));
+  wheel.schedule(&b, ms(50));
+  assert(wheel.size() == 2);
+  assert(a.is_timer_scheduled());
+  assert(wheel.next_deadline() == ms(50));
+
+  /* Rescheduling replaces the earlier deadline. */
+  wheel.schedule(&b, ms(150));
+  assert(wheel.size() == 2);
+  assert(wheel.next_deadline() == ms(100));
+
+  wheel.expire(ms(99), expired);
+  assert(expired.empty());
+
+  wheel.expire(ms(100), expired);
+  assert(expired.size() == 1 && expired[0] == &a);
+  assert(!a.is_timer_scheduled());
+  assert(wheel.next_deadline() == ms(150));
+  expired.clear();
+
+  wheel.cancel(&b);
+  wheel.cancel(&b);
+  assert(wheel.is_empty());
+
+  /* Deadlines in the past expire straight away. */
+  wheel.schedule(&a, start);
+  assert(wheel.next_deadline() == start);
+  wheel.expire(ms(100), expired);
+  assert(expired.size() == 1 && expired[0] == &a);
+  expired.clear();
+
+  /* A timer several turns away shares its slot with nearer timers and is
+     neither expired nor reported early. */
+  const int turn = EPOLL_TIMER_TICK_MS * EPOLL_TIMER_WHEEL_SLOTS;
+  wheel.schedule(&a, ms(100 + 3 * turn));
+  assert(wheel.next_deadline() == ms(100 + 3 * turn));
+  wheel.schedule(&b, ms(100 + turn));
+  wheel.schedule(&c, ms(200));
+  assert(wheel.next_deadline() == ms(200));
+
+  wheel.expire(ms(100 + turn), expired);
+  assert(expired.size() == 2);
+  assert(wheel.size() == 1);
+  assert(wheel.next_deadline() == ms(100 + 3 * turn));
+  expired.clear();
+
+  /* Jumping more than a turn ahead still visits every slot. */
+  wheel.expire(ms(100 + 10 * turn), expired);
+  assert(expired.size() == 1 && expired[0] == &a);
+  assert(wheel.is_empty());
+  expired.clear();
+
+  std::cout << "timer_wheel_tests(): passed" << std::endl;
+}
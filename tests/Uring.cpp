@@ -0,0 +1,339 @@
+/*
+
+    Copyright 2017 David Turner
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+
+
+
+#include "Epoll.h"
+
+#include <cassert>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+class NullClock : public Epoll::ClockCache {
+public:
+  void set_current_time(const timestamp&) override {}
+};
+
+class RecordingHandler : public Epoll::SpliceHandler,
+                         public Epoll::SyncHandler {
+public:
+  std::vector<int32_t> &events;
+  RecordingHandler(std::vector<int32_t> &events) : events(events) {}
+
+  void handle_spliced(int32_t result) override { events.push_back(result); }
+  void handle_synced() override { events.push_back(-1); }
+};
+
+int open_temporary_file() {
+  char path[] = "uring-test-XXXXXX";
+  const int fd = mkstemp(path);
+  assert(fd != -1);
+  unlink(path);
+  return fd;
+}
+
+void make_pipe(int fds[2]) {
+  const int pipe_result __attribute__((unused)) = pipe2(fds, O_NONBLOCK);
+  assert(pipe_result == 0);
+}
+
+void fill(int fd, std::vector<uint8_t> &data) {
+  for (auto &b : data) {
+    b = rand();
+  }
+  const ssize_t write_result __attribute__((unused))
+    = write(fd, data.data(), data.size());
+  assert(write_result == (ssize_t)data.size());
+}
+
+/* Waits until at least the given number of completions have arrived. */
+void wait_for(Epoll::Uring &uring, size_t count,
+              std::vector<Epoll::Uring::Completion> &completions) {
+  for (int i = 0; i < 1000 && completions.size() < count; i++) {
+    uring.submit_and_wait(100, completions);
+  }
+  assert(completions.size() == count);
+}
+
+__attribute__((unused))
+const Epoll::Uring::Completion &find(
+    const std::vector<Epoll::Uring::Completion> &completions,
+    uint64_t user_data) {
+  for (const auto &c : completions) {
+    if (c.user_data == user_data) {
+      return c;
+    }
+  }
+  assert(false);
+  abort();
+}
+
+void uring_sync_tests() {
+  /* More requests than there are submission entries, so that the ring is
+   * submitted as it fills up and its indices wrap. */
+  Epoll::Uring uring(4);
+  const int fd = open_temporary_file();
+
+  std::vector<Epoll::Uring::Completion> completions;
+  for (uint64_t round = 0; round < 5; round++) {
+    completions.clear();
+    for (uint64_t i = 1; i <= 6; i++) {
+      uring.fdatasync(fd, round * 100 + i);
+    }
+    wait_for(uring, 6, completions);
+    for (uint64_t i = 1; i <= 6; i++) {
+      assert(find(completions, round * 100 + i).result == 0);
+    }
+  }
+
+  close(fd);
+}
+
+void uring_poll_tests() {
+  Epoll::Uring uring(4);
+  int fds[2];
+  make_pipe(fds);
+  std::vector<Epoll::Uring::Completion> completions;
+
+  // One-shot: nothing until the pipe is readable, then one completion.
+  uring.poll_add(fds[0], POLLIN, false, 1);
+  uring.submit_and_wait(0, completions);
+  assert(completions.empty());
+
+  std::vector<uint8_t> data(10);
+  fill(fds[1], data);
+  wait_for(uring, 1, completions);
+  assert(completions[0].user_data == 1);
+  assert(completions[0].result & POLLIN);
+  assert(!(completions[0].flags & IORING_CQE_F_MORE));
+
+  // Multishot: stays armed until removed.
+  int other_fds[2];
+  make_pipe(other_fds);
+  completions.clear();
+  uring.poll_add(other_fds[0], POLLIN, true, 2);
+  uring.submit_and_wait(0, completions);
+  assert(completions.empty());
+
+  // Each time the empty pipe is written, it becomes readable again.
+  uint8_t buffer[10];
+  for (size_t i = 1; i <= 3; i++) {
+    fill(other_fds[1], data);
+    wait_for(uring, i, completions);
+    assert(completions[i-1].user_data == 2);
+    assert(completions[i-1].result & POLLIN);
+    assert(completions[i-1].flags & IORING_CQE_F_MORE);
+    const ssize_t read_result __attribute__((unused))
+      = read(other_fds[0], buffer, sizeof buffer);
+    assert(read_result == sizeof buffer);
+  }
+
+  completions.clear();
+  uring.poll_remove(2);
+  for (int i = 0; i < 10; i++) {
+    uring.submit_and_wait(10, completions);
+  }
+  /* The removal completes with user data 0, and the poll itself completes
+   * one last time without IORING_CQE_F_MORE. */
+  bool removed __attribute__((unused)) = false;
+  bool ended   __attribute__((unused)) = false;
+  for (const auto &c : completions) {
+    if (c.user_data == 0) {
+      removed = true;
+    } else if (c.user_data == 2 && !(c.flags & IORING_CQE_F_MORE)) {
+      ended = true;
+    }
+  }
+  assert(removed && ended);
+
+  close(fds[0]);
+  close(fds[1]);
+  close(other_fds[0]);
+  close(other_fds[1]);
+}
+
+void uring_splice_tests() {
+  Epoll::Uring uring(4);
+  const int fd = open_temporary_file();
+  int fds[2];
+  make_pipe(fds);
+  std::vector<Epoll::Uring::Completion> completions;
+
+  /* A splice linked to a sync, each pair straddling the end of the
+   * submission ring in turn. */
+  std::vector<uint8_t> all_data;
+  for (uint64_t i = 0; i < 7; i++) {
+    std::vector<uint8_t> data(10000 + i);
+    fill(fds[1], data);
+    completions.clear();
+    uring.splice_then_fdatasync(fds[0], fd, all_data.size(), data.size(),
+                                2 * i + 1, 2 * i + 2);
+    if (i % 2 == 0) {
+      uring.fdatasync(fd, 1000 + i);
+      wait_for(uring, 3, completions);
+      assert(find(completions, 1000 + i).result == 0);
+    } else {
+      wait_for(uring, 2, completions);
+    }
+    assert(find(completions, 2 * i + 1).result == (int32_t)data.size());
+    assert(find(completions, 2 * i + 2).result == 0);
+    all_data.insert(all_data.end(), data.begin(), data.end());
+  }
+
+  std::vector<uint8_t> file_data(all_data.size() + 1);
+  const ssize_t pread_result __attribute__((unused))
+    = pread(fd, file_data.data(), file_data.size(), 0);
+  assert(pread_result == (ssize_t)all_data.size());
+  assert(memcmp(file_data.data(), all_data.data(), all_data.size()) == 0);
+
+  /* A short splice breaks the link, so the sync is cancelled. */
+  std::vector<uint8_t> data(10);
+  fill(fds[1], data);
+  close(fds[1]);
+  completions.clear();
+  uring.splice_then_fdatasync(fds[0], fd, 0, 20, 101, 102);
+  wait_for(uring, 2, completions);
+  assert(find(completions, 101).result == 10);
+  assert(find(completions, 102).result == -ECANCELED);
+
+  close(fds[0]);
+  close(fd);
+}
+
+void manager_splice_tests() {
+  NullClock clock;
+  Epoll::Manager manager(clock, Epoll::Manager::Backend::io_uring);
+  assert(manager.can_splice_in_background());
+
+  const int fd = open_temporary_file();
+  int fds[2];
+  make_pipe(fds);
+
+  /* Each splice is reported before its own sync, and splices and syncs are
+   * each reported in the order requested, even though the caller closes its
+   * fds first. */
+  std::vector<int32_t> events;
+  RecordingHandler handler(events);
+  std::vector<uint8_t> first(5000), second(7000);
+  fill(fds[1], first);
+  manager.splice_and_sync_in_background(fds[0], fd, 0, first.size(),
+                                        &handler, &handler);
+  manager.sync_in_background(fd, NULL);
+  fill(fds[1], second);
+  manager.splice_and_sync_in_background(fds[0], fd, first.size(),
+                                        second.size(), &handler, &handler);
+  close(fds[0]);
+  close(fds[1]);
+
+  for (int i = 0; i < 1000 && events.size() < 4; i++) {
+    manager.wait(100);
+  }
+  assert(events.size() == 4);
+  assert(events[0] == (int32_t)first.size());
+  assert(events[3] == -1);
+  // The second splice may complete before the first sync.
+  assert((events[1] == -1 && events[2] == (int32_t)second.size())
+      || (events[1] == (int32_t)second.size() && events[2] == -1));
+
+  // Cancelled handlers are not called.
+  make_pipe(fds);
+  fill(fds[1], first);
+  manager.splice_and_sync_in_background(fds[0], fd, 0, first.size(),
+                                        &handler, &handler);
+  manager.cancel_splices(&handler);
+  manager.cancel_syncs(&handler);
+  for (int i = 0; i < 20; i++) {
+    manager.wait(10);
+  }
+  assert(events.size() == 4);
+
+  close(fds[0]);
+  close(fds[1]);
+  close(fd);
+}
+
+/* Counts the times it finds the pipe readable, and drains it. */
+class ReadCounter : public Epoll::Handler {
+public:
+  const int fd;
+  int       count = 0;
+  ReadCounter(int fd) : fd(fd) {}
+
+  void handle_readable() override {
+    count += 1;
+    char buf[64];
+    while (0 < read(fd, buf, sizeof buf)) {}
+  }
+  void handle_writeable() override {}
+  void handle_error(const uint32_t) override { assert(false); }
+};
+
+void manager_generation_wrap_tests() {
+  NullClock clock;
+  Epoll::Manager manager(clock, Epoll::Manager::Backend::io_uring);
+  manager.set_uring_generation((1U << 30) - 3);
+
+  int fds[2];
+  make_pipe(fds);
+  const int fd = open_temporary_file();
+  ReadCounter reader(fds[0]);
+  std::vector<int32_t> events;
+  RecordingHandler synced(events);
+
+  /* Each registration takes a new generation, wrapping back to 1, and poll
+   * completions are still told apart from syncs throughout. */
+  manager.register_handler(fds[0], &reader, EPOLLIN);
+  for (int round = 1; round <= 5; round++) {
+    manager.modify_handler(fds[0], &reader, EPOLLIN);
+    manager.sync_in_background(fd, &synced);
+    const ssize_t write_result __attribute__((unused))
+      = write(fds[1], "x", 1);
+    assert(write_result == 1);
+    for (int i = 0; i < 1000 && (reader.count < round
+                              || (int)events.size() < round); i++) {
+      manager.wait(10);
+    }
+    assert(reader.count == round);
+    assert((int)events.size() == round);
+  }
+  assert(manager.get_uring_generation() == 4);
+
+  manager.deregister_handler(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+  close(fd);
+}
+
+}
+
+void uring_tests() {
+  uring_sync_tests();
+  uring_poll_tests();
+  uring_splice_tests();
+  manager_splice_tests();
+  manager_generation_wrap_tests();
+  std::cout << "uring_tests(): passed" << std::endl;
+}
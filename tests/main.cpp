@@ -21,25 +21,75 @@
 
 void term_tests();
 void slot_range_tests();
+void spsc_queue_tests();
+void outbound_ring_tests();
+void pipe_budget_tests();
+void pipe_tests();
+void tee_sink_tests();
+void segment_pool_tests();
+void segment_tests();
+void segment_cache_tests();
+void chosen_stream_reader_tests();
+void catch_up_tests();
+void proposed_and_accepted_sender_tests();
+void chosen_log_compactor_tests();
+void segment_manifest_tests();
+void real_world_tests();
+void timer_wheel_tests();
+void activation_scheduler_tests();
+void flow_control_tests();
+void uring_tests();
 void palladium_tests();
 void palladium_random_safety_test();
 void palladium_follower_speed_test();
 void palladium_leader_speed_test();
+void palladium_quorum_speed_tests();
 void legislator_test();
+void consensus_group_port_tests();
+void consensus_group_restart_tests();
+void protocol_tests();
+void protocol_framing_speed_tests();
+void segment_cache_speed_test();
 
 int main() {
   srand(time(NULL));
 
   term_tests();
   slot_range_tests();
+  spsc_queue_tests();
+  outbound_ring_tests();
+  pipe_budget_tests();
+  pipe_tests();
+  tee_sink_tests();
+  segment_pool_tests();
+  segment_tests();
+  segment_cache_tests();
+  chosen_stream_reader_tests();
+  catch_up_tests();
+  proposed_and_accepted_sender_tests();
+  chosen_log_compactor_tests();
+  segment_manifest_tests();
+  real_world_tests();
+  timer_wheel_tests();
+  activation_scheduler_tests();
+  flow_control_tests();
+  uring_tests();
   palladium_tests();
   for (int i = 0; i < 1; i++) {
     palladium_random_safety_test();
   }
   palladium_follower_speed_test();
   palladium_leader_speed_test();
+  palladium_quorum_speed_tests();
 
   legislator_test();
+  consensus_group_port_tests();
+  consensus_group_restart_tests();
+
+  protocol_tests();
+  protocol_framing_speed_tests();
+
+  segment_cache_speed_test();
 
   std::cout << std::endl << "ALL OK" << std::endl << std::endl;
   return 0;
@@ -20,8 +20,12 @@
 
 #include "Paxos/Configuration.h"
 #include "Paxos/Proposal.h"
+#include "Pipeline/NodeName.h"
+#include "directories.h"
 
 #include <algorithm>
+#include <ftw.h>
+#include <stdio.h>
 
 using namespace Paxos;
 
@@ -58,3 +62,22 @@ void assert_consistent(std::vector<Proposal> &chosens) {
                             chosens.end());
   }
 }
+
+static int remove_entry(const char *path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+/* Starts a test that uses the disk with an empty directory for the node. */
+void reset_node_directory(const Pipeline::NodeName &node_name) {
+  nftw(node_name.directory.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  ensure_directory(".", "data");
+  ensure_directory("data", node_name.group_directory.c_str());
+  ensure_directory(node_name.group_directory.c_str(),
+                   node_name.directory.c_str());
+}
+
+/* Removes everything a test left in the node's directory, including any
+   preallocated files. */
+void remove_node_directory(const Pipeline::NodeName &node_name) {
+  nftw(node_name.directory.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}